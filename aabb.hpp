@@ -3,7 +3,11 @@
 
 #include <vector>
 #include <functional>
-#include <tumbo/tumbo.hpp>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include "tumbo.hpp"
+#include "parallel.hpp"
 #include <algorithm>
 
 using std::min;
@@ -73,9 +77,13 @@ namespace tumbo
 
     /* Get the center point of the aabb. */
     template<class T,size_t D> vec<T,D>
-    center( aabb<T,D> a )
+    center( const aabb<T,D>& a )
         {
-        return column(a,0) + dimensions(a)/T(2);
+        // As column(a,0) + dimensions(a)/T(2), without the temporaries.
+        vec<T,D> c;
+        for( size_t d=0; d<D; ++d )
+            c[d] = a(d,0) + ( a(d,1) - a(d,0) ) / T(2);
+        return c;
         }
 
 
@@ -105,7 +113,7 @@ namespace tumbo
     template<class T,size_t D> aabb<T,D>
     place( const aabb<T,D> a, const vec<T,D>& p )
         {
-        return translate( a, p-center(a) );
+        return translate<T,D>( a, p-center(a) );
         }
 
 
@@ -128,6 +136,40 @@ namespace tumbo
         }
 
 
+    /* Half the surface area; the half perimeter in 2D. Proportional to the
+        chance that a random ray hits the box. */
+    template<class T,size_t D> T
+    half_area( const aabb<T,D> a )
+        {
+        if( D == 1 )
+            return a(0,1) - a(0,0);
+        T area = 0;
+        for( size_t d=0; d < D; ++d )
+            {
+            T face = 1;
+            for( size_t e=0; e < D; ++e )
+                if( e != d ) face *= a(e,1) - a(e,0);
+            area += face;
+            }
+        return area;
+        }
+
+
+    /* Squared distance from p to the closest point of a, 0 inside. */
+    template<class T,size_t D> T
+    distance_sq( const aabb<T,D>& a, const vec<T,D>& p )
+        {
+        T dist = 0;
+        for( size_t d=0; d < D; ++d )
+            {
+            T out = p[d] < a(d,0) ? a(d,0) - p[d] :
+                    p[d] > a(d,1) ? p[d] - a(d,1) : T(0);
+            dist += out*out;
+            }
+        return dist;
+        }
+
+
     /* TODO: 2D corners should preferably come in clockwise order. */
     template<class T,size_t D> std::vector<vec<T,D>>
     corners( const aabb<T,D>& a )
@@ -224,18 +266,36 @@ namespace tumbo
         }
 
 
-    template<class T, size_t D> aabb<T,D>
-    transform_aabb( const aabb<T,D>& box, const matrix<T,D+1,D+1>& mat )
+    /// Box around a box under an affine transform.
+    /** Arvo's method: every output axis starts at the translation and adds
+        the smaller and the larger of m(i,j)*lo[j] and m(i,j)*hi[j] for each
+        input axis j, so no corners are made. mat is a homogeneous
+        (D+1)x(D+1) matrix or an affine<T,D>; only its top D rows are used,
+        which means a projection gives the wrong box. */
+    template<class T, size_t D, size_t N> aabb<T,D>
+    transform_aabb( const aabb<T,D>& box, const matrix<T,N,D+1>& mat )
         {
-        // http://www.gamedev.net/topic/347234-quickest-way-to-compute-a-new-aabb-from-an-aabb--transform/
-        auto vertices = corners( box );
-        for( auto& v : vertices )
-            v = submatrix<3,1>( mat * weldv(v,scalar<T>{1}) );
-        return calculate_aabb<float,3>( begin(vertices), end(vertices) );
+        static_assert( N == D || N == D+1, "Not a transform of the box" );
+        aabb<T,D> result;
+        for( size_t i=0; i<D; ++i )
+            {
+            T lo = mat(i,D), hi = mat(i,D);
+            for( size_t j=0; j<D; ++j )
+                {
+                T a = mat(i,j) * box(j,0);
+                T b = mat(i,j) * box(j,1);
+                lo += a < b ? a : b;
+                hi += a < b ? b : a;
+                }
+            result(i,0) = lo;
+            result(i,1) = hi;
+            }
+        return result;
         }
 
 
-    /* Splits an aabb into 2^D smaller aabbs. */
+    /* Splits an aabb into 2^D smaller aabbs meeting at p, none if p is
+        outside. */
     template<class T, size_t D> aabb_list<T,D>
     split( const aabb<T,D>& a, const vec<T,D>& p )
         {
@@ -243,6 +303,7 @@ namespace tumbo
         if( !contains( a, p ) ) return result;
         for( auto c : corners(a) )
             result.push_back( make_aabb( c, p ) );
+        return result;
         }
 
 
@@ -317,26 +378,241 @@ namespace tumbo
         }
 
 
-    /* Combines all overlapping boxes in place. */
-    template<class Iter> Iter
-    combine_overlapping( Iter it, Iter end )
+    /* Disjoint sets of indices. The smaller index becomes the root, so the
+        sets do not depend on the order of the unions. */
+    class union_find_
         {
-        while( it != end )
+        public:
+            explicit
+            union_find_( size_t n ) :
+                parent_( n )
+                {
+                for( size_t i=0; i < n; ++i )
+                    parent_[i] = uint32_t(i);
+                }
+
+            uint32_t
+            find( uint32_t a )
+                {
+                while( parent_[a] != a )
+                    {
+                    parent_[a] = parent_[ parent_[a] ];
+                    a = parent_[a];
+                    }
+                return a;
+                }
+
+            void
+            unite( uint32_t a, uint32_t b )
+                {
+                a = find( a );
+                b = find( b );
+                if( b < a )
+                    std::swap( a, b );
+                parent_[b] = a;
+                }
+
+        private:
+            std::vector<uint32_t> parent_;
+        };
+
+
+    /* One round of combine_overlapping. Sorts the boxes along one axis,
+        sweeps for the overlapping pairs in parallel chunks and replaces
+        every connected set by the box around it. The boxes come out in
+        sweep order. Boxes that did not grow in the previous round overlap
+        none of the others that did not, so only pairs with a grown box are
+        tested. Returns false if no boxes overlapped. */
+    template<class T, size_t D> bool
+    merge_overlapping_( aabb_list<T,D>& boxes, std::vector<char>& grown,
+                        size_t threads )
+        {
+        size_t n = boxes.size();
+        TUMBO_ASSERT( n < ( size_t(1) << 32 ) );
+
+        // Sweep the axis where the boxes are thinnest compared to their
+        // spread, as it has the fewest boxes open at a time.
+        aabb<T,D> bound = boxes[0];
+        vec<T,D> widths = uniform< vec<T,D> >( 0 );
+        for( const aabb<T,D>& b : boxes )
+            {
+            bound = combine( bound, b );
+            widths += dimensions( b );
+            }
+        size_t axis = 0;
+        for( size_t d=1; d<D; ++d )
+            if( widths[d] * width( bound, axis ) < widths[axis] * width( bound, d ) )
+                axis = d;
+
+        std::vector< std::pair<T,uint32_t> > order( n );
+        for( size_t i=0; i < n; ++i )
+            order[i] = { boxes[i](axis,0), uint32_t(i) };
+        parallel_sort( order.begin(), order.end(), threads );
+        aabb_list<T,D> sorted( n );
+        std::vector<char> sorted_grown( n );
+        parallel_for( 0, n, threads, [&]( size_t first, size_t last )
             {
-            auto it2 = it+1;
-            while( it2 != end )
+            for( size_t i=first; i < last; ++i )
                 {
-                if( overlaps( *it, *it2 ) )
+                sorted[i] = boxes[ order[i].second ];
+                sorted_grown[i] = grown[ order[i].second ];
+                }
+            }, 1 << 14 );
+
+        // Grown boxes in sweep order, and for every box the first of them
+        // after it.
+        std::vector<uint32_t> grown_at, next_grown( n );
+        for( size_t i=n; i-- > 0; )
+            {
+            next_grown[i] = uint32_t( grown_at.size() );
+            if( sorted_grown[i] )
+                grown_at.push_back( uint32_t(i) );
+            }
+        std::reverse( grown_at.begin(), grown_at.end() );
+        for( uint32_t& k : next_grown )
+            k = uint32_t( grown_at.size() ) - k;
+
+        // The coordinates in separate arrays so a block of candidates is
+        // tested in a vectorizable loop.
+        std::vector<T> lo[D], hi[D];
+        for( size_t d=0; d<D; ++d )
+            {
+            lo[d].resize( n );
+            hi[d].resize( n );
+            for( size_t i=0; i < n; ++i )
+                {
+                lo[d][i] = sorted[i](d,0);
+                hi[d][i] = sorted[i](d,1);
+                }
+            }
+
+        // Each chunk tests its boxes against the later boxes that start
+        // before they end, so every pair is found once.
+        size_t chunks = std::min( thread_count( threads ),
+                                  std::max<size_t>( n >> 12, 1 ) );
+        std::vector< std::vector< std::pair<uint32_t,uint32_t> > > found( chunks );
+        parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+            {
+            for( size_t c=c0; c < c1; ++c )
+                for( size_t i = n*c / chunks; i < n*(c+1) / chunks; ++i )
                     {
-                    *it = combine( *it, *it2 );
-                    --end;
-                    *it2 = *end;
+                    const T* los[D];
+                    const T* his[D];
+                    T alo[D], ahi[D];
+                    for( size_t d=0; d<D; ++d )
+                        {
+                        los[d] = lo[d].data();
+                        his[d] = hi[d].data();
+                        alo[d] = lo[d][i];
+                        ahi[d] = hi[d][i];
+                        }
+                    // Same as overlaps() without branching on every axis.
+                    auto hit = [&]( size_t j )
+                        {
+                        bool h = true;
+                        for( size_t d=0; d<D; ++d )
+                            h &= ( alo[d] < his[d][j] ) & ( los[d][j] < ahi[d] );
+                        return h;
+                        };
+                    const T* sweep = los[axis];
+                    size_t j = i+1;
+                    if( sorted_grown[i] )
+                        {
+                        size_t last = std::lower_bound( sweep + j, sweep + n,
+                                                        ahi[axis] ) - sweep;
+                        for( ; j + 8 <= last; j += 8 )
+                            {
+                            int block[8], any = 0;
+                            for( size_t k=0; k<8; ++k )
+                                block[k] = 1;
+                            for( size_t d=0; d<D; ++d )
+                                for( size_t k=0; k<8; ++k )
+                                    block[k] &= ( alo[d] < his[d][j+k] ) &
+                                                ( los[d][j+k] < ahi[d] );
+                            for( size_t k=0; k<8; ++k )
+                                any |= block[k];
+                            if( any )
+                                for( size_t k=0; k<8; ++k )
+                                    if( block[k] )
+                                        found[c].emplace_back( uint32_t(i), uint32_t(j+k) );
+                            }
+                        for( ; j < last; ++j )
+                            if( hit( j ) )
+                                found[c].emplace_back( uint32_t(i), uint32_t(j) );
+                        }
+                    else
+                        for( size_t k = next_grown[i];
+                             k < grown_at.size() && sweep[ grown_at[k] ] < ahi[axis]; ++k )
+                            if( hit( grown_at[k] ) )
+                                found[c].emplace_back( uint32_t(i), grown_at[k] );
                     }
-                else ++it2;
+            } );
+
+        bool merged = false;
+        union_find_ sets( n );
+        for( const auto& pairs : found )
+            for( const auto& p : pairs )
+                {
+                sets.unite( p.first, p.second );
+                merged = true;
+                }
+        if( !merged )
+            {
+            boxes.swap( sorted );
+            return false;
+            }
+
+        // Roots come before the rest of their set.
+        std::vector<uint32_t> slot( n );
+        boxes.clear();
+        grown.clear();
+        for( size_t i=0; i < n; ++i )
+            {
+            uint32_t r = sets.find( uint32_t(i) );
+            if( r == i )
+                {
+                slot[i] = uint32_t( boxes.size() );
+                boxes.push_back( sorted[i] );
+                grown.push_back( 0 );
+                }
+            else
+                {
+                aabb<T,D>& b = boxes[ slot[r] ];
+                b = combine( b, sorted[i] );
+                grown[ slot[r] ] = 1;
                 }
-            ++it;
             }
-        return end;
+        return true;
+        }
+
+
+    template<class T, size_t D, class Iter> Iter
+    combine_overlapping_( std::vector< aabb<T,D> > boxes, Iter it,
+                          size_t threads )
+        {
+        if( boxes.empty() )
+            return it;
+        std::vector<char> grown( boxes.size(), 1 );
+        while( merge_overlapping_( boxes, grown, threads ) )
+            ;
+        return std::copy( boxes.begin(), boxes.end(), it );
+        }
+
+
+    /// Replaces overlapping boxes by the box around them until none overlap.
+    /** A merged box may overlap boxes that none of its parts did, so the
+        merging is repeated until nothing changes. Each round sorts the boxes
+        along one axis and sweeps for the overlapping pairs, which are joined
+        with union-find. Rounds are O(n log n) plus the boxes met in the sweep,
+        and run on the given number of threads (0 for all). The result is the
+        same for any thread count, but not in the input order.
+
+        Requires random access iterators. Returns the new end. */
+    template<class Iter> Iter
+    combine_overlapping( Iter it, Iter end, size_t threads = 1 )
+        {
+        typedef typename std::iterator_traits<Iter>::value_type box_t;
+        return combine_overlapping_( std::vector<box_t>( it, end ), it, threads );
         }
 
 
@@ -0,0 +1,216 @@
+#ifndef TUMBO_AABB_PACKET_HPP
+#define TUMBO_AABB_PACKET_HPP
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "simd.hpp"
+
+/**
+    \file aabb_packet.hpp
+    \brief Blocks of boxes tested against one query at a time.
+
+    aabb_packet<T,D,W> keeps W boxes as structure of arrays, one array of
+    W low ends and one of W high ends per axis. The tests compare a query
+    with every box in the packet using simd::packet compares and return a
+    bitmask with bit i set for box i. A test is two compares and two ands
+    per axis and register of lanes, without branches.
+
+    W is 4, 8 or 16 (any multiple of the lanes used, up to 32). Lanes past
+    size() hold an empty box, low ends at the largest value and high ends
+    at the lowest, so no test sets their bits.
+*/
+
+namespace tumbo
+    {
+
+    /// W boxes stored by axis for packet tests.
+    template<class T, size_t D, size_t W>
+    struct aabb_packet
+        {
+        static_assert( W <= 32, "The masks have 32 bits" );
+
+        /// Lanes per simd::packet used in the tests.
+        static constexpr size_t lanes =
+            W < simd::batch_width<T>::value ? W : simd::batch_width<T>::value;
+        static_assert( W % lanes == 0, "W must be a multiple of the lanes" );
+
+        alignas( sizeof(T)*lanes ) T lo[D][W];
+        alignas( sizeof(T)*lanes ) T hi[D][W];
+
+        /// An empty packet.
+        aabb_packet()
+            {
+            clear();
+            }
+
+        /// Packs up to W boxes from a range.
+        template<class Iter>
+        aabb_packet( Iter it, Iter end )
+            {
+            clear();
+            for( ; it != end; ++it )
+                push_back( *it );
+            }
+
+        static constexpr size_t
+        width()
+            { return W; }
+
+        size_t
+        size() const
+            { return size_; }
+
+        bool
+        full() const
+            { return size_ == W; }
+
+        void
+        clear()
+            {
+            for( size_t i=0; i<W; ++i )
+                reset( i );
+            size_ = 0;
+            }
+
+        void
+        push_back( const aabb<T,D>& box )
+            {
+            TUMBO_ASSERT( size_ < W );
+            set( size_++, box );
+            }
+
+        void
+        set( size_t i, const aabb<T,D>& box )
+            {
+            for( size_t d=0; d<D; ++d )
+                {
+                lo[d][i] = box(d,0);
+                hi[d][i] = box(d,1);
+                }
+            }
+
+        aabb<T,D>
+        get( size_t i ) const
+            {
+            aabb<T,D> box;
+            for( size_t d=0; d<D; ++d )
+                {
+                box(d,0) = lo[d][i];
+                box(d,1) = hi[d][i];
+                }
+            return box;
+            }
+
+        /// Mask with a bit for each of the size() boxes.
+        uint32_t
+        used() const
+            { return size_ == 32 ? ~uint32_t(0) : ( uint32_t(1) << size_ ) - 1; }
+
+        private:
+            void
+            reset( size_t i )
+                {
+                for( size_t d=0; d<D; ++d )
+                    {
+                    lo[d][i] = std::numeric_limits<T>::max();
+                    hi[d][i] = std::numeric_limits<T>::lowest();
+                    }
+                }
+
+            size_t size_;
+        };
+
+
+    /// The boxes of p that overlap a, as overlaps( box, a ).
+    template<class T, size_t D, size_t W> uint32_t
+    overlaps( const aabb_packet<T,D,W>& p, const aabb<T,D>& a )
+        {
+        typedef simd::packet<T, aabb_packet<T,D,W>::lanes> P;
+        uint32_t mask = 0;
+        for( size_t i=0; i<W; i += P::width() )
+            {
+            P m = ( P::load( p.lo[0]+i ) < P::broadcast( a(0,1) ) ) &
+                  ( P::broadcast( a(0,0) ) < P::load( p.hi[0]+i ) );
+            for( size_t d=1; d<D; ++d )
+                m = m & ( P::load( p.lo[d]+i ) < P::broadcast( a(d,1) ) ) &
+                        ( P::broadcast( a(d,0) ) < P::load( p.hi[d]+i ) );
+            mask |= uint32_t( simd::movemask( m ) ) << i;
+            }
+        return mask;
+        }
+
+
+    /// The boxes of p that contain the point x, as contains( box, x ).
+    template<class T, size_t D, size_t W> uint32_t
+    contains( const aabb_packet<T,D,W>& p, const vec<T,D>& x )
+        {
+        typedef simd::packet<T, aabb_packet<T,D,W>::lanes> P;
+        uint32_t mask = 0;
+        for( size_t i=0; i<W; i += P::width() )
+            {
+            P m = ( P::load( p.lo[0]+i ) <= P::broadcast( x[0] ) ) &
+                  ( P::broadcast( x[0] ) <= P::load( p.hi[0]+i ) );
+            for( size_t d=1; d<D; ++d )
+                m = m & ( P::load( p.lo[d]+i ) <= P::broadcast( x[d] ) ) &
+                        ( P::broadcast( x[d] ) <= P::load( p.hi[d]+i ) );
+            mask |= uint32_t( simd::movemask( m ) ) << i;
+            }
+        return mask;
+        }
+
+
+    /// The boxes of p that contain the box a, as contains( box, a ).
+    /** a is assumed normalized. */
+    template<class T, size_t D, size_t W> uint32_t
+    contains( const aabb_packet<T,D,W>& p, const aabb<T,D>& a )
+        {
+        typedef simd::packet<T, aabb_packet<T,D,W>::lanes> P;
+        uint32_t mask = 0;
+        for( size_t i=0; i<W; i += P::width() )
+            {
+            P m = ( P::load( p.lo[0]+i ) <= P::broadcast( a(0,0) ) ) &
+                  ( P::broadcast( a(0,1) ) <= P::load( p.hi[0]+i ) );
+            for( size_t d=1; d<D; ++d )
+                m = m & ( P::load( p.lo[d]+i ) <= P::broadcast( a(d,0) ) ) &
+                        ( P::broadcast( a(d,1) ) <= P::load( p.hi[d]+i ) );
+            mask |= uint32_t( simd::movemask( m ) ) << i;
+            }
+        return mask;
+        }
+
+
+    /// Packs a list of boxes, the last packet holding the rest.
+    template<size_t W, class T, size_t D> std::vector< aabb_packet<T,D,W> >
+    make_aabb_packets( const aabb_list<T,D>& boxes )
+        {
+        std::vector< aabb_packet<T,D,W> > packets( ( boxes.size() + W-1 ) / W );
+        for( size_t i=0; i < boxes.size(); ++i )
+            packets[ i/W ].push_back( boxes[i] );
+        return packets;
+        }
+
+
+    /// Calls fn( i ) for every set bit i of mask, lowest first.
+    template<class Fn> void
+    for_each_bit( uint32_t mask, Fn fn )
+        {
+        while( mask != 0 )
+            {
+#if defined(__GNUC__) || defined(__clang__)
+            size_t i = size_t( __builtin_ctz( mask ) );
+#else
+            size_t i = 0;
+            while( !( mask >> i & 1 ) )
+                ++i;
+#endif
+            fn( i );
+            mask &= mask - 1;
+            }
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_AABB_PACKET_HPP
@@ -0,0 +1,223 @@
+#ifndef TUMBO_AFFINE_HPP
+#define TUMBO_AFFINE_HPP
+
+#include "matrix.hpp"
+#include "utility.hpp"
+#include "cons.hpp"
+#include "types.hpp"
+
+/**
+    \file affine.hpp
+    \brief Affine transforms stored without their constant bottom row.
+
+    An affine<T,D> holds the top D rows of a (D+1)x(D+1) homogeneous
+    transform: the linear part in the first D columns and the translation
+    in the last one. The bottom row, always 0,...,0,1, is implied, which
+    saves a quarter of the storage of a mat44 and skips the products with
+    it in compose and the transform functions.
+
+    to_matrix and to_affine convert to and from the full square matrix
+    without loss, so the constructors in cons.hpp can still be used:
+        faffine3 t = to_affine( look_at( eye, target, up ) );
+*/
+
+namespace tumbo
+    {
+
+    template<typename T, size_t D> using
+    affine = tumbo::matrix<T,D,D+1>;
+
+    typedef affine<float,2>     faffine2;
+    typedef affine<float,3>     faffine3;
+
+    typedef affine<double,2>    daffine2;
+    typedef affine<double,3>    daffine3;
+
+
+    template<class T, size_t D> constexpr affine<T,D>
+    affine_identity()
+        {
+        affine<T,D> A{};
+        for( size_t d=0; d<D; ++d )
+            A(d,d) = T(1);
+        return A;
+        }
+
+
+    /// Drops the bottom row of a homogeneous transform.
+    /** The bottom row must be 0,...,0,1; projections are not affine. */
+    template<class T, size_t N> constexpr affine<T,N-1>
+    to_affine( const matrix<T,N,N>& M )
+        {
+        for( size_t j=0; j<N; ++j )
+            TUMBO_ASSERT( M(N-1,j) == ( j == N-1 ? T(1) : T(0) ) );
+        return submatrix<N-1,N>( M );
+        }
+
+
+    /// Expands the transform to a square homogeneous matrix.
+    template<class T, size_t D> constexpr matrix<T,D+1,D+1>
+    to_matrix( const affine<T,D>& A )
+        {
+        matrix<T,D+1,D+1> M{};
+        for( size_t i=0; i<D; ++i )
+        for( size_t j=0; j<=D; ++j )
+            M(i,j) = A(i,j);
+        M(D,D) = T(1);
+        return M;
+        }
+
+
+    template<class T, size_t D> constexpr matrix<T,D,D>
+    linear_part( const affine<T,D>& A )
+        {
+        return submatrix<D,D>( A );
+        }
+
+
+    template<class T, size_t D> constexpr vec<T,D>
+    translation_part( const affine<T,D>& A )
+        {
+        return submatrix<D,1>( A, 0, D );
+        }
+
+
+    /// Builds a transform from its linear part and translation.
+    template<class T, size_t D> constexpr affine<T,D>
+    make_affine( const matrix<T,D,D>& L, const vec<T,D>& t )
+        {
+        return weld( L, t );
+        }
+
+
+    template<class T, size_t D> constexpr affine<T,D>
+    affine_translation( const vec<T,D>& t )
+        {
+        return make_affine( identity<matrix<T,D,D>>(), t );
+        }
+
+
+    template<class T, size_t D> constexpr affine<T,D>
+    affine_scaling( const vec<T,D>& v )
+        {
+        affine<T,D> A{};
+        for( size_t d=0; d<D; ++d )
+            A(d,d) = v[d];
+        return A;
+        }
+
+
+    /// The affine<T,3> counterpart of rotation( rad, x, y, z ).
+    template<class T> affine<T,3>
+    affine_rotation( T rad, T x, T y, T z )
+        {
+        return to_affine( rotation( rad, x, y, z ) );
+        }
+
+
+    /// Returns the transform applying B first, then A.
+    /** Equal to to_affine( to_matrix(A) * to_matrix(B) ). */
+    template<class T, size_t D> constexpr affine<T,D>
+    compose( const affine<T,D>& A, const affine<T,D>& B )
+        {
+        if constexpr( D == 3 && simd::packable<T,12>::value )
+            {
+            if( !TUMBO_IS_CONSTANT_EVALUATED() )
+                return simd_kernel_< affine<T,3> >( [&]( T* r )
+                    { simd::mul34( A.data(), B.data(), r ); } );
+            }
+
+        affine<T,D> R{};
+        T* r = R.begin();
+        const T* a = A.data();
+        const T* b = B.data();
+        constexpr size_t W = D+1;
+        for( size_t i=0; i<D; ++i )
+            {
+            for( size_t k=0; k<D; ++k )
+            for( size_t j=0; j<W; ++j )
+                r[i*W+j] += a[i*W+k] * b[k*W+j];
+            r[i*W+D] += a[i*W+D];
+            }
+        return R;
+        }
+
+
+    /// Transforms a point, translation included.
+    template<class T, size_t D> constexpr vec<T,D>
+    transform_point( const affine<T,D>& A, const vec<T,D>& p )
+        {
+        vec<T,D> r{};
+        for( size_t i=0; i<D; ++i )
+            {
+            T sum = A(i,D);
+            for( size_t j=0; j<D; ++j )
+                sum += A(i,j) * p[j];
+            r[i] = sum;
+            }
+        return r;
+        }
+
+
+    /// Transforms a direction, ignoring the translation.
+    template<class T, size_t D> constexpr vec<T,D>
+    transform_direction( const affine<T,D>& A, const vec<T,D>& v )
+        {
+        vec<T,D> r{};
+        for( size_t i=0; i<D; ++i )
+            {
+            T sum = 0;
+            for( size_t j=0; j<D; ++j )
+                sum += A(i,j) * v[j];
+            r[i] = sum;
+            }
+        return r;
+        }
+
+
+    /// Inverse of any invertible affine transform.
+    /** Inverts the DxD linear part only; the translation of the inverse is
+        the inverted linear part applied to the negated translation. */
+    template<class T, size_t D> constexpr affine<T,D>
+    affine_inverse( const affine<T,D>& A )
+        {
+        matrix<T,D,D> L = inverse( linear_part(A) );
+        affine<T,D> R{};
+        for( size_t i=0; i<D; ++i )
+            {
+            T sum = 0;
+            for( size_t j=0; j<D; ++j )
+                {
+                R(i,j) = L(i,j);
+                sum -= L(i,j) * A(j,D);
+                }
+            R(i,D) = sum;
+            }
+        return R;
+        }
+
+
+    /// Inverse of a rotation and translation.
+    /** The linear part must be orthonormal, so its inverse is its
+        transpose. Scaling or shearing give a wrong result; use
+        affine_inverse for those. */
+    template<class T, size_t D> constexpr affine<T,D>
+    rigid_inverse( const affine<T,D>& A )
+        {
+        affine<T,D> R{};
+        for( size_t i=0; i<D; ++i )
+            {
+            T sum = 0;
+            for( size_t j=0; j<D; ++j )
+                {
+                R(i,j) = A(j,i);
+                sum -= A(j,i) * A(j,D);
+                }
+            R(i,D) = sum;
+            }
+        return R;
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_AFFINE_HPP
@@ -0,0 +1,871 @@
+#include "tumbo.hpp"
+#include "affine.hpp"
+#include "aabb_packet.hpp"
+#include "bvh.hpp"
+#include "dmatrix.hpp"
+#include "dynamic_tree.hpp"
+#include "frustum.hpp"
+#include "loose_tree.hpp"
+#include "matrix_array.hpp"
+#include "morton.hpp"
+#include "overlap_pairs.hpp"
+#include "quantized_aabb.hpp"
+#include "ray_packet.hpp"
+#include "spatial_hash.hpp"
+#include "sweep_prune.hpp"
+#include "transform.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+using namespace tumbo;
+
+/* The row times column product tumbo used before the unrolled kernels,
+    kept here as the baseline. */
+template< class T, size_t M, size_t N, size_t P > matrix<T,M,P>
+multiply_row_column( const matrix<T,M,N>& A, const matrix<T,N,P>& B )
+    {
+    matrix<T,M,P> R;
+    for( size_t i=0; i<M; ++i )
+    for( size_t j=0; j<P; ++j )
+        R(i,j) = dot( row(A,i), column(B,j) );
+    return R;
+    }
+
+template< class T, size_t M, size_t N > matrix<T,N,M>
+transpose_loop( const matrix<T,M,N>& A )
+    {
+    matrix<T,N,M> R;
+    for( size_t i=0; i<M; ++i )
+    for( size_t j=0; j<N; ++j )
+        R(j,i) = A(i,j);
+    return R;
+    }
+
+/* Inverse through the adjugate, as tumbo computed it before the LU and
+    closed form versions. */
+template< class T, size_t N > matrix<T,N,N>
+inverse_adjugate( const matrix<T,N,N>& A )
+    {
+    return (1 / determinant(A)) * adjugate(A);
+    }
+
+template< class Mat > Mat
+bench_matrix( typename Mat::scalar_t seed )
+    {
+    Mat A;
+    for( size_t i=0; i < A.size(); ++i )
+        A[i] = seed + typename Mat::scalar_t(i) / 7;
+    return A;
+    }
+
+
+template< class Mat > static void
+BM_Multiply( benchmark::State& state )
+    {
+    Mat A = bench_matrix<Mat>(1), B = bench_matrix<Mat>(2);
+    for( auto _ : state )
+        {
+        benchmark::DoNotOptimize( A );
+        A = A * B;
+        A[0] = 1;
+        }
+    benchmark::DoNotOptimize( A );
+    }
+
+template< class Mat > static void
+BM_MultiplyUnrolled( benchmark::State& state )
+    {
+    Mat A = bench_matrix<Mat>(1), B = bench_matrix<Mat>(2);
+    for( auto _ : state )
+        {
+        benchmark::DoNotOptimize( A );
+        A = multiply_( A, B, std::make_index_sequence<Mat::size()>() );
+        A[0] = 1;
+        }
+    benchmark::DoNotOptimize( A );
+    }
+
+template< class Mat > static void
+BM_MultiplyRowColumn( benchmark::State& state )
+    {
+    Mat A = bench_matrix<Mat>(1), B = bench_matrix<Mat>(2);
+    for( auto _ : state )
+        {
+        benchmark::DoNotOptimize( A );
+        A = multiply_row_column( A, B );
+        A[0] = 1;
+        }
+    benchmark::DoNotOptimize( A );
+    }
+
+template< class Mat > static void
+BM_Transpose( benchmark::State& state )
+    {
+    Mat A = bench_matrix<Mat>(1);
+    for( auto _ : state )
+        {
+        benchmark::DoNotOptimize( A );
+        A = transpose( A );
+        }
+    benchmark::DoNotOptimize( A );
+    }
+
+template< class Mat > static void
+BM_TransposeLoop( benchmark::State& state )
+    {
+    Mat A = bench_matrix<Mat>(1);
+    for( auto _ : state )
+        {
+        benchmark::DoNotOptimize( A );
+        A = transpose_loop( A );
+        }
+    benchmark::DoNotOptimize( A );
+    }
+
+template< class Mat > static void
+BM_Inverse( benchmark::State& state )
+    {
+    Mat A = bench_matrix<Mat>(1);
+    for( size_t i=0; i < Mat::height(); ++i )
+        A(i,i) += 10;
+    for( auto _ : state )
+        {
+        benchmark::DoNotOptimize( A );
+        benchmark::DoNotOptimize( inverse( A ) );
+        }
+    }
+
+template< class Mat > static void
+BM_InverseAdjugate( benchmark::State& state )
+    {
+    Mat A = bench_matrix<Mat>(1);
+    for( size_t i=0; i < Mat::height(); ++i )
+        A(i,i) += 10;
+    for( auto _ : state )
+        {
+        benchmark::DoNotOptimize( A );
+        benchmark::DoNotOptimize( inverse_adjugate( A ) );
+        }
+    }
+
+template< class Aff > static void
+BM_Compose( benchmark::State& state )
+    {
+    Aff A = bench_matrix<Aff>(1), B = bench_matrix<Aff>(2);
+    for( auto _ : state )
+        {
+        benchmark::DoNotOptimize( A );
+        A = compose( A, B );
+        A[0] = 1;
+        }
+    benchmark::DoNotOptimize( A );
+    }
+
+static void
+BM_NormalizeArray( benchmark::State& state )
+    {
+    matrix_array<float,3,1> a;
+    for( int i=0; i < state.range(0); ++i )
+        a.push_back( bench_matrix<fvec3>( float(i) ) );
+    for( auto _ : state )
+        benchmark::DoNotOptimize( normalize( a ) );
+    state.SetItemsProcessed( state.iterations() * state.range(0) );
+    }
+
+static void
+BM_NormalizeVector( benchmark::State& state )
+    {
+    std::vector<fvec3> a;
+    for( int i=0; i < state.range(0); ++i )
+        a.push_back( bench_matrix<fvec3>( float(i) ) );
+    for( auto _ : state )
+        {
+        std::vector<fvec3> r( a.size() );
+        for( size_t i=0; i < a.size(); ++i )
+            r[i] = normalize( a[i] );
+        benchmark::DoNotOptimize( r );
+        }
+    state.SetItemsProcessed( state.iterations() * state.range(0) );
+    }
+
+static void
+BM_TransformArray( benchmark::State& state )
+    {
+    fmat33 R = bench_matrix<fmat33>( 1 );
+    matrix_array<float,3,1> a;
+    for( int i=0; i < state.range(0); ++i )
+        a.push_back( bench_matrix<fvec3>( float(i) ) );
+    for( auto _ : state )
+        benchmark::DoNotOptimize( R * a );
+    state.SetItemsProcessed( state.iterations() * state.range(0) );
+    }
+
+static void
+BM_TransformVector( benchmark::State& state )
+    {
+    fmat33 R = bench_matrix<fmat33>( 1 );
+    std::vector<fvec3> a;
+    for( int i=0; i < state.range(0); ++i )
+        a.push_back( bench_matrix<fvec3>( float(i) ) );
+    for( auto _ : state )
+        {
+        std::vector<fvec3> r( a.size() );
+        for( size_t i=0; i < a.size(); ++i )
+            r[i] = R * a[i];
+        benchmark::DoNotOptimize( r );
+        }
+    state.SetItemsProcessed( state.iterations() * state.range(0) );
+    }
+
+static void
+BM_TransformPoints( benchmark::State& state )
+    {
+    fmat44 M = bench_matrix<fmat44>( 1 );
+    std::vector<fvec3> a, r( 1 << 16 );
+    for( size_t i=0; i < r.size(); ++i )
+        a.push_back( bench_matrix<fvec3>( float(i) ) );
+    for( auto _ : state )
+        {
+        transform_points( M, a.data(), r.data(), a.size(), state.range(0) );
+        benchmark::DoNotOptimize( r.data() );
+        }
+    state.SetItemsProcessed( state.iterations() * a.size() );
+    }
+
+static void
+BM_TransformPointsWeld( benchmark::State& state )
+    {
+    fmat44 M = bench_matrix<fmat44>( 1 );
+    std::vector<fvec3> a, r( 1 << 16 );
+    for( size_t i=0; i < r.size(); ++i )
+        a.push_back( bench_matrix<fvec3>( float(i) ) );
+    for( auto _ : state )
+        {
+        for( size_t i=0; i < a.size(); ++i )
+            r[i] = submatrix<3,1>( M * weldv( a[i], scalar<float>{1} ) );
+        benchmark::DoNotOptimize( r.data() );
+        }
+    state.SetItemsProcessed( state.iterations() * a.size() );
+    }
+
+static dmatrix<double>
+bench_dmatrix( size_t n )
+    {
+    dmatrix<double> A( n, n );
+    for( size_t i=0; i < A.size(); ++i )
+        A[i] = double( (i*7) % 13 ) - 6 + ( i % (n+1) == 0 ? 4.0*n : 0.0 );
+    return A;
+    }
+
+static void
+BM_DMatrixMultiply( benchmark::State& state )
+    {
+    dmatrix<double> A = bench_dmatrix( state.range(0) ), B = A;
+    for( auto _ : state )
+        benchmark::DoNotOptimize( multiply( A, B, 1 ) );
+    }
+
+/* The plain i-j-k triple loop as a baseline. */
+static void
+BM_DMatrixMultiplyNaive( benchmark::State& state )
+    {
+    size_t n = state.range(0);
+    dmatrix<double> A = bench_dmatrix( n ), B = A;
+    for( auto _ : state )
+        {
+        dmatrix<double> C( n, n );
+        for( size_t i=0; i<n; ++i )
+        for( size_t j=0; j<n; ++j )
+            {
+            double sum = 0;
+            for( size_t k=0; k<n; ++k )
+                sum += A(i,k) * B(k,j);
+            C(i,j) = sum;
+            }
+        benchmark::DoNotOptimize( C );
+        }
+    }
+
+static void
+BM_DMatrixInverse( benchmark::State& state )
+    {
+    dmatrix<double> A = bench_dmatrix( state.range(0) );
+    for( auto _ : state )
+        benchmark::DoNotOptimize( inverse( A ) );
+    }
+
+/* n boxes scattered over [0,100)^3 with sides up to 0.2. */
+static aabb_list<float,3>
+bench_boxes( size_t n )
+    {
+    std::mt19937 gen( 1 );
+    std::uniform_real_distribution<float> pos( 0, 100 ), side( 0, .2f );
+    aabb_list<float,3> boxes( n );
+    for( auto& b : boxes )
+        for( size_t d=0; d<3; ++d )
+            {
+            b(d,0) = pos( gen );
+            b(d,1) = b(d,0) + side( gen );
+            }
+    return boxes;
+    }
+
+static void
+BM_BvhBuild( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    for( auto _ : state )
+        {
+        bvh<float,3> tree( boxes );
+        benchmark::DoNotOptimize( tree.nodes().data() );
+        }
+    }
+
+static void
+BM_BvhBuildParallel( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    bvh_build_options options;
+    options.threads = state.range(1);
+    for( auto _ : state )
+        {
+        bvh<float,3> tree( boxes, options );
+        benchmark::DoNotOptimize( tree.nodes().data() );
+        }
+    }
+
+/* Rebuilt in place, as every frame of a scene where everything moves. */
+static void
+BM_BvhBuildLinear( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    bvh_build_options options;
+    options.method = bvh_build_method::linear;
+    options.threads = state.range(1);
+    bvh<float,3> tree;
+    for( auto _ : state )
+        {
+        tree.build( boxes, options );
+        benchmark::DoNotOptimize( tree.nodes().data() );
+        }
+    }
+
+static void
+BM_BvhOverlaps( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    bvh<float,3> tree( boxes );
+    float x = 0;
+    for( auto _ : state )
+        {
+        x = x < 99 ? x + 0.37f : 0;
+        faabb3 q{ x, x+1, x, x+1, 50, 51 };
+        size_t hits = 0;
+        tree.query_overlaps( q, [&]( size_t ) { ++hits; } );
+        benchmark::DoNotOptimize( hits );
+        }
+    }
+
+static void
+BM_LinearOverlaps( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    float x = 0;
+    for( auto _ : state )
+        {
+        x = x < 99 ? x + 0.37f : 0;
+        faabb3 q{ x, x+1, x, x+1, 50, 51 };
+        size_t hits = 0;
+        for( auto& b : boxes )
+            hits += overlaps( b, q );
+        benchmark::DoNotOptimize( hits );
+        }
+    }
+
+/* The same scan over boxes quantized to Q in the bounds of the scene. */
+template<class Q> static void
+BM_QuantizedOverlaps( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    aabb_quantizer<float,3,Q> quant( combine<float,3>( boxes.begin(), boxes.end() ) );
+    std::vector<aabb<Q,3>> q( boxes.size() );
+    quant.encode( boxes.data(), boxes.size(), q.data() );
+    std::vector<uint32_t> hits( boxes.size() );
+    float x = 0;
+    for( auto _ : state )
+        {
+        x = x < 99 ? x + 0.37f : 0;
+        faabb3 b{ x, x+1, x, x+1, 50, 51 };
+        size_t n = may_overlap( q.data(), q.size(), quant.encode( b ), hits.data() );
+        benchmark::DoNotOptimize( n );
+        }
+    }
+
+/* The same scan over packets of 8 boxes. */
+static void
+BM_PacketOverlaps( benchmark::State& state )
+    {
+    auto packets = make_aabb_packets<8>( bench_boxes( state.range(0) ) );
+    float x = 0;
+    for( auto _ : state )
+        {
+        x = x < 99 ? x + 0.37f : 0;
+        faabb3 q{ x, x+1, x, x+1, 50, 51 };
+        size_t hits = 0;
+        for( auto& p : packets )
+            hits += std::bitset<32>( overlaps( p, q ) ).count();
+        benchmark::DoNotOptimize( hits );
+        }
+    }
+
+static void
+BM_TransformAabb( benchmark::State& state )
+    {
+    fmat44 M = bench_matrix<fmat44>( 1 );
+    aabb_list<float,3> boxes = bench_boxes( 1 << 16 ), r( boxes.size() );
+    for( auto _ : state )
+        {
+        for( size_t i=0; i < boxes.size(); ++i )
+            r[i] = transform_aabb( boxes[i], M );
+        benchmark::DoNotOptimize( r.data() );
+        }
+    state.SetItemsProcessed( state.iterations() * boxes.size() );
+    }
+
+static void
+BM_TransformAabbs( benchmark::State& state )
+    {
+    fmat44 M = bench_matrix<fmat44>( 1 );
+    aabb_list<float,3> boxes = bench_boxes( 1 << 16 ), r( boxes.size() );
+    for( auto _ : state )
+        {
+        transform_aabbs( M, boxes.data(), r.data(), boxes.size(), state.range(0) );
+        benchmark::DoNotOptimize( r.data() );
+        }
+    state.SetItemsProcessed( state.iterations() * boxes.size() );
+    }
+
+/* A camera in the middle of the boxes, turning a little each frame. The
+    boxes are in scene order, sorted by the cell of a coarse grid. */
+static void
+BM_FrustumCull( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    auto cell = []( const faabb3& b )
+        { return int( b(0,0)/5 )*400 + int( b(1,0)/5 )*20 + int( b(2,0)/5 ); };
+    std::sort( boxes.begin(), boxes.end(), [&]( const faabb3& a, const faabb3& b )
+        { return cell( a ) < cell( b ); } );
+    fmat44 P = perspective( -1.f, 1.f, -1.f, 1.f, 1.f, 40.f );
+    fmat44 view = translation( fvec3{ -50, -50, -50 } );
+    std::vector<uint32_t> visible;
+    cull_cache cache;
+    float turn = 0;
+    for( auto _ : state )
+        {
+        turn += 0.001f;
+        ffrustum f = make_frustum( P * rotation( turn, 0.f, 1.f, 0.f ) * view );
+        cull_aabbs( f, boxes.data(), boxes.size(), visible,
+                    state.range(2) ? &cache : nullptr, state.range(1) );
+        benchmark::DoNotOptimize( visible.data() );
+        }
+    state.SetItemsProcessed( state.iterations() * boxes.size() );
+    }
+
+static void
+BM_BvhRaycast( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    bvh<float,3> tree( boxes );
+    float x = 0;
+    for( auto _ : state )
+        {
+        x = x < 99 ? x + 0.37f : 0;
+        fray3 r = make_ray( fvec3{ x, 0, 50 }, fvec3{ 0.1f, 1, 0.2f } );
+        size_t index;
+        float t;
+        tree.closest_hit( r, 1000.f, index, t );
+        benchmark::DoNotOptimize( index );
+        }
+    }
+
+/* A view's worth of rays fanning out over the boxes, 128 x 128. */
+static std::vector<fray3>
+bench_rays()
+    {
+    std::vector<fray3> rays;
+    for( int y=0; y<128; ++y )
+    for( int x=0; x<128; ++x )
+        rays.push_back( make_ray( fvec3{ 50, 50, -10 },
+                                  fvec3{ x/128.f - .5f, y/128.f - .5f, 1 } ) );
+    return rays;
+    }
+
+/* The rays one by one, or as packets when range(1) is set. */
+static void
+BM_BvhRaycastBatch( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    bvh<float,3> tree( boxes );
+    std::vector<fray3> rays = bench_rays();
+    std::vector<size_t> index( rays.size() );
+    std::vector<float> t( rays.size() );
+    for( auto _ : state )
+        {
+        if( state.range(1) )
+            tree.closest_hits( rays.data(), rays.size(), 1000.f, index.data(), t.data() );
+        else
+            for( size_t i=0; i < rays.size(); ++i )
+                tree.closest_hit( rays[i], 1000.f, index[i], t[i] );
+        benchmark::DoNotOptimize( index.data() );
+        }
+    state.SetItemsProcessed( state.iterations() * rays.size() );
+    }
+
+/* One ray against every box, scalar or in packets of 8. */
+static void
+BM_RayBoxes( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( 1 << 16 );
+    auto packets = make_aabb_packets<8>( boxes );
+    fray3 r = make_ray( fvec3{ 0, 0, 0 }, fvec3{ 1, 1, 1 } );
+    float tnear;
+    for( auto _ : state )
+        {
+        size_t hits = 0;
+        if( state.range(0) )
+            for( auto& p : packets )
+                hits += std::bitset<32>( intersects( r, p, 0.f, 1000.f ) ).count();
+        else
+            for( auto& b : boxes )
+                hits += intersects( r, b, 0.f, 1000.f, tnear );
+        benchmark::DoNotOptimize( hits );
+        }
+    state.SetItemsProcessed( state.iterations() * boxes.size() );
+    }
+
+/* Morton keys of 1M box centers with their positions, by radix sort or
+    by std::sort when range(0) is 0. */
+static void
+BM_SortKeys( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( 1 << 20 );
+    std::vector<uint32_t> keys( boxes.size() ), values( boxes.size() );
+    std::vector< std::pair<uint32_t,uint32_t> > pairs( boxes.size() );
+    curve_keys( curve::morton, boxes.data(), boxes.size(),
+                faabb3{ 0, 101, 0, 101, 0, 101 }, keys.data() );
+    for( auto _ : state )
+        {
+        state.PauseTiming();
+        std::vector<uint32_t> k = keys;
+        for( size_t i=0; i < values.size(); ++i )
+            {
+            values[i] = uint32_t( i );
+            pairs[i] = { k[i], uint32_t( i ) };
+            }
+        state.ResumeTiming();
+        if( state.range(0) )
+            radix_sort( k.data(), values.data(), k.size(), state.range(1) );
+        else
+            std::sort( pairs.begin(), pairs.end() );
+        benchmark::DoNotOptimize( values.data() );
+        }
+    state.SetItemsProcessed( state.iterations() * keys.size() );
+    }
+
+static void
+BM_SpatialSort( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( 1 << 20 );
+    curve c = state.range(0) ? curve::hilbert : curve::morton;
+    for( auto _ : state )
+        {
+        aabb_list<float,3> sorted = boxes;
+        spatial_sort( sorted, c );
+        benchmark::DoNotOptimize( sorted.data() );
+        }
+    state.SetItemsProcessed( state.iterations() * boxes.size() );
+    }
+
+static void
+BM_BvhNearest( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    bvh<float,3> tree( boxes );
+    float x = 0;
+    for( auto _ : state )
+        {
+        x = x < 99 ? x + 0.37f : 0;
+        size_t index;
+        float dist;
+        tree.nearest( fvec3{ x, 100-x, 50 }, index, dist );
+        benchmark::DoNotOptimize( index );
+        }
+    }
+
+/* One tick of n objects of which every hundredth moves, then the pairs
+    of the moved objects. */
+static void
+BM_DynamicTreeTick( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    dynamic_tree<float,3> tree( .05f );
+    std::vector<uint32_t> ids;
+    for( auto& b : boxes )
+        ids.push_back( tree.insert( b ) );
+    tree.moved_pairs( []( uint32_t, uint32_t ) {} );
+
+    float dx = .03f;
+    for( auto _ : state )
+        {
+        dx = -dx;
+        for( size_t i=0; i < boxes.size(); i += 100 )
+            {
+            boxes[i](0,0) += dx;
+            boxes[i](0,1) += dx;
+            tree.move( ids[i], boxes[i], fvec3{ dx, 0, 0 } );
+            }
+        size_t pairs = 0;
+        tree.moved_pairs( [&]( uint32_t, uint32_t ) { ++pairs; } );
+        benchmark::DoNotOptimize( pairs );
+        }
+    }
+
+/* The same tick in a loose octree, querying the moved boxes for pairs. */
+static void
+BM_LooseTreeTick( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    loose_octree<float> tree( faabb3{ 0, 100, 0, 100, 0, 100 } );
+    std::vector<uint32_t> ids;
+    for( auto& b : boxes )
+        ids.push_back( tree.insert( b ) );
+
+    float dx = .03f;
+    for( auto _ : state )
+        {
+        dx = -dx;
+        size_t pairs = 0;
+        for( size_t i=0; i < boxes.size(); i += 100 )
+            {
+            boxes[i](0,0) += dx;
+            boxes[i](0,1) += dx;
+            tree.move( ids[i], boxes[i] );
+            tree.query_overlaps( boxes[i], [&]( uint32_t ) { ++pairs; } );
+            }
+        benchmark::DoNotOptimize( pairs );
+        }
+    }
+
+/* The same tick in a spatial hash with cells about twice the box size. */
+static void
+BM_SpatialHashTick( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    spatial_hash<float,3> grid( .4f );
+    grid.rebuild( boxes );
+
+    float dx = .03f;
+    for( auto _ : state )
+        {
+        dx = -dx;
+        size_t pairs = 0;
+        for( size_t i=0; i < boxes.size(); i += 100 )
+            {
+            boxes[i](0,0) += dx;
+            boxes[i](0,1) += dx;
+            grid.move( uint32_t(i), boxes[i] );
+            grid.query_overlaps( boxes[i], [&]( uint32_t ) { ++pairs; } );
+            }
+        benchmark::DoNotOptimize( pairs );
+        }
+    }
+
+/* Rebuilding from scratch, second argument threads, 0 for all. */
+static void
+BM_SpatialHashRebuild( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_boxes( state.range(0) );
+    spatial_hash<float,3> grid( .4f );
+    for( auto _ : state )
+        {
+        grid.rebuild( boxes, state.range(1) );
+        benchmark::DoNotOptimize( grid.cell_count() );
+        }
+    }
+
+/* Boxes of side .2 to .6 in a cube holding about one per unit volume. */
+static aabb_list<float,3>
+bench_scene( size_t n )
+    {
+    std::mt19937 gen( 1 );
+    float size = std::cbrt( float(n) );
+    std::uniform_real_distribution<float> pos( 0, size ), side( .2f, .6f );
+    aabb_list<float,3> boxes( n );
+    for( auto& b : boxes )
+        for( size_t d=0; d<3; ++d )
+            {
+            b(d,0) = pos( gen );
+            b(d,1) = b(d,0) + side( gen );
+            }
+    return boxes;
+    }
+
+/* Every box jitters a little each frame. */
+static void
+jitter( aabb_list<float,3>& boxes, std::mt19937& gen )
+    {
+    std::uniform_real_distribution<float> step( -.02f, .02f );
+    for( auto& b : boxes )
+        for( size_t d=0; d<3; ++d )
+            {
+            float s = step( gen );
+            b(d,0) += s;
+            b(d,1) += s;
+            }
+    }
+
+static void
+BM_SweepPruneFrame( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_scene( state.range(0) );
+    sweep_prune<float,3> sap;
+    for( auto& b : boxes )
+        sap.insert( b );
+    sap.update();
+    std::mt19937 gen( 2 );
+    for( auto _ : state )
+        {
+        jitter( boxes, gen );
+        for( uint32_t i=0; i < boxes.size(); ++i )
+            sap.move( i, boxes[i] );
+        sap.update();
+        benchmark::DoNotOptimize( sap.added().size() );
+        }
+    }
+
+/* The same frames sorting and sweeping from scratch. */
+static void
+BM_SweepPruneRebuild( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_scene( state.range(0) );
+    std::mt19937 gen( 2 );
+    for( auto _ : state )
+        {
+        jitter( boxes, gen );
+        sweep_prune<float,3> sap;
+        for( auto& b : boxes )
+            sap.insert( b );
+        sap.update();
+        benchmark::DoNotOptimize( sap.pair_count() );
+        }
+    }
+
+static void
+BM_CombineOverlapping( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_scene( state.range(0) );
+    aabb_list<float,3> result;
+    for( auto _ : state )
+        {
+        result = boxes;
+        auto end = combine_overlapping( result.begin(), result.end(),
+                                        state.range(1) );
+        benchmark::DoNotOptimize( end );
+        }
+    }
+
+/* All pairs in a scene, or between it and a tenth as many boxes when the
+    third argument is 1. Second argument threads, 0 for all. */
+static void
+BM_OverlapPairs( benchmark::State& state )
+    {
+    aabb_list<float,3> boxes = bench_scene( state.range(0) );
+    aabb_list<float,3> triggers( boxes.begin(), boxes.begin() + boxes.size() / 10 );
+    for( auto& b : triggers )
+        b(0,1) += 2;
+    for( auto _ : state )
+        {
+        auto pairs = state.range(2) ? overlapping_pairs( triggers, boxes, state.range(1) )
+                                    : overlapping_pairs( boxes, state.range(1) );
+        benchmark::DoNotOptimize( pairs.data() );
+        }
+    }
+
+BENCHMARK_TEMPLATE( BM_Multiply, fmat33 );
+BENCHMARK_TEMPLATE( BM_MultiplyRowColumn, fmat33 );
+BENCHMARK_TEMPLATE( BM_Multiply, dmat33 );
+BENCHMARK_TEMPLATE( BM_MultiplyRowColumn, dmat33 );
+BENCHMARK_TEMPLATE( BM_Multiply, fmat44 );
+BENCHMARK_TEMPLATE( BM_MultiplyUnrolled, fmat44 );
+BENCHMARK_TEMPLATE( BM_MultiplyRowColumn, fmat44 );
+BENCHMARK_TEMPLATE( BM_Multiply, imat44 );
+BENCHMARK_TEMPLATE( BM_MultiplyRowColumn, imat44 );
+BENCHMARK_TEMPLATE( BM_Transpose, fmat33 );
+BENCHMARK_TEMPLATE( BM_TransposeLoop, fmat33 );
+BENCHMARK_TEMPLATE( BM_Transpose, fmat44 );
+BENCHMARK_TEMPLATE( BM_TransposeLoop, fmat44 );
+BENCHMARK_TEMPLATE( BM_Compose, faffine3 );
+BENCHMARK_TEMPLATE( BM_Compose, daffine3 );
+BENCHMARK_TEMPLATE( BM_Multiply, dmat44 );
+BENCHMARK_TEMPLATE( BM_Inverse, fmat33 );
+BENCHMARK_TEMPLATE( BM_InverseAdjugate, fmat33 );
+BENCHMARK_TEMPLATE( BM_Inverse, fmat44 );
+BENCHMARK_TEMPLATE( BM_InverseAdjugate, fmat44 );
+BENCHMARK_TEMPLATE( BM_Inverse, dmat44 );
+BENCHMARK_TEMPLATE( BM_Inverse, matrix<double,6,6> );
+BENCHMARK_TEMPLATE( BM_InverseAdjugate, matrix<double,6,6> );
+
+BENCHMARK( BM_NormalizeArray )->Arg( 1 << 16 );
+BENCHMARK( BM_NormalizeVector )->Arg( 1 << 16 );
+BENCHMARK( BM_TransformArray )->Arg( 1 << 16 );
+BENCHMARK( BM_TransformVector )->Arg( 1 << 16 );
+
+BENCHMARK( BM_TransformPoints )->Arg( 1 )->Arg( 4 );
+BENCHMARK( BM_TransformPointsWeld );
+BENCHMARK( BM_TransformAabb );
+BENCHMARK( BM_TransformAabbs )->Arg( 1 )->Arg( 4 );
+
+BENCHMARK( BM_DMatrixMultiply )->Arg( 512 );
+BENCHMARK( BM_DMatrixMultiplyNaive )->Arg( 512 );
+BENCHMARK( BM_DMatrixInverse )->Arg( 512 );
+
+BENCHMARK( BM_BvhBuild )->Arg( 1 << 20 )->Unit( benchmark::kMillisecond );
+BENCHMARK( BM_BvhBuildParallel )->Args( { 1 << 20, 0 } )
+    ->Unit( benchmark::kMillisecond )->UseRealTime();
+BENCHMARK( BM_BvhBuildLinear )->Args( { 1 << 20, 1 } )->Args( { 1 << 20, 0 } )
+    ->Unit( benchmark::kMillisecond )->UseRealTime();
+BENCHMARK( BM_BvhBuild )->Arg( 1 << 17 )->Unit( benchmark::kMillisecond );
+BENCHMARK( BM_DynamicTreeTick )->Arg( 1 << 17 );
+BENCHMARK( BM_LooseTreeTick )->Arg( 1 << 17 );
+BENCHMARK( BM_SpatialHashTick )->Arg( 1 << 17 );
+BENCHMARK( BM_SpatialHashRebuild )->Args( { 1 << 17, 1 } )->Args( { 1 << 17, 0 } )
+    ->Unit( benchmark::kMillisecond );
+BENCHMARK( BM_SweepPruneFrame )->Arg( 1 << 14 );
+BENCHMARK( BM_SweepPruneRebuild )->Arg( 1 << 14 );
+BENCHMARK( BM_CombineOverlapping )->Args( { 1 << 15, 1 } )->Args( { 1 << 15, 0 } )
+    ->Unit( benchmark::kMillisecond )->UseRealTime();
+BENCHMARK( BM_OverlapPairs )->Args( { 1 << 17, 1, 0 } )->Args( { 1 << 17, 0, 0 } )
+    ->Args( { 1 << 17, 1, 1 } )->Unit( benchmark::kMillisecond )->UseRealTime();
+BENCHMARK( BM_BvhOverlaps )->Arg( 1 << 20 );
+BENCHMARK( BM_LinearOverlaps )->Arg( 1 << 20 );
+BENCHMARK( BM_PacketOverlaps )->Arg( 1 << 20 );
+BENCHMARK_TEMPLATE( BM_QuantizedOverlaps, uint8_t )->Arg( 1 << 20 );
+BENCHMARK_TEMPLATE( BM_QuantizedOverlaps, uint16_t )->Arg( 1 << 20 );
+BENCHMARK( BM_FrustumCull )->Args( { 500000, 1, 0 } )->Args( { 500000, 1, 1 } )
+    ->Args( { 500000, 0, 1 } )->Unit( benchmark::kMicrosecond )->UseRealTime();
+BENCHMARK( BM_BvhRaycast )->Arg( 1 << 20 );
+BENCHMARK( BM_BvhRaycastBatch )->Args( { 1 << 20, 0 } )->Args( { 1 << 20, 1 } )
+    ->Unit( benchmark::kMillisecond );
+BENCHMARK( BM_RayBoxes )->Arg( 0 )->Arg( 1 );
+BENCHMARK( BM_SortKeys )->Args( { 0, 1 } )->Args( { 1, 1 } )->Args( { 1, 0 } )
+    ->Unit( benchmark::kMillisecond )->UseRealTime();
+BENCHMARK( BM_SpatialSort )->Arg( 0 )->Arg( 1 )->Unit( benchmark::kMillisecond );
+BENCHMARK( BM_BvhNearest )->Arg( 1 << 20 );
+
+BENCHMARK_MAIN();
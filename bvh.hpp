@@ -0,0 +1,1378 @@
+#ifndef TUMBO_BVH_HPP
+#define TUMBO_BVH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "morton.hpp"
+#include "ray_packet.hpp"
+#include "parallel.hpp"
+
+/**
+    \file bvh.hpp
+    \brief Static bounding volume hierarchy over an aabb_list.
+
+    The tree is built top-down with the binned surface area heuristic and
+    stored as one flat node array. An internal node has its two children
+    next to each other at first and first+1; a leaf refers to count boxes
+    starting at first in items(). The boxes are copied into items() in
+    leaf order so a leaf reads contiguous memory; indices() maps them back
+    to their position in the list the tree was built from, which is what
+    the queries report.
+
+    bvh_build_options sets the bins, the leaf size and the threads of the
+    build. The upper levels bin and partition their boxes in parallel
+    chunks and the subtrees below are built as separate tasks. The tree
+    does not depend on the thread count unless deterministic is turned
+    off, which saves a compacting pass over the nodes.
+
+    The linear build method is for scenes where everything moves every
+    frame. It sorts the box centers by Morton key and builds the tree of
+    the key prefixes after Karras, "Maximizing parallelism in the
+    construction of BVHs, octrees, and k-d trees" (2012): every internal
+    node finds its range and split from the keys alone, so all of them
+    are made at once. Nodes of leaf_size boxes or fewer become leaves and
+    the bounds are combined bottom up, the second child to finish going
+    on to its parent. The trees are worse to query than the SAH ones but
+    several times faster to build.
+
+    Ray packets are traversed together: a node is entered while any of
+    its rays hits it, and each ray keeps its own closest hit. This pays
+    off for coherent rays such as those through neighbouring pixels.
+    closest_hits() runs a list of rays as packets on several threads.
+
+    Every query returns the number of nodes it visited.
+*/
+
+namespace tumbo
+    {
+
+    template<class T, size_t D>
+    struct bvh_node
+        {
+        aabb<T,D> box;
+        uint32_t first; // Left child, or first box of a leaf
+        uint32_t count; // Boxes in a leaf, 0 for internal nodes
+
+        bool
+        is_leaf() const
+            { return count != 0; }
+        };
+
+
+    /* Stack for tree traversal. Lives on the stack for the usual depths
+        and spills to the heap for degenerate trees. */
+    template<class E>
+    class traversal_stack_
+        {
+        public:
+            traversal_stack_() :
+                size_( 0 )
+                {}
+
+            void
+            push( const E& e )
+                {
+                if( size_ < local_size )
+                    local_[size_] = e;
+                else
+                    heap_.push_back( e );
+                ++size_;
+                }
+
+            E
+            pop()
+                {
+                --size_;
+                if( size_ < local_size )
+                    return local_[size_];
+                E e = heap_.back();
+                heap_.pop_back();
+                return e;
+                }
+
+            bool
+            empty() const
+                { return size_ == 0; }
+
+        private:
+            static constexpr size_t local_size = 64;
+            E local_[local_size];
+            std::vector<E> heap_;
+            size_t size_;
+        };
+
+
+    enum class bvh_build_method
+        {
+        /// Top-down binned surface area heuristic.
+        sah,
+        /// Karras' linear bvh over Morton keys. Ignores bins and
+        /// deterministic, the tree only depends on the boxes. Integral
+        /// boxes are built with sah.
+        linear
+        };
+
+
+    struct bvh_build_options
+        {
+        bvh_build_method method = bvh_build_method::sah;
+        /// Threads to build with, 0 for all hardware threads.
+        size_t threads = 1;
+        /// Centroid bins per axis, the split candidates are between them.
+        /// At most 64.
+        size_t bins = 16;
+        /// Nodes with this many boxes or fewer become leaves.
+        size_t leaf_size = 4;
+        /// Number the nodes breadth first so the tree does not depend on
+        /// the thread count or scheduling.
+        bool deterministic = true;
+        };
+
+
+    template<class T, size_t D> class bvh_builder_;
+
+
+    template<class T, size_t D>
+    class bvh
+        {
+        public:
+            typedef bvh_node<T,D> node;
+
+            static constexpr size_t npos = size_t(-1);
+
+            bvh() :
+                depth_( 0 )
+                {}
+
+            explicit
+            bvh( const aabb_list<T,D>& boxes, size_t leaf_size = 4 ) :
+                depth_( 0 )
+                {
+                build( boxes, leaf_size );
+                }
+
+            bvh( const aabb_list<T,D>& boxes, const bvh_build_options& options ) :
+                depth_( 0 )
+                {
+                build( boxes, options );
+                }
+
+            /// Rebuilds the tree over boxes, with at most about leaf_size
+            /// boxes per leaf.
+            void
+            build( const aabb_list<T,D>& boxes, size_t leaf_size = 4 )
+                {
+                bvh_build_options options;
+                options.leaf_size = leaf_size;
+                build( boxes, options );
+                }
+
+            void
+            build( const aabb_list<T,D>& boxes, const bvh_build_options& options );
+
+            const std::vector<node>&
+            nodes() const
+                { return nodes_; }
+
+            /// The boxes in leaf order.
+            const aabb_list<T,D>&
+            items() const
+                { return items_; }
+
+            /// Position in the original list of each box in items().
+            const std::vector<uint32_t>&
+            indices() const
+                { return indices_; }
+
+            size_t
+            size() const
+                { return items_.size(); }
+
+            bool
+            empty() const
+                { return items_.empty(); }
+
+            /// Levels below the root of the deepest leaf.
+            size_t
+            depth() const
+                { return depth_; }
+
+            /// Calls fn( index ) for every box containing p.
+            template<class Fn> size_t
+            query_contains( const vec<T,D>& p, Fn fn ) const;
+
+            /// Calls fn( index ) for every box overlapping b.
+            template<class Fn> size_t
+            query_overlaps( const aabb<T,D>& b, Fn fn ) const;
+
+            /// Calls fn( index, tnear ) for every box the ray hits before
+            /// tmax, roughly front to back.
+            template<class Fn> size_t
+            query_ray( const ray<T,D>& r, T tmax, Fn fn ) const;
+
+            /// Finds the box the ray enters first.
+            /** index is npos on a miss. */
+            size_t
+            closest_hit( const ray<T,D>& r, T tmax,
+                         size_t& index, T& t ) const;
+
+            /// Finds the box each ray of the packet enters first.
+            /** index and t take W values, one per lane, as closest_hit
+                with the segment of the lane. Lanes that miss get npos. */
+            template<size_t W> size_t
+            closest_hit( const ray_packet<T,D,W>& rays,
+                         size_t* index, T* t ) const;
+
+            /// closest_hit for n rays, in packets of consecutive rays.
+            /** Rays next to each other should be close in direction and
+                origin for the packets to help. */
+            size_t
+            closest_hits( const ray<T,D>* rays, size_t n, T tmax,
+                          size_t* index, T* t, size_t threads = 1 ) const;
+
+            /// Finds the box closest to p, distance 0 if inside.
+            /** index is npos if the tree is empty. */
+            size_t
+            nearest( const vec<T,D>& p, size_t& index, T& distance_sq ) const;
+
+        private:
+            void
+            build_linear_( const aabb_list<T,D>& boxes,
+                           const bvh_build_options& options );
+
+            std::vector<node> nodes_;
+            aabb_list<T,D> items_;
+            std::vector<uint32_t> indices_;
+            size_t depth_;
+        };
+
+
+    /* Bounds of boxes or of centroids during a build. */
+    template<class T, size_t D>
+    struct build_bounds_
+        {
+        // Areas and split costs, in double for integral boxes so they
+        // neither truncate nor overflow.
+        typedef typename std::conditional< std::is_floating_point<T>::value,
+                                           T, double >::type real;
+
+        T lo[D], hi[D];
+
+        void
+        reset()
+            {
+            std::fill( lo, lo+D, std::numeric_limits<T>::max() );
+            std::fill( hi, hi+D, std::numeric_limits<T>::lowest() );
+            }
+
+        void
+        grow( const build_bounds_& b )
+            {
+            for( size_t d=0; d<D; ++d )
+                {
+                lo[d] = std::min( lo[d], b.lo[d] );
+                hi[d] = std::max( hi[d], b.hi[d] );
+                }
+            }
+
+        /// Grows to twice the centroid of b, which orders the same.
+        void
+        grow_centroid( const build_bounds_& b )
+            {
+            for( size_t d=0; d<D; ++d )
+                {
+                T c = b.lo[d] + b.hi[d];
+                lo[d] = std::min( lo[d], c );
+                hi[d] = std::max( hi[d], c );
+                }
+            }
+
+        real
+        half_area() const
+            {
+            if constexpr( D == 3 )
+                {
+                real x = real( hi[0] ) - real( lo[0] ),
+                     y = real( hi[1] ) - real( lo[1] ),
+                     z = real( hi[2] ) - real( lo[2] );
+                return x*y + y*z + z*x;
+                }
+            else if constexpr( std::is_floating_point<T>::value )
+                return tumbo::half_area( box() );
+            else
+                return tumbo::half_area( aabb<real,D>( box() ) );
+            }
+
+        aabb<T,D>
+        box() const
+            {
+            aabb<T,D> a;
+            for( size_t d=0; d<D; ++d )
+                {
+                a(d,0) = lo[d];
+                a(d,1) = hi[d];
+                }
+            return a;
+            }
+        };
+
+
+    /* Builds the nodes of a bvh over a list of box references that is
+        reordered in place into leaf order.
+
+        Nodes of parallel_grain boxes or more bin and partition their boxes
+        in chunks over the threads; children of task_grain boxes or more are
+        built as separate tasks while fewer than threads tasks run. Those
+        large nodes partition stably into the other of refs_ and temp_
+        whatever the thread count, so the tree shape only depends on the
+        input. A node gets its bounds from the bins of its parent and its
+        centroid bounds from the partition, so each level reads the boxes
+        twice.
+
+        In deterministic mode every subtree owns the node slots a tree over
+        its boxes could need at most, and the nodes are compacted
+        afterwards; otherwise children are numbered in the order they are
+        created. */
+    template<class T, size_t D>
+    class bvh_builder_
+        {
+        public:
+            typedef bvh_node<T,D> node;
+            typedef build_bounds_<T,D> bounds;
+            typedef typename bounds::real real;
+
+            struct ref
+                {
+                bounds box;
+                uint32_t index;
+                };
+
+            static constexpr size_t max_bins = 64;
+            static constexpr size_t parallel_grain = 1 << 14;
+            static constexpr size_t task_grain = 1 << 10;
+
+            bvh_builder_( const bvh_build_options& options,
+                          std::vector<ref>& refs, std::vector<node>& nodes ) :
+                refs_( refs ),
+                nodes_( nodes ),
+                temp_( refs.size() >= parallel_grain ? refs.size() : 0 ),
+                threads_( thread_count( options.threads ) ),
+                bins_( options.bins ),
+                leaf_size_( std::max<size_t>( options.leaf_size, 1 ) ),
+                deterministic_( options.deterministic ),
+                next_( 1 ),
+                depth_( 0 ),
+                tasks_( 0 )
+                {
+                TUMBO_ASSERT( bins_ >= 2 && bins_ <= max_bins );
+                }
+
+            /// Builds the tree and returns its depth.
+            size_t
+            build()
+                {
+                nodes_.assign( 2*refs_.size() - 1, node() );
+                task root{ 0, 0, uint32_t( refs_.size() ), 1, 0, false, {}, {} };
+                bounds_( root );
+                task_group group;
+                build_( group, root );
+                group.wait();
+                if( deterministic_ )
+                    compact_();
+                else
+                    nodes_.resize( next_ );
+                return depth_;
+                }
+
+        private:
+            struct task
+                {
+                uint32_t node, first, count;
+                uint32_t slot;  // First node slot of the descendants
+                uint32_t depth;
+                bool in_temp;   // The boxes are in temp_ instead of refs_
+                bounds box, centroids;
+                };
+
+            struct bin
+                {
+                bounds box;
+                size_t count;
+                };
+
+            static T
+            centroid_( const ref& r, size_t d )
+                {
+                return r.box.lo[d] + r.box.hi[d];
+                }
+
+            size_t
+            chunks_( size_t count ) const
+                {
+                return count >= parallel_grain ?
+                    std::min( threads_, count / ( parallel_grain/4 ) ) : 1;
+                }
+
+            ref*
+            data_( const task& t )
+                {
+                return ( t.in_temp ? temp_ : refs_ ).data() + t.first;
+                }
+
+            /* Calls fn( chunk, first, last ) for chunks splitting count
+                boxes, in parallel when there are several. */
+            template<class Fn> void
+            for_chunks_( size_t chunks, size_t count, Fn fn )
+                {
+                if( chunks == 1 )
+                    {
+                    fn( size_t(0), size_t(0), count );
+                    return;
+                    }
+                parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+                    {
+                    for( size_t c = c0; c < c1; ++c )
+                        fn( c, count*c / chunks, count*(c+1) / chunks );
+                    } );
+                }
+
+            /* Claims one of the threads-1 extra tasks. */
+            bool
+            reserve_task_()
+                {
+                size_t n = tasks_;
+                while( n+1 < threads_ )
+                    if( tasks_.compare_exchange_weak( n, n+1 ) )
+                        return true;
+                return false;
+                }
+
+            void
+            bounds_( task& t );
+
+            void
+            build_( task_group& group, task root );
+
+            void
+            compact_();
+
+            std::vector<ref>& refs_;
+            std::vector<node>& nodes_;
+            std::vector<ref> temp_;
+            const size_t threads_;
+            const size_t bins_;
+            const size_t leaf_size_;
+            const bool deterministic_;
+            std::atomic<uint32_t> next_;
+            std::atomic<size_t> depth_;
+            std::atomic<size_t> tasks_;
+        };
+
+
+    /* Computes the bounds of a task's boxes and their centroids. */
+    template<class T, size_t D> void
+    bvh_builder_<T,D>::bounds_( task& t )
+        {
+        const ref* r = data_( t );
+        size_t chunks = chunks_( t.count );
+        std::vector<bounds> part( 2*chunks );
+        for_chunks_( chunks, t.count,
+            [&]( size_t c, size_t first, size_t last )
+            {
+            bounds& b = part[2*c];
+            bounds& cb = part[2*c+1];
+            b.reset();
+            cb.reset();
+            for( size_t i = first; i < last; ++i )
+                {
+                b.grow( r[i].box );
+                cb.grow_centroid( r[i].box );
+                }
+            } );
+        t.box = part[0];
+        t.centroids = part[1];
+        for( size_t c=1; c < chunks; ++c )
+            {
+            t.box.grow( part[2*c] );
+            t.centroids.grow( part[2*c+1] );
+            }
+        }
+
+
+    template<class T, size_t D> void
+    bvh_builder_<T,D>::build_( task_group& group, task root )
+        {
+        // Leaves are allowed to grow this big when splitting is not worth it.
+        const size_t max_leaf = leaf_size_ * 4;
+        const real inf = std::numeric_limits<real>::infinity();
+
+        std::vector<task> stack( 1, root );
+        std::vector<bin> part;
+        size_t depth = 0;
+        while( !stack.empty() )
+            {
+            task t = stack.back();
+            stack.pop_back();
+            depth = std::max<size_t>( depth, t.depth );
+
+            if( t.in_temp && t.count < parallel_grain )
+                {
+                // Small nodes partition in place in refs_.
+                std::copy( data_( t ), data_( t ) + t.count,
+                           refs_.data() + t.first );
+                t.in_temp = false;
+                }
+
+            node& n = nodes_[ t.node ];
+            n.box = t.box.box();
+            n.first = t.first;
+            n.count = t.count;
+            if( t.count <= leaf_size_ )
+                continue;
+
+            ref* r = data_( t );
+            const bounds& cb = t.centroids;
+            const size_t chunks = chunks_( t.count );
+
+            // Bin the centroids along every axis with some extent. Small
+            // nodes use one bin per box.
+            const size_t nbins = std::min<size_t>( bins_, t.count );
+            const size_t stride = D*nbins;
+            real scale[D];
+            for( size_t d=0; d<D; ++d )
+                {
+                real extent = real( cb.hi[d] ) - real( cb.lo[d] );
+                scale[d] = extent > 0 ? real(nbins) / extent : real(0);
+                }
+            auto bin_index = [&]( const ref& x, size_t d )
+                {
+                // Through int, the conversion to unsigned is slow.
+                return std::min( nbins-1, size_t( int(
+                    ( centroid_( x, d ) - cb.lo[d] ) * scale[d] ) ) );
+                };
+
+            // Chunk c bins into part, which the partition uses to find
+            // where its boxes go. One chunk bins straight into bins.
+            bin bins[ D*max_bins ];
+            part.resize( chunks > 1 ? chunks*stride : 0 );
+            for_chunks_( chunks, t.count,
+                [&]( size_t c, size_t first, size_t last )
+                {
+                bin* b = chunks > 1 ? part.data() + c*stride : bins;
+                for( size_t k=0; k < stride; ++k )
+                    {
+                    b[k].box.reset();
+                    b[k].count = 0;
+                    }
+                for( size_t i = first; i < last; ++i )
+                    for( size_t d=0; d<D; ++d )
+                        if( scale[d] > 0 )
+                            {
+                            bin& bi = b[ d*nbins + bin_index( r[i], d ) ];
+                            bi.box.grow( r[i].box );
+                            ++bi.count;
+                            }
+                } );
+            if( chunks > 1 )
+                {
+                std::copy( part.begin(), part.begin() + stride, bins );
+                for( size_t c=1; c < chunks; ++c )
+                    for( size_t k=0; k < stride; ++k )
+                        {
+                        bins[k].box.grow( part[ c*stride + k ].box );
+                        bins[k].count += part[ c*stride + k ].count;
+                        }
+                }
+
+            // Evaluate the bin boundaries of every axis. A boundary after
+            // an empty bin splits like the one before it and is skipped.
+            real best_cost = inf;
+            size_t best_axis = 0, best_split = 0;
+            for( size_t d=0; d<D; ++d )
+                {
+                if( !( scale[d] > 0 ) )
+                    continue;
+                const bin* b = bins + d*nbins;
+
+                // Right side areas and counts swept from the top.
+                real right_area[max_bins];
+                size_t right_count[max_bins];
+                bounds right = b[nbins-1].box;
+                size_t rc = b[nbins-1].count;
+                for( size_t k = nbins-1; k > 0; --k )
+                    {
+                    if( k < nbins-1 && b[k].count != 0 )
+                        {
+                        right.grow( b[k].box );
+                        rc += b[k].count;
+                        }
+                    right_count[k] = rc;
+                    right_area[k] = rc ? right.half_area() : real(0);
+                    }
+
+                bounds left;
+                left.reset();
+                size_t lc = 0;
+                for( size_t k=0; k+1 < nbins; ++k )
+                    {
+                    if( b[k].count == 0 )
+                        continue;
+                    left.grow( b[k].box );
+                    lc += b[k].count;
+                    if( right_count[k+1] == 0 )
+                        break;
+                    real cost = left.half_area() * real(lc) +
+                                right_area[k+1] * real(right_count[k+1]);
+                    if( cost < best_cost )
+                        {
+                        best_cost = cost;
+                        best_axis = d;
+                        best_split = k+1;
+                        }
+                    }
+                }
+
+            // Compare with the cost of intersecting every box in a leaf,
+            // counting one unit for visiting the two children.
+            real area = t.box.half_area();
+            if( t.count <= max_leaf && area > 0 &&
+                best_cost + area >= area * real(t.count) )
+                continue;
+
+            task children[2];
+            for( task& child : children )
+                {
+                child.depth = t.depth + 1;
+                child.in_temp = t.in_temp;
+                child.box.reset();
+                child.centroids.reset();
+                }
+            size_t left_count = 0;
+            if( best_cost < inf )
+                {
+                const size_t d = best_axis;
+                const bin* b = bins + d*nbins;
+                for( size_t k=0; k < nbins; ++k )
+                    {
+                    children[ k < best_split ? 0 : 1 ].box.grow( b[k].box );
+                    if( k < best_split )
+                        left_count += b[k].count;
+                    }
+                auto is_left = [&]( const ref& x )
+                    { return bin_index( x, d ) < best_split; };
+                bounds& cl = children[0].centroids;
+                bounds& cr = children[1].centroids;
+
+                if( t.count < parallel_grain )
+                    {
+                    ref* i = r;
+                    ref* j = r + t.count;
+                    for(;;)
+                        {
+                        while( i < j && is_left( *i ) )
+                            cl.grow_centroid( (i++)->box );
+                        while( i < j && !is_left( j[-1] ) )
+                            cr.grow_centroid( (--j)->box );
+                        if( i == j )
+                            break;
+                        std::swap( *i, *--j );
+                        cl.grow_centroid( (i++)->box );
+                        cr.grow_centroid( j->box );
+                        }
+                    }
+                else
+                    {
+                    // Stable partition into the other buffer. The bins of
+                    // each chunk tell where its boxes go.
+                    std::vector<size_t> lefts( chunks+1, 0 );
+                    for( size_t c=0; c < chunks; ++c )
+                        {
+                        const bin* pb = chunks > 1 ? part.data() + c*stride : bins;
+                        lefts[c+1] = lefts[c];
+                        for( size_t k=0; k < best_split; ++k )
+                            lefts[c+1] += pb[ d*nbins + k ].count;
+                        }
+                    std::vector<bounds> cpart( 2*chunks );
+                    ref* out = ( t.in_temp ? refs_ : temp_ ).data() + t.first;
+                    for_chunks_( chunks, t.count,
+                        [&]( size_t c, size_t first, size_t last )
+                        {
+                        bounds& pl = cpart[2*c];
+                        bounds& pr = cpart[2*c+1];
+                        pl.reset();
+                        pr.reset();
+                        size_t l = lefts[c], g = left_count + first - lefts[c];
+                        for( size_t i = first; i < last; ++i )
+                            if( is_left( r[i] ) )
+                                {
+                                pl.grow_centroid( r[i].box );
+                                out[ l++ ] = r[i];
+                                }
+                            else
+                                {
+                                pr.grow_centroid( r[i].box );
+                                out[ g++ ] = r[i];
+                                }
+                        } );
+                    for( size_t c=0; c < chunks; ++c )
+                        {
+                        cl.grow( cpart[2*c] );
+                        cr.grow( cpart[2*c+1] );
+                        }
+                    children[0].in_temp = children[1].in_temp = !t.in_temp;
+                    }
+                }
+
+            uint32_t lc = uint32_t( left_count ), rc = t.count - lc;
+            if( lc == 0 || rc == 0 )
+                {
+                // All centroids in one bin: split at the median of the
+                // widest centroid axis.
+                size_t d = 0;
+                for( size_t e=1; e<D; ++e )
+                    if( cb.hi[e] - cb.lo[e] > cb.hi[d] - cb.lo[d] )
+                        d = e;
+                lc = t.count/2;
+                rc = t.count - lc;
+                std::nth_element( r, r + lc, r + t.count,
+                    [&]( const ref& a, const ref& b )
+                    { return centroid_( a, d ) < centroid_( b, d ); } );
+                }
+
+            uint32_t left = deterministic_ ? t.slot : next_.fetch_add( 2 );
+            n.first = left;
+            n.count = 0;
+            children[0].node = left;
+            children[0].first = t.first;
+            children[0].count = lc;
+            children[0].slot = t.slot + 2;
+            children[1].node = left+1;
+            children[1].first = t.first + lc;
+            children[1].count = rc;
+            children[1].slot = t.slot + 2*lc;
+            if( left_count != lc )
+                {
+                bounds_( children[0] );
+                bounds_( children[1] );
+                }
+
+            for( int c=1; c >= 0; --c )
+                {
+                if( children[c].count >= task_grain && reserve_task_() )
+                    {
+                    task child = children[c];
+                    group.run( [this, &group, child]
+                        {
+                        build_( group, child );
+                        --tasks_;
+                        } );
+                    }
+                else
+                    stack.push_back( children[c] );
+                }
+            }
+
+        size_t seen = depth_;
+        while( seen < depth && !depth_.compare_exchange_weak( seen, depth ) )
+            {}
+        }
+
+
+    template<class T, size_t D> void
+    bvh_builder_<T,D>::compact_()
+        {
+        // Breadth first, the pending nodes are the queue.
+        std::vector<node> out;
+        out.reserve( 2 * refs_.size() / leaf_size_ + 1 );
+        out.push_back( nodes_[0] );
+        for( size_t i=0; i < out.size(); ++i )
+            if( !out[i].is_leaf() )
+                {
+                uint32_t child = out[i].first;
+                out[i].first = uint32_t( out.size() );
+                out.push_back( nodes_[ child ] );
+                out.push_back( nodes_[ child+1 ] );
+                }
+        nodes_.swap( out );
+        }
+
+
+    template<class T, size_t D> void
+    bvh<T,D>::build( const aabb_list<T,D>& boxes,
+                     const bvh_build_options& options )
+        {
+        TUMBO_ASSERT( boxes.size() < std::numeric_limits<uint32_t>::max()/2 );
+        typedef typename bvh_builder_<T,D>::ref ref;
+        nodes_.clear();
+        items_.resize( boxes.size() );
+        indices_.resize( boxes.size() );
+        depth_ = 0;
+        if( boxes.empty() )
+            return;
+
+        // Morton keys need float or double centers; integral boxes get
+        // the SAH build instead.
+        if constexpr( std::is_floating_point<T>::value )
+            if( options.method == bvh_build_method::linear )
+                {
+                build_linear_( boxes, options );
+                return;
+                }
+
+        std::vector<ref> refs( boxes.size() );
+        parallel_for( 0, boxes.size(), options.threads,
+            [&]( size_t first, size_t last )
+            {
+            for( size_t i = first; i < last; ++i )
+                {
+                for( size_t d=0; d<D; ++d )
+                    {
+                    refs[i].box.lo[d] = boxes[i](d,0);
+                    refs[i].box.hi[d] = boxes[i](d,1);
+                    }
+                refs[i].index = uint32_t(i);
+                }
+            }, 1 << 14 );
+
+        bvh_builder_<T,D> builder( options, refs, nodes_ );
+        depth_ = builder.build();
+
+        parallel_for( 0, boxes.size(), options.threads,
+            [&]( size_t first, size_t last )
+            {
+            for( size_t i = first; i < last; ++i )
+                {
+                items_[i] = refs[i].box.box();
+                indices_[i] = refs[i].index;
+                }
+            }, 1 << 14 );
+        }
+
+
+    /* Leading zero bits of x, 32 for 0. */
+    inline int
+    leading_zeros_( uint32_t x )
+        {
+#if defined(__GNUC__) || defined(__clang__)
+        return x == 0 ? 32 : __builtin_clz( x );
+#else
+        int n = 0;
+        for( uint32_t bit = 0x80000000u; bit != 0 && !( x & bit ); bit >>= 1 )
+            ++n;
+        return n;
+#endif
+        }
+
+
+    template<class T, size_t D> void
+    bvh<T,D>::build_linear_( const aabb_list<T,D>& boxes,
+                             const bvh_build_options& options )
+        {
+        const size_t n = boxes.size();
+        const size_t threads = options.threads;
+        const size_t leaf_size = std::max<size_t>( options.leaf_size, 1 );
+        const size_t grain = 1 << 12;
+        const size_t chunks = std::min( thread_count( threads ),
+                                        std::max<size_t>( n >> 14, 1 ) );
+
+        // Keys of the centers in the bounds of the centers.
+        std::vector< build_bounds_<T,D> > part( chunks );
+        parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+            {
+            for( size_t c=c0; c < c1; ++c )
+                {
+                build_bounds_<T,D> b;
+                b.reset();
+                for( size_t i = n*c / chunks; i < n*(c+1) / chunks; ++i )
+                    {
+                    vec<T,D> p = center( boxes[i] );
+                    for( size_t d=0; d<D; ++d )
+                        {
+                        b.lo[d] = std::min( b.lo[d], p[d] );
+                        b.hi[d] = std::max( b.hi[d], p[d] );
+                        }
+                    }
+                part[c] = b;
+                }
+            } );
+        for( size_t c=1; c < chunks; ++c )
+            part[0].grow( part[c] );
+        std::vector<uint32_t> keys( n );
+        curve_keys( curve::morton, boxes.data(), n, part[0].box(), keys.data(),
+                    threads );
+        parallel_for( 0, n, threads, [&]( size_t first, size_t last )
+            {
+            for( size_t i = first; i < last; ++i )
+                indices_[i] = uint32_t( i );
+            }, grain );
+        radix_sort( keys.data(), indices_.data(), n, threads );
+        parallel_for( 0, n, threads, [&]( size_t first, size_t last )
+            {
+            for( size_t i = first; i < last; ++i )
+                items_[i] = boxes[ indices_[i] ];
+            }, grain );
+
+        if( n <= leaf_size )
+            {
+            nodes_.assign( 1, node{ combine<T,D>( items_.begin(), items_.end() ),
+                                    0, uint32_t( n ) } );
+            return;
+            }
+
+        // Length of the common prefix of the keys at i and j, with the
+        // positions breaking ties between equal keys.
+        const int64_t count = int64_t( n );
+        auto prefix = [&]( int64_t i, int64_t j )
+            {
+            if( j < 0 || j >= count )
+                return -1;
+            uint32_t a = keys[i], b = keys[j];
+            return a != b ? leading_zeros_( a ^ b )
+                          : 32 + leading_zeros_( uint32_t( i ^ j ) );
+            };
+
+        // Internal node i covers the sorted boxes [lo,hi] and its children
+        // are split and split+1, leaves if they are the ends of the range.
+        // Node 0 is the root. Every other internal node i is one end of its
+        // range, the right child of split i-1 if it is the low end and the
+        // left child of split i otherwise.
+        struct inner
+            {
+            uint32_t lo, hi, split;
+            };
+        const size_t m = n-1;
+        std::vector<inner> inners( m );
+        std::vector<uint32_t> owner( m );   // The node split at each split
+        parallel_for( 0, m, threads, [&]( size_t first, size_t last )
+            {
+            for( size_t u = first; u < last; ++u )
+                {
+                int64_t i = int64_t( u );
+                int64_t d = prefix( i, i+1 ) > prefix( i, i-1 ) ? 1 : -1;
+                // Widen the range while the prefix stays longer than the
+                // one shared with the neighbour on the other side.
+                int min_prefix = prefix( i, i-d );
+                int64_t max_length = 2;
+                while( prefix( i, i + max_length*d ) > min_prefix )
+                    max_length *= 2;
+                int64_t length = 0;
+                for( int64_t t = max_length/2; t >= 1; t /= 2 )
+                    if( prefix( i, i + ( length+t )*d ) > min_prefix )
+                        length += t;
+                int64_t j = i + length*d;
+                // The split is where the prefix of the range ends.
+                int node_prefix = prefix( i, j );
+                int64_t split = 0;
+                for( int64_t t = length; t > 1; )
+                    {
+                    t = ( t+1 ) / 2;
+                    if( prefix( i, i + ( split+t )*d ) > node_prefix )
+                        split += t;
+                    }
+                split = i + split*d + std::min<int64_t>( d, 0 );
+                inners[u] = { uint32_t( std::min( i, j ) ),
+                              uint32_t( std::max( i, j ) ), uint32_t( split ) };
+                owner[ split ] = uint32_t( u );
+                }
+            }, grain );
+
+        // The children of the splits of nodes over more than leaf_size
+        // boxes are kept, two slots each in the order of the splits.
+        auto size = [&]( uint32_t u ) { return inners[u].hi - inners[u].lo + 1; };
+        std::vector<uint32_t> slot( m+1 );
+        std::vector<uint32_t> chunk_slots( chunks+1, 0 );
+        parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+            {
+            for( size_t c=c0; c < c1; ++c )
+                for( size_t s = m*c / chunks; s < m*(c+1) / chunks; ++s )
+                    chunk_slots[c+1] += size( owner[s] ) > leaf_size;
+            } );
+        for( size_t c=0; c < chunks; ++c )
+            chunk_slots[c+1] += chunk_slots[c];
+        parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+            {
+            for( size_t c=c0; c < c1; ++c )
+                {
+                uint32_t next = chunk_slots[c];
+                for( size_t s = m*c / chunks; s < m*(c+1) / chunks; ++s )
+                    {
+                    slot[s] = 1 + 2*next;
+                    next += size( owner[s] ) > leaf_size;
+                    }
+                }
+            } );
+        nodes_.resize( 1 + 2*size_t( chunk_slots[chunks] ) );
+
+        // Where internal node u ended up.
+        auto place = [&]( uint32_t u ) -> uint32_t
+            {
+            if( u == 0 )
+                return 0;
+            return inners[u].lo == u ? slot[u-1] + 1 : slot[u];
+            };
+        auto make_node = [&]( uint32_t u, node& out )
+            {
+            if( size( u ) <= leaf_size )
+                {
+                out.first = inners[u].lo;
+                out.count = size( u );
+                }
+            else
+                {
+                out.first = slot[ inners[u].split ];
+                out.count = 0;
+                }
+            };
+        std::vector<uint32_t> parent( nodes_.size() );
+        make_node( 0, nodes_[0] );
+        parallel_for( 0, m, threads, [&]( size_t first, size_t last )
+            {
+            for( size_t s = first; s < last; ++s )
+                {
+                uint32_t u = owner[s];
+                if( size( u ) <= leaf_size )
+                    continue;
+                uint32_t left = slot[s], up = place( u );
+                parent[left] = parent[left+1] = up;
+                if( s == inners[u].lo )
+                    nodes_[left] = node{ {}, uint32_t( s ), 1 };
+                else
+                    make_node( uint32_t( s ), nodes_[left] );
+                if( s+1 == inners[u].hi )
+                    nodes_[left+1] = node{ {}, uint32_t( s+1 ), 1 };
+                else
+                    make_node( uint32_t( s+1 ), nodes_[left+1] );
+                }
+            }, grain );
+
+        // Bounds from the leaves up. The first child to finish stops at
+        // the parent, the second combines both and goes on.
+        std::unique_ptr< std::atomic<uint32_t>[] > arrived(
+            new std::atomic<uint32_t>[ nodes_.size() ]() );
+        std::vector<uint32_t> height( nodes_.size() );
+        parallel_for( 0, nodes_.size(), threads, [&]( size_t first, size_t last )
+            {
+            for( size_t k = first; k < last; ++k )
+                {
+                node& leaf = nodes_[k];
+                if( !leaf.is_leaf() )
+                    continue;
+                leaf.box = combine<T,D>( items_.begin() + leaf.first,
+                                         items_.begin() + leaf.first + leaf.count );
+                height[k] = 0;
+                for( uint32_t c = uint32_t( k ); c != 0; )
+                    {
+                    uint32_t p = parent[c];
+                    if( arrived[p].fetch_add( 1 ) == 0 )
+                        break;
+                    node& n = nodes_[p];
+                    n.box = combine( nodes_[ n.first ].box, nodes_[ n.first+1 ].box );
+                    height[p] = 1 + std::max( height[ n.first ], height[ n.first+1 ] );
+                    c = p;
+                    }
+                }
+            }, grain );
+        depth_ = height[0];
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    bvh<T,D>::query_contains( const vec<T,D>& p, Fn fn ) const
+        {
+        if( nodes_.empty() )
+            return 0;
+        size_t visited = 0;
+        traversal_stack_<uint32_t> stack;
+        stack.push( 0 );
+        while( !stack.empty() )
+            {
+            const node& n = nodes_[ stack.pop() ];
+            ++visited;
+            if( !contains( n.box, p ) )
+                continue;
+            if( n.is_leaf() )
+                {
+                for( uint32_t i = n.first; i < n.first + n.count; ++i )
+                    if( contains( items_[i], p ) )
+                        fn( size_t( indices_[i] ) );
+                }
+            else
+                {
+                stack.push( n.first+1 );
+                stack.push( n.first );
+                }
+            }
+        return visited;
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    bvh<T,D>::query_overlaps( const aabb<T,D>& b, Fn fn ) const
+        {
+        if( nodes_.empty() )
+            return 0;
+        size_t visited = 0;
+        traversal_stack_<uint32_t> stack;
+        stack.push( 0 );
+        while( !stack.empty() )
+            {
+            const node& n = nodes_[ stack.pop() ];
+            ++visited;
+            if( !overlaps( n.box, b ) )
+                continue;
+            if( n.is_leaf() )
+                {
+                for( uint32_t i = n.first; i < n.first + n.count; ++i )
+                    if( overlaps( items_[i], b ) )
+                        fn( size_t( indices_[i] ) );
+                }
+            else
+                {
+                stack.push( n.first+1 );
+                stack.push( n.first );
+                }
+            }
+        return visited;
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    bvh<T,D>::query_ray( const ray<T,D>& r, T tmax, Fn fn ) const
+        {
+        if( nodes_.empty() )
+            return 0;
+        size_t visited = 0;
+        T t;
+        traversal_stack_<uint32_t> stack;
+        stack.push( 0 );
+        while( !stack.empty() )
+            {
+            const node& n = nodes_[ stack.pop() ];
+            ++visited;
+            if( !intersects( r, n.box, T(0), tmax, t ) )
+                continue;
+            if( n.is_leaf() )
+                {
+                for( uint32_t i = n.first; i < n.first + n.count; ++i )
+                    if( intersects( r, items_[i], T(0), tmax, t ) )
+                        fn( size_t( indices_[i] ), t );
+                }
+            else
+                {
+                // Visit the child on the side the ray comes from first.
+                size_t axis = 0;
+                for( size_t d=1; d<D; ++d )
+                    if( std::abs( r.direction[d] ) > std::abs( r.direction[axis] ) )
+                        axis = d;
+                bool flip = r.direction[axis] < 0;
+                stack.push( n.first + ( flip ? 0 : 1 ) );
+                stack.push( n.first + ( flip ? 1 : 0 ) );
+                }
+            }
+        return visited;
+        }
+
+
+    template<class T, size_t D> size_t
+    bvh<T,D>::closest_hit( const ray<T,D>& r, T tmax,
+                           size_t& index, T& t ) const
+        {
+        index = npos;
+        t = tmax;
+        if( nodes_.empty() )
+            return 0;
+
+        struct entry { uint32_t node; T tnear; };
+        size_t visited = 1;
+        T tn;
+        traversal_stack_<entry> stack;
+        if( intersects( r, nodes_[0].box, T(0), t, tn ) )
+            stack.push( { 0, tn } );
+        while( !stack.empty() )
+            {
+            entry e = stack.pop();
+            if( e.tnear > t )
+                continue;
+            const node& n = nodes_[ e.node ];
+            if( n.is_leaf() )
+                {
+                for( uint32_t i = n.first; i < n.first + n.count; ++i )
+                    if( intersects( r, items_[i], T(0), t, tn ) &&
+                        ( tn < t || index == npos ) )
+                        {
+                        t = tn;
+                        index = indices_[i];
+                        }
+                continue;
+                }
+
+            T tl, tr;
+            visited += 2;
+            bool hl = intersects( r, nodes_[ n.first ].box, T(0), t, tl );
+            bool hr = intersects( r, nodes_[ n.first+1 ].box, T(0), t, tr );
+            if( hl && hr )
+                {
+                // Nearest on top
+                if( tl <= tr )
+                    {
+                    stack.push( { n.first+1, tr } );
+                    stack.push( { n.first, tl } );
+                    }
+                else
+                    {
+                    stack.push( { n.first, tl } );
+                    stack.push( { n.first+1, tr } );
+                    }
+                }
+            else if( hl )
+                stack.push( { n.first, tl } );
+            else if( hr )
+                stack.push( { n.first+1, tr } );
+            }
+        return visited;
+        }
+
+
+    template<class T, size_t D>
+    template<size_t W> size_t
+    bvh<T,D>::closest_hit( const ray_packet<T,D,W>& rays,
+                           size_t* index, T* t ) const
+        {
+        for( size_t k=0; k<W; ++k )
+            {
+            index[k] = npos;
+            t[k] = rays.tmax[k];
+            }
+        if( nodes_.empty() || rays.size() == 0 )
+            return 0;
+
+        // Each hit shortens the segment of its lane.
+        ray_packet<T,D,W> p = rays;
+        alignas( sizeof(T)*ray_packet<T,D,W>::lanes ) T tn[W];
+
+        // Children in the order of the first ray along its main axis.
+        size_t axis = 0;
+        for( size_t d=1; d<D; ++d )
+            if( std::abs( p.inv_direction[d][0] ) < std::abs( p.inv_direction[axis][0] ) )
+                axis = d;
+        uint32_t nearer = p.inv_direction[axis][0] < 0 ? 1 : 0;
+
+        size_t visited = 0;
+        traversal_stack_<uint32_t> stack;
+        stack.push( 0 );
+        while( !stack.empty() )
+            {
+            const node& n = nodes_[ stack.pop() ];
+            ++visited;
+            if( intersects( p, n.box ) == 0 )
+                continue;
+            if( n.is_leaf() )
+                {
+                for( uint32_t i = n.first; i < n.first + n.count; ++i )
+                    for_each_bit( intersects( p, items_[i], tn ), [&]( size_t k )
+                        {
+                        if( tn[k] < t[k] || index[k] == npos )
+                            {
+                            t[k] = p.tmax[k] = tn[k];
+                            index[k] = indices_[i];
+                            }
+                        } );
+                }
+            else
+                {
+                stack.push( n.first + 1 - nearer );
+                stack.push( n.first + nearer );
+                }
+            }
+        return visited;
+        }
+
+
+    template<class T, size_t D> size_t
+    bvh<T,D>::closest_hits( const ray<T,D>* rays, size_t n, T tmax,
+                            size_t* index, T* t, size_t threads ) const
+        {
+        constexpr size_t W = simd::batch_width<T>::value;
+        std::atomic<size_t> visited( 0 );
+        parallel_for( 0, ( n + W-1 ) / W, threads, [&]( size_t first, size_t last )
+            {
+            size_t local = 0;
+            size_t index_w[W];
+            T t_w[W];
+            for( size_t b = first; b < last; ++b )
+                {
+                size_t begin = b*W, end = std::min( begin + W, n );
+                ray_packet<T,D,W> p( rays + begin, rays + end, T(0), tmax );
+                local += closest_hit( p, index_w, t_w );
+                std::copy( index_w, index_w + ( end-begin ), index + begin );
+                std::copy( t_w, t_w + ( end-begin ), t + begin );
+                }
+            visited += local;
+            }, 8 );
+        return visited;
+        }
+
+
+    template<class T, size_t D> size_t
+    bvh<T,D>::nearest( const vec<T,D>& p, size_t& index, T& distance_sq ) const
+        {
+        index = npos;
+        distance_sq = std::numeric_limits<T>::max();
+        if( nodes_.empty() )
+            return 0;
+
+        struct entry { uint32_t node; T dist; };
+        size_t visited = 1;
+        traversal_stack_<entry> stack;
+        stack.push( { 0, tumbo::distance_sq( nodes_[0].box, p ) } );
+        while( !stack.empty() )
+            {
+            entry e = stack.pop();
+            if( e.dist >= distance_sq && index != npos )
+                continue;
+            const node& n = nodes_[ e.node ];
+            if( n.is_leaf() )
+                {
+                for( uint32_t i = n.first; i < n.first + n.count; ++i )
+                    {
+                    T dist = tumbo::distance_sq( items_[i], p );
+                    if( dist < distance_sq || index == npos )
+                        {
+                        distance_sq = dist;
+                        index = indices_[i];
+                        }
+                    }
+                continue;
+                }
+
+            visited += 2;
+            T dl = tumbo::distance_sq( nodes_[ n.first ].box, p );
+            T dr = tumbo::distance_sq( nodes_[ n.first+1 ].box, p );
+            // Nearest on top
+            if( dl <= dr )
+                {
+                stack.push( { n.first+1, dr } );
+                stack.push( { n.first, dl } );
+                }
+            else
+                {
+                stack.push( { n.first, dl } );
+                stack.push( { n.first+1, dr } );
+                }
+            }
+        return visited;
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_BVH_HPP
@@ -10,18 +10,14 @@
     \brief Contains various constructor functions for affine matrices.
 */
 
-#ifdef _WIN32
-#define static_assert(...)
-#endif
-
 namespace tumbo
     {
-    template<typename matrix> matrix
+    template<typename matrix> constexpr matrix
     identity()
         {
         static_assert( matrix::width() == matrix::height(),
             "Only square matrix types has identity." );
-        matrix A;
+        matrix A{};
         for( size_t i=0; i<matrix::size(); ++i )
             A[i] = static_cast<typename matrix::scalar_t>(
                 i % (matrix::width()+1) == 0 ? 1 : 0);
@@ -29,17 +25,17 @@ namespace tumbo
         }
 
 
-    template<typename matrix> matrix
+    template<typename matrix> constexpr matrix
     uniform(typename matrix::scalar_t s)
         {
-        matrix A;
+        matrix A{};
         for( size_t i=0; i<matrix::size(); ++i )
             A[i] = s;
         return A;
         }
 
 
-    template<class T, size_t D> matrix<T,D+1,D+1>
+    template<class T, size_t D> constexpr matrix<T,D+1,D+1>
     translation( matrix<T,D,1> v )
         {
         auto r = identity<matrix<T,D+1,D+1>>();
@@ -88,7 +84,7 @@ namespace tumbo
         }
 
 
-    template<class T, size_t D> matrix<T,D+1,D+1>
+    template<class T, size_t D> constexpr matrix<T,D+1,D+1>
     scaling( matrix<T,D,1> v )
         {
         auto R = identity<matrix<T,D+1,D+1>>();
@@ -98,7 +94,7 @@ namespace tumbo
         }
 
 
-    template<class T> matrix<T,4,4>
+    template<class T> constexpr matrix<T,4,4>
     orthographic(
         T left, T right,
         T bottom, T top,
@@ -109,7 +105,7 @@ namespace tumbo
         T z_ortho = T(-2) / (far - near);
         T tx = -(right + left) / (right - left);
         T ty = -(top + bottom) / (top - bottom);
-        T tz = (far + near)   / (far - near);
+        T tz = -(far + near)  / (far - near);
         return matrix<T,4,4>{
             x_ortho, 0,       0,       tx,
             0,       y_ortho, 0,       ty,
@@ -119,7 +115,7 @@ namespace tumbo
 
 
     // Near and far are entered as positive values.
-    template<class T> matrix<T,4,4>
+    template<class T> constexpr matrix<T,4,4>
     perspective(
         T l, T r,       /* left, right */
         T b, T t,       /* bottom, top */
@@ -0,0 +1,623 @@
+#ifndef TUMBO_DMATRIX_HPP
+#define TUMBO_DMATRIX_HPP
+
+#include <algorithm>
+#include <initializer_list>
+#include <iterator>
+#include <vector>
+#include "assert.hpp"
+#include "matrix.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+#include "utility.hpp"
+
+/**
+    \file dmatrix.hpp
+    \brief Heap allocated matrix with its size given at runtime.
+
+    dmatrix<T> is for sizes that do not belong on the stack, such as the
+    systems solved with LU. It has the same row major layout and the same
+    free function interface as matrix: transpose, operator*, row, column,
+    submatrix, determinant and inverse, plus +, - and scalar operators.
+    These are evaluated eagerly; there are no expression templates.
+
+    Products and LU decompositions of large matrices are cache blocked,
+    use simd::packet across columns and are split over default_thread_pool.
+    multiply, lu_decompose, lu_solve and solve take a thread count as
+    described in parallel.hpp; the operators use all hardware threads.
+*/
+
+namespace tumbo
+    {
+
+    template< class T >
+    class dmatrix
+        {
+        public:
+            typedef T scalar_t;
+
+            dmatrix() :
+                height_( 0 ), width_( 0 )
+                {}
+
+            /// A zeroed m by n matrix.
+            dmatrix( size_t m, size_t n ) :
+                data_( m*n, T(0) ), height_( m ), width_( n )
+                {}
+
+            dmatrix( size_t m, size_t n, std::initializer_list<T> l ) :
+                data_( l ), height_( m ), width_( n )
+                {
+                TUMBO_ASSERT( l.size() == m*n );
+                }
+
+            template< size_t M, size_t N > explicit
+            dmatrix( const matrix<T,M,N>& A ) :
+                data_( A.begin(), A.end() ), height_( M ), width_( N )
+                {}
+
+            T&
+            operator() ( size_t i, size_t j )
+                {
+                TUMBO_ASSERT( i < height_ )
+                TUMBO_ASSERT( j < width_ )
+                return data_[ j + i*width_ ];
+                }
+
+            const T&
+            operator() ( size_t i, size_t j ) const
+                {
+                TUMBO_ASSERT( i < height_ )
+                TUMBO_ASSERT( j < width_ )
+                return data_[ j + i*width_ ];
+                }
+
+            T&
+            operator[] ( size_t i )
+                {
+                TUMBO_ASSERT( i < size() );
+                return data_[i];
+                }
+
+            const T&
+            operator[] ( size_t i ) const
+                {
+                TUMBO_ASSERT( i < size() );
+                return data_[i];
+                }
+
+            const T*
+            data() const
+                { return data_.data(); }
+
+            T*
+            begin()
+                { return data_.data(); }
+
+            const T*
+            begin() const
+                { return data_.data(); }
+
+            T*
+            end()
+                { return data_.data() + data_.size(); }
+
+            const T*
+            end() const
+                { return data_.data() + data_.size(); }
+
+            size_t
+            size() const
+                { return data_.size(); }
+
+            size_t
+            height() const
+                { return height_; }
+
+            size_t
+            width() const
+                { return width_; }
+
+        private:
+            std::vector<T> data_;
+            size_t height_;
+            size_t width_;
+        };
+
+
+    template< class T > bool
+    operator == ( const dmatrix<T>& A, const dmatrix<T>& B )
+        {
+        return A.height() == B.height() && A.width() == B.width() &&
+               std::equal( A.begin(), A.end(), B.begin() );
+        }
+
+
+    template< class T > bool
+    operator != ( const dmatrix<T>& A, const dmatrix<T>& B )
+        {
+        return !( A == B );
+        }
+
+
+    /// Copies a dmatrix of matching size into a fixed size matrix.
+    template< size_t M, size_t N, class T > matrix<T,M,N>
+    to_fixed( const dmatrix<T>& A )
+        {
+        TUMBO_ASSERT( A.height() == M && A.width() == N );
+        return matrix<T,M,N>( A.begin(), A.end() );
+        }
+
+
+    template< class T > dmatrix<T>
+    identity_dmatrix( size_t n )
+        {
+        dmatrix<T> I( n, n );
+        for( size_t i=0; i<n; ++i )
+            I(i,i) = T(1);
+        return I;
+        }
+
+
+    template< class T > dmatrix<T>
+    operator + ( const dmatrix<T>& A, const dmatrix<T>& B )
+        {
+        TUMBO_ASSERT( A.height() == B.height() && A.width() == B.width() );
+        dmatrix<T> R( A.height(), A.width() );
+        std::transform( A.begin(), A.end(), B.begin(), R.begin(),
+                        []( T a, T b ){ return a+b; } );
+        return R;
+        }
+
+
+    template< class T > dmatrix<T>
+    operator - ( const dmatrix<T>& A, const dmatrix<T>& B )
+        {
+        TUMBO_ASSERT( A.height() == B.height() && A.width() == B.width() );
+        dmatrix<T> R( A.height(), A.width() );
+        std::transform( A.begin(), A.end(), B.begin(), R.begin(),
+                        []( T a, T b ){ return a-b; } );
+        return R;
+        }
+
+
+    template< class T > dmatrix<T>
+    operator - ( const dmatrix<T>& A )
+        {
+        dmatrix<T> R( A.height(), A.width() );
+        std::transform( A.begin(), A.end(), R.begin(),
+                        []( T a ){ return -a; } );
+        return R;
+        }
+
+
+    template< class T > dmatrix<T>
+    operator * ( const dmatrix<T>& A, T s )
+        {
+        dmatrix<T> R( A.height(), A.width() );
+        std::transform( A.begin(), A.end(), R.begin(),
+                        [s]( T a ){ return a*s; } );
+        return R;
+        }
+
+
+    template< class T > dmatrix<T>
+    operator * ( T s, const dmatrix<T>& A )
+        {
+        return A * s;
+        }
+
+
+    template< class T > dmatrix<T>
+    operator / ( const dmatrix<T>& A, T s )
+        {
+        dmatrix<T> R( A.height(), A.width() );
+        std::transform( A.begin(), A.end(), R.begin(),
+                        [s]( T a ){ return a/s; } );
+        return R;
+        }
+
+
+    /// Transposes in square tiles so both matrices are walked in cache.
+    template< class T > dmatrix<T>
+    transpose( const dmatrix<T>& A )
+        {
+        const size_t tile = 32;
+        size_t m = A.height(), n = A.width();
+        dmatrix<T> R( n, m );
+        const T* a = A.data();
+        T* r = R.begin();
+        for( size_t ib=0; ib < m; ib += tile )
+        for( size_t jb=0; jb < n; jb += tile )
+            {
+            size_t ie = std::min( ib+tile, m ), je = std::min( jb+tile, n );
+            for( size_t i=ib; i < ie; ++i )
+            for( size_t j=jb; j < je; ++j )
+                r[j*m+i] = a[i*n+j];
+            }
+        return R;
+        }
+
+
+    template< class T > dmatrix<T>
+    row( const dmatrix<T>& A, size_t i )
+        {
+        TUMBO_ASSERT( i < A.height() );
+        dmatrix<T> r( 1, A.width() );
+        std::copy( A.data() + i*A.width(), A.data() + (i+1)*A.width(),
+                   r.begin() );
+        return r;
+        }
+
+
+    template< class T > dmatrix<T>
+    column( const dmatrix<T>& A, size_t j )
+        {
+        TUMBO_ASSERT( j < A.width() );
+        dmatrix<T> c( A.height(), 1 );
+        for( size_t i=0; i < A.height(); ++i )
+            c[i] = A(i,j);
+        return c;
+        }
+
+
+    /// The m by n block of A with (oi,oj) as its top left element.
+    template< class T > dmatrix<T>
+    submatrix( const dmatrix<T>& A, size_t oi, size_t oj, size_t m, size_t n )
+        {
+        TUMBO_ASSERT( oi+m <= A.height() && oj+n <= A.width() );
+        dmatrix<T> R( m, n );
+        for( size_t i=0; i<m; ++i )
+            std::copy( A.data() + (oi+i)*A.width() + oj,
+                       A.data() + (oi+i)*A.width() + oj+n,
+                       R.begin() + i*n );
+        return R;
+        }
+
+
+    /// A fixed size block of A, like submatrix for matrix.
+    template< size_t RM, size_t RN, class T > matrix<T,RM,RN>
+    submatrix( const dmatrix<T>& A, size_t oi = 0, size_t oj = 0 )
+        {
+        TUMBO_ASSERT( oi+RM <= A.height() && oj+RN <= A.width() );
+        matrix<T,RM,RN> R;
+        for( size_t i=0; i<RM; ++i )
+        for( size_t j=0; j<RN; ++j )
+            R(i,j) = A(oi+i,oj+j);
+        return R;
+        }
+
+
+    /* Matrix product kernels. The product is computed in blocks of
+        gemm_kc_ by gemm_nc_ of B, which stay in cache while every row of
+        A passes them. Within a block, four rows of C times one packet of
+        columns are kept in registers. */
+
+    constexpr size_t gemm_kc_ = 128;
+    constexpr size_t gemm_nc_ = 256;
+
+
+    /// c[m x n] += a[m x k] * b[k x n], all row major with leading sizes.
+    template< class T > void
+    gemm_block_( const T* a, size_t lda, const T* b, size_t ldb,
+                 T* c, size_t ldc, size_t m, size_t n, size_t k )
+        {
+        typedef simd::packet< T, simd::batch_width<T>::value > P;
+        const size_t W = P::width();
+
+        size_t i = 0;
+        for( ; i+4 <= m; i += 4 )
+            {
+            const T* a0 = a + i*lda;
+            const T* a1 = a0 + lda;
+            const T* a2 = a1 + lda;
+            const T* a3 = a2 + lda;
+            T* c0 = c + i*ldc;
+            T* c1 = c0 + ldc;
+            T* c2 = c1 + ldc;
+            T* c3 = c2 + ldc;
+
+            size_t j = 0;
+            for( ; j+W <= n; j += W )
+                {
+                P r0 = P::load( c0+j ), r1 = P::load( c1+j ),
+                  r2 = P::load( c2+j ), r3 = P::load( c3+j );
+                for( size_t p=0; p<k; ++p )
+                    {
+                    P bp = P::load( b + p*ldb + j );
+                    r0 = r0 + P::broadcast( a0[p] ) * bp;
+                    r1 = r1 + P::broadcast( a1[p] ) * bp;
+                    r2 = r2 + P::broadcast( a2[p] ) * bp;
+                    r3 = r3 + P::broadcast( a3[p] ) * bp;
+                    }
+                r0.store( c0+j ); r1.store( c1+j );
+                r2.store( c2+j ); r3.store( c3+j );
+                }
+            for( ; j<n; ++j )
+                {
+                T s0 = c0[j], s1 = c1[j], s2 = c2[j], s3 = c3[j];
+                for( size_t p=0; p<k; ++p )
+                    {
+                    T bp = b[p*ldb+j];
+                    s0 += a0[p]*bp; s1 += a1[p]*bp;
+                    s2 += a2[p]*bp; s3 += a3[p]*bp;
+                    }
+                c0[j] = s0; c1[j] = s1; c2[j] = s2; c3[j] = s3;
+                }
+            }
+
+        for( ; i<m; ++i )
+            {
+            const T* ai = a + i*lda;
+            T* ci = c + i*ldc;
+            for( size_t p=0; p<k; ++p )
+                {
+                T s = ai[p];
+                const T* bp = b + p*ldb;
+                for( size_t j=0; j<n; ++j )
+                    ci[j] += s*bp[j];
+                }
+            }
+        }
+
+
+    /// C = A*B, split over threads by blocks of rows.
+    template< class T > dmatrix<T>
+    multiply( const dmatrix<T>& A, const dmatrix<T>& B, size_t threads )
+        {
+        TUMBO_ASSERT( A.width() == B.height() );
+        size_t m = A.height(), n = B.width(), k = A.width();
+        dmatrix<T> C( m, n );
+        const T* a = A.data();
+        const T* b = B.data();
+        T* c = C.begin();
+
+        // Rows per thread so that each does at least about 2^18 products.
+        size_t grain = std::max<size_t>( 4,
+            ( size_t(1) << 18 ) / std::max<size_t>( n*k, 1 ) );
+        parallel_for( 0, m, threads, [&]( size_t first, size_t last )
+            {
+            for( size_t pb=0; pb < k; pb += gemm_kc_ )
+            for( size_t jb=0; jb < n; jb += gemm_nc_ )
+                gemm_block_( a + first*k + pb, k, b + pb*n + jb, n,
+                             c + first*n + jb, n, last-first,
+                             std::min( gemm_nc_, n-jb ),
+                             std::min( gemm_kc_, k-pb ) );
+            }, grain );
+        return C;
+        }
+
+
+    template< class T > dmatrix<T>
+    operator * ( const dmatrix<T>& A, const dmatrix<T>& B )
+        {
+        return multiply( A, B, 0 );
+        }
+
+
+    /// Partial pivoting LU decomposition of a dmatrix, PA = LU.
+    /** Same layout as lu_decomposition: U on and above the diagonal, the
+        multipliers of L below it, row i coming from row perm[i] of A. */
+    template< class T >
+    struct dmatrix_lu
+        {
+        dmatrix<T> lu;
+        std::vector<size_t> perm;
+        T sign;
+        bool singular;
+        };
+
+
+    /* LU works on panels of lu_nb_ columns. A panel is factored column by
+        column, then the rows to its right are solved with its unit lower
+        triangle and the trailing matrix is updated with one product
+        through gemm_block_, which is where nearly all the work is. */
+
+    constexpr size_t lu_nb_ = 64;
+
+
+    /* Subtracts multiples of row k from rows first..last over the columns
+        k+1..end, storing the multipliers in column k. */
+    template< class T > void
+    lu_eliminate_( T* a, size_t n, size_t k, size_t first, size_t last,
+                   size_t end )
+        {
+        typedef simd::packet< T, simd::batch_width<T>::value > P;
+        const size_t W = P::width();
+        const T* ak = a + k*n;
+        for( size_t i = first; i < last; ++i )
+            {
+            T* ai = a + i*n;
+            T f = ai[k] / ak[k];
+            ai[k] = f;
+            P pf = P::broadcast( f );
+            size_t j = k+1;
+            for( ; j+W <= end; j += W )
+                ( P::load( ai+j ) - pf * P::load( ak+j ) ).store( ai+j );
+            for( ; j<end; ++j )
+                ai[j] -= f * ak[j];
+            }
+        }
+
+
+    template< class T > dmatrix_lu<T>
+    lu_decompose( const dmatrix<T>& A, size_t threads = 0 )
+        {
+        static_assert( std::is_floating_point<T>::value,
+            "LU decomposition needs a floating point type." );
+        TUMBO_ASSERT( A.height() == A.width() );
+        typedef simd::packet< T, simd::batch_width<T>::value > P;
+        const size_t W = P::width();
+        size_t n = A.height();
+        dmatrix_lu<T> D{ A, std::vector<size_t>( n ), T(1), false };
+        T* a = D.lu.begin();
+        for( size_t i=0; i<n; ++i )
+            D.perm[i] = i;
+
+        std::vector<T> l21;
+        for( size_t kb=0; kb<n; kb += lu_nb_ )
+            {
+            size_t end = std::min( kb + lu_nb_, n ), b = end - kb;
+
+            // Factor the panel, swapping whole rows.
+            for( size_t k=kb; k<end; ++k )
+                {
+                size_t p = k;
+                for( size_t i=k+1; i<n; ++i )
+                    if( abs_( a[i*n+k] ) > abs_( a[p*n+k] ) )
+                        p = i;
+
+                if( a[p*n+k] == T(0) )
+                    {
+                    D.singular = true;
+                    continue;
+                    }
+
+                if( p != k )
+                    {
+                    std::swap_ranges( a + k*n, a + (k+1)*n, a + p*n );
+                    std::swap( D.perm[k], D.perm[p] );
+                    D.sign = -D.sign;
+                    }
+                lu_eliminate_( a, n, k, k+1, n, end );
+                }
+            if( end == n )
+                break;
+
+            // Rows of U right of the panel, by columns split over threads.
+            size_t rest = n - end;
+            size_t grain = std::max<size_t>( 4*W, ( size_t(1) << 16 ) / ( b*b ) );
+            parallel_for( end, n, threads, [&]( size_t first, size_t last )
+                {
+                for( size_t i=kb+1; i<end; ++i )
+                for( size_t p=kb; p<i; ++p )
+                    {
+                    T f = a[i*n+p];
+                    P pf = P::broadcast( f );
+                    T* ai = a + i*n;
+                    const T* ap = a + p*n;
+                    size_t j = first;
+                    for( ; j+W <= last; j += W )
+                        ( P::load( ai+j ) - pf * P::load( ap+j ) ).store( ai+j );
+                    for( ; j<last; ++j )
+                        ai[j] -= f * ap[j];
+                    }
+                }, grain );
+
+            // The trailing matrix minus L21 U12, with L21 negated so the
+            // product kernel can add it.
+            l21.resize( rest*b );
+            for( size_t i=0; i<rest; ++i )
+                for( size_t p=0; p<b; ++p )
+                    l21[i*b+p] = -a[(end+i)*n + kb+p];
+            grain = std::max<size_t>( 4, ( size_t(1) << 18 ) / ( rest*b ) );
+            parallel_for( end, n, threads, [&]( size_t first, size_t last )
+                {
+                for( size_t jb=end; jb < n; jb += gemm_nc_ )
+                    gemm_block_( l21.data() + (first-end)*b, b, a + kb*n + jb, n,
+                                 a + first*n + jb, n, last-first,
+                                 std::min( gemm_nc_, n-jb ), b );
+                }, grain );
+            }
+        return D;
+        }
+
+
+    template< class T > T
+    lu_determinant( const dmatrix_lu<T>& D )
+        {
+        T det = D.sign;
+        for( size_t i=0; i < D.lu.height(); ++i )
+            det *= D.lu(i,i);
+        return det;
+        }
+
+
+    /// Solves AX = B for every column of B, given the LU decomposition of A.
+    /** The columns of X are independent and split over threads. */
+    template< class T > dmatrix<T>
+    lu_solve( const dmatrix_lu<T>& D, const dmatrix<T>& B, size_t threads = 0 )
+        {
+        size_t n = D.lu.height(), m = B.width();
+        TUMBO_ASSERT( B.height() == n );
+        typedef simd::packet< T, simd::batch_width<T>::value > P;
+        const size_t W = P::width();
+        const T* a = D.lu.data();
+
+        dmatrix<T> X( n, m );
+        T* x = X.begin();
+        for( size_t i=0; i<n; ++i )
+            std::copy( B.data() + D.perm[i]*m, B.data() + (D.perm[i]+1)*m,
+                       x + i*m );
+
+        size_t grain = std::max<size_t>( 4*W,
+            ( size_t(1) << 16 ) / std::max<size_t>( n*n, 1 ) );
+        parallel_for( 0, m, threads, [&]( size_t first, size_t last )
+            {
+            // dst -= f*src over the columns first..last of two rows of X
+            auto axpy = [&]( T* dst, T f, const T* src )
+                {
+                P pf = P::broadcast( f );
+                size_t j = first;
+                for( ; j+W <= last; j += W )
+                    ( P::load( dst+j ) - pf * P::load( src+j ) ).store( dst+j );
+                for( ; j<last; ++j )
+                    dst[j] -= f * src[j];
+                };
+
+            for( size_t i=0; i<n; ++i )
+            for( size_t k=0; k<i; ++k )
+                axpy( x + i*m, a[i*n+k], x + k*m );
+
+            for( size_t i=n; i-- > 0; )
+                {
+                for( size_t k=i+1; k<n; ++k )
+                    axpy( x + i*m, a[i*n+k], x + k*m );
+                T inv = T(1) / a[i*n+i];
+                for( size_t j=first; j<last; ++j )
+                    x[i*m+j] *= inv;
+                }
+            }, grain );
+        return X;
+        }
+
+
+    template< class T > dmatrix<T>
+    lu_inverse( const dmatrix_lu<T>& D )
+        {
+        return lu_solve( D, identity_dmatrix<T>( D.lu.height() ) );
+        }
+
+
+    /// Solves AX = B.
+    template< class T > dmatrix<T>
+    solve( const dmatrix<T>& A, const dmatrix<T>& B, size_t threads = 0 )
+        {
+        return lu_solve( lu_decompose( A, threads ), B, threads );
+        }
+
+
+    template< class T > T
+    determinant( const dmatrix<T>& A )
+        {
+        return lu_determinant( lu_decompose( A ) );
+        }
+
+
+    template< class T > dmatrix<T>
+    inverse( const dmatrix<T>& A )
+        {
+        return lu_inverse( lu_decompose( A ) );
+        }
+
+
+    template< class T > std::pair< dmatrix<T>, T >
+    inverse_and_determinant( const dmatrix<T>& A )
+        {
+        dmatrix_lu<T> D = lu_decompose( A );
+        return { lu_inverse( D ), lu_determinant( D ) };
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_DMATRIX_HPP
@@ -0,0 +1,476 @@
+#ifndef TUMBO_DYNAMIC_TREE_HPP
+#define TUMBO_DYNAMIC_TREE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "bvh.hpp"
+
+/**
+    \file dynamic_tree.hpp
+    \brief Incrementally updated aabb tree for moving objects.
+
+    Every object is a leaf holding a fat box: its box grown by a margin on
+    all sides and stretched along its last displacement. move() only
+    touches the tree when the box leaves its fat box, or the fat box has
+    become much larger than needed, so objects jiggling in place cost
+    nothing. Leaves are inserted next to the sibling that grows the tree's
+    surface area least, and nodes are rotated on the way up to keep the
+    children's heights within one of each other.
+
+    Nodes live in one array with a free list, and an object's id is the
+    index of its leaf, stable until it is removed. Queries test the fat
+    boxes; callers compare their own boxes for exact results.
+
+    moved_pairs() reports the overlapping pairs that involve an object
+    inserted or reinserted since the last call. Pairs between objects that
+    stayed inside their fat boxes cannot have appeared, so a tick costs in
+    proportion to the number of objects that moved out of theirs.
+*/
+
+namespace tumbo
+    {
+
+    template<class T, size_t D>
+    class dynamic_tree
+        {
+        public:
+            typedef uint32_t id;
+
+            static constexpr id null = id(-1);
+
+            /// margin is how far fat boxes extend past the objects.
+            explicit
+            dynamic_tree( T margin = T(0.1) ) :
+                margin_( margin ), root_( null ), free_( null ), size_( 0 )
+                {}
+
+            /// Adds an object and returns its id.
+            id
+            insert( const aabb<T,D>& box, size_t data = 0 );
+
+            void
+            remove( id leaf );
+
+            /// Updates the box of an object that moved by displacement.
+            /** Returns true if the object was reinserted. */
+            bool
+            move( id leaf, const aabb<T,D>& box,
+                  const vec<T,D>& displacement = vec<T,D>{} );
+
+            const aabb<T,D>&
+            fat_box( id leaf ) const
+                { return nodes_[leaf].box; }
+
+            size_t
+            data( id leaf ) const
+                { return nodes_[leaf].data; }
+
+            /// Number of objects.
+            size_t
+            size() const
+                { return size_; }
+
+            /// Height of the root, 0 for a single object.
+            size_t
+            height() const
+                { return root_ == null ? 0 : size_t( nodes_[root_].height ); }
+
+            /// Calls fn( id ) for every fat box overlapping b.
+            /** Returns the number of nodes visited. */
+            template<class Fn> size_t
+            query_overlaps( const aabb<T,D>& b, Fn fn ) const;
+
+            /// Calls fn( id ) for every fat box containing p.
+            template<class Fn> size_t
+            query_contains( const vec<T,D>& p, Fn fn ) const;
+
+            /// Calls fn( a, b ) once for every pair of overlapping fat
+            /// boxes where a or b was inserted or reinserted since the
+            /// last call, with a < b.
+            template<class Fn> void
+            moved_pairs( Fn fn );
+
+        private:
+            struct node
+                {
+                aabb<T,D> box;
+                id parent;      // Next free node when on the free list
+                id child[2];    // null for leaves
+                int32_t height; // 0 for leaves, -1 on the free list
+                bool moved;
+                size_t data;
+
+                bool
+                is_leaf() const
+                    { return child[0] == null; }
+                };
+
+            id
+            allocate_();
+
+            void
+            free_node_( id n );
+
+            aabb<T,D>
+            fatten_( const aabb<T,D>& box, const vec<T,D>& displacement ) const;
+
+            void
+            insert_leaf_( id leaf );
+
+            void
+            remove_leaf_( id leaf );
+
+            /* Recomputes boxes and heights from n to the root, rotating
+                unbalanced nodes. */
+            void
+            refit_( id n );
+
+            id
+            rotate_( id a );
+
+            void
+            replace_child_( id parent, id old_child, id new_child );
+
+            T margin_;
+            id root_;
+            id free_;
+            size_t size_;
+            std::vector<node> nodes_;
+            std::vector<id> moved_;
+        };
+
+
+    template<class T, size_t D> typename dynamic_tree<T,D>::id
+    dynamic_tree<T,D>::allocate_()
+        {
+        id n;
+        if( free_ != null )
+            {
+            n = free_;
+            free_ = nodes_[n].parent;
+            }
+        else
+            {
+            TUMBO_ASSERT( nodes_.size() < null );
+            n = id( nodes_.size() );
+            nodes_.emplace_back();
+            }
+        node& x = nodes_[n];
+        x.parent = x.child[0] = x.child[1] = null;
+        x.height = 0;
+        x.moved = false;
+        x.data = 0;
+        return n;
+        }
+
+
+    template<class T, size_t D> void
+    dynamic_tree<T,D>::free_node_( id n )
+        {
+        nodes_[n].parent = free_;
+        nodes_[n].height = -1;
+        free_ = n;
+        }
+
+
+    template<class T, size_t D> aabb<T,D>
+    dynamic_tree<T,D>::fatten_( const aabb<T,D>& box,
+                                const vec<T,D>& displacement ) const
+        {
+        // Twice the displacement ahead, as the next one is likely alike.
+        aabb<T,D> fat;
+        for( size_t d=0; d<D; ++d )
+            {
+            T ahead = 2 * displacement[d];
+            fat(d,0) = box(d,0) - margin_ + std::min( ahead, T(0) );
+            fat(d,1) = box(d,1) + margin_ + std::max( ahead, T(0) );
+            }
+        return fat;
+        }
+
+
+    template<class T, size_t D> typename dynamic_tree<T,D>::id
+    dynamic_tree<T,D>::insert( const aabb<T,D>& box, size_t data )
+        {
+        id leaf = allocate_();
+        nodes_[leaf].box = fatten_( box, vec<T,D>{} );
+        nodes_[leaf].data = data;
+        nodes_[leaf].moved = true;
+        insert_leaf_( leaf );
+        moved_.push_back( leaf );
+        ++size_;
+        return leaf;
+        }
+
+
+    template<class T, size_t D> void
+    dynamic_tree<T,D>::remove( id leaf )
+        {
+        TUMBO_ASSERT( leaf < nodes_.size() && nodes_[leaf].is_leaf() &&
+                      nodes_[leaf].height == 0 );
+        if( nodes_[leaf].moved )
+            moved_.erase( std::find( moved_.begin(), moved_.end(), leaf ) );
+        remove_leaf_( leaf );
+        free_node_( leaf );
+        --size_;
+        }
+
+
+    template<class T, size_t D> bool
+    dynamic_tree<T,D>::move( id leaf, const aabb<T,D>& box,
+                             const vec<T,D>& displacement )
+        {
+        TUMBO_ASSERT( leaf < nodes_.size() && nodes_[leaf].is_leaf() &&
+                      nodes_[leaf].height == 0 );
+        node& x = nodes_[leaf];
+        aabb<T,D> fat = fatten_( box, displacement );
+        if( contains( x.box, box ) )
+            {
+            // Keep the fat box unless it has grown far too loose.
+            aabb<T,D> loose = fat;
+            for( size_t d=0; d<D; ++d )
+                {
+                loose(d,0) -= 4 * margin_;
+                loose(d,1) += 4 * margin_;
+                }
+            if( contains( loose, x.box ) )
+                return false;
+            }
+
+        remove_leaf_( leaf );
+        nodes_[leaf].box = fat;
+        insert_leaf_( leaf );
+        if( !nodes_[leaf].moved )
+            {
+            nodes_[leaf].moved = true;
+            moved_.push_back( leaf );
+            }
+        return true;
+        }
+
+
+    template<class T, size_t D> void
+    dynamic_tree<T,D>::insert_leaf_( id leaf )
+        {
+        if( root_ == null )
+            {
+            root_ = leaf;
+            nodes_[leaf].parent = null;
+            return;
+            }
+
+        // Descend to the sibling that adds the least area, counting the
+        // growth of the ancestors each step passes on to the children.
+        const aabb<T,D> box = nodes_[leaf].box;
+        id n = root_;
+        while( !nodes_[n].is_leaf() )
+            {
+            const node& x = nodes_[n];
+            T area = half_area( x.box );
+            T combined = half_area( combine( x.box, box ) );
+            T cost = 2 * combined;
+            T inherited = 2 * ( combined - area );
+
+            T child_cost[2];
+            for( int c=0; c<2; ++c )
+                {
+                const node& y = nodes_[ x.child[c] ];
+                T grown = half_area( combine( y.box, box ) );
+                child_cost[c] = inherited +
+                    ( y.is_leaf() ? grown : grown - half_area( y.box ) );
+                }
+            if( cost < child_cost[0] && cost < child_cost[1] )
+                break;
+            n = x.child[ child_cost[1] < child_cost[0] ? 1 : 0 ];
+            }
+
+        id sibling = n;
+        id old_parent = nodes_[sibling].parent;
+        id parent = allocate_();
+        node& p = nodes_[parent];
+        p.parent = old_parent;
+        p.box = combine( box, nodes_[sibling].box );
+        p.height = nodes_[sibling].height + 1;
+        p.child[0] = sibling;
+        p.child[1] = leaf;
+        nodes_[sibling].parent = parent;
+        nodes_[leaf].parent = parent;
+        if( old_parent == null )
+            root_ = parent;
+        else
+            replace_child_( old_parent, sibling, parent );
+
+        refit_( old_parent );
+        }
+
+
+    template<class T, size_t D> void
+    dynamic_tree<T,D>::remove_leaf_( id leaf )
+        {
+        if( leaf == root_ )
+            {
+            root_ = null;
+            return;
+            }
+
+        id parent = nodes_[leaf].parent;
+        id grandparent = nodes_[parent].parent;
+        const node& p = nodes_[parent];
+        id sibling = p.child[ p.child[0] == leaf ? 1 : 0 ];
+
+        nodes_[sibling].parent = grandparent;
+        if( grandparent == null )
+            root_ = sibling;
+        else
+            replace_child_( grandparent, parent, sibling );
+        free_node_( parent );
+        refit_( grandparent );
+        }
+
+
+    template<class T, size_t D> void
+    dynamic_tree<T,D>::replace_child_( id parent, id old_child, id new_child )
+        {
+        node& p = nodes_[parent];
+        p.child[ p.child[0] == old_child ? 0 : 1 ] = new_child;
+        }
+
+
+    template<class T, size_t D> void
+    dynamic_tree<T,D>::refit_( id n )
+        {
+        while( n != null )
+            {
+            n = rotate_( n );
+            node& x = nodes_[n];
+            const node& a = nodes_[ x.child[0] ];
+            const node& b = nodes_[ x.child[1] ];
+            x.height = 1 + std::max( a.height, b.height );
+            x.box = combine( a.box, b.box );
+            n = x.parent;
+            }
+        }
+
+
+    /* If the heights of a's children differ by more than one, the higher
+        child takes a's place and a takes the lower grandchild. Returns the
+        node now in a's place. */
+    template<class T, size_t D> typename dynamic_tree<T,D>::id
+    dynamic_tree<T,D>::rotate_( id a )
+        {
+        node& A = nodes_[a];
+        if( A.is_leaf() || A.height < 2 )
+            return a;
+
+        int balance = nodes_[ A.child[1] ].height - nodes_[ A.child[0] ].height;
+        if( balance >= -1 && balance <= 1 )
+            return a;
+
+        // Rotate the higher child c up, keeping its higher child.
+        int hi = balance > 1 ? 1 : 0;
+        id c = A.child[hi];
+        id b = A.child[1-hi];
+        node& C = nodes_[c];
+        id f = C.child[0], g = C.child[1];
+        if( nodes_[f].height > nodes_[g].height )
+            std::swap( f, g );
+        // g is the higher grandchild and stays under c, f moves to a.
+
+        C.parent = A.parent;
+        if( C.parent == null )
+            root_ = c;
+        else
+            replace_child_( C.parent, a, c );
+        C.child[0] = a;
+        C.child[1] = g;
+        A.parent = c;
+        A.child[hi] = f;
+        nodes_[f].parent = a;
+
+        A.box = combine( nodes_[b].box, nodes_[f].box );
+        A.height = 1 + std::max( nodes_[b].height, nodes_[f].height );
+        C.box = combine( A.box, nodes_[g].box );
+        C.height = 1 + std::max( A.height, nodes_[g].height );
+        return c;
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    dynamic_tree<T,D>::query_overlaps( const aabb<T,D>& b, Fn fn ) const
+        {
+        if( root_ == null )
+            return 0;
+        size_t visited = 0;
+        traversal_stack_<id> stack;
+        stack.push( root_ );
+        while( !stack.empty() )
+            {
+            id n = stack.pop();
+            const node& x = nodes_[n];
+            ++visited;
+            if( !overlaps( x.box, b ) )
+                continue;
+            if( x.is_leaf() )
+                fn( n );
+            else
+                {
+                stack.push( x.child[1] );
+                stack.push( x.child[0] );
+                }
+            }
+        return visited;
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    dynamic_tree<T,D>::query_contains( const vec<T,D>& p, Fn fn ) const
+        {
+        if( root_ == null )
+            return 0;
+        size_t visited = 0;
+        traversal_stack_<id> stack;
+        stack.push( root_ );
+        while( !stack.empty() )
+            {
+            id n = stack.pop();
+            const node& x = nodes_[n];
+            ++visited;
+            if( !contains( x.box, p ) )
+                continue;
+            if( x.is_leaf() )
+                fn( n );
+            else
+                {
+                stack.push( x.child[1] );
+                stack.push( x.child[0] );
+                }
+            }
+        return visited;
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> void
+    dynamic_tree<T,D>::moved_pairs( Fn fn )
+        {
+        for( id a : moved_ )
+            query_overlaps( nodes_[a].box, [&]( id b )
+                {
+                // A pair of two moved objects is reported from the lower id.
+                if( b == a || ( nodes_[b].moved && b < a ) )
+                    return;
+                fn( std::min( a, b ), std::max( a, b ) );
+                } );
+        for( id a : moved_ )
+            nodes_[a].moved = false;
+        moved_.clear();
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_DYNAMIC_TREE_HPP
@@ -0,0 +1,453 @@
+#ifndef TUMBO_EXPRESSION_HPP
+#define TUMBO_EXPRESSION_HPP
+
+/**
+    \file expression.hpp
+    \brief Lazy element-wise arithmetic on matrices.
+
+    The element-wise operators (binary + and -, unary -, scalar * and /)
+    return small expression objects instead of matrices. A chain such as
+    a + b*2 - c is evaluated in a single loop, without temporaries, when it
+    is assigned to a matrix or passed to eval(). Float and double results
+    with a multiple of four elements are evaluated with simd::packet.
+
+    Matrices bound to lvalues are referenced by the expression, temporaries
+    are copied into it, so an expression stored with auto stays valid as
+    long as the named matrices it uses do. length, dot, cross, weld,
+    operator* and the other functions on matrices in utility.hpp also take
+    expressions, evaluating them first.
+*/
+
+#include <type_traits>
+#include <utility>
+#include "matrix.hpp"
+#include "simd.hpp"
+
+namespace tumbo
+    {
+
+    /// True for matrices and element-wise expressions.
+    template< class X >
+    struct is_expression :
+        std::integral_constant< bool, std::is_base_of<expression<X>,X>::value >
+        {};
+
+    template< class T, size_t M, size_t N >
+    struct is_expression< matrix<T,M,N> > : std::true_type
+        {};
+
+
+    /// True if the operand can be read with simd::packet loads.
+    template< class X >
+    struct is_vectorizable :
+        std::integral_constant< bool, X::vectorizable >
+        {};
+
+    template< class T, size_t M, size_t N >
+    struct is_vectorizable< matrix<T,M,N> > :
+        std::is_floating_point<T>
+        {};
+
+
+    /// How an operand is stored inside an expression node.
+    /** Lvalue matrices are held by reference, everything else by value. */
+    template< class X >
+    struct operand
+        {
+        typedef typename std::decay<X>::type type;
+        };
+
+    template< class T, size_t M, size_t N >
+    struct operand< matrix<T,M,N>& >
+        {
+        typedef const matrix<T,M,N>& type;
+        };
+
+    template< class T, size_t M, size_t N >
+    struct operand< const matrix<T,M,N>& >
+        {
+        typedef const matrix<T,M,N>& type;
+        };
+
+
+    template< class P, class T, size_t M, size_t N > P
+    load_packet( const matrix<T,M,N>& A, size_t i )
+        {
+        return P::load( A.data() + i );
+        }
+
+    template< class P, class E > P
+    load_packet( const expression<E>& e, size_t i )
+        {
+        return e.self().template packet<P>( i );
+        }
+
+
+    /* Element operations. They work on scalars and on simd::packets. */
+
+    struct add_op
+        {
+        template< class A, class B > constexpr auto
+        operator() ( const A& a, const B& b ) const -> decltype( a+b )
+            { return a+b; }
+        };
+
+    struct sub_op
+        {
+        template< class A, class B > constexpr auto
+        operator() ( const A& a, const B& b ) const -> decltype( a-b )
+            { return a-b; }
+        };
+
+    struct mul_op
+        {
+        template< class A, class B > constexpr auto
+        operator() ( const A& a, const B& b ) const -> decltype( a*b )
+            { return a*b; }
+        };
+
+    struct div_op
+        {
+        template< class A, class B > constexpr auto
+        operator() ( const A& a, const B& b ) const -> decltype( a/b )
+            { return a/b; }
+        };
+
+    struct negate_op
+        {
+        template< class A > constexpr auto
+        operator() ( const A& a ) const -> decltype( -a )
+            { return -a; }
+        };
+
+
+    /// Element-wise operation between two equally sized operands.
+    template< class Op, class L, class R >
+    class binary_expression : public expression< binary_expression<Op,L,R> >
+        {
+        typedef typename std::decay<L>::type left_t;
+        typedef typename std::decay<R>::type right_t;
+
+        static_assert( left_t::height() == right_t::height() &&
+                       left_t::width() == right_t::width(),
+            "Element-wise operands must be of equal size." );
+
+        public:
+            typedef typename std::common_type<
+                typename left_t::scalar_t,
+                typename right_t::scalar_t >::type scalar_t;
+
+            static constexpr bool vectorizable =
+                is_vectorizable<left_t>::value &&
+                is_vectorizable<right_t>::value &&
+                std::is_same<scalar_t, typename left_t::scalar_t>::value &&
+                std::is_same<scalar_t, typename right_t::scalar_t>::value;
+
+            constexpr
+            binary_expression( L l, R r ) :
+                l_( l ), r_( r )
+                {}
+
+            constexpr scalar_t
+            operator[] ( size_t i ) const
+                { return Op()( l_[i], r_[i] ); }
+
+            template< class P > P
+            packet( size_t i ) const
+                { return Op()( load_packet<P>( l_, i ), load_packet<P>( r_, i ) ); }
+
+            static constexpr size_t
+            size()
+                { return left_t::size(); }
+
+            static constexpr size_t
+            height()
+                { return left_t::height(); }
+
+            static constexpr size_t
+            width()
+                { return left_t::width(); }
+
+        private:
+            L l_;
+            R r_;
+        };
+
+
+    /// Element-wise operation between an operand and a scalar.
+    template< class Op, class E, class S >
+    class scalar_expression : public expression< scalar_expression<Op,E,S> >
+        {
+        typedef typename std::decay<E>::type operand_t;
+
+        public:
+            typedef typename std::common_type<
+                typename operand_t::scalar_t, S >::type scalar_t;
+
+            static constexpr bool vectorizable =
+                is_vectorizable<operand_t>::value &&
+                std::is_same<scalar_t, typename operand_t::scalar_t>::value;
+
+            constexpr
+            scalar_expression( E e, S s ) :
+                e_( e ), s_( s )
+                {}
+
+            constexpr scalar_t
+            operator[] ( size_t i ) const
+                { return Op()( e_[i], s_ ); }
+
+            template< class P > P
+            packet( size_t i ) const
+                {
+                return Op()( load_packet<P>( e_, i ),
+                             P::broadcast( static_cast<scalar_t>(s_) ) );
+                }
+
+            static constexpr size_t
+            size()
+                { return operand_t::size(); }
+
+            static constexpr size_t
+            height()
+                { return operand_t::height(); }
+
+            static constexpr size_t
+            width()
+                { return operand_t::width(); }
+
+        private:
+            E e_;
+            S s_;
+        };
+
+
+    /// Element-wise operation on a single operand.
+    template< class Op, class E >
+    class unary_expression : public expression< unary_expression<Op,E> >
+        {
+        typedef typename std::decay<E>::type operand_t;
+
+        public:
+            typedef typename operand_t::scalar_t scalar_t;
+
+            static constexpr bool vectorizable =
+                is_vectorizable<operand_t>::value;
+
+            constexpr explicit
+            unary_expression( E e ) :
+                e_( e )
+                {}
+
+            constexpr scalar_t
+            operator[] ( size_t i ) const
+                { return Op()( e_[i] ); }
+
+            template< class P > P
+            packet( size_t i ) const
+                { return Op()( load_packet<P>( e_, i ) ); }
+
+            static constexpr size_t
+            size()
+                { return operand_t::size(); }
+
+            static constexpr size_t
+            height()
+                { return operand_t::height(); }
+
+            static constexpr size_t
+            width()
+                { return operand_t::width(); }
+
+        private:
+            E e_;
+        };
+
+
+    /// True for the nodes built by the element-wise operators.
+    /** They hold no elements of their own, unlike matrices and views. */
+    template< class X >
+    struct is_lazy : std::false_type
+        {};
+
+    template< class Op, class L, class R >
+    struct is_lazy< binary_expression<Op,L,R> > : std::true_type
+        {};
+
+    template< class Op, class E, class S >
+    struct is_lazy< scalar_expression<Op,E,S> > : std::true_type
+        {};
+
+    template< class Op, class E >
+    struct is_lazy< unary_expression<Op,E> > : std::true_type
+        {};
+
+
+    /* Enables the overloads in utility.hpp that evaluate their operands
+        when all of them are expressions and at least one is lazy. */
+    template< class R, class... X >
+    struct enable_lazy_ : std::enable_if<
+        ( is_expression<X>::value && ... ) && ( is_lazy<X>::value || ... ), R >
+        {};
+
+
+    template< class T, size_t M, size_t N, class E > void
+    evaluate_packets_( matrix<T,M,N>& A, const E& e )
+        {
+        typedef simd::packet<T,4> P;
+        T* dst = A.begin();
+        for( size_t i=0; i < M*N; i += 4 )
+            e.template packet<P>( i ).store( dst+i );
+        }
+
+    /// Writes the elements of expression e into A in a single pass.
+    /** Element i of the result only depends on element i of the operands,
+        so A may appear in e. Elements are converted to A's scalar type. */
+    template< class T, size_t M, size_t N, class E > constexpr void
+    evaluate( matrix<T,M,N>& A, const E& e )
+        {
+        static_assert( E::height() == M && E::width() == N,
+            "Expression and matrix must be of equal size." );
+        if constexpr( simd::packable<T,M*N>::value && E::vectorizable &&
+                      std::is_same< T, typename E::scalar_t >::value )
+            {
+            if( !TUMBO_IS_CONSTANT_EVALUATED() )
+                return evaluate_packets_( A, e );
+            }
+        T* dst = A.begin();
+        for( size_t i=0; i < M*N; ++i )
+            dst[i] = static_cast<T>( e[i] );
+        }
+
+
+    /// Evaluates an expression into a matrix.
+    template< class E > constexpr
+    matrix< typename E::scalar_t, E::height(), E::width() >
+    eval( const expression<E>& e )
+        {
+        return matrix< typename E::scalar_t, E::height(), E::width() >( e );
+        }
+
+    /// A matrix is already evaluated.
+    template< class T, size_t M, size_t N > constexpr const matrix<T,M,N>&
+    eval( const matrix<T,M,N>& A )
+        {
+        return A;
+        }
+
+
+    /// Element-wise addition of matrices.
+    template< class L, class R > constexpr
+    typename std::enable_if<
+        is_expression< typename std::decay<L>::type >::value &&
+        is_expression< typename std::decay<R>::type >::value,
+        binary_expression< add_op,
+            typename operand<L>::type, typename operand<R>::type > >::type
+    operator + ( L&& l, R&& r )
+        {
+        return { std::forward<L>(l), std::forward<R>(r) };
+        }
+
+
+    /// Element-wise subtraction of matrices.
+    template< class L, class R > constexpr
+    typename std::enable_if<
+        is_expression< typename std::decay<L>::type >::value &&
+        is_expression< typename std::decay<R>::type >::value,
+        binary_expression< sub_op,
+            typename operand<L>::type, typename operand<R>::type > >::type
+    operator - ( L&& l, R&& r )
+        {
+        return { std::forward<L>(l), std::forward<R>(r) };
+        }
+
+
+    /// Element-wise negation of matrix.
+    template< class E > constexpr
+    typename std::enable_if<
+        is_expression< typename std::decay<E>::type >::value,
+        unary_expression< negate_op, typename operand<E>::type > >::type
+    operator - ( E&& e )
+        {
+        return unary_expression< negate_op, typename operand<E>::type >(
+            std::forward<E>(e) );
+        }
+
+
+    /// Multiply matrix by scalar.
+    template< class S, class E > constexpr
+    typename std::enable_if< std::is_arithmetic<S>::value &&
+        is_expression< typename std::decay<E>::type >::value,
+        scalar_expression< mul_op, typename operand<E>::type, S > >::type
+    operator * ( S s, E&& e )
+        {
+        return { std::forward<E>(e), s };
+        }
+
+
+    /// Scalar multiplication is associative.
+    template< class E, class S > constexpr
+    typename std::enable_if< std::is_arithmetic<S>::value &&
+        is_expression< typename std::decay<E>::type >::value,
+        scalar_expression< mul_op, typename operand<E>::type, S > >::type
+    operator * ( E&& e, S s )
+        {
+        return { std::forward<E>(e), s };
+        }
+
+
+    /// Matrix division by scalar.
+    template< class E, class S > constexpr
+    typename std::enable_if< std::is_arithmetic<S>::value &&
+        is_expression< typename std::decay<E>::type >::value,
+        scalar_expression< div_op, typename operand<E>::type, S > >::type
+    operator / ( E&& e, S s )
+        {
+        return { std::forward<E>(e), s };
+        }
+
+
+    template< class T, size_t M, size_t N, class E > constexpr
+    typename std::enable_if<
+        is_expression< typename std::decay<E>::type >::value,
+        matrix<T,M,N>& >::type
+    operator += ( matrix<T,M,N>& A, E&& e )
+        {
+        evaluate( A, A + std::forward<E>(e) );
+        return A;
+        }
+
+
+    template< class T, size_t M, size_t N, class E > constexpr
+    typename std::enable_if<
+        is_expression< typename std::decay<E>::type >::value,
+        matrix<T,M,N>& >::type
+    operator -= ( matrix<T,M,N>& A, E&& e )
+        {
+        evaluate( A, A - std::forward<E>(e) );
+        return A;
+        }
+
+
+    template< class T, size_t M, size_t N, class S > constexpr
+    typename std::enable_if< std::is_arithmetic<S>::value,
+        matrix<T,M,N>& >::type
+    operator *= ( matrix<T,M,N>& A, S s )
+        {
+        evaluate( A, A * s );
+        return A;
+        }
+
+
+    template< class T, size_t M, size_t N, class S > constexpr
+    typename std::enable_if< std::is_arithmetic<S>::value,
+        matrix<T,M,N>& >::type
+    operator /= ( matrix<T,M,N>& A, S s )
+        {
+        evaluate( A, A / s );
+        return A;
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_EXPRESSION_HPP
@@ -0,0 +1,389 @@
+#ifndef TUMBO_FRUSTUM_HPP
+#define TUMBO_FRUSTUM_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+
+/**
+    \file frustum.hpp
+    \brief View frustum planes and culling of boxes and spheres.
+
+    make_frustum takes the six planes from the rows of a view projection
+    matrix, such as perspective( ... ) * inverse( camera ), so the frustum
+    is in the space the matrix is applied to. The planes are normalized and
+    point inwards.
+
+    The tests are conservative: a box or sphere is only culled if it lies
+    entirely outside one plane, so a few near the corners of the frustum
+    pass even though they are outside it.
+
+    cull_aabbs and cull_spheres test a whole buffer and write the indices
+    of the visible elements to a list. They take four elements at a time,
+    one per lane, and test them against one plane at a time until all of
+    them are outside a plane. Elements stored in scene order, so that
+    neighbours are near each other, are often culled together by the
+    first plane tested. A cull_cache remembers, for each block, the plane
+    that culled all of it and tests that one first in the next call. With
+    threads other than 1 the buffer is split over default_thread_pool (see
+    parallel.hpp); 0 uses all hardware threads. The list is the same for
+    any thread count.
+*/
+
+namespace tumbo
+    {
+
+    /// Depth range of clip space, [-w,w] as in OpenGL or [0,w] as in D3D.
+    /** perspective( l, r, b, t, n, f ) and orthographic give the first,
+        perspective( fov, aspect, near, far ) the second. */
+    enum class clip_depth { negative_one_to_one, zero_to_one };
+
+
+    /// Six planes, each a normal and an offset as (nx, ny, nz, d).
+    /** p is inside a plane when dot( n, p ) + d >= 0. */
+    template<class T>
+    struct frustum
+        {
+        enum { left, right, bottom, top, near, far };
+        vec<T,4> planes[6];
+        };
+
+    typedef frustum<float>  ffrustum;
+    typedef frustum<double> dfrustum;
+
+
+    template<class T>
+    struct sphere
+        {
+        vec<T,3> center;
+        T radius;
+        };
+
+    typedef sphere<float>   fsphere;
+    typedef sphere<double>  dsphere;
+
+
+    enum class cull_result { outside, intersecting, inside };
+
+
+    /// Plane extraction from the rows of a view projection (Gribb, Hartmann).
+    template<class T> frustum<T>
+    make_frustum( const matrix<T,4,4>& M,
+                  clip_depth depth = clip_depth::negative_one_to_one )
+        {
+        frustum<T> f;
+        for( size_t j=0; j<4; ++j )
+            {
+            f.planes[frustum<T>::left][j]   = M(3,j) + M(0,j);
+            f.planes[frustum<T>::right][j]  = M(3,j) - M(0,j);
+            f.planes[frustum<T>::bottom][j] = M(3,j) + M(1,j);
+            f.planes[frustum<T>::top][j]    = M(3,j) - M(1,j);
+            f.planes[frustum<T>::near][j]   =
+                depth == clip_depth::zero_to_one ? M(2,j) : M(3,j) + M(2,j);
+            f.planes[frustum<T>::far][j]    = M(3,j) - M(2,j);
+            }
+        for( auto& p : f.planes )
+            {
+            T length = std::sqrt( p[0]*p[0] + p[1]*p[1] + p[2]*p[2] );
+            for( size_t j=0; j<4; ++j )
+                p[j] /= length;
+            }
+        return f;
+        }
+
+
+    /// Signed distance from p to a normalized plane, positive inside.
+    template<class T> T
+    plane_distance( const vec<T,4>& plane, const vec<T,3>& p )
+        {
+        return plane[0]*p[0] + plane[1]*p[1] + plane[2]*p[2] + plane[3];
+        }
+
+
+    template<class T> bool
+    contains( const frustum<T>& f, const vec<T,3>& p )
+        {
+        for( const auto& plane : f.planes )
+            if( plane_distance( plane, p ) < 0 )
+                return false;
+        return true;
+        }
+
+
+    /// Whether a box is outside, inside or crossing the planes.
+    /** Compares the corners farthest along and against each normal. */
+    template<class T> cull_result
+    classify( const frustum<T>& f, const aabb<T,3>& box )
+        {
+        cull_result result = cull_result::inside;
+        for( const auto& plane : f.planes )
+            {
+            T far = 0, near = 0;
+            for( size_t j=0; j<3; ++j )
+                {
+                bool positive = plane[j] >= 0;
+                far += box( j, positive ) * plane[j];
+                near += box( j, !positive ) * plane[j];
+                }
+            far += plane[3];
+            near += plane[3];
+            if( far < 0 )
+                return cull_result::outside;
+            if( near < 0 )
+                result = cull_result::intersecting;
+            }
+        return result;
+        }
+
+
+    template<class T> cull_result
+    classify( const frustum<T>& f, const sphere<T>& s )
+        {
+        cull_result result = cull_result::inside;
+        for( const auto& plane : f.planes )
+            {
+            T d = plane_distance( plane, s.center );
+            if( d + s.radius < 0 )
+                return cull_result::outside;
+            if( d - s.radius < 0 )
+                result = cull_result::intersecting;
+            }
+        return result;
+        }
+
+
+    template<class T> bool
+    intersects( const frustum<T>& f, const aabb<T,3>& box )
+        {
+        return classify( f, box ) != cull_result::outside;
+        }
+
+
+    template<class T> bool
+    intersects( const frustum<T>& f, const sphere<T>& s )
+        {
+        return classify( f, s ) != cull_result::outside;
+        }
+
+
+    /// Plane that culled each block in the last cull, tested first next time.
+    /** Keep one per buffer; it is resized when the buffer size changes. */
+    struct cull_cache
+        {
+        std::vector<uint8_t> planes;
+        };
+
+
+    /* The planes broadcast to packets, and which of their normal components
+        are positive. */
+    template<class T>
+    struct frustum_packets_
+        {
+        typedef simd::packet<T,4> P;
+        P n[6][4];
+        bool positive[6][3];
+
+        explicit
+        frustum_packets_( const frustum<T>& f )
+            {
+            for( size_t p=0; p<6; ++p )
+                for( size_t j=0; j<4; ++j )
+                    {
+                    n[p][j] = P::broadcast( f.planes[p][j] );
+                    if( j < 3 )
+                        positive[p][j] = f.planes[p][j] >= 0;
+                    }
+            }
+        };
+
+
+    /* Culls the blocks [first,last) of W elements, writing the indices of
+        the visible ones to out and returning their count. block.load( i,
+        count ) loads the elements from i into lanes, and block.distance(
+        F, p ) gives the distance of their farthest point inside plane p. */
+    template<class T, class Block> size_t
+    cull_blocks_( const frustum_packets_<T>& F, Block block, size_t n,
+                  size_t first, size_t last, uint8_t* cache, uint32_t* out )
+        {
+        typedef typename frustum_packets_<T>::P P;
+        const size_t W = P::width();
+        const unsigned all = ( 1u << W ) - 1;
+        const P zero = P::broadcast(0);
+        size_t m = 0;
+        for( size_t b = first; b < last; ++b )
+            {
+            size_t i = b*W, count = n - i < W ? n - i : W;
+            block.load( i, count );
+
+            unsigned outside = 0;
+            size_t start = cache ? cache[b] : 0;
+            for( size_t k=0; k<6; ++k )
+                {
+                size_t p = start + k < 6 ? start + k : start + k - 6;
+                outside |= simd::movemask( block.distance( F, p ) < zero );
+                if( outside == all )
+                    {
+                    if( cache )
+                        cache[b] = uint8_t( p );
+                    break;
+                    }
+                }
+            // Written without branches, as visibility is hard to predict.
+            for( size_t k=0; k < count; ++k )
+                {
+                out[m] = uint32_t( i+k );
+                m += ~outside >> k & 1;
+                }
+            }
+        return m;
+        }
+
+
+    /* Splits the blocks over threads. Each chunk writes to its own part of
+        visible, which are then moved together in order. */
+    template<class T, class Block> size_t
+    cull_buffer_( const frustum<T>& f, Block block, size_t n,
+                  std::vector<uint32_t>& visible, cull_cache* cache,
+                  size_t threads )
+        {
+        TUMBO_ASSERT( n < ( size_t(1) << 32 ) );
+        const size_t W = frustum_packets_<T>::P::width();
+        size_t blocks = ( n + W-1 ) / W;
+        uint8_t* planes = nullptr;
+        if( cache )
+            {
+            cache->planes.resize( blocks, 0 );
+            planes = cache->planes.data();
+            }
+        frustum_packets_<T> F( f );
+        visible.resize( n );
+
+        size_t chunks = std::min( thread_count( threads ),
+                                  std::max<size_t>( blocks >> 11, 1 ) );
+        std::vector<size_t> found( chunks );
+        parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+            {
+            for( size_t c=c0; c < c1; ++c )
+                {
+                size_t first = blocks*c / chunks;
+                found[c] = cull_blocks_( F, block, n, first, blocks*(c+1) / chunks,
+                                         planes, visible.data() + first*W );
+                }
+            } );
+        size_t m = found[0];
+        for( size_t c=1; c < chunks; ++c )
+            {
+            const uint32_t* part = visible.data() + blocks*c / chunks * W;
+            std::copy( part, part + found[c], visible.data() + m );
+            m += found[c];
+            }
+        visible.resize( m );
+        return m;
+        }
+
+
+    /* Boxes by axis, one per lane. The corner farthest along a normal
+        takes the high end on the axes where the normal is positive, the
+        same for every lane. */
+    template<class T>
+    struct cull_aabb_block_
+        {
+        typedef typename frustum_packets_<T>::P P;
+        const aabb<T,3>* boxes;
+        P lo[3], hi[3];
+
+        void
+        load( size_t i, size_t count )
+            {
+            // A box is lo0 hi0 lo1 hi1 lo2 hi2; two overlapping loads per
+            // box and a transpose give the lanes of each.
+            const T* b[4];
+            for( size_t k=0; k<4; ++k )
+                b[k] = boxes[ i + ( k < count ? k : 0 ) ].data();
+            P z0 = P::load( b[0]+2 ), z1 = P::load( b[1]+2 ),
+              z2 = P::load( b[2]+2 ), z3 = P::load( b[3]+2 );
+            lo[0] = P::load( b[0] );
+            hi[0] = P::load( b[1] );
+            lo[1] = P::load( b[2] );
+            hi[1] = P::load( b[3] );
+            simd::transpose( lo[0], hi[0], lo[1], hi[1] );
+            simd::transpose( z0, z1, z2, z3 );
+            lo[2] = z2;
+            hi[2] = z3;
+            }
+
+        P
+        distance( const frustum_packets_<T>& F, size_t p ) const
+            {
+            const P* end[2] = { lo, hi };
+            return end[ F.positive[p][0] ][0] * F.n[p][0] +
+                   end[ F.positive[p][1] ][1] * F.n[p][1] +
+                   end[ F.positive[p][2] ][2] * F.n[p][2] + F.n[p][3];
+            }
+        };
+
+
+    /* Sphere centers by axis and radii, one per lane. */
+    template<class T>
+    struct cull_sphere_block_
+        {
+        typedef typename frustum_packets_<T>::P P;
+        const sphere<T>* spheres;
+        P c[3], r;
+
+        void
+        load( size_t i, size_t count )
+            {
+            const size_t W = P::width();
+            T x[4][W];
+            for( size_t k=0; k<W; ++k )
+                {
+                const sphere<T>& s = spheres[ i + ( k < count ? k : 0 ) ];
+                x[0][k] = s.center[0];
+                x[1][k] = s.center[1];
+                x[2][k] = s.center[2];
+                x[3][k] = s.radius;
+                }
+            for( size_t d=0; d<3; ++d )
+                c[d] = P::load( x[d] );
+            r = P::load( x[3] );
+            }
+
+        P
+        distance( const frustum_packets_<T>& F, size_t p ) const
+            {
+            return c[0]*F.n[p][0] + c[1]*F.n[p][1] + c[2]*F.n[p][2] +
+                   F.n[p][3] + r;
+            }
+        };
+
+
+    /// Writes the indices of the boxes that intersect f to visible.
+    /** Returns the number of visible boxes. */
+    template<class T> size_t
+    cull_aabbs( const frustum<T>& f, const aabb<T,3>* boxes, size_t n,
+                std::vector<uint32_t>& visible, cull_cache* cache = nullptr,
+                size_t threads = 1 )
+        {
+        return cull_buffer_( f, cull_aabb_block_<T>{ boxes, {}, {} }, n, visible,
+                             cache, threads );
+        }
+
+
+    /// Writes the indices of the spheres that intersect f to visible.
+    template<class T> size_t
+    cull_spheres( const frustum<T>& f, const sphere<T>* spheres, size_t n,
+                  std::vector<uint32_t>& visible, cull_cache* cache = nullptr,
+                  size_t threads = 1 )
+        {
+        return cull_buffer_( f, cull_sphere_block_<T>{ spheres, {}, {} }, n, visible,
+                             cache, threads );
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_FRUSTUM_HPP
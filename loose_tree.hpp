@@ -0,0 +1,467 @@
+#ifndef TUMBO_LOOSE_TREE_HPP
+#define TUMBO_LOOSE_TREE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "bvh.hpp"
+
+/**
+    \file loose_tree.hpp
+    \brief Loose quadtree and octree of boxes.
+
+    The root is the cube around the bounds given to the constructor and
+    every node splits its cube into 2^D children, as split() does with its
+    center. A node's loose box is its cube grown by half a side on every
+    side, twice the size, and holds objects whose box lies inside it. An
+    object goes down to the child whose cube contains the center of its
+    box for as long as the box fits that child's loose box and the tree
+    is split there. Objects up to a cube's side in size always fit the
+    child, so small objects never stick high up on a boundary between
+    cubes. Objects outside the root's loose box stay in the root.
+
+    A leaf splits once it holds more than leaf_capacity objects, unless it
+    is at max_depth; a node whose subtree is down to half of that takes
+    its descendants' objects back and frees them. Nodes come from one array
+    in blocks of 2^D children, reused through a free list, and the objects
+    of a node are a linked list through the object array, so inserting and
+    removing do not allocate once the arrays have grown. An object's id is
+    its position in the object array, stable until it is removed.
+*/
+
+namespace tumbo
+    {
+
+    template<class T, size_t D>
+    class loose_tree
+        {
+        public:
+            typedef uint32_t id;
+
+            static constexpr id null = id(-1);
+            static constexpr size_t fanout = size_t(1) << D;
+
+            /// A tree over the cube around bounds.
+            explicit
+            loose_tree( const aabb<T,D>& bounds, size_t max_depth = 8,
+                        size_t leaf_capacity = 8 );
+
+            /// Adds an object and returns its id.
+            id
+            insert( const aabb<T,D>& box, size_t data = 0 );
+
+            void
+            remove( id a );
+
+            /// Changes the box of an object.
+            /** Returns true if it moved to another node. */
+            bool
+            move( id a, const aabb<T,D>& box );
+
+            const aabb<T,D>&
+            box( id a ) const
+                { return objects_[a].box; }
+
+            size_t
+            data( id a ) const
+                { return objects_[a].data; }
+
+            /// Depth of the node holding a, 0 for the root.
+            size_t
+            depth( id a ) const
+                { return nodes_[ objects_[a].node ].depth; }
+
+            /// Number of objects.
+            size_t
+            size() const
+                { return nodes_[0].total; }
+
+            /// Number of nodes in use.
+            size_t
+            node_count() const
+                { return nodes_.size() - fanout * free_blocks_.size(); }
+
+            /// Removes all objects and nodes but the root.
+            void
+            clear();
+
+            /// Calls fn( id ) for every object overlapping b.
+            /** Returns the number of nodes visited. */
+            template<class Fn> size_t
+            query_overlaps( const aabb<T,D>& b, Fn fn ) const;
+
+            /// Calls fn( id ) for every object containing p.
+            template<class Fn> size_t
+            query_contains( const vec<T,D>& p, Fn fn ) const;
+
+        private:
+            struct node
+                {
+                vec<T,D> center;
+                T half;         // Half the side of the cube
+                id children;    // First of fanout children, null for leaves
+                id parent;
+                id first;       // First object, null if none
+                uint32_t count; // Objects in this node
+                uint32_t total; // Objects in this subtree
+                uint32_t depth;
+                };
+
+            struct object
+                {
+                aabb<T,D> box;
+                size_t data;
+                id node;        // null on the free list
+                id prev, next;  // In the node's list, next links the free list
+                };
+
+            /* The node's cube grown by half a side on every side. */
+            aabb<T,D>
+            loose_box_( const node& x ) const
+                {
+                aabb<T,D> b;
+                for( size_t d=0; d<D; ++d )
+                    {
+                    b(d,0) = x.center[d] - 2*x.half;
+                    b(d,1) = x.center[d] + 2*x.half;
+                    }
+                return b;
+                }
+
+            bool
+            fits_( id n, const aabb<T,D>& box ) const
+                {
+                return n == 0 || contains( loose_box_( nodes_[n] ), box );
+                }
+
+            /* The child of n that box goes to, null if it fits none. */
+            id
+            child_for_( id n, const aabb<T,D>& box ) const
+                {
+                const node& x = nodes_[n];
+                size_t k = 0;
+                for( size_t d=0; d<D; ++d )
+                    if( box(d,0) + box(d,1) >= 2*x.center[d] )
+                        k |= size_t(1) << d;
+                id c = x.children + id(k);
+                return fits_( c, box ) ? c : null;
+                }
+
+            void
+            link_( id a, id n );
+
+            void
+            unlink_( id a );
+
+            /* Puts a in the subtree of n, counting it in every node
+                passed. */
+            void
+            place_( id a, id n );
+
+            void
+            split_( id n );
+
+            /* Uncounts an object taken out of n from n up to and including
+                last, then merges the highest node small enough. */
+            void
+            release_( id n, id last );
+
+            void
+            merge_( id n );
+
+            std::vector<node> nodes_;
+            std::vector<object> objects_;
+            std::vector<id> free_blocks_;
+            std::vector<id> merge_stack_;   // Kept to not allocate in merge_
+            id free_objects_;
+            uint32_t max_depth_;
+            uint32_t capacity_;
+        };
+
+    template<class T> using loose_quadtree = loose_tree<T,2>;
+    template<class T> using loose_octree = loose_tree<T,3>;
+
+
+    template<class T, size_t D>
+    loose_tree<T,D>::loose_tree( const aabb<T,D>& bounds, size_t max_depth,
+                                 size_t leaf_capacity ) :
+        free_objects_( null ),
+        max_depth_( uint32_t( max_depth ) ),
+        capacity_( uint32_t( std::max<size_t>( leaf_capacity, 1 ) ) )
+        {
+        node root;
+        root.center = center( bounds );
+        root.half = 0;
+        for( size_t d=0; d<D; ++d )
+            root.half = std::max( root.half, ( bounds(d,1) - bounds(d,0) ) / 2 );
+        root.children = root.parent = root.first = null;
+        root.count = root.total = root.depth = 0;
+        nodes_.push_back( root );
+        }
+
+
+    template<class T, size_t D> void
+    loose_tree<T,D>::link_( id a, id n )
+        {
+        object& o = objects_[a];
+        node& x = nodes_[n];
+        o.node = n;
+        o.prev = null;
+        o.next = x.first;
+        if( x.first != null )
+            objects_[ x.first ].prev = a;
+        x.first = a;
+        ++x.count;
+        }
+
+
+    template<class T, size_t D> void
+    loose_tree<T,D>::unlink_( id a )
+        {
+        object& o = objects_[a];
+        node& x = nodes_[ o.node ];
+        if( o.prev != null )
+            objects_[ o.prev ].next = o.next;
+        else
+            x.first = o.next;
+        if( o.next != null )
+            objects_[ o.next ].prev = o.prev;
+        --x.count;
+        }
+
+
+    template<class T, size_t D> void
+    loose_tree<T,D>::place_( id a, id n )
+        {
+        const aabb<T,D> box = objects_[a].box;
+        for(;;)
+            {
+            ++nodes_[n].total;
+            if( nodes_[n].children == null )
+                {
+                if( nodes_[n].count < capacity_ || nodes_[n].depth >= max_depth_ )
+                    break;
+                split_( n );
+                }
+            id c = child_for_( n, box );
+            if( c == null )
+                break;
+            n = c;
+            }
+        link_( a, n );
+        }
+
+
+    template<class T, size_t D> void
+    loose_tree<T,D>::split_( id n )
+        {
+        id first;
+        if( free_blocks_.empty() )
+            {
+            TUMBO_ASSERT( nodes_.size() + fanout < null );
+            first = id( nodes_.size() );
+            nodes_.resize( nodes_.size() + fanout );
+            }
+        else
+            {
+            first = free_blocks_.back();
+            free_blocks_.pop_back();
+            }
+        node& x = nodes_[n];
+        x.children = first;
+        for( size_t k=0; k < fanout; ++k )
+            {
+            node& c = nodes_[ first+k ];
+            c.half = x.half / 2;
+            for( size_t d=0; d<D; ++d )
+                c.center[d] = x.center[d] + ( k >> d & 1 ? c.half : -c.half );
+            c.children = c.first = null;
+            c.parent = n;
+            c.count = c.total = 0;
+            c.depth = x.depth + 1;
+            }
+
+        // Objects that fit a child move down one level.
+        id a = x.first;
+        while( a != null )
+            {
+            id next = objects_[a].next;
+            id c = child_for_( n, objects_[a].box );
+            if( c != null )
+                {
+                unlink_( a );
+                link_( a, c );
+                ++nodes_[c].total;
+                }
+            a = next;
+            }
+        }
+
+
+    template<class T, size_t D> void
+    loose_tree<T,D>::release_( id n, id last )
+        {
+        id merge = null;
+        for( id p = n; ; p = nodes_[p].parent )
+            {
+            node& x = nodes_[p];
+            --x.total;
+            if( x.children != null && 2*x.total <= capacity_ )
+                merge = p;
+            if( p == last )
+                break;
+            }
+        if( merge != null )
+            merge_( merge );
+        }
+
+
+    template<class T, size_t D> void
+    loose_tree<T,D>::merge_( id n )
+        {
+        // Depth first through the children, moving their objects to n.
+        std::vector<id>& stack = merge_stack_;
+        stack.assign( 1, nodes_[n].children );
+        nodes_[n].children = null;
+        while( !stack.empty() )
+            {
+            id first = stack.back();
+            stack.pop_back();
+            for( id c = first; c < first + fanout; ++c )
+                {
+                while( nodes_[c].first != null )
+                    {
+                    id a = nodes_[c].first;
+                    unlink_( a );
+                    link_( a, n );
+                    }
+                if( nodes_[c].children != null )
+                    stack.push_back( nodes_[c].children );
+                }
+            free_blocks_.push_back( first );
+            }
+        }
+
+
+    template<class T, size_t D> typename loose_tree<T,D>::id
+    loose_tree<T,D>::insert( const aabb<T,D>& box, size_t data )
+        {
+        id a;
+        if( free_objects_ != null )
+            {
+            a = free_objects_;
+            free_objects_ = objects_[a].next;
+            }
+        else
+            {
+            TUMBO_ASSERT( objects_.size() < null );
+            a = id( objects_.size() );
+            objects_.emplace_back();
+            }
+        objects_[a].box = box;
+        objects_[a].data = data;
+        place_( a, 0 );
+        return a;
+        }
+
+
+    template<class T, size_t D> void
+    loose_tree<T,D>::remove( id a )
+        {
+        TUMBO_ASSERT( a < objects_.size() && objects_[a].node != null );
+        id n = objects_[a].node;
+        unlink_( a );
+        objects_[a].node = null;
+        objects_[a].next = free_objects_;
+        free_objects_ = a;
+        release_( n, 0 );
+        }
+
+
+    template<class T, size_t D> bool
+    loose_tree<T,D>::move( id a, const aabb<T,D>& box )
+        {
+        TUMBO_ASSERT( a < objects_.size() && objects_[a].node != null );
+        id n = objects_[a].node;
+        objects_[a].box = box;
+        // Stays if it fits and would not go further down.
+        if( fits_( n, box ) &&
+            ( nodes_[n].children == null || child_for_( n, box ) == null ) )
+            return false;
+
+        // Up to the first node it fits, then down from there.
+        id up = n;
+        while( !fits_( up, box ) )
+            up = nodes_[up].parent;
+        unlink_( a );
+        release_( n, up );
+        place_( a, up );
+        return objects_[a].node != n;
+        }
+
+
+    template<class T, size_t D> void
+    loose_tree<T,D>::clear()
+        {
+        nodes_.resize( 1 );
+        node& root = nodes_[0];
+        root.children = root.first = null;
+        root.count = root.total = 0;
+        objects_.clear();
+        free_blocks_.clear();
+        free_objects_ = null;
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    loose_tree<T,D>::query_overlaps( const aabb<T,D>& b, Fn fn ) const
+        {
+        size_t visited = 0;
+        traversal_stack_<id> stack;
+        stack.push( 0 );
+        while( !stack.empty() )
+            {
+            const node& x = nodes_[ stack.pop() ];
+            ++visited;
+            for( id a = x.first; a != null; a = objects_[a].next )
+                if( overlaps( objects_[a].box, b ) )
+                    fn( a );
+            if( x.children == null )
+                continue;
+            for( id c = x.children; c < x.children + fanout; ++c )
+                if( nodes_[c].total != 0 && overlaps( loose_box_( nodes_[c] ), b ) )
+                    stack.push( c );
+            }
+        return visited;
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    loose_tree<T,D>::query_contains( const vec<T,D>& p, Fn fn ) const
+        {
+        size_t visited = 0;
+        traversal_stack_<id> stack;
+        stack.push( 0 );
+        while( !stack.empty() )
+            {
+            const node& x = nodes_[ stack.pop() ];
+            ++visited;
+            for( id a = x.first; a != null; a = objects_[a].next )
+                if( contains( objects_[a].box, p ) )
+                    fn( a );
+            if( x.children == null )
+                continue;
+            for( id c = x.children; c < x.children + fanout; ++c )
+                if( nodes_[c].total != 0 && contains( loose_box_( nodes_[c] ), p ) )
+                    stack.push( c );
+            }
+        return visited;
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_LOOSE_TREE_HPP
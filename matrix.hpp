@@ -5,13 +5,10 @@
 
 #include <iterator>
 #include <algorithm>
-#include <cassert>
-#include <cstring>
+#include <initializer_list>
+#include <type_traits>
 #include "assert.hpp"
-
-#ifdef _WIN32
-#define constexpr
-#endif
+#include "simd.hpp"
 
 namespace tumbo
     {
@@ -24,7 +21,16 @@ namespace tumbo
     class matrix;
 
     template< class T, class S, size_t M, size_t N >
-    matrix<S,M,N> cast_matrix( const matrix<T,M,N>& );
+    constexpr matrix<S,M,N> cast_matrix( const matrix<T,M,N>& );
+
+    /// Base of the lazy element-wise expressions in expression.hpp.
+    template< class E >
+    struct expression
+        {
+        constexpr const E&
+        self() const
+            { return static_cast<const E&>(*this); }
+        };
 
     /**
         \class matrix
@@ -34,6 +40,9 @@ namespace tumbo
         in a row major order.
 
         Convinient typedefs such as mat44 and vec3 are defined in tumbo.hpp
+
+        All members are constexpr. A default constructed matrix is left
+        uninitialized; use matrix{} for a zeroed one in constant expressions.
     */
     template < class T, size_t M, size_t N >
     class matrix
@@ -41,48 +50,63 @@ namespace tumbo
         public:
             typedef T scalar_t;
 
-            matrix() {}
-            matrix( const matrix& );
+            matrix() = default;
+            matrix( const matrix& ) = default;
 
-            template< class S > explicit
+            template< class S > constexpr explicit
             matrix( const matrix<S,M,N>& );
 
+            constexpr
             matrix( std::initializer_list<T> l );
 
-            template<class Iter>
+            /// Evaluates an element-wise expression of the same scalar type.
+            template< class E, typename std::enable_if< std::is_same<
+                T, typename E::scalar_t >::value, int >::type = 0 > constexpr
+            matrix( const expression<E>& );
+
+            /// Evaluates an expression of another scalar type, converting
+            /// its elements, explicitly like the matrix conversion above.
+            template< class E, typename std::enable_if< !std::is_same<
+                T, typename E::scalar_t >::value, int >::type = 0 > constexpr explicit
+            matrix( const expression<E>& );
+
+            template<class Iter> constexpr
             matrix( Iter first, Iter end );
 
-            template<class Iter> matrix&
+            template<class Iter> constexpr matrix&
             assign( Iter first, Iter end );
 
             matrix&
-            operator = ( const matrix& );
+            operator = ( const matrix& ) = default;
+
+            template< class E > constexpr matrix&
+            operator = ( const expression<E>& );
 
-            scalar_t&
+            constexpr scalar_t&
             operator() ( size_t i, size_t j );
 
-            const scalar_t&
+            constexpr const scalar_t&
             operator() ( size_t i, size_t j ) const;
 
-            scalar_t&
+            constexpr scalar_t&
             operator[] ( size_t i );
 
-            const scalar_t&
+            constexpr const scalar_t&
             operator[] ( size_t i ) const;
 
-            const scalar_t*
+            constexpr const scalar_t*
             data() const;
 
-            scalar_t*
+            constexpr scalar_t*
             begin();
 
-            const scalar_t*
+            constexpr const scalar_t*
             begin() const;
 
-            scalar_t*
+            constexpr scalar_t*
             end();
 
-            const scalar_t*
+            constexpr const scalar_t*
             end() const;
 
             static constexpr size_t
@@ -98,11 +122,12 @@ namespace tumbo
                 { return N; }
 
         private:
+            alignas( simd::storage_alignment<T,M*N>::value )
             scalar_t data_[ M*N ];
         };
 
     /// Cast a matrix to another equal sized matrix with different inner type.
-    template<class S, class T, size_t M, size_t N> matrix<S,M,N>
+    template<class S, class T, size_t M, size_t N> constexpr matrix<S,M,N>
     cast_matrix( const matrix<T,M,N>& A )
         {
         return matrix<S,M,N>(A);
@@ -110,52 +135,68 @@ namespace tumbo
 
 
     template< class T, size_t M, size_t N >
-    matrix<T,M,N>::matrix( const matrix<T,M,N>& other )
+    template< class S > constexpr
+    matrix<T,M,N>::matrix( const matrix<S,M,N>& other ) :
+        data_{}
         {
-        std::memcpy( this, &other, sizeof(matrix<T,M,N>) );
+        for( size_t i=0; i < other.size(); ++i )
+            data_[i] = static_cast<T>( other[i] );
+        }
+
+
+    template < class T, size_t M, size_t N > constexpr
+    matrix<T,M,N>::matrix( std::initializer_list<T> l ) :
+        data_{}
+        {
+        assign(l.begin(), l.end());
         }
 
 
     template< class T, size_t M, size_t N >
-    template< class S >
-    matrix<T,M,N>::matrix( const matrix<S,M,N>& other )
+    template< class E, typename std::enable_if< std::is_same<
+        T, typename E::scalar_t >::value, int >::type > constexpr
+    matrix<T,M,N>::matrix( const expression<E>& e ) :
+        data_{}
         {
-        for( size_t i=0; i < other.size(); ++i )
-            data_[i] = static_cast<T>( other[i] );
+        *this = e;
         }
 
 
-    template < class T, size_t M, size_t N >
-    matrix<T,M,N>::matrix( std::initializer_list<T> l )
+    template< class T, size_t M, size_t N >
+    template< class E, typename std::enable_if< !std::is_same<
+        T, typename E::scalar_t >::value, int >::type > constexpr
+    matrix<T,M,N>::matrix( const expression<E>& e ) :
+        data_{}
         {
-        assign(l.begin(), l.end());
+        *this = e;
         }
 
 
     template< class T, size_t M, size_t N>
-    template<class Iter>
-    matrix<T,M,N>::matrix( Iter it, Iter end )
+    template<class Iter> constexpr
+    matrix<T,M,N>::matrix( Iter it, Iter end ) :
+        data_{}
         {
         assign(it,end);
         }
 
 
     template < class T, size_t M, size_t N >
+    template< class E > constexpr
     matrix<T,M,N>&
-    matrix<T,M,N>::operator = ( const matrix<T,M,N>& other )
+    matrix<T,M,N>::operator = ( const expression<E>& e )
         {
-        auto it = std::begin(other);
-        auto end = std::end(other);
-        return assign(it,end);
+        evaluate( *this, e.self() );
+        return *this;
         }
 
 
     template < class T, size_t M, size_t N >
-    template<class Iter>
+    template<class Iter> constexpr
     matrix<T,M,N>&
     matrix<T,M,N>::assign ( Iter it, Iter end )
         {
-        assert( size() == std::distance(it,end) );
+        TUMBO_ASSERT( size() == size_t( std::distance(it,end) ) );
         size_t i=0;
         while( it != end )
             {
@@ -166,7 +207,7 @@ namespace tumbo
         }
 
 
-    template < class T, size_t M, size_t N >
+    template < class T, size_t M, size_t N > constexpr
     typename matrix<T,M,N>::scalar_t&
     matrix<T,M,N>::operator() ( size_t i, size_t j )
         {
@@ -176,7 +217,7 @@ namespace tumbo
         }
 
 
-    template < class T, size_t M, size_t N >
+    template < class T, size_t M, size_t N > constexpr
     const typename matrix<T,M,N>::scalar_t&
     matrix<T,M,N>::operator() ( size_t i, size_t j ) const
         {
@@ -186,7 +227,7 @@ namespace tumbo
         }
 
 
-    template < class T, size_t M, size_t N >
+    template < class T, size_t M, size_t N > constexpr
     typename matrix<T,M,N>::scalar_t&
     matrix<T,M,N>::operator[] ( size_t i )
         {
@@ -195,7 +236,7 @@ namespace tumbo
         }
 
 
-    template < class T, size_t M, size_t N >
+    template < class T, size_t M, size_t N > constexpr
     const typename matrix<T,M,N>::scalar_t&
     matrix<T,M,N>::operator[] ( size_t i ) const
         {
@@ -205,7 +246,7 @@ namespace tumbo
 
 
 
-    template < class T, size_t M, size_t N >
+    template < class T, size_t M, size_t N > constexpr
     const typename matrix<T,M,N>::scalar_t*
     matrix<T,M,N>::data() const
         {
@@ -213,7 +254,7 @@ namespace tumbo
         }
 
 
-    template < class T, size_t M, size_t N >
+    template < class T, size_t M, size_t N > constexpr
     typename matrix<T,M,N>::scalar_t*
     matrix<T,M,N>::begin()
         {
@@ -222,7 +263,7 @@ namespace tumbo
 
 
 
-    template < class T, size_t M, size_t N >
+    template < class T, size_t M, size_t N > constexpr
     const typename matrix<T,M,N>::scalar_t*
     matrix<T,M,N>::begin() const
         {
@@ -230,7 +271,7 @@ namespace tumbo
         }
 
 
-    template < class T, size_t M, size_t N >
+    template < class T, size_t M, size_t N > constexpr
     typename matrix<T,M,N>::scalar_t*
     matrix<T,M,N>::end()
         {
@@ -238,7 +279,7 @@ namespace tumbo
         }
 
 
-    template < class T, size_t M, size_t N >
+    template < class T, size_t M, size_t N > constexpr
     const typename matrix<T,M,N>::scalar_t*
     matrix<T,M,N>::end() const
         {
@@ -0,0 +1,371 @@
+#ifndef TUMBO_MATRIX_ARRAY_HPP
+#define TUMBO_MATRIX_ARRAY_HPP
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include "matrix.hpp"
+#include "utility.hpp"
+#include "simd.hpp"
+
+/**
+    \file matrix_array.hpp
+    \brief Structure of arrays container for many equally sized matrices.
+
+    A matrix_array<T,M,N> stores element (i,j) of all its matrices in one
+    contiguous stream, so the batch operations below process
+    simd::batch_width<T> matrices per instruction: eight fvec3s are
+    normalized in one AVX pass instead of one at a time.
+
+    Indexing returns a proxy that converts to and assigns from
+    matrix<T,M,N>. Streams are padded to a whole number of packets; the
+    batch operations also compute the padding lanes, whose values are
+    unspecified.
+*/
+
+namespace tumbo
+    {
+
+    template< class T, size_t M, size_t N >
+    class matrix_array
+        {
+        public:
+            typedef T scalar_t;
+            typedef matrix<T,M,N> value_type;
+
+            static constexpr size_t lanes = simd::batch_width<T>::value;
+
+            /// Proxy for one matrix in the array.
+            class reference
+                {
+                public:
+                    reference( matrix_array& a, size_t i ) :
+                        a_( a ), i_( i )
+                        {}
+
+                    operator value_type () const
+                        { return a_.get( i_ ); }
+
+                    reference&
+                    operator = ( const value_type& A )
+                        { a_.set( i_, A ); return *this; }
+
+                    reference&
+                    operator = ( const reference& r )
+                        { a_.set( i_, value_type(r) ); return *this; }
+
+                    T&
+                    operator() ( size_t i, size_t j )
+                        { return a_.stream( j + i*N )[ i_ ]; }
+
+                    T&
+                    operator[] ( size_t c )
+                        { return a_.stream( c )[ i_ ]; }
+
+                private:
+                    matrix_array& a_;
+                    size_t i_;
+                };
+
+            matrix_array() :
+                size_( 0 ), stride_( 0 )
+                {}
+
+            explicit
+            matrix_array( size_t n ) :
+                size_( 0 ), stride_( 0 )
+                {
+                resize( n );
+                }
+
+            template< class Iter >
+            matrix_array( Iter first, Iter end ) :
+                size_( 0 ), stride_( 0 )
+                {
+                reserve( size_t( std::distance( first, end ) ) );
+                for( ; first != end; ++first )
+                    push_back( *first );
+                }
+
+            size_t
+            size() const
+                { return size_; }
+
+            bool
+            empty() const
+                { return size_ == 0; }
+
+            /// Distance between the streams, a multiple of lanes.
+            size_t
+            stride() const
+                { return stride_; }
+
+            static constexpr size_t
+            components()
+                { return M*N; }
+
+            void
+            reserve( size_t n )
+                {
+                if( n <= stride_ )
+                    return;
+                size_t stride = ( n + lanes-1 ) / lanes * lanes;
+                std::vector<T> data( stride * M*N, T(0) );
+                for( size_t c=0; c < M*N; ++c )
+                    std::copy( stream(c), stream(c) + size_,
+                               data.begin() + c*stride );
+                data_.swap( data );
+                stride_ = stride;
+                }
+
+            /// New matrices are zeroed.
+            /** The batch operations also write the padding past size(),
+                so growing zeroes the new range rather than trusting it. */
+            void
+            resize( size_t n )
+                {
+                reserve( n );
+                size_t lo = std::min( n, size_ ), hi = std::max( n, size_ );
+                for( size_t c=0; c < M*N; ++c )
+                    std::fill( stream(c) + lo, stream(c) + hi, T(0) );
+                size_ = n;
+                }
+
+            void
+            clear()
+                { resize( 0 ); }
+
+            void
+            push_back( const value_type& A )
+                {
+                if( size_ == stride_ )
+                    reserve( stride_ == 0 ? lanes : stride_*2 );
+                set( size_++, A );
+                }
+
+            value_type
+            get( size_t i ) const
+                {
+                TUMBO_ASSERT( i < size_ );
+                value_type A;
+                for( size_t c=0; c < M*N; ++c )
+                    A[c] = stream(c)[i];
+                return A;
+                }
+
+            void
+            set( size_t i, const value_type& A )
+                {
+                TUMBO_ASSERT( i < size_ );
+                for( size_t c=0; c < M*N; ++c )
+                    stream(c)[i] = A[c];
+                }
+
+            reference
+            operator[] ( size_t i )
+                { return reference( *this, i ); }
+
+            value_type
+            operator[] ( size_t i ) const
+                { return get( i ); }
+
+            /// Element c, in row major order, of every matrix.
+            T*
+            stream( size_t c )
+                { return data_.data() + c*stride_; }
+
+            const T*
+            stream( size_t c ) const
+                { return data_.data() + c*stride_; }
+
+        private:
+            std::vector<T> data_;
+            size_t size_;
+            size_t stride_;
+        };
+
+
+    /* Batch operations. Each loops over whole packets of lanes matrices,
+        loading component c of all of them from stream c. */
+
+    template< class T >
+    using batch_packet_ = simd::packet< T, simd::batch_width<T>::value >;
+
+
+    template< class T, size_t M, size_t N > matrix_array<T,M,N>
+    operator + ( const matrix_array<T,M,N>& a, const matrix_array<T,M,N>& b )
+        {
+        TUMBO_ASSERT( a.size() == b.size() );
+        typedef batch_packet_<T> P;
+        matrix_array<T,M,N> r( a.size() );
+        for( size_t c=0; c < M*N; ++c )
+        for( size_t i=0; i < a.size(); i += P::width() )
+            ( P::load( a.stream(c)+i ) + P::load( b.stream(c)+i ) )
+                .store( r.stream(c)+i );
+        return r;
+        }
+
+
+    template< class T, size_t M, size_t N > matrix_array<T,M,N>
+    operator - ( const matrix_array<T,M,N>& a, const matrix_array<T,M,N>& b )
+        {
+        TUMBO_ASSERT( a.size() == b.size() );
+        typedef batch_packet_<T> P;
+        matrix_array<T,M,N> r( a.size() );
+        for( size_t c=0; c < M*N; ++c )
+        for( size_t i=0; i < a.size(); i += P::width() )
+            ( P::load( a.stream(c)+i ) - P::load( b.stream(c)+i ) )
+                .store( r.stream(c)+i );
+        return r;
+        }
+
+
+    /// Scales every matrix by s.
+    template< class T, size_t M, size_t N > matrix_array<T,M,N>
+    operator * ( const matrix_array<T,M,N>& a, T s )
+        {
+        typedef batch_packet_<T> P;
+        P ps = P::broadcast( s );
+        matrix_array<T,M,N> r( a.size() );
+        for( size_t c=0; c < M*N; ++c )
+        for( size_t i=0; i < a.size(); i += P::width() )
+            ( P::load( a.stream(c)+i ) * ps ).store( r.stream(c)+i );
+        return r;
+        }
+
+
+    template< class T, size_t M, size_t N > matrix_array<T,M,N>
+    operator * ( T s, const matrix_array<T,M,N>& a )
+        {
+        return a * s;
+        }
+
+
+    /// A times every vector in v.
+    template< class T, size_t M, size_t N > matrix_array<T,M,1>
+    operator * ( const matrix<T,M,N>& A, const matrix_array<T,N,1>& v )
+        {
+        typedef batch_packet_<T> P;
+        P a[M*N];
+        for( size_t c=0; c < M*N; ++c )
+            a[c] = P::broadcast( A[c] );
+
+        matrix_array<T,M,1> r( v.size() );
+        for( size_t i=0; i < v.size(); i += P::width() )
+            {
+            P x[N];
+            for( size_t j=0; j<N; ++j )
+                x[j] = P::load( v.stream(j)+i );
+            for( size_t k=0; k<M; ++k )
+                {
+                P sum = a[k*N] * x[0];
+                for( size_t j=1; j<N; ++j )
+                    sum = sum + a[k*N+j] * x[j];
+                sum.store( r.stream(k)+i );
+                }
+            }
+        return r;
+        }
+
+
+    /// Multiplies the matrices of a and b pairwise.
+    template< class T, size_t M, size_t N, size_t P_ > matrix_array<T,M,P_>
+    operator * ( const matrix_array<T,M,N>& a, const matrix_array<T,N,P_>& b )
+        {
+        TUMBO_ASSERT( a.size() == b.size() );
+        typedef batch_packet_<T> P;
+        matrix_array<T,M,P_> r( a.size() );
+        for( size_t i=0; i < a.size(); i += P::width() )
+        for( size_t m=0; m<M; ++m )
+        for( size_t p=0; p<P_; ++p )
+            {
+            P sum = P::load( a.stream(m*N)+i ) * P::load( b.stream(p)+i );
+            for( size_t k=1; k<N; ++k )
+                sum = sum + P::load( a.stream(m*N+k)+i ) *
+                            P::load( b.stream(k*P_+p)+i );
+            sum.store( r.stream(m*P_+p)+i );
+            }
+        return r;
+        }
+
+
+    template< class T, size_t M, size_t N > matrix_array<T,1,1>
+    dot( const matrix_array<T,M,N>& a, const matrix_array<T,M,N>& b )
+        {
+        static_assert( M == 1 || N == 1, "Input must be vectors." );
+        TUMBO_ASSERT( a.size() == b.size() );
+        typedef batch_packet_<T> P;
+        matrix_array<T,1,1> r( a.size() );
+        for( size_t i=0; i < a.size(); i += P::width() )
+            {
+            P sum = P::load( a.stream(0)+i ) * P::load( b.stream(0)+i );
+            for( size_t c=1; c < M*N; ++c )
+                sum = sum + P::load( a.stream(c)+i ) * P::load( b.stream(c)+i );
+            sum.store( r.stream(0)+i );
+            }
+        return r;
+        }
+
+
+    template< class T > matrix_array<T,3,1>
+    cross( const matrix_array<T,3,1>& a, const matrix_array<T,3,1>& b )
+        {
+        TUMBO_ASSERT( a.size() == b.size() );
+        typedef batch_packet_<T> P;
+        matrix_array<T,3,1> r( a.size() );
+        for( size_t i=0; i < a.size(); i += P::width() )
+            {
+            P ax = P::load( a.stream(0)+i ), ay = P::load( a.stream(1)+i ),
+              az = P::load( a.stream(2)+i );
+            P bx = P::load( b.stream(0)+i ), by = P::load( b.stream(1)+i ),
+              bz = P::load( b.stream(2)+i );
+            ( ay*bz - az*by ).store( r.stream(0)+i );
+            ( az*bx - ax*bz ).store( r.stream(1)+i );
+            ( ax*by - ay*bx ).store( r.stream(2)+i );
+            }
+        return r;
+        }
+
+
+    template< class T, size_t M, size_t N > matrix_array<T,1,1>
+    length_sq( const matrix_array<T,M,N>& a )
+        {
+        return dot( a, a );
+        }
+
+
+    template< class T, size_t M, size_t N > matrix_array<T,1,1>
+    length( const matrix_array<T,M,N>& a )
+        {
+        static_assert( M == 1 || N == 1,
+           "Length is a vector property. matrix is not a vector." );
+        typedef batch_packet_<T> P;
+        matrix_array<T,1,1> r = dot( a, a );
+        for( size_t i=0; i < a.size(); i += P::width() )
+            sqrt( P::load( r.stream(0)+i ) ).store( r.stream(0)+i );
+        return r;
+        }
+
+
+    /// Normalizes every matrix. Zero length ones give NaNs, as normalize.
+    template< class T, size_t M, size_t N > matrix_array<T,M,N>
+    normalize( const matrix_array<T,M,N>& a )
+        {
+        static_assert( M == 1 || N == 1, "Can only normalize a vector" );
+        typedef batch_packet_<T> P;
+        matrix_array<T,M,N> r( a.size() );
+        for( size_t i=0; i < a.size(); i += P::width() )
+            {
+            P sum = P::load( a.stream(0)+i ) * P::load( a.stream(0)+i );
+            for( size_t c=1; c < M*N; ++c )
+                sum = sum + P::load( a.stream(c)+i ) * P::load( a.stream(c)+i );
+            P inv = P::broadcast( T(1) ) / sqrt( sum );
+            for( size_t c=0; c < M*N; ++c )
+                ( P::load( a.stream(c)+i ) * inv ).store( r.stream(c)+i );
+            }
+        return r;
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_MATRIX_ARRAY_HPP
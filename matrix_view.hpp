@@ -0,0 +1,339 @@
+#ifndef TUMBO_MATRIX_VIEW_HPP
+#define TUMBO_MATRIX_VIEW_HPP
+
+#include <cmath>
+#include <type_traits>
+#include "matrix.hpp"
+#include "expression.hpp"
+#include "utility.hpp"
+
+/**
+    \file matrix_view.hpp
+    \brief Non-owning matrices over external memory.
+
+    A matrix_view<T,M,N> reads element (i,j) at data[ i*row_stride +
+    j*col_stride ], so it can point into a matrix, an interleaved vertex
+    buffer or a mapped file without copying. T may be const for read-only
+    views. The position of vertex k in a buffer with eight floats per
+    vertex is
+        matrix_view<float,3,1> pos( buffer + k*8, 1 );
+
+    Views are element-wise expressions: they mix with matrices in + - * /,
+    convert to matrix through its expression constructor and eval(), and
+    assigning a matrix or expression to a view writes through it. dot,
+    cross, length_sq, length, normalize, transpose, row, column, submatrix
+    and operator* accept any mix of views and matrices. row_view,
+    column_view and subview return views instead of copies.
+*/
+
+namespace tumbo
+    {
+
+    template< class T, size_t M, size_t N >
+    class matrix_view : public expression< matrix_view<T,M,N> >
+        {
+        public:
+            typedef typename std::remove_const<T>::type scalar_t;
+
+            static constexpr bool vectorizable = false;
+
+            /// Views M by N elements starting at data.
+            /** The defaults describe a densely packed row major matrix. */
+            constexpr explicit
+            matrix_view( T* data, size_t row_stride = N, size_t col_stride = 1 ) :
+                data_( data ), row_stride_( row_stride ), col_stride_( col_stride )
+                {}
+
+            /// A view of T converts to a view of const T.
+            template< class S, class = typename std::enable_if<
+                std::is_convertible<S*,T*>::value >::type > constexpr
+            matrix_view( const matrix_view<S,M,N>& other ) :
+                data_( other.data() ),
+                row_stride_( other.row_stride() ),
+                col_stride_( other.col_stride() )
+                {}
+
+            /// Copies the elements of the other view, the view is not rebound.
+            constexpr const matrix_view&
+            operator = ( const matrix_view& other ) const
+                {
+                return assign( other );
+                }
+
+            template< class E > constexpr const matrix_view&
+            operator = ( const expression<E>& e ) const
+                {
+                return assign( e.self() );
+                }
+
+            constexpr const matrix_view&
+            operator = ( const matrix<scalar_t,M,N>& A ) const
+                {
+                return assign( A );
+                }
+
+            /// Writes element i of X to element i of the view.
+            /** Elements are read before they are written, one at a time, so
+                X may only overlap the view if it reads the same element. */
+            template< class X > constexpr const matrix_view&
+            assign( const X& x ) const
+                {
+                static_assert( X::height() == M && X::width() == N,
+                    "Assigned value must be of equal size." );
+                for( size_t i=0; i < M*N; ++i )
+                    (*this)[i] = static_cast<scalar_t>( x[i] );
+                return *this;
+                }
+
+            constexpr T&
+            operator() ( size_t i, size_t j ) const
+                {
+                TUMBO_ASSERT( i < M )
+                TUMBO_ASSERT( j < N )
+                return data_[ i*row_stride_ + j*col_stride_ ];
+                }
+
+            /// Element i in row major order.
+            constexpr T&
+            operator[] ( size_t i ) const
+                {
+                TUMBO_ASSERT( i < M*N );
+                return data_[ (i/N)*row_stride_ + (i%N)*col_stride_ ];
+                }
+
+            constexpr T*
+            data() const
+                { return data_; }
+
+            constexpr size_t
+            row_stride() const
+                { return row_stride_; }
+
+            constexpr size_t
+            col_stride() const
+                { return col_stride_; }
+
+            static constexpr size_t
+            size()
+                { return M*N; }
+
+            static constexpr size_t
+            height()
+                { return M; }
+
+            static constexpr size_t
+            width()
+                { return N; }
+
+        private:
+            T* data_;
+            size_t row_stride_;
+            size_t col_stride_;
+        };
+
+
+    template< class X >
+    struct is_matrix_view : std::false_type
+        {};
+
+    template< class T, size_t M, size_t N >
+    struct is_matrix_view< matrix_view<T,M,N> > : std::true_type
+        {};
+
+
+    /// Matrices and views, the operands of the functions below.
+    template< class X >
+    struct is_matrix_like : is_matrix_view<X>
+        {};
+
+    template< class T, size_t M, size_t N >
+    struct is_matrix_like< matrix<T,M,N> > : std::true_type
+        {};
+
+
+    /* Enables the view overloads when all operands are matrices or views
+        and at least one is a view, leaving matrix-only calls to the
+        overloads in utility.hpp. */
+    template< class R, class... X >
+    struct enable_view_ : std::enable_if<
+        ( is_matrix_like<X>::value && ... ) &&
+        ( is_matrix_view<X>::value || ... ), R >
+        {};
+
+
+    template< class T, size_t M, size_t N > constexpr matrix_view<T,M,N>
+    make_view( matrix<T,M,N>& A )
+        {
+        return matrix_view<T,M,N>( A.begin() );
+        }
+
+    template< class T, size_t M, size_t N > constexpr matrix_view<const T,M,N>
+    make_view( const matrix<T,M,N>& A )
+        {
+        return matrix_view<const T,M,N>( A.data() );
+        }
+
+    template< class T, size_t M, size_t N > constexpr matrix_view<T,M,N>
+    make_view( const matrix_view<T,M,N>& v )
+        {
+        return v;
+        }
+
+
+    /// View of the RM by RN block of A with (oi,oj) as its top left element.
+    /** A is a matrix lvalue or a view. */
+    template< size_t RM, size_t RN, class X > constexpr auto
+    subview( X&& A, size_t oi = 0, size_t oj = 0 )
+        {
+        static_assert( std::is_lvalue_reference<X>::value ||
+                       is_matrix_view< typename std::decay<X>::type >::value,
+            "Cannot view a temporary matrix." );
+        auto v = make_view( A );
+        typedef typename std::remove_pointer<decltype( v.data() )>::type T;
+        static_assert( RM <= decltype(v)::height() && RN <= decltype(v)::width(),
+            "Subview must fit inside the viewed matrix." );
+        TUMBO_ASSERT( oi+RM <= v.height() && oj+RN <= v.width() );
+        return matrix_view<T,RM,RN>( &v(oi,oj), v.row_stride(), v.col_stride() );
+        }
+
+
+    /// View of row i of a matrix or view.
+    template< class X > constexpr auto
+    row_view( X&& A, size_t i )
+        {
+        static_assert( std::is_lvalue_reference<X>::value ||
+                       is_matrix_view< typename std::decay<X>::type >::value,
+            "Cannot view a temporary matrix." );
+        auto v = make_view( A );
+        return subview< 1, decltype(v)::width() >( v, i, 0 );
+        }
+
+
+    /// View of column j of a matrix or view.
+    template< class X > constexpr auto
+    column_view( X&& A, size_t j )
+        {
+        static_assert( std::is_lvalue_reference<X>::value ||
+                       is_matrix_view< typename std::decay<X>::type >::value,
+            "Cannot view a temporary matrix." );
+        auto v = make_view( A );
+        return subview< decltype(v)::height(), 1 >( v, 0, j );
+        }
+
+
+    template< class T, size_t M, size_t N > constexpr
+    matrix<typename std::remove_const<T>::type,1,N>
+    row( const matrix_view<T,M,N>& v, size_t i )
+        {
+        return matrix<typename std::remove_const<T>::type,1,N>( row_view( v, i ) );
+        }
+
+
+    template< class T, size_t M, size_t N > constexpr
+    matrix<typename std::remove_const<T>::type,M,1>
+    column( const matrix_view<T,M,N>& v, size_t j )
+        {
+        return matrix<typename std::remove_const<T>::type,M,1>( column_view( v, j ) );
+        }
+
+
+    template< size_t RM, size_t RN, class T, size_t M, size_t N > constexpr
+    matrix<typename std::remove_const<T>::type,RM,RN>
+    submatrix( const matrix_view<T,M,N>& v, size_t oi = 0, size_t oj = 0 )
+        {
+        return matrix<typename std::remove_const<T>::type,RM,RN>(
+            subview<RM,RN>( v, oi, oj ) );
+        }
+
+
+    template< class T, size_t M, size_t N > constexpr
+    matrix<typename std::remove_const<T>::type,N,M>
+    transpose( const matrix_view<T,M,N>& v )
+        {
+        // Swapping the strides transposes the view.
+        return matrix<typename std::remove_const<T>::type,N,M>(
+            matrix_view<T,N,M>( v.data(), v.col_stride(), v.row_stride() ) );
+        }
+
+
+    template< class A, class B > constexpr
+    typename enable_view_< typename std::common_type<
+        typename A::scalar_t, typename B::scalar_t >::type, A, B >::type
+    dot( const A& a, const B& b )
+        {
+        static_assert( (A::height() == 1 || A::width() == 1) &&
+                       (B::height() == 1 || B::width() == 1),
+            "Input must be vectors." );
+        static_assert( A::size() == B::size(),
+            "Vectors must be equal in length." );
+        typename std::common_type<
+            typename A::scalar_t, typename B::scalar_t >::type sum = 0;
+        for( size_t i=0; i < A::size(); ++i )
+            sum += a[i] * b[i];
+        return sum;
+        }
+
+
+    template< class A, class B > constexpr
+    typename enable_view_< matrix< typename A::scalar_t, 3, 1 >, A, B >::type
+    cross( const A& a, const B& b )
+        {
+        static_assert( A::size() == 3 && B::size() == 3,
+            "Cross product is only defined for 3D vectors." );
+        return { a[1]*b[2] - a[2]*b[1],
+                 a[2]*b[0] - a[0]*b[2],
+                 a[0]*b[1] - a[1]*b[0] };
+        }
+
+
+    template< class T, size_t M, size_t N > constexpr
+    typename std::remove_const<T>::type
+    length_sq( const matrix_view<T,M,N>& v )
+        {
+        return dot( v, v );
+        }
+
+
+    template< class T, size_t M, size_t N >
+    decltype( std::sqrt( std::declval< typename std::remove_const<T>::type >() ) )
+    length( const matrix_view<T,M,N>& v )
+        {
+        return std::sqrt( length_sq( v ) );
+        }
+
+
+    /// Returns the normalized vector; assign it to v to normalize in place.
+    template< class T, size_t M, size_t N >
+    matrix< typename std::remove_const<T>::type, M, N >
+    normalize( const matrix_view<T,M,N>& v )
+        {
+        static_assert( M == 1 || N == 1, "Can only normalize a vector" );
+        return eval( v / length( v ) );
+        }
+
+
+    /// Matrix product where either operand is a view.
+    template< class A, class B > constexpr
+    typename enable_view_< matrix< typename std::common_type<
+        typename A::scalar_t, typename B::scalar_t >::type,
+        A::height(), B::width() >, A, B >::type
+    operator * ( const A& a, const B& b )
+        {
+        static_assert( A::width() == B::height(),
+            "Matrix product needs matching inner sizes." );
+        typedef typename std::common_type<
+            typename A::scalar_t, typename B::scalar_t >::type R_t;
+        matrix< R_t, A::height(), B::width() > R{};
+        for( size_t i=0; i < A::height(); ++i )
+        for( size_t k=0; k < A::width(); ++k )
+            {
+            R_t aik = a( i, k );
+            for( size_t j=0; j < B::width(); ++j )
+                R( i, j ) += aik * b( k, j );
+            }
+        return R;
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_MATRIX_VIEW_HPP
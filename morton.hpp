@@ -0,0 +1,472 @@
+#ifndef TUMBO_MORTON_HPP
+#define TUMBO_MORTON_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "parallel.hpp"
+
+/**
+    \file morton.hpp
+    \brief Morton and Hilbert keys, and sorting along them.
+
+    A key is computed from a point by quantizing it in a bounding box,
+    usually the calculate_aabb() of the points, to a grid of 2^bits cells
+    per axis and mapping the cell to its position along a space filling
+    curve. The keys are 32 or 64 bits, giving curve_bits<Key,D>::value bits
+    per axis: 16 and 32 in 2D, 10 and 21 in 3D. Boxes are keyed by their
+    center().
+
+    The Morton (Z-order) key interleaves the bits of the cell coordinates,
+    x lowest. The Hilbert key comes from Skilling's transform and is
+    slower to compute, but consecutive cells along it are always
+    neighbours, so a range of keys covers a more compact region.
+
+    radix_sort sorts keys with a payload, eight bits per pass and skipping
+    the bytes in which all keys agree. spatial_sort uses it to reorder
+    point and box arrays along a curve, which keeps things that are close
+    in space close in memory.
+*/
+
+namespace tumbo
+    {
+
+    enum class curve
+        {
+        morton,
+        hilbert
+        };
+
+
+    /// Bits per axis of a Key over D axes.
+    template<class Key, size_t D>
+    struct curve_bits
+        {
+        static constexpr unsigned value = unsigned( 8*sizeof(Key) / D );
+        };
+
+
+    /* Moves bit i of x to bit D*i. */
+    template<size_t D> inline uint64_t
+    spread_bits_( uint64_t x )
+        {
+        uint64_t r = 0;
+        for( unsigned i=0; i*D < 64; ++i )
+            r |= ( x >> i & 1 ) << ( i*D );
+        return r;
+        }
+
+    template<> inline uint64_t
+    spread_bits_<1>( uint64_t x )
+        {
+        return x;
+        }
+
+    template<> inline uint64_t
+    spread_bits_<2>( uint64_t x )
+        {
+        x &= 0xFFFFFFFFull;
+        x = ( x | x << 16 ) & 0x0000FFFF0000FFFFull;
+        x = ( x | x << 8 )  & 0x00FF00FF00FF00FFull;
+        x = ( x | x << 4 )  & 0x0F0F0F0F0F0F0F0Full;
+        x = ( x | x << 2 )  & 0x3333333333333333ull;
+        x = ( x | x << 1 )  & 0x5555555555555555ull;
+        return x;
+        }
+
+    template<> inline uint64_t
+    spread_bits_<3>( uint64_t x )
+        {
+        x &= 0x1FFFFFull;
+        x = ( x | x << 32 ) & 0x001F00000000FFFFull;
+        x = ( x | x << 16 ) & 0x001F0000FF0000FFull;
+        x = ( x | x << 8 )  & 0x100F00F00F00F00Full;
+        x = ( x | x << 4 )  & 0x10C30C30C30C30C3ull;
+        x = ( x | x << 2 )  & 0x1249249249249249ull;
+        return x;
+        }
+
+
+    /// Morton key of a grid cell, interleaving the bits with x lowest.
+    /** Only the low curve_bits<Key,D> bits of each coordinate are used. */
+    template<class Key, size_t D> Key
+    morton_code( const vec<uint32_t,D>& cell )
+        {
+        constexpr unsigned bits = curve_bits<Key,D>::value;
+        constexpr uint64_t mask = bits >= 32 ? 0xFFFFFFFFull : ( uint64_t(1) << bits ) - 1;
+        uint64_t key = 0;
+        for( size_t d=0; d<D; ++d )
+            key |= spread_bits_<D>( cell[d] & mask ) << d;
+        return Key( key );
+        }
+
+
+    /* Skilling, "Programming the Hilbert curve" (2004): turns the cell
+        coordinates x into the transposed Hilbert index, whose interleaved
+        bits are the key, for L cells at a time. The steps of one cell
+        depend on each other, so L > 1 lets them overlap. The bit tests
+        select with masks; as branches they mispredict half the time. */
+    template<size_t D, size_t L> void
+    hilbert_transpose_( uint32_t (&x)[D][L], unsigned bits )
+        {
+        for( unsigned b = bits-1; b > 0; --b )
+            {
+            uint32_t p = ( uint32_t(1) << b ) - 1;
+            for( size_t d=0; d<D; ++d )
+            for( size_t l=0; l<L; ++l )
+                {
+                // Invert the low bits of x[0] if bit b is set, else
+                // exchange them with those of x[d].
+                uint32_t set = 0 - ( x[d][l] >> b & 1 );
+                x[0][l] ^= p & set;
+                uint32_t t = ( x[0][l] ^ x[d][l] ) & p & ~set;
+                x[0][l] ^= t;
+                x[d][l] ^= t;
+                }
+            }
+        for( size_t d=1; d<D; ++d )
+        for( size_t l=0; l<L; ++l )
+            x[d][l] ^= x[d-1][l];
+        for( size_t l=0; l<L; ++l )
+            {
+            uint32_t t = 0;
+            for( unsigned b = bits-1; b > 0; --b )
+                t ^= ( ( uint32_t(1) << b ) - 1 ) & ( 0 - ( x[D-1][l] >> b & 1 ) );
+            for( size_t d=0; d<D; ++d )
+                x[d][l] ^= t;
+            }
+        }
+
+
+    /* Interleaves a transposed Hilbert index, x[0] holding the most
+        significant bit of every group. */
+    template<class Key, size_t D, size_t L> Key
+    hilbert_interleave_( const uint32_t (&x)[D][L], size_t l )
+        {
+        uint64_t key = 0;
+        for( size_t d=0; d<D; ++d )
+            key |= spread_bits_<D>( x[d][l] ) << ( D-1-d );
+        return Key( key );
+        }
+
+
+    /// Hilbert key of a cell of a grid with 2^bits cells per axis.
+    /** bits is at most curve_bits<Key,D>, which is the default. Cells
+        with consecutive keys share a face. */
+    template<class Key, size_t D> Key
+    hilbert_code( const vec<uint32_t,D>& cell,
+                  unsigned bits = curve_bits<Key,D>::value )
+        {
+        TUMBO_ASSERT( ( bits >= 1 && bits <= curve_bits<Key,D>::value ) );
+        uint32_t x[D][1];
+        uint32_t mask = bits >= 32 ? ~uint32_t(0) : ( uint32_t(1) << bits ) - 1;
+        for( size_t d=0; d<D; ++d )
+            x[d][0] = cell[d] & mask;
+        hilbert_transpose_( x, bits );
+        return hilbert_interleave_<Key>( x, 0 );
+        }
+
+
+    /* Maps points in bounds to cells of the curve grid. */
+    template<class Key, class T, size_t D>
+    struct curve_grid_
+        {
+        static_assert( std::is_floating_point<T>::value,
+                       "Keys are made from float or double points" );
+
+        T lo[D];
+        T scale[D];
+        T last;
+
+        explicit
+        curve_grid_( const aabb<T,D>& bounds )
+            {
+            constexpr unsigned bits = curve_bits<Key,D>::value;
+            T cells = T( uint64_t(1) << bits );
+            // Below cells, so it converts to the last cell even where
+            // cells - 1 would round up to cells.
+            last = std::nextafter( cells, T(0) );
+            for( size_t d=0; d<D; ++d )
+                {
+                T extent = bounds(d,1) - bounds(d,0);
+                lo[d] = bounds(d,0);
+                scale[d] = extent > 0 ? cells / extent : T(0);
+                }
+            }
+
+        vec<uint32_t,D>
+        cell( const vec<T,D>& p ) const
+            {
+            vec<uint32_t,D> c;
+            for( size_t d=0; d<D; ++d )
+                {
+                T x = ( p[d] - lo[d] ) * scale[d];
+                x = x < 0 ? T(0) : x;
+                x = x > last ? last : x;
+                c[d] = uint32_t( x );
+                }
+            return c;
+            }
+
+        Key
+        key( const vec<T,D>& p, curve c ) const
+            {
+            return c == curve::morton ? morton_code<Key,D>( cell( p ) )
+                                      : hilbert_code<Key,D>( cell( p ) );
+            }
+        };
+
+
+    /// Morton key of p in bounds. Points outside go to the nearest cell.
+    template<class Key, class T, size_t D> Key
+    morton_code( const vec<T,D>& p, const aabb<T,D>& bounds )
+        {
+        return curve_grid_<Key,T,D>( bounds ).key( p, curve::morton );
+        }
+
+
+    /// Morton key of the center of a box in bounds.
+    template<class Key, class T, size_t D> Key
+    morton_code( const aabb<T,D>& box, const aabb<T,D>& bounds )
+        {
+        return morton_code<Key>( center( box ), bounds );
+        }
+
+
+    /// Hilbert key of p in bounds. Points outside go to the nearest cell.
+    template<class Key, class T, size_t D> Key
+    hilbert_code( const vec<T,D>& p, const aabb<T,D>& bounds )
+        {
+        return curve_grid_<Key,T,D>( bounds ).key( p, curve::hilbert );
+        }
+
+
+    /// Hilbert key of the center of a box in bounds.
+    template<class Key, class T, size_t D> Key
+    hilbert_code( const aabb<T,D>& box, const aabb<T,D>& bounds )
+        {
+        return hilbert_code<Key>( center( box ), bounds );
+        }
+
+
+    /* keys[i] = the key of point( i ) in bounds along c, for i in
+        [first,last). Hilbert keys are made eight at a time. */
+    template<class Key, class T, size_t D, class Point> void
+    curve_keys_( curve c, const curve_grid_<Key,T,D>& grid, Point point,
+                 size_t first, size_t last, Key* keys )
+        {
+        if( c == curve::morton )
+            {
+            for( size_t i = first; i < last; ++i )
+                keys[i] = morton_code<Key,D>( grid.cell( point( i ) ) );
+            return;
+            }
+        constexpr size_t L = 8;
+        uint32_t x[D][L];
+        for( size_t i = first; i < last; i += L )
+            {
+            size_t count = std::min( L, last - i );
+            for( size_t l=0; l<L; ++l )
+                {
+                vec<uint32_t,D> cell = grid.cell( point( i + ( l < count ? l : 0 ) ) );
+                for( size_t d=0; d<D; ++d )
+                    x[d][l] = cell[d];
+                }
+            hilbert_transpose_( x, curve_bits<Key,D>::value );
+            for( size_t l=0; l < count; ++l )
+                keys[i+l] = hilbert_interleave_<Key>( x, l );
+            }
+        }
+
+
+    /// keys[i] = the key of points[i] in bounds along c.
+    template<class Key, class T, size_t D> void
+    curve_keys( curve c, const vec<T,D>* points, size_t n,
+                const aabb<T,D>& bounds, Key* keys, size_t threads = 1 )
+        {
+        curve_grid_<Key,T,D> grid( bounds );
+        parallel_for( 0, n, threads, [&]( size_t first, size_t last )
+            {
+            curve_keys_( c, grid, [&]( size_t i ) { return points[i]; },
+                         first, last, keys );
+            }, 1 << 12 );
+        }
+
+
+    /// keys[i] = the key of the center of boxes[i] in bounds along c.
+    template<class Key, class T, size_t D> void
+    curve_keys( curve c, const aabb<T,D>* boxes, size_t n,
+                const aabb<T,D>& bounds, Key* keys, size_t threads = 1 )
+        {
+        curve_grid_<Key,T,D> grid( bounds );
+        parallel_for( 0, n, threads, [&]( size_t first, size_t last )
+            {
+            curve_keys_( c, grid, [&]( size_t i ) { return center( boxes[i] ); },
+                         first, last, keys );
+            }, 1 << 12 );
+        }
+
+
+    /// Sorts keys, moving values along, by least significant digit first.
+    /** Stable. Each pass counts the digits of contiguous chunks in
+        parallel and scatters them in parallel, the chunks of a digit in
+        order. Bytes that are the same in all keys are not sorted on. */
+    template<class Key, class Value> void
+    radix_sort( Key* keys, Value* values, size_t n, size_t threads = 1 )
+        {
+        static_assert( std::is_unsigned<Key>::value, "Keys are unsigned integers" );
+        if( n < 2 )
+            return;
+        size_t chunks = std::min( thread_count( threads ),
+                                  std::max<size_t>( n >> 14, 1 ) );
+        std::vector<size_t> bounds( chunks+1 );
+        for( size_t c=0; c <= chunks; ++c )
+            bounds[c] = n*c / chunks;
+
+        // Bits that differ between some keys.
+        std::vector<Key> any( chunks, 0 ), all( chunks, Key(~Key(0)) );
+        parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+            {
+            for( size_t c=c0; c < c1; ++c )
+                for( size_t i = bounds[c]; i < bounds[c+1]; ++i )
+                    {
+                    any[c] |= keys[i];
+                    all[c] &= keys[i];
+                    }
+            } );
+        for( size_t c=1; c < chunks; ++c )
+            {
+            any[0] |= any[c];
+            all[0] &= all[c];
+            }
+        Key varying = any[0] ^ all[0];
+
+        std::vector<Key> key_buffer( n );
+        std::vector<Value> value_buffer( n );
+        Key* k0 = keys, *k1 = key_buffer.data();
+        Value* v0 = values, *v1 = value_buffer.data();
+        std::vector<size_t> offsets( chunks*256 );
+        for( unsigned shift = 0; shift < 8*sizeof(Key); shift += 8 )
+            {
+            if( ( varying >> shift & 0xFF ) == 0 )
+                continue;
+            parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+                {
+                for( size_t c=c0; c < c1; ++c )
+                    {
+                    size_t* count = &offsets[c*256];
+                    std::fill( count, count+256, size_t(0) );
+                    for( size_t i = bounds[c]; i < bounds[c+1]; ++i )
+                        ++count[ k0[i] >> shift & 0xFF ];
+                    }
+                } );
+            size_t sum = 0;
+            for( size_t digit=0; digit < 256; ++digit )
+                for( size_t c=0; c < chunks; ++c )
+                    {
+                    size_t count = offsets[c*256 + digit];
+                    offsets[c*256 + digit] = sum;
+                    sum += count;
+                    }
+            parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+                {
+                for( size_t c=c0; c < c1; ++c )
+                    {
+                    size_t* next = &offsets[c*256];
+                    for( size_t i = bounds[c]; i < bounds[c+1]; ++i )
+                        {
+                        size_t j = next[ k0[i] >> shift & 0xFF ]++;
+                        k1[j] = k0[i];
+                        v1[j] = v0[i];
+                        }
+                    }
+                } );
+            std::swap( k0, k1 );
+            std::swap( v0, v1 );
+            }
+        if( k0 != keys )
+            {
+            std::copy( k0, k0+n, keys );
+            std::copy( v0, v0+n, values );
+            }
+        }
+
+
+    /// Positions of n points in the order of their keys along c.
+    /** The keys are taken in the calculate_aabb() of the points. */
+    template<class Key = uint32_t, class T, size_t D> std::vector<uint32_t>
+    spatial_order( const vec<T,D>* points, size_t n, curve c = curve::morton,
+                   size_t threads = 1 )
+        {
+        std::vector<Key> keys( n );
+        std::vector<uint32_t> order( n );
+        curve_keys( c, points, n, calculate_aabb<T,D>( points, points+n ),
+                    keys.data(), threads );
+        for( size_t i=0; i<n; ++i )
+            order[i] = uint32_t( i );
+        radix_sort( keys.data(), order.data(), n, threads );
+        return order;
+        }
+
+
+    /// Positions of n boxes in the order of the keys of their centers.
+    template<class Key = uint32_t, class T, size_t D> std::vector<uint32_t>
+    spatial_order( const aabb<T,D>* boxes, size_t n, curve c = curve::morton,
+                   size_t threads = 1 )
+        {
+        std::vector< vec<T,D> > centers( n );
+        parallel_for( 0, n, threads, [&]( size_t first, size_t last )
+            {
+            for( size_t i = first; i < last; ++i )
+                centers[i] = center( boxes[i] );
+            }, 1 << 12 );
+        return spatial_order<Key>( centers.data(), n, c, threads );
+        }
+
+
+    /* items = items[order], gathered in parallel. */
+    template<class E> void
+    apply_order_( std::vector<E>& items, const std::vector<uint32_t>& order,
+                  size_t threads )
+        {
+        std::vector<E> sorted( items.size() );
+        parallel_for( 0, items.size(), threads, [&]( size_t first, size_t last )
+            {
+            for( size_t i = first; i < last; ++i )
+                sorted[i] = items[ order[i] ];
+            }, 1 << 12 );
+        items.swap( sorted );
+        }
+
+
+    /// Reorders points along c. Returns where each point came from.
+    template<class Key = uint32_t, class T, size_t D> std::vector<uint32_t>
+    spatial_sort( std::vector< vec<T,D> >& points, curve c = curve::morton,
+                  size_t threads = 1 )
+        {
+        std::vector<uint32_t> order =
+            spatial_order<Key>( points.data(), points.size(), c, threads );
+        apply_order_( points, order, threads );
+        return order;
+        }
+
+
+    /// Reorders boxes by the keys of their centers along c. Returns where
+    /// each box came from.
+    template<class Key = uint32_t, class T, size_t D> std::vector<uint32_t>
+    spatial_sort( aabb_list<T,D>& boxes, curve c = curve::morton,
+                  size_t threads = 1 )
+        {
+        std::vector<uint32_t> order =
+            spatial_order<Key>( boxes.data(), boxes.size(), c, threads );
+        apply_order_( boxes, order, threads );
+        return order;
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_MORTON_HPP
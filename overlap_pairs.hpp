@@ -0,0 +1,291 @@
+#ifndef TUMBO_OVERLAP_PAIRS_HPP
+#define TUMBO_OVERLAP_PAIRS_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "parallel.hpp"
+
+/**
+    \file overlap_pairs.hpp
+    \brief All overlapping pairs within one box list or between two.
+
+    The boxes are sorted by their low end along the axis where they are
+    thinnest compared to their spread, and each box is tested against the
+    boxes starting inside it along that axis. A pair is found from the box
+    that starts first, so every pair comes once without a set to remove
+    duplicates. The candidates of a box are tested in blocks of eight from
+    coordinates stored by axis, a loop the compiler can vectorize.
+
+    The sweep is cut into one tile per thread, holding about the same
+    number of candidates rather than of boxes, as a dense region can cost
+    much more than its share. Each tile appends to its own buffer, and the
+    buffers are copied to their offsets in the result in parallel, so no
+    locks are taken. The pairs come in sweep order, the same for any
+    thread count.
+*/
+
+namespace tumbo
+    {
+
+    /* A box list sorted along one axis with the coordinates by axis. */
+    template<class T, size_t D>
+    struct sweep_list_
+        {
+        sweep_list_( const aabb_list<T,D>& boxes, size_t axis, size_t threads )
+            {
+            size_t n = boxes.size();
+            TUMBO_ASSERT( n < ( size_t(1) << 32 ) );
+            std::vector< std::pair<T,uint32_t> > order( n );
+            for( size_t i=0; i < n; ++i )
+                order[i] = { boxes[i](axis,0), uint32_t(i) };
+            parallel_sort( order.begin(), order.end(), threads );
+            index.resize( n );
+            for( size_t d=0; d<D; ++d )
+                {
+                lo[d].resize( n );
+                hi[d].resize( n );
+                }
+            parallel_for( 0, n, threads, [&]( size_t first, size_t last )
+                {
+                for( size_t i=first; i < last; ++i )
+                    {
+                    const aabb<T,D>& b = boxes[ order[i].second ];
+                    index[i] = order[i].second;
+                    for( size_t d=0; d<D; ++d )
+                        {
+                        lo[d][i] = b(d,0);
+                        hi[d][i] = b(d,1);
+                        }
+                    }
+                }, 1 << 14 );
+            }
+
+        size_t
+        size() const
+            { return index.size(); }
+
+        /* First box starting at or after x along the axis. */
+        uint32_t
+        first_from( size_t axis, T x ) const
+            {
+            return uint32_t( std::lower_bound( lo[axis].begin(), lo[axis].end(), x ) -
+                             lo[axis].begin() );
+            }
+
+        /* First box starting after x along the axis. */
+        uint32_t
+        first_after( size_t axis, T x ) const
+            {
+            return uint32_t( std::upper_bound( lo[axis].begin(), lo[axis].end(), x ) -
+                             lo[axis].begin() );
+            }
+
+        std::vector<T> lo[D], hi[D];
+        std::vector<uint32_t> index;    // Position of each box in the input
+        };
+
+
+    /* The axis where the boxes of a and b are thinnest compared to their
+        spread, as it has the fewest boxes open at a time. */
+    template<class T, size_t D> size_t
+    sweep_axis_( const aabb_list<T,D>& a, const aabb_list<T,D>& b )
+        {
+        aabb<T,D> bound = a.empty() ? b[0] : a[0];
+        vec<T,D> widths = uniform< vec<T,D> >( 0 );
+        for( const aabb_list<T,D>* list : { &a, &b } )
+            for( const aabb<T,D>& box : *list )
+                {
+                bound = combine( bound, box );
+                widths += dimensions( box );
+                }
+        size_t axis = 0;
+        for( size_t d=1; d<D; ++d )
+            if( widths[d] * width( bound, axis ) < widths[axis] * width( bound, d ) )
+                axis = d;
+        return axis;
+        }
+
+
+    /* Calls emit( j ) for every box j in [first,last) of s overlapping the
+        box qlo, qhi. */
+    template<class T, size_t D, class Emit> void
+    sweep_range_( const sweep_list_<T,D>& s, size_t first, size_t last,
+                  const T* qlo, const T* qhi, Emit emit )
+        {
+        const T* los[D];
+        const T* his[D];
+        for( size_t d=0; d<D; ++d )
+            {
+            los[d] = s.lo[d].data();
+            his[d] = s.hi[d].data();
+            }
+        size_t j = first;
+        for( ; j + 8 <= last; j += 8 )
+            {
+            int block[8], any = 0;
+            for( size_t k=0; k<8; ++k )
+                block[k] = 1;
+            for( size_t d=0; d<D; ++d )
+                for( size_t k=0; k<8; ++k )
+                    block[k] &= ( qlo[d] < his[d][j+k] ) & ( los[d][j+k] < qhi[d] );
+            for( size_t k=0; k<8; ++k )
+                any |= block[k];
+            if( any )
+                for( size_t k=0; k<8; ++k )
+                    if( block[k] )
+                        emit( j+k );
+            }
+        for( ; j < last; ++j )
+            {
+            bool h = true;
+            for( size_t d=0; d<D; ++d )
+                h &= ( qlo[d] < his[d][j] ) & ( los[d][j] < qhi[d] );
+            if( h )
+                emit( j );
+            }
+        }
+
+
+    /* Sweeps n items in tiles. span( i ) gives the range of candidates of
+        item i and sweep( i, first, last, pairs ) appends its pairs. */
+    template<class Span, class Sweep> std::vector< std::pair<uint32_t,uint32_t> >
+    tiled_sweep_( size_t n, size_t threads, Span span, Sweep sweep )
+        {
+        typedef std::vector< std::pair<uint32_t,uint32_t> > pair_list;
+        std::vector<uint32_t> first( n ), last( n );
+        parallel_for( 0, n, threads, [&]( size_t i0, size_t i1 )
+            {
+            for( size_t i=i0; i < i1; ++i )
+                {
+                std::pair<uint32_t,uint32_t> r = span( i );
+                first[i] = r.first;
+                last[i] = std::max( r.first, r.second );
+                }
+            }, 1 << 12 );
+
+        // Tiles of equal work, counting a box as one plus its candidates.
+        std::vector<uint64_t> cost( n+1, 0 );
+        for( size_t i=0; i < n; ++i )
+            cost[i+1] = cost[i] + 1 + ( last[i] - first[i] );
+        size_t tiles = std::min( thread_count( threads ),
+                                 std::max<size_t>( cost[n] >> 14, 1 ) );
+        std::vector<size_t> bounds( tiles+1, n );
+        for( size_t t=0; t < tiles; ++t )
+            bounds[t] = std::lower_bound( cost.begin(), cost.end(),
+                                          cost[n] * t / tiles ) - cost.begin();
+
+        std::vector<pair_list> found( tiles );
+        parallel_for( 0, tiles, tiles, [&]( size_t t0, size_t t1 )
+            {
+            for( size_t t=t0; t < t1; ++t )
+                for( size_t i = bounds[t]; i < bounds[t+1]; ++i )
+                    sweep( i, first[i], last[i], found[t] );
+            } );
+
+        std::vector<size_t> offsets( tiles+1, 0 );
+        for( size_t t=0; t < tiles; ++t )
+            offsets[t+1] = offsets[t] + found[t].size();
+        pair_list pairs( offsets[tiles] );
+        parallel_for( 0, tiles, tiles, [&]( size_t t0, size_t t1 )
+            {
+            for( size_t t=t0; t < t1; ++t )
+                std::copy( found[t].begin(), found[t].end(), pairs.begin() + offsets[t] );
+            } );
+        return pairs;
+        }
+
+
+    /// All pairs of overlapping boxes in a list, as indices i < j.
+    /** Runs on the given number of threads, 0 for all. */
+    template<class T, size_t D> std::vector< std::pair<uint32_t,uint32_t> >
+    overlapping_pairs( const aabb_list<T,D>& boxes, size_t threads = 1 )
+        {
+        if( boxes.size() < 2 )
+            return {};
+        size_t axis = sweep_axis_( boxes, aabb_list<T,D>() );
+        sweep_list_<T,D> s( boxes, axis, threads );
+        auto span = [&]( size_t i )
+            {
+            uint32_t first = uint32_t( i+1 );
+            uint32_t last = uint32_t( std::lower_bound( s.lo[axis].begin() + first,
+                                                        s.lo[axis].end(),
+                                                        s.hi[axis][i] ) - s.lo[axis].begin() );
+            return std::make_pair( first, last );
+            };
+        auto sweep = [&]( size_t i, size_t first, size_t last,
+                          std::vector< std::pair<uint32_t,uint32_t> >& pairs )
+            {
+            T qlo[D], qhi[D];
+            for( size_t d=0; d<D; ++d )
+                {
+                qlo[d] = s.lo[d][i];
+                qhi[d] = s.hi[d][i];
+                }
+            uint32_t a = s.index[i];
+            sweep_range_( s, first, last, qlo, qhi, [&]( size_t j )
+                {
+                uint32_t b = s.index[j];
+                pairs.emplace_back( std::min( a, b ), std::max( a, b ) );
+                } );
+            };
+        return tiled_sweep_( s.size(), threads, span, sweep );
+        }
+
+
+    /// All pairs (i,j) of a box a[i] overlapping a box b[j].
+    /** Runs on the given number of threads, 0 for all. */
+    template<class T, size_t D> std::vector< std::pair<uint32_t,uint32_t> >
+    overlapping_pairs( const aabb_list<T,D>& a, const aabb_list<T,D>& b,
+                       size_t threads = 1 )
+        {
+        if( a.empty() || b.empty() )
+            return {};
+        size_t axis = sweep_axis_( a, b );
+        sweep_list_<T,D> sa( a, axis, threads ), sb( b, axis, threads );
+        size_t n = sa.size();
+
+        /* Boxes of a find the boxes of b starting at or after their own
+            start, and boxes of b the boxes of a starting strictly after,
+            so a pair starting together is found once. */
+        auto span = [&]( size_t i )
+            {
+            if( i < n )
+                return std::make_pair( sb.first_from( axis, sa.lo[axis][i] ),
+                                       sb.first_from( axis, sa.hi[axis][i] ) );
+            i -= n;
+            return std::make_pair( sa.first_after( axis, sb.lo[axis][i] ),
+                                   sa.first_from( axis, sb.hi[axis][i] ) );
+            };
+        auto sweep = [&]( size_t i, size_t first, size_t last,
+                          std::vector< std::pair<uint32_t,uint32_t> >& pairs )
+            {
+            bool from_a = i < n;
+            const sweep_list_<T,D>& query = from_a ? sa : sb;
+            const sweep_list_<T,D>& other = from_a ? sb : sa;
+            if( !from_a )
+                i -= n;
+            T qlo[D], qhi[D];
+            for( size_t d=0; d<D; ++d )
+                {
+                qlo[d] = query.lo[d][i];
+                qhi[d] = query.hi[d][i];
+                }
+            uint32_t q = query.index[i];
+            sweep_range_( other, first, last, qlo, qhi, [&]( size_t j )
+                {
+                if( from_a )
+                    pairs.emplace_back( q, other.index[j] );
+                else
+                    pairs.emplace_back( other.index[j], q );
+                } );
+            };
+        return tiled_sweep_( n + sb.size(), threads, span, sweep );
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_OVERLAP_PAIRS_HPP
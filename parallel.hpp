@@ -0,0 +1,304 @@
+#ifndef TUMBO_PARALLEL_HPP
+#define TUMBO_PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+    \file parallel.hpp
+    \brief A small persistent thread pool and the loops built on it.
+
+    The batch functions in tumbo take a thread count. 1 runs everything on
+    the calling thread and 0 means one thread per hardware thread. Work is
+    handed to default_thread_pool(), whose workers are started on first
+    use and live for the rest of the program.
+
+    A thread waiting in task_group::wait runs queued tasks itself, so
+    nested parallel loops cannot deadlock the pool.
+*/
+
+namespace tumbo
+    {
+
+    class thread_pool
+        {
+        public:
+            explicit
+            thread_pool( size_t workers ) :
+                stop_( false )
+                {
+                for( size_t i=0; i < workers; ++i )
+                    threads_.emplace_back( [this]{ work_(); } );
+                }
+
+            thread_pool( const thread_pool& ) = delete;
+            thread_pool& operator = ( const thread_pool& ) = delete;
+
+            ~thread_pool()
+                {
+                    {
+                    std::lock_guard<std::mutex> lock( mutex_ );
+                    stop_ = true;
+                    }
+                ready_.notify_all();
+                for( auto& t : threads_ )
+                    t.join();
+                }
+
+            size_t
+            workers() const
+                { return threads_.size(); }
+
+            void
+            submit( std::function<void()> task )
+                {
+                    {
+                    std::lock_guard<std::mutex> lock( mutex_ );
+                    queue_.push_back( std::move(task) );
+                    }
+                ready_.notify_one();
+                }
+
+            /// Runs one queued task on the calling thread, if there is any.
+            bool
+            run_one()
+                {
+                std::function<void()> task;
+                    {
+                    std::lock_guard<std::mutex> lock( mutex_ );
+                    if( queue_.empty() )
+                        return false;
+                    task = std::move( queue_.front() );
+                    queue_.pop_front();
+                    }
+                task();
+                return true;
+                }
+
+        private:
+            void
+            work_()
+                {
+                for(;;)
+                    {
+                    std::function<void()> task;
+                        {
+                        std::unique_lock<std::mutex> lock( mutex_ );
+                        ready_.wait( lock, [this]{ return stop_ || !queue_.empty(); } );
+                        if( queue_.empty() )
+                            return;
+                        task = std::move( queue_.front() );
+                        queue_.pop_front();
+                        }
+                    task();
+                    }
+                }
+
+            std::vector<std::thread> threads_;
+            std::deque< std::function<void()> > queue_;
+            std::mutex mutex_;
+            std::condition_variable ready_;
+            bool stop_;
+        };
+
+
+    /// Number of threads to use for a requested count, 0 meaning all.
+    inline size_t
+    thread_count( size_t threads )
+        {
+        if( threads != 0 )
+            return threads;
+        size_t hw = std::thread::hardware_concurrency();
+        return hw == 0 ? 1 : hw;
+        }
+
+
+    /// The pool used by tumbo. The calling thread is the extra thread.
+    inline thread_pool&
+    default_thread_pool()
+        {
+        static thread_pool pool( thread_count(0) - 1 );
+        return pool;
+        }
+
+
+    /// Tasks that are waited for together.
+    /** The first exception thrown by a task is rethrown by wait. */
+    class task_group
+        {
+        public:
+            explicit
+            task_group( thread_pool& pool = default_thread_pool() ) :
+                pool_( pool ), pending_( 0 )
+                {}
+
+            task_group( const task_group& ) = delete;
+            task_group& operator = ( const task_group& ) = delete;
+
+            ~task_group()
+                {
+                wait_();
+                }
+
+            template< class F > void
+            run( F f )
+                {
+                if( pool_.workers() == 0 )
+                    {
+                    call_( f );
+                    return;
+                    }
+                ++pending_;
+                pool_.submit( [this, f]() mutable
+                    {
+                    call_( f );
+                    --pending_;
+                    } );
+                }
+
+            void
+            wait()
+                {
+                wait_();
+                if( error_ )
+                    {
+                    std::exception_ptr e = error_;
+                    error_ = nullptr;
+                    std::rethrow_exception( e );
+                    }
+                }
+
+        private:
+            template< class F > void
+            call_( F& f )
+                {
+                try
+                    {
+                    f();
+                    }
+                catch( ... )
+                    {
+                    std::lock_guard<std::mutex> lock( error_mutex_ );
+                    if( !error_ )
+                        error_ = std::current_exception();
+                    }
+                }
+
+            void
+            wait_()
+                {
+                while( pending_ != 0 )
+                    if( !pool_.run_one() )
+                        std::this_thread::yield();
+                }
+
+            thread_pool& pool_;
+            std::atomic<size_t> pending_;
+            std::mutex error_mutex_;
+            std::exception_ptr error_;
+        };
+
+
+    /// Calls fn( first, last ) on contiguous chunks covering [begin,end).
+    /** The range is split into at most threads chunks of at least grain
+        indices. The last chunk runs on the calling thread. */
+    template< class Fn > void
+    parallel_for( size_t begin, size_t end, size_t threads, Fn fn,
+                  size_t grain = 1 )
+        {
+        if( end <= begin )
+            return;
+        size_t n = end - begin;
+        size_t chunks = std::min( thread_count( threads ),
+                                  std::max<size_t>( n / std::max<size_t>( grain, 1 ), 1 ) );
+        if( chunks <= 1 )
+            {
+            fn( begin, end );
+            return;
+            }
+
+        task_group group;
+        size_t step = n / chunks, extra = n % chunks;
+        size_t first = begin;
+        for( size_t c=0; c+1 < chunks; ++c )
+            {
+            size_t last = first + step + ( c < extra ? 1 : 0 );
+            group.run( [&fn, first, last]{ fn( first, last ); } );
+            first = last;
+            }
+        fn( first, end );
+        group.wait();
+        }
+
+
+    /// Sorts [first,last) by sorting chunks and merging them pairwise.
+    /** Not stable. Ranges below grain elements are sorted on the calling
+        thread. */
+    template< class Iter, class Comp > void
+    parallel_sort( Iter first, Iter last, size_t threads, Comp comp,
+                   size_t grain = 1 << 13 )
+        {
+        size_t n = last - first;
+        size_t chunks = std::min( thread_count( threads ),
+                                  std::max<size_t>( n / std::max<size_t>( grain, 1 ), 1 ) );
+        if( chunks <= 1 )
+            {
+            std::sort( first, last, comp );
+            return;
+            }
+
+        std::vector<size_t> bounds( chunks+1 );
+        for( size_t c=0; c <= chunks; ++c )
+            bounds[c] = n*c / chunks;
+        parallel_for( 0, chunks, chunks, [&]( size_t c0, size_t c1 )
+            {
+            for( size_t c=c0; c < c1; ++c )
+                std::sort( first + bounds[c], first + bounds[c+1], comp );
+            } );
+        for( size_t width=1; width < chunks; width *= 2 )
+            {
+            size_t merges = ( chunks + 2*width - 1 ) / ( 2*width );
+            parallel_for( 0, merges, merges, [&]( size_t m0, size_t m1 )
+                {
+                for( size_t m=m0; m < m1; ++m )
+                    {
+                    size_t lo = 2*width*m;
+                    size_t mid = std::min( lo + width, chunks );
+                    size_t hi = std::min( lo + 2*width, chunks );
+                    if( mid < hi )
+                        std::inplace_merge( first + bounds[lo], first + bounds[mid],
+                                            first + bounds[hi], comp );
+                    }
+                } );
+            }
+        }
+
+
+    template< class Iter > void
+    parallel_sort( Iter first, Iter last, size_t threads )
+        {
+        parallel_sort( first, last, threads, std::less<>() );
+        }
+
+
+    /// Runs f and g, possibly at the same time.
+    template< class F, class G > void
+    parallel_invoke( F f, G g )
+        {
+        task_group group;
+        group.run( f );
+        g();
+        group.wait();
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_PARALLEL_HPP
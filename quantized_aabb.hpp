@@ -0,0 +1,195 @@
+#ifndef TUMBO_QUANTIZED_AABB_HPP
+#define TUMBO_QUANTIZED_AABB_HPP
+
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "parallel.hpp"
+
+/**
+    \file quantized_aabb.hpp
+    \brief Boxes stored with 8 or 16 bits per coordinate inside a frame.
+
+    aabb_quantizer<T,D,Q> lays a grid of 2^bits - 1 steps per axis over a
+    frame box and stores a box as an aabb<Q,D> of grid values, 6 bytes
+    for aabb<float,3> with Q = uint8_t and 12 with uint16_t. The frame can
+    be the bounds of the whole data set, or the decoded box of a parent
+    in a hierarchy, so each level spends its bits on its own extent.
+
+    Encoding rounds outwards: the low end goes to the highest grid value
+    at or below it and the high end to the lowest at or above it, checked
+    against decode() itself so float rounding cannot break it. The decoded
+    box therefore always contains the original, and may_overlap() on two
+    encoded boxes is true whenever the originals overlap or touch. It can
+    also be true for boxes less than a step apart. Boxes must lie in the
+    frame for this to hold, as anything outside is clamped to its edges.
+*/
+
+namespace tumbo
+    {
+
+    /// Encodes boxes to grid values of type Q within a frame.
+    template<class T, size_t D, class Q = uint16_t>
+    class aabb_quantizer
+        {
+        static_assert( std::is_unsigned<Q>::value && sizeof(Q) <= 2,
+                       "Q is uint8_t or uint16_t" );
+
+        public:
+            typedef aabb<Q,D> quantized;
+
+            /// The highest grid value.
+            static constexpr Q top = std::numeric_limits<Q>::max();
+
+            explicit
+            aabb_quantizer( const aabb<T,D>& frame ) :
+                frame_( frame )
+                {
+                for( size_t d=0; d<D; ++d )
+                    {
+                    T extent = frame(d,1) - frame(d,0);
+                    step_[d] = extent / T(top);
+                    scale_[d] = extent > 0 ? T(top) / extent : T(0);
+                    }
+                }
+
+            const aabb<T,D>&
+            frame() const
+                { return frame_; }
+
+            /// The coordinate of grid value q on axis d.
+            T
+            value( size_t d, Q q ) const
+                { return frame_(d,0) + T(q) * step_[d]; }
+
+            /// The smallest quantized box whose decoded box contains b.
+            quantized
+            encode( const aabb<T,D>& b ) const
+                {
+                quantized q;
+                for( size_t d=0; d<D; ++d )
+                    {
+                    q(d,0) = lower_( d, b(d,0) );
+                    q(d,1) = upper_( d, b(d,1) );
+                    }
+                return q;
+                }
+
+            /// The quantized box around a point, for queries.
+            quantized
+            encode( const vec<T,D>& p ) const
+                {
+                quantized q;
+                for( size_t d=0; d<D; ++d )
+                    {
+                    q(d,0) = lower_( d, p[d] );
+                    q(d,1) = upper_( d, p[d] );
+                    }
+                return q;
+                }
+
+            aabb<T,D>
+            decode( const quantized& q ) const
+                {
+                aabb<T,D> b;
+                for( size_t d=0; d<D; ++d )
+                    {
+                    b(d,0) = value( d, q(d,0) );
+                    b(d,1) = value( d, q(d,1) );
+                    }
+                return b;
+                }
+
+            /// Encodes n boxes into out.
+            void
+            encode( const aabb<T,D>* boxes, size_t n, quantized* out,
+                    size_t threads = 1 ) const
+                {
+                parallel_for( 0, n, threads, [&]( size_t i0, size_t i1 )
+                    {
+                    for( size_t i=i0; i < i1; ++i )
+                        out[i] = encode( boxes[i] );
+                    }, 4096 );
+                }
+
+            /// Decodes n boxes into out.
+            void
+            decode( const quantized* q, size_t n, aabb<T,D>* out,
+                    size_t threads = 1 ) const
+                {
+                parallel_for( 0, n, threads, [&]( size_t i0, size_t i1 )
+                    {
+                    for( size_t i=i0; i < i1; ++i )
+                        out[i] = decode( q[i] );
+                    }, 4096 );
+                }
+
+        private:
+            /* The highest grid value at or below x, 0 below the frame. */
+            Q
+            lower_( size_t d, T x ) const
+                {
+                T t = ( x - frame_(d,0) ) * scale_[d];
+                Q q = !( t > 0 ) ? Q(0) : t >= T(top) ? top : Q( t );
+                while( q > 0 && value( d, q ) > x )
+                    --q;
+                // Strictly, as grid values can coincide in a tiny frame.
+                while( q < top && value( d, Q(q+1) ) < x )
+                    ++q;
+                return q;
+                }
+
+            /* The lowest grid value at or above x, the top above the frame
+                or for NaN. */
+            Q
+            upper_( size_t d, T x ) const
+                {
+                T t = ( x - frame_(d,0) ) * scale_[d];
+                Q q = t <= 0 ? Q(0) : !( t < T(top) ) ? top : Q( t );
+                q += q < top && T(q) < t;
+                while( q < top && value( d, q ) < x )
+                    ++q;
+                while( q > 0 && value( d, Q(q-1) ) > x )
+                    --q;
+                return q;
+                }
+
+            aabb<T,D> frame_;
+            T step_[D];
+            T scale_[D];
+        };
+
+
+    /// Whether two boxes quantized in the same frame may overlap.
+    /** True if the original boxes overlapped or touched. */
+    template<class Q, size_t D> bool
+    may_overlap( const aabb<Q,D>& a, const aabb<Q,D>& b )
+        {
+        bool r = true;
+        for( size_t d=0; d<D; ++d )
+            r &= ( a(d,0) <= b(d,1) ) & ( b(d,0) <= a(d,1) );
+        return r;
+        }
+
+
+    /// Writes the index of every box that may overlap q to hits.
+    /** Returns the number of indices written, at most n. */
+    template<class Q, size_t D> size_t
+    may_overlap( const aabb<Q,D>* boxes, size_t n, const aabb<Q,D>& q,
+                 uint32_t* hits )
+        {
+        size_t count = 0;
+        for( size_t i=0; i < n; ++i )
+            {
+            // Always written, kept only if it is a hit.
+            hits[count] = uint32_t( i );
+            count += may_overlap( boxes[i], q );
+            }
+        return count;
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_QUANTIZED_AABB_HPP
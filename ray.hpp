@@ -0,0 +1,100 @@
+#ifndef TUMBO_RAY_HPP
+#define TUMBO_RAY_HPP
+
+#include <algorithm>
+#include <limits>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+
+/**
+    \file ray.hpp
+    \brief Rays and their intersection with aabbs.
+*/
+
+namespace tumbo
+    {
+
+    /// A ray with the reciprocal of its direction precomputed.
+    /** Zero direction components give infinite reciprocals, which the slab
+        test handles: the ray is then parallel to that slab. */
+    template<class T, size_t D>
+    struct ray
+        {
+        vec<T,D> origin;
+        vec<T,D> direction;
+        vec<T,D> inv_direction;
+        };
+
+    typedef ray<float,3>    fray3;
+    typedef ray<float,2>    fray2;
+
+    typedef ray<double,3>   dray3;
+    typedef ray<double,2>   dray2;
+
+
+    template<class T, size_t D> ray<T,D>
+    make_ray( const vec<T,D>& origin, const vec<T,D>& direction )
+        {
+        ray<T,D> r{ origin, direction, direction };
+        for( size_t d=0; d<D; ++d )
+            r.inv_direction[d] = T(1) / direction[d];
+        return r;
+        }
+
+
+    /// The point origin + t*direction.
+    template<class T, size_t D> vec<T,D>
+    point_at( const ray<T,D>& r, T t )
+        {
+        return r.origin + r.direction * t;
+        }
+
+
+    /// Slab test of a ray segment [tmin,tmax] against a box.
+    /** On a hit, tnear and tfar are set to where the segment enters and
+        leaves the box, clamped to [tmin,tmax]. The slabs are clipped with
+        selects rather than branches and every axis is tested; a NaN from
+        0*inf, a ray in the plane of a face, leaves the interval unchanged.
+        The packet tests in ray_packet.hpp give the same distances. */
+    template<class T, size_t D> bool
+    intersects( const ray<T,D>& r, const aabb<T,D>& a, T tmin, T tmax,
+                T& tnear, T& tfar )
+        {
+        for( size_t d=0; d<D; ++d )
+            {
+            T t0 = ( a(d,0) - r.origin[d] ) * r.inv_direction[d];
+            T t1 = ( a(d,1) - r.origin[d] ) * r.inv_direction[d];
+            T enter = t1 < t0 ? t1 : t0;
+            T leave = t1 < t0 ? t0 : t1;
+            tmin = tmin < enter ? enter : tmin;
+            tmax = leave < tmax ? leave : tmax;
+            }
+        tnear = tmin;
+        tfar = tmax;
+        return tmin <= tmax;
+        }
+
+
+    /// Slab test of a ray segment [tmin,tmax] against a box.
+    /** On a hit, tnear is set to where the segment enters the box, which
+        is tmin if it starts inside. */
+    template<class T, size_t D> bool
+    intersects( const ray<T,D>& r, const aabb<T,D>& a, T tmin, T tmax,
+                T& tnear )
+        {
+        T tfar;
+        return intersects( r, a, tmin, tmax, tnear, tfar );
+        }
+
+
+    template<class T, size_t D> bool
+    intersects( const ray<T,D>& r, const aabb<T,D>& a,
+                T tmax = std::numeric_limits<T>::infinity() )
+        {
+        T tnear;
+        return intersects( r, a, T(0), tmax, tnear );
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_RAY_HPP
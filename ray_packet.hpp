@@ -0,0 +1,200 @@
+#ifndef TUMBO_RAY_PACKET_HPP
+#define TUMBO_RAY_PACKET_HPP
+
+#include <cstdint>
+#include <limits>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "aabb_packet.hpp"
+#include "ray.hpp"
+#include "simd.hpp"
+
+/**
+    \file ray_packet.hpp
+    \brief Slab tests of ray packets against a box and of a ray against a
+    box packet.
+
+    ray_packet<T,D,W> keeps W rays as structure of arrays: origins and
+    reciprocal directions by axis, and the segment [tmin,tmax] of each ray.
+    Testing it against one box, or one ray against an aabb_packet, clips
+    all lanes with simd::min and simd::max and returns a bitmask with bit i
+    set for each hit, like the tests in aabb_packet.hpp. The operands are
+    ordered so the lanes give exactly the entry and exit distances of the
+    scalar intersects() in ray.hpp, NaN cases included.
+
+    Lanes past size() hold an empty segment, tmin at infinity and tmax at
+    minus infinity, and never hit.
+*/
+
+namespace tumbo
+    {
+
+    /// W rays stored by axis for packet tests.
+    template<class T, size_t D, size_t W>
+    struct ray_packet
+        {
+        static_assert( W <= 32, "The masks have 32 bits" );
+
+        /// Lanes per simd::packet used in the tests.
+        static constexpr size_t lanes =
+            W < simd::batch_width<T>::value ? W : simd::batch_width<T>::value;
+        static_assert( W % lanes == 0, "W must be a multiple of the lanes" );
+
+        alignas( sizeof(T)*lanes ) T origin[D][W];
+        alignas( sizeof(T)*lanes ) T inv_direction[D][W];
+        alignas( sizeof(T)*lanes ) T tmin[W];
+        alignas( sizeof(T)*lanes ) T tmax[W];
+
+        /// An empty packet.
+        ray_packet()
+            {
+            clear();
+            }
+
+        /// Packs up to W rays from a range, all with the segment [t0,t1].
+        template<class Iter>
+        ray_packet( Iter it, Iter end, T t0 = 0,
+                    T t1 = std::numeric_limits<T>::infinity() )
+            {
+            clear();
+            for( ; it != end; ++it )
+                push_back( *it, t0, t1 );
+            }
+
+        static constexpr size_t
+        width()
+            { return W; }
+
+        size_t
+        size() const
+            { return size_; }
+
+        bool
+        full() const
+            { return size_ == W; }
+
+        void
+        clear()
+            {
+            for( size_t i=0; i<W; ++i )
+                reset( i );
+            size_ = 0;
+            }
+
+        void
+        push_back( const ray<T,D>& r, T t0 = 0,
+                   T t1 = std::numeric_limits<T>::infinity() )
+            {
+            TUMBO_ASSERT( size_ < W );
+            set( size_++, r, t0, t1 );
+            }
+
+        void
+        set( size_t i, const ray<T,D>& r, T t0 = 0,
+             T t1 = std::numeric_limits<T>::infinity() )
+            {
+            for( size_t d=0; d<D; ++d )
+                {
+                origin[d][i] = r.origin[d];
+                inv_direction[d][i] = r.inv_direction[d];
+                }
+            tmin[i] = t0;
+            tmax[i] = t1;
+            }
+
+        /// Mask with a bit for each of the size() rays.
+        uint32_t
+        used() const
+            { return size_ == 32 ? ~uint32_t(0) : ( uint32_t(1) << size_ ) - 1; }
+
+        private:
+            void
+            reset( size_t i )
+                {
+                for( size_t d=0; d<D; ++d )
+                    {
+                    origin[d][i] = 0;
+                    inv_direction[d][i] = 0;
+                    }
+                tmin[i] = std::numeric_limits<T>::infinity();
+                tmax[i] = -std::numeric_limits<T>::infinity();
+                }
+
+            size_t size_;
+        };
+
+
+    /* Clips [tmin,tmax] to the slab between lo and hi, lane by lane. The
+        argument order makes the SSE min and max pick the same value as the
+        selects of the scalar test when one side is NaN. */
+    template<class P> void
+    clip_slab_( P origin, P inv, P lo, P hi, P& tmin, P& tmax )
+        {
+        P t0 = ( lo - origin ) * inv;
+        P t1 = ( hi - origin ) * inv;
+        tmin = simd::max( simd::min( t1, t0 ), tmin );
+        tmax = simd::min( simd::max( t0, t1 ), tmax );
+        }
+
+
+    /// The rays of p that hit a within their segments.
+    /** If tnear or tfar is given it receives W entry or exit distances,
+        which only mean something for the lanes in the mask. */
+    template<class T, size_t D, size_t W> uint32_t
+    intersects( const ray_packet<T,D,W>& p, const aabb<T,D>& a,
+                T* tnear = nullptr, T* tfar = nullptr )
+        {
+        typedef simd::packet<T, ray_packet<T,D,W>::lanes> P;
+        uint32_t mask = 0;
+        for( size_t i=0; i<W; i += P::width() )
+            {
+            P t0 = P::load( p.tmin+i );
+            P t1 = P::load( p.tmax+i );
+            for( size_t d=0; d<D; ++d )
+                clip_slab_( P::load( p.origin[d]+i ), P::load( p.inv_direction[d]+i ),
+                            P::broadcast( a(d,0) ), P::broadcast( a(d,1) ), t0, t1 );
+            mask |= uint32_t( simd::movemask( t0 <= t1 ) ) << i;
+            if( tnear )
+                t0.store( tnear+i );
+            if( tfar )
+                t1.store( tfar+i );
+            }
+        return mask;
+        }
+
+
+    /// The boxes of p that the segment [tmin,tmax] of r hits.
+    /** If tnear or tfar is given it receives W entry or exit distances,
+        which only mean something for the lanes in the mask. */
+    template<class T, size_t D, size_t W> uint32_t
+    intersects( const ray<T,D>& r, const aabb_packet<T,D,W>& p, T tmin, T tmax,
+                T* tnear = nullptr, T* tfar = nullptr )
+        {
+        typedef simd::packet<T, aabb_packet<T,D,W>::lanes> P;
+        P origin[D], inv[D];
+        for( size_t d=0; d<D; ++d )
+            {
+            origin[d] = P::broadcast( r.origin[d] );
+            inv[d] = P::broadcast( r.inv_direction[d] );
+            }
+        uint32_t mask = 0;
+        for( size_t i=0; i<W; i += P::width() )
+            {
+            P t0 = P::broadcast( tmin );
+            P t1 = P::broadcast( tmax );
+            for( size_t d=0; d<D; ++d )
+                clip_slab_( origin[d], inv[d],
+                            P::load( p.lo[d]+i ), P::load( p.hi[d]+i ), t0, t1 );
+            mask |= uint32_t( simd::movemask( t0 <= t1 ) ) << i;
+            if( tnear )
+                t0.store( tnear+i );
+            if( tfar )
+                t1.store( tfar+i );
+            }
+        // The empty boxes past size() span every slab.
+        return mask & p.used();
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_RAY_PACKET_HPP
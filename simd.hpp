@@ -0,0 +1,939 @@
+#ifndef TUMBO_SIMD_HPP
+#define TUMBO_SIMD_HPP
+
+/**
+    \file simd.hpp
+    \brief Small register wrappers and the 4-wide kernels built on them.
+
+    packet<T,W> holds W lanes of T. The generic version is a plain array so
+    every kernel compiles everywhere; SSE2 and AVX specializations are used
+    when the compiler targets them. packet<float,8> and packet<double,4>
+    fill an AVX register and are used for batches of elements. Define
+    TUMBO_NO_SIMD to turn the specializations (and the matrix overloads
+    using them) off.
+*/
+
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+
+#if !defined(TUMBO_NO_SIMD) && ( defined(__SSE2__) || defined(_M_X64) )
+    #define TUMBO_SSE2
+    #include <emmintrin.h>
+#endif
+
+#if !defined(TUMBO_NO_SIMD) && defined(__AVX__)
+    #define TUMBO_AVX
+    #include <immintrin.h>
+#endif
+
+/* Lets constexpr functions fall back to scalar code during constant
+    evaluation, where intrinsics cannot run. Compilers without the builtin
+    only get the scalar path in constant expressions for non-SIMD types. */
+#if defined(__has_builtin)
+    #if __has_builtin(__builtin_is_constant_evaluated)
+        #define TUMBO_IS_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+    #endif
+#endif
+#if !defined(TUMBO_IS_CONSTANT_EVALUATED) && defined(_MSC_VER) && _MSC_VER >= 1925
+    #define TUMBO_IS_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#endif
+#ifndef TUMBO_IS_CONSTANT_EVALUATED
+    #define TUMBO_IS_CONSTANT_EVALUATED() false
+#endif
+
+namespace tumbo
+    {
+    namespace simd
+        {
+
+        /// Alignment used for matrix storage of T with Size elements.
+        /** Float and double matrices with a multiple of four elements are
+            kept on a 16 byte boundary, so the 16 byte SSE loads of their
+            packets never split across cache lines. 32 byte AVX loads still
+            can; the kernels use unaligned loads and do not depend on it. */
+        template<class T, size_t Size>
+        struct storage_alignment
+            {
+            static constexpr size_t value =
+                ( std::is_floating_point<T>::value && Size % 4 == 0 &&
+                  alignof(T) < 16 ) ? 16 : alignof(T);
+            };
+
+
+        /// True if Size elements of T can be processed as 4-wide packets.
+        template<class T, size_t Size>
+        struct packable
+            {
+#ifdef TUMBO_SSE2
+            static constexpr bool value =
+                ( std::is_same<T,float>::value ||
+                  std::is_same<T,double>::value ) && Size % 4 == 0;
+#else
+            static constexpr bool value = false;
+#endif
+            };
+
+
+        /// True for the matrix types that get the explicit SIMD overloads.
+        template<class T, size_t M, size_t N>
+        struct accelerated
+            {
+#ifdef TUMBO_SSE2
+            static constexpr bool value =
+                ( std::is_same<T,float>::value ||
+                  std::is_same<T,double>::value ) &&
+                ( (M == 4 && N == 1) || (M == 1 && N == 4) ||
+                  (M == 4 && N == 4) );
+#else
+            static constexpr bool value = false;
+#endif
+            };
+
+
+        /// W lanes of T. Loads and stores do not require alignment.
+        template<class T, size_t W>
+        struct packet
+            {
+            T v[W];
+
+            static constexpr size_t
+            width()
+                { return W; }
+
+            static packet
+            load( const T* p )
+                {
+                packet r;
+                for( size_t i=0; i<W; ++i ) r.v[i] = p[i];
+                return r;
+                }
+
+            static packet
+            broadcast( T s )
+                {
+                packet r;
+                for( size_t i=0; i<W; ++i ) r.v[i] = s;
+                return r;
+                }
+
+            void
+            store( T* p ) const
+                {
+                for( size_t i=0; i<W; ++i ) p[i] = v[i];
+                }
+            };
+
+
+        template<class T, size_t W, class Op> packet<T,W>
+        lanewise( const packet<T,W>& a, const packet<T,W>& b, Op op )
+            {
+            packet<T,W> r;
+            for( size_t i=0; i<W; ++i ) r.v[i] = op( a.v[i], b.v[i] );
+            return r;
+            }
+
+        template<class T, size_t W> packet<T,W>
+        operator + ( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return x+y; } ); }
+
+        template<class T, size_t W> packet<T,W>
+        operator - ( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return x-y; } ); }
+
+        template<class T, size_t W> packet<T,W>
+        operator * ( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return x*y; } ); }
+
+        template<class T, size_t W> packet<T,W>
+        operator / ( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return x/y; } ); }
+
+        template<class T, size_t W> packet<T,W>
+        operator - ( const packet<T,W>& a )
+            { return packet<T,W>::broadcast(0) - a; }
+
+        /// Horizontal sum of all lanes.
+        template<class T, size_t W> T
+        sum( const packet<T,W>& a )
+            {
+            T s = 0;
+            for( size_t i=0; i<W; ++i ) s += a.v[i];
+            return s;
+            }
+
+        template<class T, size_t W> packet<T,W>
+        sqrt( const packet<T,W>& a )
+            {
+            packet<T,W> r;
+            for( size_t i=0; i<W; ++i ) r.v[i] = std::sqrt( a.v[i] );
+            return r;
+            }
+
+        /* Comparisons give mask packets, which are only meant for &, | and
+            movemask. The generic lanes hold 1 or 0; the SIMD ones all bits
+            set or clear. */
+
+        template<class T, size_t W> packet<T,W>
+        operator < ( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return T( x < y ); } ); }
+
+        template<class T, size_t W> packet<T,W>
+        operator <= ( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return T( x <= y ); } ); }
+
+        template<class T, size_t W> packet<T,W>
+        operator & ( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return T( x != 0 && y != 0 ); } ); }
+
+        template<class T, size_t W> packet<T,W>
+        operator | ( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return T( x != 0 || y != 0 ); } ); }
+
+        template<class T, size_t W> packet<T,W>
+        min( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return x < y ? x : y; } ); }
+
+        template<class T, size_t W> packet<T,W>
+        max( const packet<T,W>& a, const packet<T,W>& b )
+            { return lanewise( a, b, [](T x, T y){ return y < x ? x : y; } ); }
+
+        /// Bit i set for every true lane i of a mask packet.
+        template<class T, size_t W> unsigned
+        movemask( const packet<T,W>& a )
+            {
+            unsigned m = 0;
+            for( size_t i=0; i<W; ++i )
+                m |= unsigned( a.v[i] != 0 ) << i;
+            return m;
+            }
+
+        /// Transposes four 4-lane packets as if they were rows of a 4x4.
+        template<class T> void
+        transpose( packet<T,4>& r0, packet<T,4>& r1,
+                   packet<T,4>& r2, packet<T,4>& r3 )
+            {
+            packet<T,4>* r[4] = { &r0, &r1, &r2, &r3 };
+            for( size_t i=0; i<4; ++i )
+            for( size_t j=i+1; j<4; ++j )
+                {
+                T t = r[i]->v[j];
+                r[i]->v[j] = r[j]->v[i];
+                r[j]->v[i] = t;
+                }
+            }
+
+
+#ifdef TUMBO_SSE2
+        template<>
+        struct packet<float,4>
+            {
+            __m128 v;
+
+            static constexpr size_t
+            width()
+                { return 4; }
+
+            static packet
+            load( const float* p )
+                { return { _mm_loadu_ps(p) }; }
+
+            static packet
+            broadcast( float s )
+                { return { _mm_set1_ps(s) }; }
+
+            void
+            store( float* p ) const
+                { _mm_storeu_ps( p, v ); }
+            };
+
+        inline packet<float,4>
+        operator + ( packet<float,4> a, packet<float,4> b )
+            { return { _mm_add_ps( a.v, b.v ) }; }
+
+        inline packet<float,4>
+        operator - ( packet<float,4> a, packet<float,4> b )
+            { return { _mm_sub_ps( a.v, b.v ) }; }
+
+        inline packet<float,4>
+        operator * ( packet<float,4> a, packet<float,4> b )
+            { return { _mm_mul_ps( a.v, b.v ) }; }
+
+        inline packet<float,4>
+        operator / ( packet<float,4> a, packet<float,4> b )
+            { return { _mm_div_ps( a.v, b.v ) }; }
+
+        inline packet<float,4>
+        operator - ( packet<float,4> a )
+            { return { _mm_xor_ps( a.v, _mm_set1_ps(-0.0f) ) }; }
+
+        inline float
+        sum( packet<float,4> a )
+            {
+            __m128 shuf = _mm_shuffle_ps( a.v, a.v, _MM_SHUFFLE(2,3,0,1) );
+            __m128 sums = _mm_add_ps( a.v, shuf );
+            shuf = _mm_movehl_ps( shuf, sums );
+            return _mm_cvtss_f32( _mm_add_ss( sums, shuf ) );
+            }
+
+        inline packet<float,4>
+        sqrt( packet<float,4> a )
+            { return { _mm_sqrt_ps( a.v ) }; }
+
+        inline packet<float,4>
+        operator < ( packet<float,4> a, packet<float,4> b )
+            { return { _mm_cmplt_ps( a.v, b.v ) }; }
+
+        inline packet<float,4>
+        operator <= ( packet<float,4> a, packet<float,4> b )
+            { return { _mm_cmple_ps( a.v, b.v ) }; }
+
+        inline packet<float,4>
+        operator & ( packet<float,4> a, packet<float,4> b )
+            { return { _mm_and_ps( a.v, b.v ) }; }
+
+        inline packet<float,4>
+        operator | ( packet<float,4> a, packet<float,4> b )
+            { return { _mm_or_ps( a.v, b.v ) }; }
+
+        inline unsigned
+        movemask( packet<float,4> a )
+            { return unsigned( _mm_movemask_ps( a.v ) ); }
+
+        inline packet<float,4>
+        min( packet<float,4> a, packet<float,4> b )
+            { return { _mm_min_ps( a.v, b.v ) }; }
+
+        inline packet<float,4>
+        max( packet<float,4> a, packet<float,4> b )
+            { return { _mm_max_ps( a.v, b.v ) }; }
+
+        inline void
+        transpose( packet<float,4>& r0, packet<float,4>& r1,
+                   packet<float,4>& r2, packet<float,4>& r3 )
+            {
+            _MM_TRANSPOSE4_PS( r0.v, r1.v, r2.v, r3.v );
+            }
+
+
+        template<>
+        struct packet<double,2>
+            {
+            __m128d v;
+
+            static constexpr size_t
+            width()
+                { return 2; }
+
+            static packet
+            load( const double* p )
+                { return { _mm_loadu_pd(p) }; }
+
+            static packet
+            broadcast( double s )
+                { return { _mm_set1_pd(s) }; }
+
+            void
+            store( double* p ) const
+                { _mm_storeu_pd( p, v ); }
+            };
+
+        inline packet<double,2>
+        operator + ( packet<double,2> a, packet<double,2> b )
+            { return { _mm_add_pd( a.v, b.v ) }; }
+
+        inline packet<double,2>
+        operator - ( packet<double,2> a, packet<double,2> b )
+            { return { _mm_sub_pd( a.v, b.v ) }; }
+
+        inline packet<double,2>
+        operator * ( packet<double,2> a, packet<double,2> b )
+            { return { _mm_mul_pd( a.v, b.v ) }; }
+
+        inline packet<double,2>
+        operator / ( packet<double,2> a, packet<double,2> b )
+            { return { _mm_div_pd( a.v, b.v ) }; }
+
+        inline packet<double,2>
+        operator - ( packet<double,2> a )
+            { return { _mm_xor_pd( a.v, _mm_set1_pd(-0.0) ) }; }
+
+        inline double
+        sum( packet<double,2> a )
+            {
+            return _mm_cvtsd_f64(
+                _mm_add_sd( a.v, _mm_unpackhi_pd( a.v, a.v ) ) );
+            }
+
+        inline packet<double,2>
+        sqrt( packet<double,2> a )
+            { return { _mm_sqrt_pd( a.v ) }; }
+
+        inline packet<double,2>
+        operator < ( packet<double,2> a, packet<double,2> b )
+            { return { _mm_cmplt_pd( a.v, b.v ) }; }
+
+        inline packet<double,2>
+        operator <= ( packet<double,2> a, packet<double,2> b )
+            { return { _mm_cmple_pd( a.v, b.v ) }; }
+
+        inline packet<double,2>
+        operator & ( packet<double,2> a, packet<double,2> b )
+            { return { _mm_and_pd( a.v, b.v ) }; }
+
+        inline packet<double,2>
+        operator | ( packet<double,2> a, packet<double,2> b )
+            { return { _mm_or_pd( a.v, b.v ) }; }
+
+        inline unsigned
+        movemask( packet<double,2> a )
+            { return unsigned( _mm_movemask_pd( a.v ) ); }
+
+        inline packet<double,2>
+        min( packet<double,2> a, packet<double,2> b )
+            { return { _mm_min_pd( a.v, b.v ) }; }
+
+        inline packet<double,2>
+        max( packet<double,2> a, packet<double,2> b )
+            { return { _mm_max_pd( a.v, b.v ) }; }
+#endif // TUMBO_SSE2
+
+
+#if defined(TUMBO_AVX)
+        template<>
+        struct packet<double,4>
+            {
+            __m256d v;
+
+            static constexpr size_t
+            width()
+                { return 4; }
+
+            static packet
+            load( const double* p )
+                { return { _mm256_loadu_pd(p) }; }
+
+            static packet
+            broadcast( double s )
+                { return { _mm256_set1_pd(s) }; }
+
+            void
+            store( double* p ) const
+                { _mm256_storeu_pd( p, v ); }
+            };
+
+        inline packet<double,4>
+        operator + ( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_add_pd( a.v, b.v ) }; }
+
+        inline packet<double,4>
+        operator - ( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_sub_pd( a.v, b.v ) }; }
+
+        inline packet<double,4>
+        operator * ( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_mul_pd( a.v, b.v ) }; }
+
+        inline packet<double,4>
+        operator / ( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_div_pd( a.v, b.v ) }; }
+
+        inline packet<double,4>
+        operator - ( packet<double,4> a )
+            { return { _mm256_xor_pd( a.v, _mm256_set1_pd(-0.0) ) }; }
+
+        inline double
+        sum( packet<double,4> a )
+            {
+            __m128d lo = _mm256_castpd256_pd128( a.v );
+            __m128d hi = _mm256_extractf128_pd( a.v, 1 );
+            return sum( packet<double,2>{ _mm_add_pd( lo, hi ) } );
+            }
+
+        inline packet<double,4>
+        sqrt( packet<double,4> a )
+            { return { _mm256_sqrt_pd( a.v ) }; }
+
+        inline packet<double,4>
+        operator < ( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_cmp_pd( a.v, b.v, _CMP_LT_OQ ) }; }
+
+        inline packet<double,4>
+        operator <= ( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_cmp_pd( a.v, b.v, _CMP_LE_OQ ) }; }
+
+        inline packet<double,4>
+        operator & ( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_and_pd( a.v, b.v ) }; }
+
+        inline packet<double,4>
+        operator | ( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_or_pd( a.v, b.v ) }; }
+
+        inline unsigned
+        movemask( packet<double,4> a )
+            { return unsigned( _mm256_movemask_pd( a.v ) ); }
+
+        inline packet<double,4>
+        min( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_min_pd( a.v, b.v ) }; }
+
+        inline packet<double,4>
+        max( packet<double,4> a, packet<double,4> b )
+            { return { _mm256_max_pd( a.v, b.v ) }; }
+
+        inline void
+        transpose( packet<double,4>& r0, packet<double,4>& r1,
+                   packet<double,4>& r2, packet<double,4>& r3 )
+            {
+            __m256d t0 = _mm256_unpacklo_pd( r0.v, r1.v );
+            __m256d t1 = _mm256_unpackhi_pd( r0.v, r1.v );
+            __m256d t2 = _mm256_unpacklo_pd( r2.v, r3.v );
+            __m256d t3 = _mm256_unpackhi_pd( r2.v, r3.v );
+            r0.v = _mm256_permute2f128_pd( t0, t2, 0x20 );
+            r1.v = _mm256_permute2f128_pd( t1, t3, 0x20 );
+            r2.v = _mm256_permute2f128_pd( t0, t2, 0x31 );
+            r3.v = _mm256_permute2f128_pd( t1, t3, 0x31 );
+            }
+
+#elif defined(TUMBO_SSE2)
+        /* Without AVX a 4-wide double is a pair of SSE2 registers. */
+        template<>
+        struct packet<double,4>
+            {
+            __m128d lo, hi;
+
+            static constexpr size_t
+            width()
+                { return 4; }
+
+            static packet
+            load( const double* p )
+                { return { _mm_loadu_pd(p), _mm_loadu_pd(p+2) }; }
+
+            static packet
+            broadcast( double s )
+                { return { _mm_set1_pd(s), _mm_set1_pd(s) }; }
+
+            void
+            store( double* p ) const
+                {
+                _mm_storeu_pd( p, lo );
+                _mm_storeu_pd( p+2, hi );
+                }
+            };
+
+        inline packet<double,4>
+        operator + ( packet<double,4> a, packet<double,4> b )
+            { return { _mm_add_pd( a.lo, b.lo ), _mm_add_pd( a.hi, b.hi ) }; }
+
+        inline packet<double,4>
+        operator - ( packet<double,4> a, packet<double,4> b )
+            { return { _mm_sub_pd( a.lo, b.lo ), _mm_sub_pd( a.hi, b.hi ) }; }
+
+        inline packet<double,4>
+        operator * ( packet<double,4> a, packet<double,4> b )
+            { return { _mm_mul_pd( a.lo, b.lo ), _mm_mul_pd( a.hi, b.hi ) }; }
+
+        inline packet<double,4>
+        operator / ( packet<double,4> a, packet<double,4> b )
+            { return { _mm_div_pd( a.lo, b.lo ), _mm_div_pd( a.hi, b.hi ) }; }
+
+        inline packet<double,4>
+        operator - ( packet<double,4> a )
+            {
+            __m128d sign = _mm_set1_pd(-0.0);
+            return { _mm_xor_pd( a.lo, sign ), _mm_xor_pd( a.hi, sign ) };
+            }
+
+        inline double
+        sum( packet<double,4> a )
+            {
+            return sum( packet<double,2>{ _mm_add_pd( a.lo, a.hi ) } );
+            }
+
+        inline packet<double,4>
+        sqrt( packet<double,4> a )
+            { return { _mm_sqrt_pd( a.lo ), _mm_sqrt_pd( a.hi ) }; }
+
+        inline packet<double,4>
+        operator < ( packet<double,4> a, packet<double,4> b )
+            { return { _mm_cmplt_pd( a.lo, b.lo ), _mm_cmplt_pd( a.hi, b.hi ) }; }
+
+        inline packet<double,4>
+        operator <= ( packet<double,4> a, packet<double,4> b )
+            { return { _mm_cmple_pd( a.lo, b.lo ), _mm_cmple_pd( a.hi, b.hi ) }; }
+
+        inline packet<double,4>
+        operator & ( packet<double,4> a, packet<double,4> b )
+            { return { _mm_and_pd( a.lo, b.lo ), _mm_and_pd( a.hi, b.hi ) }; }
+
+        inline packet<double,4>
+        operator | ( packet<double,4> a, packet<double,4> b )
+            { return { _mm_or_pd( a.lo, b.lo ), _mm_or_pd( a.hi, b.hi ) }; }
+
+        inline unsigned
+        movemask( packet<double,4> a )
+            { return unsigned( _mm_movemask_pd( a.lo ) | _mm_movemask_pd( a.hi ) << 2 ); }
+
+        inline packet<double,4>
+        min( packet<double,4> a, packet<double,4> b )
+            { return { _mm_min_pd( a.lo, b.lo ), _mm_min_pd( a.hi, b.hi ) }; }
+
+        inline packet<double,4>
+        max( packet<double,4> a, packet<double,4> b )
+            { return { _mm_max_pd( a.lo, b.lo ), _mm_max_pd( a.hi, b.hi ) }; }
+
+        inline void
+        transpose( packet<double,4>& r0, packet<double,4>& r1,
+                   packet<double,4>& r2, packet<double,4>& r3 )
+            {
+            // Each row is two 2x2 blocks; transpose the blocks and swap
+            // the off-diagonal ones.
+            packet<double,4> t0 = {
+                _mm_unpacklo_pd( r0.lo, r1.lo ), _mm_unpacklo_pd( r2.lo, r3.lo ) };
+            packet<double,4> t1 = {
+                _mm_unpackhi_pd( r0.lo, r1.lo ), _mm_unpackhi_pd( r2.lo, r3.lo ) };
+            packet<double,4> t2 = {
+                _mm_unpacklo_pd( r0.hi, r1.hi ), _mm_unpacklo_pd( r2.hi, r3.hi ) };
+            packet<double,4> t3 = {
+                _mm_unpackhi_pd( r0.hi, r1.hi ), _mm_unpackhi_pd( r2.hi, r3.hi ) };
+            r0 = t0; r1 = t1; r2 = t2; r3 = t3;
+            }
+#endif // TUMBO_AVX
+
+#if defined(TUMBO_AVX)
+        template<>
+        struct packet<float,8>
+            {
+            __m256 v;
+
+            static constexpr size_t
+            width()
+                { return 8; }
+
+            static packet
+            load( const float* p )
+                { return { _mm256_loadu_ps(p) }; }
+
+            static packet
+            broadcast( float s )
+                { return { _mm256_set1_ps(s) }; }
+
+            void
+            store( float* p ) const
+                { _mm256_storeu_ps( p, v ); }
+            };
+
+        inline packet<float,8>
+        operator + ( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_add_ps( a.v, b.v ) }; }
+
+        inline packet<float,8>
+        operator - ( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_sub_ps( a.v, b.v ) }; }
+
+        inline packet<float,8>
+        operator * ( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_mul_ps( a.v, b.v ) }; }
+
+        inline packet<float,8>
+        operator / ( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_div_ps( a.v, b.v ) }; }
+
+        inline packet<float,8>
+        operator - ( packet<float,8> a )
+            { return { _mm256_xor_ps( a.v, _mm256_set1_ps(-0.0f) ) }; }
+
+        inline float
+        sum( packet<float,8> a )
+            {
+            __m128 lo = _mm256_castps256_ps128( a.v );
+            __m128 hi = _mm256_extractf128_ps( a.v, 1 );
+            return sum( packet<float,4>{ _mm_add_ps( lo, hi ) } );
+            }
+
+        inline packet<float,8>
+        sqrt( packet<float,8> a )
+            { return { _mm256_sqrt_ps( a.v ) }; }
+
+        inline packet<float,8>
+        operator < ( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_cmp_ps( a.v, b.v, _CMP_LT_OQ ) }; }
+
+        inline packet<float,8>
+        operator <= ( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_cmp_ps( a.v, b.v, _CMP_LE_OQ ) }; }
+
+        inline packet<float,8>
+        operator & ( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_and_ps( a.v, b.v ) }; }
+
+        inline packet<float,8>
+        operator | ( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_or_ps( a.v, b.v ) }; }
+
+        inline unsigned
+        movemask( packet<float,8> a )
+            { return unsigned( _mm256_movemask_ps( a.v ) ); }
+
+        inline packet<float,8>
+        min( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_min_ps( a.v, b.v ) }; }
+
+        inline packet<float,8>
+        max( packet<float,8> a, packet<float,8> b )
+            { return { _mm256_max_ps( a.v, b.v ) }; }
+
+#elif defined(TUMBO_SSE2)
+        /* Without AVX an 8-wide float is a pair of SSE2 registers. */
+        template<>
+        struct packet<float,8>
+            {
+            __m128 lo, hi;
+
+            static constexpr size_t
+            width()
+                { return 8; }
+
+            static packet
+            load( const float* p )
+                { return { _mm_loadu_ps(p), _mm_loadu_ps(p+4) }; }
+
+            static packet
+            broadcast( float s )
+                { return { _mm_set1_ps(s), _mm_set1_ps(s) }; }
+
+            void
+            store( float* p ) const
+                {
+                _mm_storeu_ps( p, lo );
+                _mm_storeu_ps( p+4, hi );
+                }
+            };
+
+        inline packet<float,8>
+        operator + ( packet<float,8> a, packet<float,8> b )
+            { return { _mm_add_ps( a.lo, b.lo ), _mm_add_ps( a.hi, b.hi ) }; }
+
+        inline packet<float,8>
+        operator - ( packet<float,8> a, packet<float,8> b )
+            { return { _mm_sub_ps( a.lo, b.lo ), _mm_sub_ps( a.hi, b.hi ) }; }
+
+        inline packet<float,8>
+        operator * ( packet<float,8> a, packet<float,8> b )
+            { return { _mm_mul_ps( a.lo, b.lo ), _mm_mul_ps( a.hi, b.hi ) }; }
+
+        inline packet<float,8>
+        operator / ( packet<float,8> a, packet<float,8> b )
+            { return { _mm_div_ps( a.lo, b.lo ), _mm_div_ps( a.hi, b.hi ) }; }
+
+        inline packet<float,8>
+        operator - ( packet<float,8> a )
+            {
+            __m128 sign = _mm_set1_ps(-0.0f);
+            return { _mm_xor_ps( a.lo, sign ), _mm_xor_ps( a.hi, sign ) };
+            }
+
+        inline float
+        sum( packet<float,8> a )
+            {
+            return sum( packet<float,4>{ _mm_add_ps( a.lo, a.hi ) } );
+            }
+
+        inline packet<float,8>
+        sqrt( packet<float,8> a )
+            { return { _mm_sqrt_ps( a.lo ), _mm_sqrt_ps( a.hi ) }; }
+
+        inline packet<float,8>
+        operator < ( packet<float,8> a, packet<float,8> b )
+            { return { _mm_cmplt_ps( a.lo, b.lo ), _mm_cmplt_ps( a.hi, b.hi ) }; }
+
+        inline packet<float,8>
+        operator <= ( packet<float,8> a, packet<float,8> b )
+            { return { _mm_cmple_ps( a.lo, b.lo ), _mm_cmple_ps( a.hi, b.hi ) }; }
+
+        inline packet<float,8>
+        operator & ( packet<float,8> a, packet<float,8> b )
+            { return { _mm_and_ps( a.lo, b.lo ), _mm_and_ps( a.hi, b.hi ) }; }
+
+        inline packet<float,8>
+        operator | ( packet<float,8> a, packet<float,8> b )
+            { return { _mm_or_ps( a.lo, b.lo ), _mm_or_ps( a.hi, b.hi ) }; }
+
+        inline unsigned
+        movemask( packet<float,8> a )
+            { return unsigned( _mm_movemask_ps( a.lo ) | _mm_movemask_ps( a.hi ) << 4 ); }
+
+        inline packet<float,8>
+        min( packet<float,8> a, packet<float,8> b )
+            { return { _mm_min_ps( a.lo, b.lo ), _mm_min_ps( a.hi, b.hi ) }; }
+
+        inline packet<float,8>
+        max( packet<float,8> a, packet<float,8> b )
+            { return { _mm_max_ps( a.lo, b.lo ), _mm_max_ps( a.hi, b.hi ) }; }
+#endif // TUMBO_AVX
+
+
+        /// Lanes per packet when processing many independent elements.
+        /** One AVX register (or two SSE2 ones) of float or double. */
+        template<class T>
+        struct batch_width
+            {
+            static constexpr size_t value = std::is_same<T,float>::value ? 8 : 4;
+            };
+
+
+        /* Kernels over 4-lane packets. Sizes are multiples of 4 and the
+            pointers may alias only if they are equal. */
+
+        template<class T> void
+        add( const T* a, const T* b, T* r, size_t n )
+            {
+            typedef packet<T,4> P;
+            for( size_t i=0; i<n; i+=4 )
+                ( P::load(a+i) + P::load(b+i) ).store(r+i);
+            }
+
+
+        template<class T> void
+        sub( const T* a, const T* b, T* r, size_t n )
+            {
+            typedef packet<T,4> P;
+            for( size_t i=0; i<n; i+=4 )
+                ( P::load(a+i) - P::load(b+i) ).store(r+i);
+            }
+
+
+        template<class T> void
+        emul( const T* a, const T* b, T* r, size_t n )
+            {
+            typedef packet<T,4> P;
+            for( size_t i=0; i<n; i+=4 )
+                ( P::load(a+i) * P::load(b+i) ).store(r+i);
+            }
+
+
+        template<class T> void
+        ediv( const T* a, const T* b, T* r, size_t n )
+            {
+            typedef packet<T,4> P;
+            for( size_t i=0; i<n; i+=4 )
+                ( P::load(a+i) / P::load(b+i) ).store(r+i);
+            }
+
+
+        template<class T> void
+        scale( const T* a, T s, T* r, size_t n )
+            {
+            typedef packet<T,4> P;
+            P ps = P::broadcast(s);
+            for( size_t i=0; i<n; i+=4 )
+                ( P::load(a+i) * ps ).store(r+i);
+            }
+
+
+        template<class T> void
+        divide( const T* a, T s, T* r, size_t n )
+            {
+            typedef packet<T,4> P;
+            P ps = P::broadcast(s);
+            for( size_t i=0; i<n; i+=4 )
+                ( P::load(a+i) / ps ).store(r+i);
+            }
+
+
+        template<class T> void
+        negate( const T* a, T* r, size_t n )
+            {
+            typedef packet<T,4> P;
+            for( size_t i=0; i<n; i+=4 )
+                ( -P::load(a+i) ).store(r+i);
+            }
+
+
+        template<class T> T
+        dot4( const T* a, const T* b )
+            {
+            typedef packet<T,4> P;
+            return sum( P::load(a) * P::load(b) );
+            }
+
+
+        /// r = transpose(a) for row major 4x4 matrices. r may not alias a.
+        template<class T> void
+        transpose44( const T* a, T* r )
+            {
+            typedef packet<T,4> P;
+            P r0 = P::load(a), r1 = P::load(a+4),
+              r2 = P::load(a+8), r3 = P::load(a+12);
+            transpose( r0, r1, r2, r3 );
+            r0.store(r); r1.store(r+4); r2.store(r+8); r3.store(r+12);
+            }
+
+
+        /// r = a*b for row major 4x4 matrices. r may not alias a or b.
+        /** Each row of r is a linear combination of the rows of b. */
+        template<class T> void
+        mul44( const T* a, const T* b, T* r )
+            {
+            typedef packet<T,4> P;
+            P b0 = P::load(b), b1 = P::load(b+4),
+              b2 = P::load(b+8), b3 = P::load(b+12);
+            for( size_t i=0; i<4; ++i )
+                {
+                const T* ai = a + i*4;
+                ( P::broadcast(ai[0]) * b0 + P::broadcast(ai[1]) * b1 +
+                  P::broadcast(ai[2]) * b2 + P::broadcast(ai[3]) * b3 )
+                    .store( r + i*4 );
+                }
+            }
+
+
+        /// r = a*v for a row major 4x4 matrix and a column vector.
+        template<class T> void
+        mul44v( const T* a, const T* v, T* r )
+            {
+            typedef packet<T,4> P;
+            P pv = P::load(v);
+            P r0 = P::load(a) * pv, r1 = P::load(a+4) * pv,
+              r2 = P::load(a+8) * pv, r3 = P::load(a+12) * pv;
+            transpose( r0, r1, r2, r3 );
+            ( r0 + r1 + r2 + r3 ).store(r);
+            }
+
+
+        /// r = v*a for a row vector and a row major 4x4 matrix.
+        template<class T> void
+        mulv44( const T* v, const T* a, T* r )
+            {
+            typedef packet<T,4> P;
+            ( P::broadcast(v[0]) * P::load(a) +
+              P::broadcast(v[1]) * P::load(a+4) +
+              P::broadcast(v[2]) * P::load(a+8) +
+              P::broadcast(v[3]) * P::load(a+12) ).store(r);
+            }
+
+        /// r = a*b for affine transforms stored as their top 3 rows.
+        /** Like mul44, with the implicit 0,0,0,1 bottom row of b only
+            adding a's translation column. */
+        template<class T> void
+        mul34( const T* a, const T* b, T* r )
+            {
+            typedef packet<T,4> P;
+            const T unit[4] = { 0, 0, 0, 1 };
+            P b0 = P::load(b), b1 = P::load(b+4), b2 = P::load(b+8),
+              b3 = P::load(unit);
+            for( size_t i=0; i<3; ++i )
+                {
+                const T* ai = a + i*4;
+                ( P::broadcast(ai[0]) * b0 + P::broadcast(ai[1]) * b1 +
+                  P::broadcast(ai[2]) * b2 + P::broadcast(ai[3]) * b3 )
+                    .store( r + i*4 );
+                }
+            }
+
+        } // namespace simd
+    } // namespace tumbo
+
+#endif // TUMBO_SIMD_HPP
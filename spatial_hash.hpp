@@ -0,0 +1,713 @@
+#ifndef TUMBO_SPATIAL_HASH_HPP
+#define TUMBO_SPATIAL_HASH_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+#include "morton.hpp"
+#include "parallel.hpp"
+
+/**
+    \file spatial_hash.hpp
+    \brief Uniform grid of boxes stored in a hash table of cells.
+
+    Space is cut into cubes of side cell_size, and the cell of a coordinate
+    x is floor( x / cell_size ) on each axis, a vec<int,D>. An object is
+    listed in every cell that its box touches, so the grid suits scenes of
+    objects of about a cell's size; one far larger than a cell is listed in
+    many cells. Works with integer boxes as well, dividing with rounding
+    towards minus infinity. Cells are clamped to +-2^30 on every axis.
+
+    Only cells holding objects are stored, in an open addressing table
+    with linear probing that is kept at most half full. A cell's objects
+    are a linked list through one entry array with a free list, so moving
+    and inserting do not allocate once the arrays have grown. move() only
+    touches the cells that the box enters or leaves.
+
+    rebuild() replaces the contents with a list of boxes. It sorts the
+    entries by the hash of their cell with radix_sort, which counting
+    sorts them a byte at a time in parallel, so each cell's list ends up
+    contiguous in the entry array.
+
+    Queries report each object once, from the lowest cell it shares with
+    the query region, without marking visited objects.
+*/
+
+namespace tumbo
+    {
+
+    template<class T, size_t D>
+    class spatial_hash
+        {
+        public:
+            typedef uint32_t id;
+            typedef vec<int,D> cell;
+
+            static constexpr id null = id(-1);
+
+            explicit
+            spatial_hash( T cell_size );
+
+            /// Adds an object and returns its id.
+            id
+            insert( const aabb<T,D>& box, size_t data = 0 );
+
+            void
+            remove( id a );
+
+            /// Changes the box of an object.
+            /** Returns true if it entered or left a cell. */
+            bool
+            move( id a, const aabb<T,D>& box );
+
+            /// Replaces the contents with boxes, giving box i the id and data i.
+            void
+            rebuild( const aabb_list<T,D>& boxes, size_t threads = 1 );
+
+            /// Removes all objects.
+            void
+            clear();
+
+            const aabb<T,D>&
+            box( id a ) const
+                { return objects_[a].box; }
+
+            size_t
+            data( id a ) const
+                { return objects_[a].data; }
+
+            T
+            cell_size() const
+                { return size_; }
+
+            /// Number of objects.
+            size_t
+            size() const
+                { return count_; }
+
+            /// Number of cells holding objects.
+            size_t
+            cell_count() const
+                { return cells_; }
+
+            /// The cell holding p.
+            cell
+            cell_of( const vec<T,D>& p ) const
+                {
+                cell c;
+                for( size_t d=0; d<D; ++d )
+                    c[d] = coordinate_( p[d] );
+                return c;
+                }
+
+            /// Number of objects listed in cell c.
+            size_t
+            objects_in( const cell& c ) const;
+
+            /// Calls fn( id ) for every object overlapping b.
+            /** Returns the number of objects tested. */
+            template<class Fn> size_t
+            query_overlaps( const aabb<T,D>& b, Fn fn ) const;
+
+            /// Calls fn( id ) for every object containing p.
+            template<class Fn> size_t
+            query_contains( const vec<T,D>& p, Fn fn ) const;
+
+            /// Calls fn( id ) for every object within radius of p.
+            template<class Fn> size_t
+            query_near( const vec<T,D>& p, T radius, Fn fn ) const;
+
+            /// Calls fn( id, id ) once for every pair of overlapping objects.
+            /** Returns the number of pairs tested. */
+            template<class Fn> size_t
+            query_pairs( Fn fn ) const;
+
+        private:
+            struct slot
+                {
+                cell key;
+                id first;       // First entry, null for an empty slot
+                };
+
+            struct entry
+                {
+                id object;
+                id next;        // In the cell's list or the free list
+                };
+
+            struct object
+                {
+                aabb<T,D> box;
+                size_t data;
+                cell lo, hi;    // Cells touched by box
+                id next;        // Next on the free list
+                bool used;
+                };
+
+            int
+            coordinate_( T x ) const;
+
+            void
+            cells_of_( const aabb<T,D>& box, cell& lo, cell& hi ) const
+                {
+                for( size_t d=0; d<D; ++d )
+                    {
+                    lo[d] = coordinate_( box(d,0) );
+                    hi[d] = coordinate_( box(d,1) );
+                    }
+                }
+
+            /* In double, as a query region can hold more than 2^64. */
+            static double
+            cells_in_( const cell& lo, const cell& hi )
+                {
+                double n = 1;
+                for( size_t d=0; d<D; ++d )
+                    n *= double( int64_t( hi[d] ) - lo[d] + 1 );
+                return n;
+                }
+
+            static bool
+            inside_( const cell& c, const cell& lo, const cell& hi )
+                {
+                for( size_t d=0; d<D; ++d )
+                    if( c[d] < lo[d] || hi[d] < c[d] )
+                        return false;
+                return true;
+                }
+
+            /* True in the lowest cell shared by the ranges lo and o. */
+            static bool
+            first_common_( const cell& c, const cell& lo, const object& o )
+                {
+                for( size_t d=0; d<D; ++d )
+                    if( c[d] != std::max( lo[d], o.lo[d] ) )
+                        return false;
+                return true;
+                }
+
+            /* Calls fn( c ) for every cell from lo to hi, x fastest. */
+            template<class Fn> static void
+            for_cells_( const cell& lo, const cell& hi, Fn fn )
+                {
+                cell c = lo;
+                for(;;)
+                    {
+                    fn( c );
+                    size_t d = 0;
+                    for( ; d<D; ++d )
+                        {
+                        if( c[d] < hi[d] )
+                            {
+                            ++c[d];
+                            break;
+                            }
+                        c[d] = lo[d];
+                        }
+                    if( d == D )
+                        return;
+                    }
+                }
+
+            static uint32_t
+            hash_( const cell& c )
+                {
+                uint32_t h = 0;
+                for( size_t d=0; d<D; ++d )
+                    {
+                    h = ( h + uint32_t( c[d] ) ) * 0x9E3779B1u;
+                    h ^= h >> 15;
+                    }
+                h *= 0x85EBCA6Bu;
+                h ^= h >> 13;
+                h *= 0xC2B2AE35u;
+                return h ^ h >> 16;
+                }
+
+            /* The first slot probed for c, from the high bits of the hash
+                so that slots are in the order of the hashes. */
+            size_t
+            home_( const cell& c ) const
+                {
+                return size_t( hash_( c ) >> shift_ );
+                }
+
+            /* The slot of c, null if c holds no objects. */
+            id
+            find_( const cell& c ) const
+                {
+                size_t mask = table_.size() - 1;
+                for( size_t i = home_( c ); table_[i].first != null; i = ( i+1 ) & mask )
+                    if( table_[i].key == c )
+                        return id( i );
+                return null;
+                }
+
+            /* The slot of c, taking an empty one if c is not there. */
+            id
+            claim_( const cell& c );
+
+            /* Empties slot i, moving later slots of the probe run back. */
+            void
+            erase_( size_t i );
+
+            /* Rehashes into a table of capacity slots, a power of two. */
+            void
+            resize_table_( size_t capacity );
+
+            void
+            link_( id a, const cell& c );
+
+            void
+            unlink_( id a, const cell& c );
+
+            /* Calls fn( id ) for the objects passing test in the cells from
+                lo to hi, each once. */
+            template<class Test, class Fn> size_t
+            query_cells_( const cell& lo, const cell& hi, Test test, Fn fn ) const;
+
+            std::vector<slot> table_;
+            std::vector<entry> entries_;
+            std::vector<object> objects_;
+            id free_entries_;
+            id free_objects_;
+            size_t cells_;
+            size_t count_;
+            unsigned shift_;
+            T size_;
+            T inverse_;
+        };
+
+
+    template<class T, size_t D>
+    spatial_hash<T,D>::spatial_hash( T cell_size ) :
+        free_entries_( null ),
+        free_objects_( null ),
+        cells_( 0 ),
+        count_( 0 ),
+        size_( cell_size ),
+        inverse_( std::is_integral<T>::value ? T(0) : T(1) / cell_size )
+        {
+        TUMBO_ASSERT( cell_size > 0 );
+        resize_table_( 16 );
+        }
+
+
+    template<class T, size_t D> int
+    spatial_hash<T,D>::coordinate_( T x ) const
+        {
+        constexpr int limit = 1 << 30;
+        if constexpr( std::is_integral<T>::value )
+            {
+            T q = x / size_;
+            if( x % size_ < 0 )
+                --q;
+            return q < -limit ? -limit : q > limit ? limit : int( q );
+            }
+        else
+            {
+            // Floor without a call to std::floor; NaN goes to the lowest cell.
+            T q = x * inverse_;
+            if( !( q > -limit ) )
+                return -limit;
+            if( q > limit )
+                return limit;
+            int i = int( q );
+            return i - int( T( i ) > q );
+            }
+        }
+
+
+    template<class T, size_t D> size_t
+    spatial_hash<T,D>::objects_in( const cell& c ) const
+        {
+        id s = find_( c );
+        size_t n = 0;
+        if( s != null )
+            for( id e = table_[s].first; e != null; e = entries_[e].next )
+                ++n;
+        return n;
+        }
+
+
+    template<class T, size_t D> typename spatial_hash<T,D>::id
+    spatial_hash<T,D>::claim_( const cell& c )
+        {
+        if( 2*( cells_+1 ) > table_.size() )
+            resize_table_( 2*table_.size() );
+        size_t mask = table_.size() - 1;
+        size_t i = home_( c );
+        for( ; table_[i].first != null; i = ( i+1 ) & mask )
+            if( table_[i].key == c )
+                return id( i );
+        table_[i].key = c;
+        ++cells_;
+        return id( i );
+        }
+
+
+    template<class T, size_t D> void
+    spatial_hash<T,D>::erase_( size_t i )
+        {
+        size_t mask = table_.size() - 1;
+        for( size_t j = ( i+1 ) & mask; table_[j].first != null; j = ( j+1 ) & mask )
+            {
+            // Slot j can fill the hole at i unless its home lies in (i,j].
+            size_t home = home_( table_[j].key );
+            bool stays = i <= j ? ( i < home && home <= j ) : ( i < home || home <= j );
+            if( stays )
+                continue;
+            table_[i] = table_[j];
+            i = j;
+            }
+        table_[i].first = null;
+        --cells_;
+        }
+
+
+    template<class T, size_t D> void
+    spatial_hash<T,D>::resize_table_( size_t capacity )
+        {
+        std::vector<slot> old( capacity, slot{ cell(), null } );
+        old.swap( table_ );
+        shift_ = 32;
+        for( size_t c = capacity; c > 1; c >>= 1 )
+            --shift_;
+        size_t mask = capacity - 1;
+        for( const slot& s : old )
+            if( s.first != null )
+                {
+                size_t i = home_( s.key );
+                while( table_[i].first != null )
+                    i = ( i+1 ) & mask;
+                table_[i] = s;
+                }
+        }
+
+
+    template<class T, size_t D> void
+    spatial_hash<T,D>::link_( id a, const cell& c )
+        {
+        id e;
+        if( free_entries_ != null )
+            {
+            e = free_entries_;
+            free_entries_ = entries_[e].next;
+            }
+        else
+            {
+            TUMBO_ASSERT( entries_.size() < null );
+            e = id( entries_.size() );
+            entries_.emplace_back();
+            }
+        id s = claim_( c );
+        entries_[e].object = a;
+        entries_[e].next = table_[s].first;
+        table_[s].first = e;
+        }
+
+
+    template<class T, size_t D> void
+    spatial_hash<T,D>::unlink_( id a, const cell& c )
+        {
+        id s = find_( c );
+        TUMBO_ASSERT( s != null );
+        id* link = &table_[s].first;
+        while( entries_[*link].object != a )
+            link = &entries_[*link].next;
+        id e = *link;
+        *link = entries_[e].next;
+        entries_[e].next = free_entries_;
+        free_entries_ = e;
+        if( table_[s].first == null )
+            erase_( s );
+        }
+
+
+    template<class T, size_t D> typename spatial_hash<T,D>::id
+    spatial_hash<T,D>::insert( const aabb<T,D>& box, size_t data )
+        {
+        id a;
+        if( free_objects_ != null )
+            {
+            a = free_objects_;
+            free_objects_ = objects_[a].next;
+            }
+        else
+            {
+            TUMBO_ASSERT( objects_.size() < null );
+            a = id( objects_.size() );
+            objects_.emplace_back();
+            }
+        object& o = objects_[a];
+        o.box = box;
+        o.data = data;
+        o.used = true;
+        cells_of_( box, o.lo, o.hi );
+        for_cells_( o.lo, o.hi, [&]( const cell& c ) { link_( a, c ); } );
+        ++count_;
+        return a;
+        }
+
+
+    template<class T, size_t D> void
+    spatial_hash<T,D>::remove( id a )
+        {
+        TUMBO_ASSERT( a < objects_.size() && objects_[a].used );
+        object& o = objects_[a];
+        for_cells_( o.lo, o.hi, [&]( const cell& c ) { unlink_( a, c ); } );
+        o.used = false;
+        o.next = free_objects_;
+        free_objects_ = a;
+        --count_;
+        }
+
+
+    template<class T, size_t D> bool
+    spatial_hash<T,D>::move( id a, const aabb<T,D>& box )
+        {
+        TUMBO_ASSERT( a < objects_.size() && objects_[a].used );
+        object& o = objects_[a];
+        o.box = box;
+        cell lo, hi;
+        cells_of_( box, lo, hi );
+        if( lo == o.lo && hi == o.hi )
+            return false;
+        for_cells_( o.lo, o.hi, [&]( const cell& c )
+            {
+            if( !inside_( c, lo, hi ) )
+                unlink_( a, c );
+            } );
+        for_cells_( lo, hi, [&]( const cell& c )
+            {
+            if( !inside_( c, o.lo, o.hi ) )
+                link_( a, c );
+            } );
+        o.lo = lo;
+        o.hi = hi;
+        return true;
+        }
+
+
+    template<class T, size_t D> void
+    spatial_hash<T,D>::clear()
+        {
+        table_.clear();
+        resize_table_( 16 );
+        entries_.clear();
+        objects_.clear();
+        free_entries_ = free_objects_ = null;
+        cells_ = count_ = 0;
+        }
+
+
+    template<class T, size_t D> void
+    spatial_hash<T,D>::rebuild( const aabb_list<T,D>& boxes, size_t threads )
+        {
+        clear();
+        size_t n = boxes.size();
+        TUMBO_ASSERT( n < null );
+        objects_.resize( n );
+        std::vector<size_t> offsets( n+1, 0 );
+        parallel_for( 0, n, threads, [&]( size_t i0, size_t i1 )
+            {
+            for( size_t i=i0; i < i1; ++i )
+                {
+                object& o = objects_[i];
+                o.box = boxes[i];
+                o.data = i;
+                o.used = true;
+                cells_of_( o.box, o.lo, o.hi );
+                offsets[i+1] = size_t( cells_in_( o.lo, o.hi ) );
+                }
+            }, 1024 );
+        for( size_t i=0; i < n; ++i )
+            offsets[i+1] += offsets[i];
+        size_t m = offsets[n];
+        TUMBO_ASSERT( m < null );
+        count_ = n;
+
+        // One entry per object and cell, sorted by the hash of the cell.
+        std::vector<cell> keys( m );
+        std::vector<uint32_t> hashes( m ), order( m );
+        std::vector<id> owner( m );
+        parallel_for( 0, n, threads, [&]( size_t i0, size_t i1 )
+            {
+            for( size_t i=i0; i < i1; ++i )
+                {
+                size_t e = offsets[i];
+                for_cells_( objects_[i].lo, objects_[i].hi, [&]( const cell& c )
+                    {
+                    keys[e] = c;
+                    hashes[e] = hash_( c );
+                    order[e] = uint32_t( e );
+                    owner[e] = id( i );
+                    ++e;
+                    } );
+                }
+            }, 1024 );
+        radix_sort( hashes.data(), order.data(), m, threads );
+
+        /* Cells sharing a hash may interleave; those runs are sorted by
+            cell, keeping the objects in order. Then every cell starts a
+            list. */
+        auto less = [&]( uint32_t a, uint32_t b )
+            {
+            return std::lexicographical_compare( &keys[a][0], &keys[a][0] + D,
+                                                 &keys[b][0], &keys[b][0] + D );
+            };
+        std::vector<uint32_t> starts;
+        for( size_t j=0; j < m; )
+            {
+            size_t k = j+1;
+            bool mixed = false;
+            for( ; k < m && hashes[k] == hashes[j]; ++k )
+                mixed |= !( keys[ order[k] ] == keys[ order[j] ] );
+            if( mixed )
+                std::stable_sort( order.begin() + j, order.begin() + k, less );
+            for( size_t i=j; i < k; ++i )
+                if( i == j || !( keys[ order[i] ] == keys[ order[i-1] ] ) )
+                    starts.push_back( uint32_t( i ) );
+            j = k;
+            }
+
+        size_t capacity = 16;
+        while( capacity < 2*starts.size() )
+            capacity *= 2;
+        /* The cells come in the order of their homes, so each goes to its
+            home or right after the previous one, until the probe runs wrap
+            around past the end. */
+        resize_table_( capacity );
+        size_t mask = capacity - 1, next = 0;
+        for( uint32_t s : starts )
+            {
+            size_t i = std::max( size_t( hashes[s] >> shift_ ), next );
+            while( table_[ i & mask ].first != null )
+                ++i;
+            table_[ i & mask ] = slot{ keys[ order[s] ], s };
+            next = i+1;
+            }
+        cells_ = starts.size();
+
+        entries_.resize( m );
+        parallel_for( 0, m, threads, [&]( size_t j0, size_t j1 )
+            {
+            for( size_t j=j0; j < j1; ++j )
+                {
+                entries_[j].object = owner[ order[j] ];
+                entries_[j].next = j+1 < m && keys[ order[j+1] ] == keys[ order[j] ] ?
+                                   id( j+1 ) : null;
+                }
+            }, 4096 );
+        }
+
+
+    template<class T, size_t D>
+    template<class Test, class Fn> size_t
+    spatial_hash<T,D>::query_cells_( const cell& lo, const cell& hi, Test test, Fn fn ) const
+        {
+        size_t tested = 0;
+        auto visit = [&]( const cell& c, id first )
+            {
+            for( id e = first; e != null; e = entries_[e].next )
+                {
+                ++tested;
+                const object& o = objects_[ entries_[e].object ];
+                if( test( o.box ) && first_common_( c, lo, o ) )
+                    fn( entries_[e].object );
+                }
+            };
+        // A region with more cells than the table is cheaper to scan.
+        if( cells_in_( lo, hi ) > double( table_.size() ) )
+            {
+            for( const slot& s : table_ )
+                if( s.first != null && inside_( s.key, lo, hi ) )
+                    visit( s.key, s.first );
+            }
+        else
+            for_cells_( lo, hi, [&]( const cell& c )
+                {
+                id s = find_( c );
+                if( s != null )
+                    visit( c, table_[s].first );
+                } );
+        return tested;
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    spatial_hash<T,D>::query_overlaps( const aabb<T,D>& b, Fn fn ) const
+        {
+        cell lo, hi;
+        cells_of_( b, lo, hi );
+        return query_cells_( lo, hi, [&]( const aabb<T,D>& box )
+            { return overlaps( box, b ); }, fn );
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    spatial_hash<T,D>::query_contains( const vec<T,D>& p, Fn fn ) const
+        {
+        id s = find_( cell_of( p ) );
+        if( s == null )
+            return 0;
+        size_t tested = 0;
+        for( id e = table_[s].first; e != null; e = entries_[e].next )
+            {
+            ++tested;
+            if( contains( objects_[ entries_[e].object ].box, p ) )
+                fn( entries_[e].object );
+            }
+        return tested;
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    spatial_hash<T,D>::query_near( const vec<T,D>& p, T radius, Fn fn ) const
+        {
+        aabb<T,D> b;
+        for( size_t d=0; d<D; ++d )
+            {
+            b(d,0) = p[d] - radius;
+            b(d,1) = p[d] + radius;
+            }
+        cell lo, hi;
+        cells_of_( b, lo, hi );
+        return query_cells_( lo, hi, [&]( const aabb<T,D>& box )
+            { return distance_sq( box, p ) <= radius*radius; }, fn );
+        }
+
+
+    template<class T, size_t D>
+    template<class Fn> size_t
+    spatial_hash<T,D>::query_pairs( Fn fn ) const
+        {
+        size_t tested = 0;
+        for( const slot& s : table_ )
+            {
+            if( s.first == null )
+                continue;
+            for( id e = s.first; e != null; e = entries_[e].next )
+                {
+                const object& a = objects_[ entries_[e].object ];
+                for( id f = entries_[e].next; f != null; f = entries_[f].next )
+                    {
+                    ++tested;
+                    const object& b = objects_[ entries_[f].object ];
+                    if( overlaps( a.box, b.box ) && first_common_( s.key, a.lo, b ) )
+                        fn( entries_[e].object, entries_[f].object );
+                    }
+                }
+            }
+        return tested;
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_SPATIAL_HASH_HPP
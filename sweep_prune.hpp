@@ -0,0 +1,450 @@
+#ifndef TUMBO_SWEEP_PRUNE_HPP
+#define TUMBO_SWEEP_PRUNE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "tumbo.hpp"
+#include "aabb.hpp"
+
+/**
+    \file sweep_prune.hpp
+    \brief Incremental sweep and prune broadphase.
+
+    Every axis keeps the low and high ends of all boxes in one sorted
+    array. Between frames the boxes move a little, so update() restores
+    the order with an insertion sort that is close to linear. A low end
+    passing a high end is the only way two boxes can start or stop
+    overlapping. A low end moving down past a high end tests the pair with
+    overlaps() and adds it to the pair set; a high end moving down past a
+    low end removes the pair without a test. Ties sort high ends first,
+    so the arrays agree with the strict overlaps().
+
+    update() lists the pairs that started and stopped overlapping since the
+    previous update in added() and removed(). The pair set is an open
+    addressed hash table and the lists keep their capacity, so once they
+    have grown to the scene nothing is allocated per frame. Inserting more
+    than the boxes already present sorts the arrays and sweeps the pairs
+    from scratch instead.
+*/
+
+namespace tumbo
+    {
+
+    /* Set of id pairs in open addressing with linear probing. Erasing
+        shifts the following entries back, so no tombstones build up. */
+    class pair_set_
+        {
+        public:
+            static constexpr uint64_t empty = uint64_t(-1);
+
+            pair_set_() :
+                size_( 0 ), table_( 16, empty )
+                {}
+
+            static uint64_t
+            key( uint32_t a, uint32_t b )
+                {
+                if( b < a )
+                    std::swap( a, b );
+                return uint64_t(a) << 32 | b;
+                }
+
+            static std::pair<uint32_t,uint32_t>
+            unpack( uint64_t k )
+                {
+                return { uint32_t( k >> 32 ), uint32_t( k ) };
+                }
+
+            /// Returns false if k was already present.
+            bool
+            insert( uint64_t k )
+                {
+                if( 2*( size_+1 ) > table_.size() )
+                    grow_();
+                size_t i = find_( k );
+                if( table_[i] == k )
+                    return false;
+                table_[i] = k;
+                ++size_;
+                return true;
+                }
+
+            /// Returns false if k was not present.
+            bool
+            erase( uint64_t k )
+                {
+                size_t mask = table_.size() - 1;
+                size_t i = find_( k );
+                if( table_[i] != k )
+                    return false;
+                // Move back the entries whose probe passed the hole.
+                for( size_t j = (i+1) & mask; table_[j] != empty; j = (j+1) & mask )
+                    {
+                    size_t home = hash_( table_[j] );
+                    if( ( ( j - home ) & mask ) >= ( ( j - i ) & mask ) )
+                        {
+                        table_[i] = table_[j];
+                        i = j;
+                        }
+                    }
+                table_[i] = empty;
+                --size_;
+                return true;
+                }
+
+            bool
+            contains( uint64_t k ) const
+                {
+                return table_[ find_( k ) ] == k;
+                }
+
+            size_t
+            size() const
+                { return size_; }
+
+            template<class Fn> void
+            for_each( Fn fn ) const
+                {
+                for( uint64_t k : table_ )
+                    if( k != empty )
+                        fn( k );
+                }
+
+            void
+            clear()
+                {
+                std::fill( table_.begin(), table_.end(), empty );
+                size_ = 0;
+                }
+
+        private:
+            size_t
+            hash_( uint64_t k ) const
+                {
+                k *= 0x9E3779B97F4A7C15ull;
+                return size_t( k >> 32 ) & ( table_.size() - 1 );
+                }
+
+            size_t
+            find_( uint64_t k ) const
+                {
+                size_t mask = table_.size() - 1;
+                size_t i = hash_( k );
+                while( table_[i] != empty && table_[i] != k )
+                    i = (i+1) & mask;
+                return i;
+                }
+
+            void
+            grow_()
+                {
+                std::vector<uint64_t> old( 2*table_.size(), empty );
+                old.swap( table_ );
+                for( uint64_t k : old )
+                    if( k != empty )
+                        table_[ find_( k ) ] = k;
+                }
+
+            size_t size_;
+            std::vector<uint64_t> table_;
+        };
+
+
+    template<class T, size_t D>
+    class sweep_prune
+        {
+        public:
+            typedef uint32_t id;
+            typedef std::pair<id,id> pair;
+
+            /// Adds a box, its pairs appear in the next update.
+            id
+            insert( const aabb<T,D>& box );
+
+            /// Removes a box, its pairs are removed in the next update.
+            void
+            remove( id a );
+
+            /// Changes the box of a.
+            void
+            move( id a, const aabb<T,D>& box );
+
+            const aabb<T,D>&
+            box( id a ) const
+                { return objects_[a].box; }
+
+            /// Restores the sort order and updates the pairs.
+            void
+            update();
+
+            /// Pairs that started overlapping in the last update.
+            const std::vector<pair>&
+            added() const
+                { return added_; }
+
+            /// Pairs that stopped overlapping in the last update.
+            const std::vector<pair>&
+            removed() const
+                { return removed_; }
+
+            /// Number of overlapping pairs after the last update.
+            size_t
+            pair_count() const
+                { return pairs_.size(); }
+
+            bool
+            overlapping( id a, id b ) const
+                { return pairs_.contains( pair_set_::key( a, b ) ); }
+
+            /// Calls fn( a, b ) with a < b for every overlapping pair.
+            template<class Fn> void
+            for_each_pair( Fn fn ) const
+                {
+                pairs_.for_each( [&]( uint64_t k )
+                    {
+                    auto p = pair_set_::unpack( k );
+                    fn( p.first, p.second );
+                    } );
+                }
+
+            /// Number of boxes.
+            size_t
+            size() const
+                { return objects_.size() - free_.size() - removing_.size(); }
+
+        private:
+            struct endpoint
+                {
+                T value;
+                uint32_t tag;   // id << 1, plus 1 for high ends
+
+                bool
+                operator < ( const endpoint& e ) const
+                    {
+                    return value < e.value ||
+                        ( value == e.value && ( tag & 1 ) > ( e.tag & 1 ) );
+                    }
+                };
+
+            struct object
+                {
+                aabb<T,D> box;
+                uint32_t end[D][2]; // Position of the low and high ends
+                };
+
+            void
+            place_( size_t d, size_t i )
+                {
+                uint32_t tag = axes_[d][i].tag;
+                objects_[ tag >> 1 ].end[d][ tag & 1 ] = uint32_t(i);
+                }
+
+            /* a and b now overlap along one axis, they may overlap. */
+            void
+            begin_( id a, id b )
+                {
+                if( !overlaps( objects_[a].box, objects_[b].box ) )
+                    return;
+                uint64_t k = pair_set_::key( a, b );
+                if( pairs_.insert( k ) )
+                    added_.push_back( pair_set_::unpack( k ) );
+                }
+
+            /* a and b no longer overlap along one axis. */
+            void
+            end_( id a, id b )
+                {
+                uint64_t k = pair_set_::key( a, b );
+                if( pairs_.erase( k ) )
+                    removed_.push_back( pair_set_::unpack( k ) );
+                }
+
+            void
+            sort_axis_( size_t d );
+
+            void
+            rebuild_();
+
+            std::vector<object> objects_;
+            std::vector<endpoint> axes_[D];
+            std::vector<id> free_;
+            std::vector<id> removing_;
+            size_t inserted_ = 0;
+            pair_set_ pairs_;
+            std::vector<pair> added_, removed_;
+        };
+
+
+    template<class T, size_t D> typename sweep_prune<T,D>::id
+    sweep_prune<T,D>::insert( const aabb<T,D>& box )
+        {
+        id a;
+        if( free_.empty() )
+            {
+            TUMBO_ASSERT( objects_.size() < ( uint32_t(1) << 31 ) );
+            a = id( objects_.size() );
+            objects_.emplace_back();
+            }
+        else
+            {
+            a = free_.back();
+            free_.pop_back();
+            }
+        objects_[a].box = box;
+        // Appended unsorted, update() moves the ends into place.
+        for( size_t d=0; d<D; ++d )
+            for( uint32_t h=0; h<2; ++h )
+                {
+                axes_[d].push_back( { box(d,h), a << 1 | h } );
+                place_( d, axes_[d].size() - 1 );
+                }
+        ++inserted_;
+        return a;
+        }
+
+
+    template<class T, size_t D> void
+    sweep_prune<T,D>::remove( id a )
+        {
+        // Moves out of every overlap and to the end of the axes.
+        move( a, uniform< aabb<T,D> >( std::numeric_limits<T>::max() ) );
+        removing_.push_back( a );
+        }
+
+
+    template<class T, size_t D> void
+    sweep_prune<T,D>::move( id a, const aabb<T,D>& box )
+        {
+        object& o = objects_[a];
+        o.box = box;
+        for( size_t d=0; d<D; ++d )
+            {
+            axes_[d][ o.end[d][0] ].value = box(d,0);
+            axes_[d][ o.end[d][1] ].value = box(d,1);
+            }
+        }
+
+
+    template<class T, size_t D> void
+    sweep_prune<T,D>::sort_axis_( size_t d )
+        {
+        std::vector<endpoint>& axis = axes_[d];
+        for( size_t i=1; i < axis.size(); ++i )
+            {
+            if( !( axis[i] < axis[i-1] ) )
+                continue;
+            endpoint e = axis[i];
+            size_t j = i;
+            do
+                {
+                const endpoint& p = axis[j-1];
+                // Only a low end passing a high end changes an overlap. A
+                // pair that just separated along this axis cannot overlap,
+                // and one that just met can only have been in the set if
+                // an earlier axis added it.
+                if( ( ( e.tag ^ p.tag ) & 1 ) && ( e.tag >> 1 ) != ( p.tag >> 1 ) )
+                    {
+                    if( e.tag & 1 )
+                        end_( e.tag >> 1, p.tag >> 1 );
+                    else
+                        begin_( e.tag >> 1, p.tag >> 1 );
+                    }
+                axis[j] = p;
+                --j;
+                }
+            while( j > 0 && e < axis[j-1] );
+            axis[j] = e;
+            }
+        // One pass instead of one per swap.
+        for( size_t i=0; i < axis.size(); ++i )
+            place_( d, i );
+        }
+
+
+    template<class T, size_t D> void
+    sweep_prune<T,D>::rebuild_()
+        {
+        for( size_t d=0; d<D; ++d )
+            {
+            std::sort( axes_[d].begin(), axes_[d].end() );
+            for( size_t i=0; i < axes_[d].size(); ++i )
+                place_( d, i );
+            }
+
+        /* Sweep the first axis, testing each box against the open ones.
+            High ends sort first on ties, so a box of zero width closes
+            before it opens; it is tested against the open boxes and never
+            opened. Boxes being removed take no part. */
+        const uint32_t waiting = uint32_t(-1), closed = uint32_t(-2),
+                       removing = uint32_t(-3);
+        pair_set_ pairs;
+        std::vector<id> open;
+        std::vector<uint32_t> slot( objects_.size(), waiting );
+        for( id a : removing_ )
+            slot[a] = removing;
+        for( const endpoint& e : axes_[0] )
+            {
+            id a = e.tag >> 1;
+            if( slot[a] == removing )
+                continue;
+            if( e.tag & 1 )
+                {
+                if( slot[a] == waiting )
+                    {
+                    slot[a] = closed;
+                    continue;
+                    }
+                // Close a by moving the last open box into its slot.
+                open[ slot[a] ] = open.back();
+                slot[ open.back() ] = slot[a];
+                open.pop_back();
+                continue;
+                }
+            for( id b : open )
+                if( overlaps( objects_[a].box, objects_[b].box ) )
+                    pairs.insert( pair_set_::key( a, b ) );
+            if( slot[a] == closed )
+                continue;
+            slot[a] = uint32_t( open.size() );
+            open.push_back( a );
+            }
+
+        pairs.for_each( [&]( uint64_t k )
+            {
+            if( !pairs_.contains( k ) )
+                added_.push_back( pair_set_::unpack( k ) );
+            } );
+        pairs_.for_each( [&]( uint64_t k )
+            {
+            if( !pairs.contains( k ) )
+                removed_.push_back( pair_set_::unpack( k ) );
+            } );
+        std::swap( pairs_, pairs );
+        }
+
+
+    template<class T, size_t D> void
+    sweep_prune<T,D>::update()
+        {
+        added_.clear();
+        removed_.clear();
+        if( 2*inserted_ > objects_.size() )
+            rebuild_();
+        else
+            for( size_t d=0; d<D; ++d )
+                sort_axis_( d );
+        inserted_ = 0;
+
+        // Removed boxes sorted last on every axis.
+        for( size_t d=0; d<D; ++d )
+            axes_[d].resize( axes_[d].size() - 2*removing_.size() );
+        free_.insert( free_.end(), removing_.begin(), removing_.end() );
+        removing_.clear();
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_SWEEP_PRUNE_HPP
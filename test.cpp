@@ -1,7 +1,28 @@
 #include "tumbo.hpp"
+#include "affine.hpp"
+#include "aabb_packet.hpp"
+#include "bvh.hpp"
+#include "dmatrix.hpp"
+#include "dynamic_tree.hpp"
+#include "frustum.hpp"
+#include "loose_tree.hpp"
+#include "matrix_array.hpp"
+#include "matrix_view.hpp"
+#include "morton.hpp"
+#include "overlap_pairs.hpp"
+#include "parallel.hpp"
+#include "quantized_aabb.hpp"
+#include "ray.hpp"
+#include "ray_packet.hpp"
+#include "spatial_hash.hpp"
+#include "transform.hpp"
+#include "sweep_prune.hpp"
 #include "swizzling.hpp"
 #include "io.hpp"
 
+#include <random>
+#include <set>
+
 #include <gtest/gtest.h>
 
 using namespace tumbo;
@@ -72,6 +93,1965 @@ TEST( Multiplication, Mat22 )
     imat22 A2_correct{ 2,3,6,11 };
     ASSERT_EQ( A2, A2_correct );
     }
+
+TEST( Expression, Fused )
+    {
+    fvec3 a{ 1, 2, 3 };
+    fvec3 b{ 4, 5, 6 };
+    fvec3 c{ 1, 1, 1 };
+
+    auto e = a + b*2 - c;
+    ASSERT_EQ( e.size(), 3u );
+    fvec3 r = e;
+    ASSERT_EQ( r, (fvec3{8, 11, 14}) );
+
+    a[0] = 0;
+    ASSERT_EQ( eval(e), (fvec3{7, 11, 14}) );
+
+    // Operands that are temporaries are copied into the expression.
+    auto t = transpose( row( identity<fmat33>(), 1 ) ) * 3;
+    ASSERT_EQ( eval(t), (fvec3{0, 3, 0}) );
+
+    // The destination may be an operand.
+    a = b - a;
+    ASSERT_EQ( a, (fvec3{4, 3, 3}) );
+    a += -c / 2;
+    a *= 2;
+    ASSERT_EQ( a, (fvec3{7, 5, 5}) );
+
+    fmat44 m = identity<fmat44>();
+    fmat44 n = 2*m - m + 0.5f*m;
+    ASSERT_EQ( n, eval(1.5f*identity<fmat44>()) );
+
+    imat22 i{ 1, 2, 3, 4 };
+    dmat22 half = i / 2.0;
+    ASSERT_EQ( half, (dmat22{0.5, 1, 1.5, 2}) );
+
+    // Other scalar types convert, explicitly as between matrices.
+    dvec3 d( a + c );
+    ASSERT_EQ( d, (dvec3{8, 6, 6}) );
+    d = b - c;
+    ASSERT_EQ( d, (dvec3{3, 4, 5}) );
+    static_assert( !std::is_convertible< decltype( a + c ), dvec3 >::value );
+    }
+
+TEST( Expression, FunctionArguments )
+    {
+    fvec3 a{ 4, 0, 3 };
+    fvec3 b{ 0, 0, 3 };
+    fmat33 M{ 1, 0, 0,
+              0, 2, 0,
+              0, 0, 3 };
+
+    ASSERT_EQ( length( a - b ), 4.0f );
+    ASSERT_EQ( length_sq( a + b ), 52.0f );
+    ASSERT_EQ( dot( a + b, a ), 34.0f );
+    ASSERT_EQ( cross( a - b, b ), (fvec3{0, -12, 0}) );
+    ASSERT_EQ( normalize( a - b ), (fvec3{1, 0, 0}) );
+    ASSERT_EQ( transpose( a + b ) * M, (matrix<float,1,3>{4, 0, 18}) );
+    ASSERT_EQ( M * ( a - b ), (fvec3{4, 0, 0}) );
+    ASSERT_EQ( (weld( -a, b )), (matrix<float,3,2>{-4, 0, 0, 0, -3, 3}) );
+    ASSERT_TRUE( a + b == (fvec3{4, 0, 6}) );
+
+    float len = 0;
+    normalize( a * 2, &len );
+    ASSERT_EQ( len, 10.0f );
+    ASSERT_EQ( inverse( M * 2 )(2,2), 1/6.0f );
+    }
+
+TEST( Constexpr, Construction )
+    {
+    constexpr auto I = identity<fmat44>();
+    static_assert( I(0,0) == 1 && I(0,1) == 0 && I(3,3) == 1 );
+    static_assert( transpose(I) == I );
+
+    constexpr auto T = translation( fvec3{1, 2, 3} );
+    static_assert( T(0,3) == 1 && T(1,3) == 2 && T(2,3) == 3 );
+    constexpr fvec4 p = T * fvec4{1, 1, 1, 1};
+    static_assert( p == fvec4{2, 3, 4, 1} );
+
+    constexpr fmat44 TS = T * scaling( fvec3{2, 2, 2} );
+    static_assert( TS(0,0) == 2 && TS(1,1) == 2 && TS(1,3) == 2 );
+
+    constexpr auto O = orthographic<float>( -2, 2, -1, 1, 1, 3 );
+    static_assert( O(0,0) == 0.5f && O(1,1) == 1 && O(2,2) == -1 );
+
+    constexpr imat33 A{ 2,0,0, 0,3,0, 1,0,4 };
+    static_assert( determinant(A) == 24 );
+    constexpr dmat22 B = inverse( dmat22{ 2, 0, 0, 4 } );
+    static_assert( B(0,0) == 0.5 && B(1,1) == 0.25 && B(0,1) == 0 );
+
+    constexpr fvec3 e = fvec3{1, 2, 3} * 2.0f - fvec3{1, 1, 1};
+    static_assert( e == fvec3{1, 3, 5} );
+    static_assert( dot( fvec4{1, 2, 3, 4}, fvec4{1, 1, 1, 1} ) == 10 );
+    static_assert( cross( fvec3{1, 0, 0}, fvec3{0, 1, 0} ) == fvec3{0, 0, 1} );
+
+    // The same functions give the same results at runtime.
+    fmat44 rT = translation( fvec3{1, 2, 3} );
+    ASSERT_EQ( rT * scaling( fvec3{2, 2, 2} ), TS );
+    }
+
+TEST( Multiplication, Unrolled )
+    {
+    matrix<int,2,3> A{ 1, 2, 3,
+                       4, 5, 6 };
+    matrix<int,3,2> B = transpose(A);
+    ASSERT_EQ( B, (matrix<int,3,2>{1, 4, 2, 5, 3, 6}) );
+    ASSERT_EQ( A*B, (imat22{14, 32, 32, 77}) );
+    ASSERT_EQ( B*A, (imat33{17, 22, 27, 22, 29, 36, 27, 36, 45}) );
+
+    // Mixed scalar types promote like the element types do.
+    matrix<double,2,2> C = A * cast_matrix<double>(B);
+    ASSERT_EQ( C, (dmat22{14, 32, 32, 77}) );
+
+    // Large sizes take the loop path.
+    auto I = identity< matrix<float,8,8> >();
+    auto L = uniform< matrix<float,8,8> >(2);
+    ASSERT_EQ( I*L, L );
+
+    ASSERT_EQ( weld( A, ivec2{7, 8} ), (matrix<int,2,4>{1, 2, 3, 7, 4, 5, 6, 8}) );
+    ASSERT_EQ( weldv( A, transpose(ivec3{7, 8, 9}) ),
+               (imat33{1, 2, 3, 4, 5, 6, 7, 8, 9}) );
+    ASSERT_EQ( (submatrix<2,2>( B*A, 1, 1 )), (imat22{29, 36, 36, 45}) );
+    ASSERT_EQ( (submatrix<3,1>( fvec4{1, 2, 3, 4} )), (fvec3{1, 2, 3}) );
+    }
+
+TEST( MatOp, Determinant )
+    {
+    imat33 A{ 2, -3, 1,
+              2,  0, -1,
+              1,  4,  5 };
+    ASSERT_EQ( determinant(A), 49 );
+
+    dmat44 B{ 1, 0, 2, -1,
+              3, 0, 0,  5,
+              2, 1, 4, -3,
+              1, 0, 5,  0 };
+    ASSERT_DOUBLE_EQ( determinant(B), 30 );
+    ASSERT_DOUBLE_EQ( determinant(transpose(B)), 30 );
+    }
+
+TEST( MatOp, LargeInverse )
+    {
+    // det(L*U) is the product of the diagonal of U
+    matrix<int,5,5> L{ 1, 0, 0, 0, 0,
+                       2, 1, 0, 0, 0,
+                      -1, 3, 1, 0, 0,
+                       0, 1, 2, 1, 0,
+                       4, 0, 1, 1, 1 };
+    matrix<int,5,5> U{ 0, 1, 2, 0, 1,
+                       0, 3, 0, 1, 2,
+                       0, 0,-1, 2, 0,
+                       0, 0, 0, 4, 1,
+                       0, 0, 0, 0, 5 };
+    U(0,0) = 2;
+    matrix<int,5,5> A = L*U;
+    ASSERT_EQ( determinant(A), -120 );
+    // Zero leading pivot needs a row swap
+    A(0,0) = 0;
+    ASSERT_NEAR( determinant(A), determinant( cast_matrix<double>(A) ), 1e-9 );
+
+    matrix<double,6,6> B{};
+    for( size_t i=0; i<6; ++i )
+    for( size_t j=0; j<6; ++j )
+        B(i,j) = ( i == j ? 10.0 : 0.0 ) + double( (i*7 + j*3) % 5 ) - 2;
+    B(0,0) = 0; // Force a pivot
+    auto inv = inverse_and_determinant(B);
+    ASSERT_NEAR( inv.second, determinant(B), 1e-9 * std::abs(inv.second) );
+    auto I = B * inv.first;
+    for( size_t i=0; i<6; ++i )
+    for( size_t j=0; j<6; ++j )
+        ASSERT_NEAR( I(i,j), i == j ? 1.0 : 0.0, 1e-12 );
+
+    dmat44 C{ 1, 0, 2, -1,
+              3, 0, 0,  5,
+              2, 1, 4, -3,
+              1, 0, 5,  0 };
+    auto [Ci, det] = inverse_and_determinant(C);
+    ASSERT_DOUBLE_EQ( det, 30 );
+    auto J = Ci * C;
+    for( size_t i=0; i<4; ++i )
+    for( size_t j=0; j<4; ++j )
+        ASSERT_NEAR( J(i,j), i == j ? 1.0 : 0.0, 1e-12 );
+
+    ASSERT_TRUE( lu_decompose( matrix<double,5,5>{} ).singular );
+    static_assert( determinant( eval( identity< matrix<double,5,5> >() * 2.0 ) ) == 32,
+        "LU determinant is constexpr." );
+    }
+
+TEST( Affine, MatchesMat44 )
+    {
+    fmat44 M0 = translation( fvec3{1, 2, 3} ) * rotation( 0.5f, 1.f, 1.f, 0.f );
+    fmat44 M1 = rotation( -1.2f, 0.f, 0.f, 1.f ) * scaling( fvec3{2, 2, 0.5f} );
+    faffine3 A0 = to_affine( M0 ), A1 = to_affine( M1 );
+    ASSERT_EQ( to_matrix( A0 ), M0 );
+
+    fmat44 M = M0 * M1;
+    faffine3 A = compose( A0, A1 );
+    for( size_t i=0; i<3; ++i )
+    for( size_t j=0; j<4; ++j )
+        ASSERT_NEAR( A(i,j), M(i,j), 1e-6f );
+
+    fvec3 p{ 3, -1, 2 };
+    fvec4 q = M * fvec4{ 3, -1, 2, 1 };
+    fvec3 tp = transform_point( A, p );
+    fvec3 td = transform_direction( A, p );
+    fvec4 qd = M * fvec4{ 3, -1, 2, 0 };
+    for( size_t i=0; i<3; ++i )
+        {
+        ASSERT_NEAR( tp[i], q[i], 1e-5f );
+        ASSERT_NEAR( td[i], qd[i], 1e-5f );
+        }
+
+    // Rigid and general inverses both undo the transform.
+    faffine3 I0 = compose( rigid_inverse( A0 ), A0 );
+    faffine3 I = compose( affine_inverse( A ), A );
+    for( size_t i=0; i<3; ++i )
+    for( size_t j=0; j<4; ++j )
+        {
+        ASSERT_NEAR( I0(i,j), i == j ? 1.f : 0.f, 1e-6f );
+        ASSERT_NEAR( I(i,j), i == j ? 1.f : 0.f, 1e-5f );
+        }
+
+    constexpr daffine2 T = compose( affine_translation( dvec2{1, 2} ),
+                                    affine_scaling( dvec2{3, 4} ) );
+    static_assert( T(0,0) == 3 && T(1,1) == 4 && T(0,2) == 1 && T(1,2) == 2,
+        "Affine compose is constexpr." );
+    ASSERT_EQ( transform_point( affine_inverse( T ), dvec2{4, 6} ),
+               (dvec2{1, 1}) );
+    }
+
+TEST( MatrixArray, BatchOps )
+    {
+    // 11 elements leaves a partial packet at the end.
+    std::vector<fvec3> av, bv;
+    for( int i=0; i<11; ++i )
+        {
+        av.push_back( fvec3{ float(i), 1.f - i, 2.f + i*0.5f } );
+        bv.push_back( fvec3{ 3.f, float(i*i) - 4, -1.f } );
+        }
+    matrix_array<float,3,1> a( av.begin(), av.end() ), b;
+    for( auto& v : bv )
+        b.push_back( v );
+    ASSERT_EQ( a.size(), 11u );
+    ASSERT_EQ( a.stride() % a.lanes, 0u );
+
+    fmat33 R{ 1, 2, 0,
+              0, 1, -1,
+              3, 0, 1 };
+    auto sum = a + b;
+    auto scaled = 2.f * a;
+    auto d = dot( a, b );
+    auto c = cross( a, b );
+    auto l = length( b );
+    auto n = normalize( b );
+    auto ra = R * a;
+    for( size_t i=0; i<11; ++i )
+        {
+        ASSERT_EQ( fvec3(sum[i]), eval( av[i] + bv[i] ) );
+        ASSERT_EQ( fvec3(scaled[i]), eval( 2.f * av[i] ) );
+        ASSERT_FLOAT_EQ( d[i][0], dot( av[i], bv[i] ) );
+        ASSERT_EQ( fvec3(c[i]), cross( av[i], bv[i] ) );
+        ASSERT_FLOAT_EQ( l[i][0], length( bv[i] ) );
+        fvec3 ni = normalize( bv[i] );
+        for( size_t k=0; k<3; ++k )
+            ASSERT_FLOAT_EQ( n[i](k,0), ni[k] );
+        ASSERT_EQ( fvec3(ra[i]), R * av[i] );
+        }
+
+    // Growing a result zeroes what the operation left in the padding.
+    n.resize( 12 );
+    ASSERT_EQ( fvec3(n[11]), ( fvec3{ 0, 0, 0 } ) );
+    matrix_array<float,3,1> three( bv.begin(), bv.begin() + 3 );
+    auto n3 = normalize( three );
+    n3.resize( 4 );
+    ASSERT_EQ( fvec3(n3[3]), ( fvec3{ 0, 0, 0 } ) );
+
+    // Proxy writes go to the streams.
+    a[3] = fvec3{ 7, 8, 9 };
+    a[4](1,0) = 5;
+    ASSERT_EQ( a.stream(2)[3], 9 );
+    ASSERT_EQ( a.get(4)[1], 5 );
+
+    matrix_array<double,2,2> m( 5 ), i2( 5 );
+    for( size_t i=0; i<5; ++i )
+        {
+        m[i] = dmat22{ 1, double(i), 0, 2 };
+        i2[i] = identity<dmat22>();
+        }
+    auto mm = m * i2;
+    ASSERT_EQ( dmat22( mm[4] ), (dmat22{ 1, 4, 0, 2 }) );
+    m.resize( 2 );
+    m.resize( 5 );
+    ASSERT_EQ( dmat22( m[4] ), dmat22{} );
+    }
+
+TEST( Transform, Buffers )
+    {
+    fmat44 M = translation( fvec3{1, -2, 3} ) * rotation( 0.7f, 0.f, 1.f, 1.f ) *
+               scaling( fvec3{2, 1, 0.5f} );
+    fmat44 P = perspective( -1.f, 1.f, -1.f, 1.f, 1.f, 10.f );
+    std::vector<fvec3> in;
+    for( int i=0; i<5000; ++i )
+        in.push_back( fvec3{ float(i%17) - 8, float(i%5), -1.f - i%11 } );
+
+    std::vector<fvec3> pts( in.size() ), dirs( in.size() ),
+                       proj( in.size() ), nrm( in.size() );
+    transform_points( M, in.data(), pts.data(), in.size(), 0 );
+    transform_directions( to_affine(M), in.data(), dirs.data(), in.size() );
+    transform_points_projected( P, in.data(), proj.data(), in.size(), 3 );
+    transform_normals( M, in.data(), nrm.data(), in.size() );
+
+    fmat33 N = transpose( inverse( submatrix<3,3>( M ) ) );
+    for( size_t i=0; i<in.size(); ++i )
+        {
+        fvec4 p = M * weldv( in[i], scalar<float>{1} );
+        fvec4 d = M * weldv( in[i], scalar<float>{0} );
+        fvec4 q = P * weldv( in[i], scalar<float>{1} );
+        fvec3 n = N * in[i];
+        for( size_t k=0; k<3; ++k )
+            {
+            ASSERT_NEAR( pts[i][k], p[k], 1e-4f );
+            ASSERT_NEAR( dirs[i][k], d[k], 1e-4f );
+            ASSERT_NEAR( proj[i][k], q[k] / q[3], 1e-5f );
+            ASSERT_NEAR( nrm[i][k], n[k], 1e-4f );
+            }
+        }
+
+    // In place
+    transform_points( M, in.data(), in.data(), in.size(), 2 );
+    ASSERT_EQ( in, pts );
+    }
+
+TEST( Parallel, ForAndInvoke )
+    {
+    std::vector<int> v( 10000, 0 );
+    parallel_for( 0, v.size(), 0, [&]( size_t first, size_t last )
+        {
+        for( size_t i=first; i<last; ++i )
+            v[i] += int(i);
+        } );
+    for( size_t i=0; i<v.size(); ++i )
+        ASSERT_EQ( v[i], int(i) );
+
+    // Nested loops run on the waiting threads.
+    std::atomic<int> count( 0 );
+    parallel_for( 0, 8, 0, [&]( size_t first, size_t last )
+        {
+        for( size_t i=first; i<last; ++i )
+            parallel_for( 0, 100, 0, [&]( size_t a, size_t b )
+                { count += int( b-a ); } );
+        } );
+    ASSERT_EQ( count, 800 );
+
+    int a = 0, b = 0;
+    parallel_invoke( [&]{ a = 1; }, [&]{ b = 2; } );
+    ASSERT_EQ( a+b, 3 );
+
+    ASSERT_THROW( parallel_for( 0, 100, 4, []( size_t first, size_t )
+        {
+        if( first == 0 )
+            throw std::runtime_error( "task" );
+        } ), std::runtime_error );
+    }
+
+TEST( DMatrix, MultiplyAndSolve )
+    {
+    // Sizes that are not multiples of the blocks or the packets.
+    const size_t m = 37, k = 300, n = 261;
+    dmatrix<double> A( m, k ), B( k, n );
+    for( size_t i=0; i < A.size(); ++i )
+        A[i] = double( (i*7) % 13 ) - 6;
+    for( size_t i=0; i < B.size(); ++i )
+        B[i] = double( (i*5) % 11 ) - 5;
+
+    dmatrix<double> C = multiply( A, B, 3 );
+    ASSERT_EQ( C.height(), m );
+    ASSERT_EQ( C.width(), n );
+    for( size_t i=0; i<m; ++i )
+    for( size_t j=0; j<n; ++j )
+        {
+        double sum = 0;
+        for( size_t p=0; p<k; ++p )
+            sum += A(i,p) * B(p,j);
+        ASSERT_EQ( C(i,j), sum );
+        }
+    ASSERT_EQ( transpose( transpose( C ) ), C );
+    ASSERT_EQ( transpose( A * B ), transpose( B ) * transpose( A ) );
+
+    // Diagonally dominant so the system is well conditioned.
+    const size_t s = 150;
+    dmatrix<double> S( s, s ), X( s, 3 );
+    for( size_t i=0; i<s; ++i )
+        for( size_t j=0; j<s; ++j )
+            S(i,j) = ( i == j ? 2.0*s : 0.0 ) + double( (i*3 + j) % 7 ) - 3;
+    for( size_t i=0; i < X.size(); ++i )
+        X[i] = double(i%5) - 2;
+    dmatrix<double> Y = solve( S, S * X );
+    for( size_t i=0; i < X.size(); ++i )
+        ASSERT_NEAR( Y[i], X[i], 1e-12 );
+
+    dmatrix<double> I = S * inverse( S );
+    for( size_t i=0; i<s; ++i )
+    for( size_t j=0; j<s; ++j )
+        ASSERT_NEAR( I(i,j), i == j ? 1.0 : 0.0, 1e-12 );
+
+    // Rows rotated so the pivots come from later panels.
+    dmatrix<double> R( s, s );
+    for( size_t i=0; i<s; ++i )
+        for( size_t j=0; j<s; ++j )
+            R(i,j) = S( (i+70) % s, j );
+    Y = solve( R, R * X, 2 );
+    for( size_t i=0; i < X.size(); ++i )
+        ASSERT_NEAR( Y[i], X[i], 1e-12 );
+    ASSERT_FALSE( lu_decompose( R ).singular );
+    for( size_t j=0; j<s; ++j )
+        R(140,j) = R(3,j);
+    ASSERT_TRUE( lu_decompose( R, 2 ).singular );
+
+    // Agrees with the fixed size versions.
+    dmat44 F{ 1, 0, 2, -1,
+              3, 0, 0,  5,
+              2, 1, 4, -3,
+              1, 0, 5,  0 };
+    dmatrix<double> DF( F );
+    ASSERT_NEAR( determinant( DF ), 30, 1e-12 );
+    dmat44 Fi = to_fixed<4,4>( inverse( DF ) );
+    dmat44 Fj = inverse( F );
+    for( size_t i=0; i<16; ++i )
+        ASSERT_NEAR( Fi[i], Fj[i], 1e-14 );
+    ASSERT_EQ( (to_fixed<4,4>( DF * DF )), F * F );
+    ASSERT_EQ( (submatrix<2,2>( DF, 1, 2 )), (dmat22{ 0, 5, 4, -3 }) );
+    ASSERT_EQ( submatrix( DF, 1, 2, 2, 2 ), (dmatrix<double>( 2, 2, { 0, 5, 4, -3 } )) );
+    ASSERT_EQ( (to_fixed<1,4>( row( DF, 2 ) )), row( F, 2 ) );
+    ASSERT_EQ( (to_fixed<4,1>( column( DF, 3 ) )), column( F, 3 ) );
+    }
+
+TEST( MatrixView, InterleavedBuffer )
+    {
+    // Position, normal and texture coordinates per vertex.
+    const size_t stride = 8;
+    float buffer[ 3*stride ] = {
+        1, 2, 3,   0, 3, 4,   0, 0,
+        4, 5, 6,   2, 0, 0,   1, 0,
+        7, 8, 9,   0, 0, -5,  1, 1 };
+
+    for( size_t k=0; k<3; ++k )
+        {
+        matrix_view<float,3,1> n( buffer + k*stride + 3, 1 );
+        n = normalize( n );
+        ASSERT_FLOAT_EQ( length( n ), 1 );
+        }
+    ASSERT_FLOAT_EQ( buffer[4], 0.6f );
+    ASSERT_FLOAT_EQ( buffer[5], 0.8f );
+    ASSERT_FLOAT_EQ( buffer[6], 0 ); // Untouched
+
+    matrix_view<const float,3,1> p0( buffer, 1 ), p1( buffer + stride, 1 );
+    ASSERT_FLOAT_EQ( dot( p0, p1 ), 32 );
+    ASSERT_FLOAT_EQ( dot( p0, fvec3{1, 0, 0} ), 1 );
+    ASSERT_EQ( cross( p0, p1 ), cross( fvec3{1, 2, 3}, fvec3{4, 5, 6} ) );
+    fvec3 s = p0 + p1 * 2.f;
+    ASSERT_EQ( s, (fvec3{9, 12, 15}) );
+
+    // All three positions as the rows of a 3x3 view.
+    matrix_view<float,3,3> P( buffer, stride );
+    fmat33 R{ 0, 1, 0,
+              1, 0, 0,
+              0, 0, 1 };
+    ASSERT_EQ( P * R, (fmat33{ 2, 1, 3, 5, 4, 6, 8, 7, 9 }) );
+    ASSERT_EQ( R * transpose( P ), (fmat33{ 2, 5, 8, 1, 4, 7, 3, 6, 9 }) );
+    ASSERT_EQ( row( P, 2 ), (matrix<float,1,3>{ 7, 8, 9 }) );
+    ASSERT_EQ( column( P, 1 ), (fvec3{ 2, 5, 8 }) );
+    ASSERT_EQ( (submatrix<2,2>( P, 1, 1 )), (fmat22{ 5, 6, 8, 9 }) );
+
+    // Views of a matrix write through.
+    fmat33 A = identity<fmat33>();
+    column_view( A, 2 ) = fvec3{ 7, 8, 9 };
+    row_view( A, 0 ) = row( P, 0 );
+    subview<2,1>( A, 1, 0 ) = fvec2{ 5, 6 };
+    ASSERT_EQ( A, (fmat33{ 1, 2, 3, 5, 1, 8, 6, 0, 9 }) );
+    matrix_view<const float,3,3> C = make_view( A );
+    ASSERT_EQ( C * P, A * eval( P ) );
+    }
+
+/* n boxes scattered over [0,100)^3 with sides up to size. */
+static aabb_list<float,3>
+random_boxes( size_t n, float size, unsigned seed )
+    {
+    std::mt19937 gen( seed );
+    std::uniform_real_distribution<float> pos( 0, 100 ), side( 0, size );
+    aabb_list<float,3> boxes( n );
+    for( auto& b : boxes )
+        for( size_t d=0; d<3; ++d )
+            {
+            b(d,0) = pos( gen );
+            b(d,1) = b(d,0) + side( gen );
+            }
+    return boxes;
+    }
+
+TEST( Bvh, MatchesBruteForce )
+    {
+    const size_t n = 20000;
+    aabb_list<float,3> boxes = random_boxes( n, 2, 1 );
+    bvh<float,3> tree( boxes );
+    ASSERT_EQ( tree.size(), n );
+    ASSERT_LT( tree.depth(), 64u );
+
+    std::mt19937 gen( 2 );
+    std::uniform_real_distribution<float> pos( -10, 110 );
+    for( int q=0; q<50; ++q )
+        {
+        fvec3 p{ pos( gen ), pos( gen ), pos( gen ) };
+
+        std::vector<size_t> found, expected;
+        size_t visited = tree.query_contains( p, [&]( size_t i )
+            { found.push_back( i ); } );
+        for( size_t i=0; i<n; ++i )
+            if( contains( boxes[i], p ) )
+                expected.push_back( i );
+        std::sort( found.begin(), found.end() );
+        ASSERT_EQ( found, expected );
+        ASSERT_LT( visited, n / 20 );
+
+        faabb3 q_box{ p[0], p[0]+5, p[1], p[1]+5, p[2], p[2]+5 };
+        found.clear();
+        expected.clear();
+        visited = tree.query_overlaps( q_box, [&]( size_t i )
+            { found.push_back( i ); } );
+        for( size_t i=0; i<n; ++i )
+            if( overlaps( boxes[i], q_box ) )
+                expected.push_back( i );
+        std::sort( found.begin(), found.end() );
+        ASSERT_EQ( found, expected );
+        ASSERT_LT( visited, n / 10 );
+
+        size_t index;
+        float dist, best = std::numeric_limits<float>::infinity();
+        tree.nearest( p, index, dist );
+        for( size_t i=0; i<n; ++i )
+            best = std::min( best, distance_sq( boxes[i], p ) );
+        ASSERT_NE( index, tree.npos );
+        ASSERT_EQ( dist, best );
+        ASSERT_EQ( distance_sq( boxes[index], p ), best );
+
+        fvec3 dir{ pos( gen ) - 50, pos( gen ) - 50, pos( gen ) - 50 };
+        fray3 r = make_ray( p, dir );
+        float t, tnear, first = std::numeric_limits<float>::infinity();
+        size_t hits = 0;
+        visited = tree.closest_hit( r, 1, index, t );
+        tree.query_ray( r, 1, [&]( size_t, float ) { ++hits; } );
+        for( size_t i=0; i<n; ++i )
+            if( intersects( r, boxes[i], 0.f, 1.f, tnear ) )
+                {
+                --hits;
+                first = std::min( first, tnear );
+                }
+        ASSERT_EQ( hits, 0u );
+        if( first > 1 )
+            ASSERT_EQ( index, tree.npos );
+        else
+            {
+            ASSERT_EQ( t, first );
+            ASSERT_TRUE( intersects( r, boxes[index], 0.f, 1.f, tnear ) );
+            ASSERT_EQ( tnear, first );
+            }
+        }
+
+    bvh<float,3> empty( aabb_list<float,3>{} );
+    size_t index;
+    float dist;
+    ASSERT_EQ( empty.nearest( fvec3{}, index, dist ), 0u );
+    ASSERT_EQ( index, empty.npos );
+
+    // Identical boxes cannot be separated, but leaves are still bounded
+    // to four times the leaf size.
+    bvh<float,3> same( aabb_list<float,3>( 100, faabb3{ 0, 1, 0, 1, 0, 1 } ) );
+    for( auto& node : same.nodes() )
+        ASSERT_LE( node.count, 16u );
+    size_t count = 0;
+    same.query_contains( fvec3{ .5f, .5f, .5f }, [&]( size_t ) { ++count; } );
+    ASSERT_EQ( count, 100u );
+    }
+
+TEST( Bvh, ParallelBuild )
+    {
+    // Large enough for the chunked partition at the top levels.
+    aabb_list<float,3> boxes = random_boxes( 40000, 1, 3 );
+    bvh_build_options options;
+    bvh<float,3> serial( boxes, options );
+    options.threads = 4;
+    bvh<float,3> parallel( boxes, options );
+
+    ASSERT_EQ( serial.indices(), parallel.indices() );
+    ASSERT_EQ( serial.nodes().size(), parallel.nodes().size() );
+    for( size_t i=0; i < serial.nodes().size(); ++i )
+        {
+        ASSERT_EQ( serial.nodes()[i].box, parallel.nodes()[i].box );
+        ASSERT_EQ( serial.nodes()[i].first, parallel.nodes()[i].first );
+        ASSERT_EQ( serial.nodes()[i].count, parallel.nodes()[i].count );
+        }
+
+    // Without the determinism the layout may differ, the results may not.
+    options.deterministic = false;
+    options.bins = 32;
+    options.leaf_size = 2;
+    bvh<float,3> fast( boxes, options );
+    ASSERT_EQ( fast.size(), boxes.size() );
+    for( auto& node : fast.nodes() )
+        if( !node.is_leaf() )
+            {
+            ASSERT_TRUE( contains( node.box, fast.nodes()[ node.first ].box ) );
+            ASSERT_TRUE( contains( node.box, fast.nodes()[ node.first+1 ].box ) );
+            }
+    faabb3 q{ 20, 30, 40, 45, 10, 50 };
+    std::vector<size_t> a, b;
+    serial.query_overlaps( q, [&]( size_t i ) { a.push_back( i ); } );
+    fast.query_overlaps( q, [&]( size_t i ) { b.push_back( i ); } );
+    std::sort( a.begin(), a.end() );
+    std::sort( b.begin(), b.end() );
+    ASSERT_FALSE( a.empty() );
+    ASSERT_EQ( a, b );
+    }
+
+TEST( Bvh, LinearBuild )
+    {
+    aabb_list<float,3> boxes = random_boxes( 40000, 1, 6 );
+    // Equal keys are ordered by position.
+    boxes.insert( boxes.end(), 40, faabb3{ 10, 11, 10, 11, 10, 11 } );
+    bvh_build_options options;
+    options.method = bvh_build_method::linear;
+    bvh<float,3> serial( boxes, options );
+    options.threads = 4;
+    bvh<float,3> parallel( boxes, options );
+    bvh<float,3> sah( boxes );
+
+    ASSERT_EQ( serial.indices(), parallel.indices() );
+    ASSERT_EQ( serial.nodes().size(), parallel.nodes().size() );
+    for( size_t i=0; i < serial.nodes().size(); ++i )
+        {
+        ASSERT_EQ( serial.nodes()[i].box, parallel.nodes()[i].box );
+        ASSERT_EQ( serial.nodes()[i].first, parallel.nodes()[i].first );
+        ASSERT_EQ( serial.nodes()[i].count, parallel.nodes()[i].count );
+        }
+    ASSERT_EQ( serial.depth(), parallel.depth() );
+
+    // Every box in one leaf, every node the union of its children.
+    const auto& nodes = serial.nodes();
+    std::vector<int> seen( boxes.size() );
+    std::vector< std::pair<uint32_t,size_t> > stack{ { 0, 0 } };
+    size_t leaves = 0, depth = 0;
+    while( !stack.empty() )
+        {
+        auto e = stack.back();
+        stack.pop_back();
+        const auto& n = nodes[ e.first ];
+        depth = std::max( depth, e.second );
+        if( n.is_leaf() )
+            {
+            ++leaves;
+            ASSERT_LE( n.count, options.leaf_size );
+            auto items = serial.items().begin() + n.first;
+            ASSERT_EQ( n.box, ( combine<float,3>( items, items + n.count ) ) );
+            for( uint32_t i = n.first; i < n.first + n.count; ++i )
+                {
+                ASSERT_EQ( serial.items()[i], boxes[ serial.indices()[i] ] );
+                ++seen[ serial.indices()[i] ];
+                }
+            continue;
+            }
+        ASSERT_EQ( n.box, combine( nodes[ n.first ].box, nodes[ n.first+1 ].box ) );
+        stack.push_back( { n.first, e.second+1 } );
+        stack.push_back( { n.first+1, e.second+1 } );
+        }
+    ASSERT_EQ( seen, std::vector<int>( boxes.size(), 1 ) );
+    ASSERT_EQ( nodes.size(), 2*leaves - 1 );
+    ASSERT_EQ( serial.depth(), depth );
+
+    // Same answers as the SAH tree.
+    std::mt19937 gen( 8 );
+    std::uniform_real_distribution<float> pos( 0, 100 );
+    for( int q=0; q<50; ++q )
+        {
+        fvec3 p{ pos( gen ), pos( gen ), pos( gen ) };
+        faabb3 qb{ p[0], p[0]+5, p[1], p[1]+5, p[2], p[2]+5 };
+        std::vector<size_t> a, b;
+        sah.query_overlaps( qb, [&]( size_t i ) { a.push_back( i ); } );
+        serial.query_overlaps( qb, [&]( size_t i ) { b.push_back( i ); } );
+        std::sort( a.begin(), a.end() );
+        std::sort( b.begin(), b.end() );
+        ASSERT_EQ( a, b );
+
+        size_t ia, ib;
+        float da, db;
+        sah.nearest( p, ia, da );
+        serial.nearest( p, ib, db );
+        ASSERT_EQ( da, db );
+
+        fray3 r = make_ray( p, fvec3{ pos( gen ) - 50, pos( gen ) - 50, pos( gen ) - 50 } );
+        sah.closest_hit( r, 1.f, ia, da );
+        serial.closest_hit( r, 1.f, ib, db );
+        ASSERT_EQ( da, db );
+        }
+
+    // Small lists
+    for( size_t n : { 1, 3, 4, 5, 9 } )
+        {
+        aabb_list<float,3> few( boxes.begin(), boxes.begin() + n );
+        bvh<float,3> tree( few, options );
+        ASSERT_EQ( tree.size(), n );
+        ASSERT_EQ( tree.nodes()[0].box, ( combine<float,3>( few.begin(), few.end() ) ) );
+        size_t count = 0;
+        tree.query_overlaps( faabb3{ -1, 101, -1, 101, -1, 101 },
+                             [&]( size_t ) { ++count; } );
+        ASSERT_EQ( count, n );
+        }
+    }
+
+TEST( Bvh, IntegerBoxes )
+    {
+    // Split costs of the upper levels would overflow an int.
+    const size_t n = 5000;
+    std::mt19937 gen( 9 );
+    std::uniform_int_distribution<int> pos( 1000, 31000 ), size( 0, 600 );
+    aabb_list<int,2> boxes( n );
+    for( iaabb2& b : boxes )
+        {
+        int x = pos( gen ), y = pos( gen );
+        b = iaabb2{ x, x + size( gen ), y, y + size( gen ) };
+        }
+
+    // The linear method needs float keys and builds with SAH instead.
+    bvh_build_options options;
+    options.method = bvh_build_method::linear;
+    bvh<int,2> tree( boxes ), linear( boxes, options );
+    ASSERT_EQ( linear.indices(), tree.indices() );
+    ASSERT_LT( tree.depth(), 32u );
+    ASSERT_EQ( tree.nodes()[0].box, ( combine<int,2>( boxes.begin(), boxes.end() ) ) );
+    for( const auto& node : tree.nodes() )
+        ASSERT_LE( node.count, 16u );
+
+    for( int q=0; q<50; ++q )
+        {
+        ivec2 p{ pos( gen ), pos( gen ) };
+        iaabb2 qb{ p[0], p[0]+1500, p[1], p[1]+1500 };
+        std::vector<size_t> found, expected;
+        size_t visited = tree.query_overlaps( qb, [&]( size_t i )
+            { found.push_back( i ); } );
+        for( size_t i=0; i<n; ++i )
+            if( overlaps( boxes[i], qb ) )
+                expected.push_back( i );
+        std::sort( found.begin(), found.end() );
+        ASSERT_EQ( found, expected );
+        ASSERT_LT( visited, n / 10 );
+
+        size_t index;
+        int dist, best = std::numeric_limits<int>::max();
+        tree.nearest( p, index, dist );
+        for( size_t i=0; i<n; ++i )
+            best = std::min( best, distance_sq( boxes[i], p ) );
+        ASSERT_EQ( dist, best );
+        ASSERT_EQ( distance_sq( boxes[index], p ), best );
+        }
+    }
+
+TEST( DynamicTree, MovedPairs )
+    {
+    const size_t n = 1000;
+    aabb_list<float,3> boxes = random_boxes( n, 4, 4 );
+    dynamic_tree<float,3> tree( 0.5f );
+    std::vector<dynamic_tree<float,3>::id> ids;
+    for( size_t i=0; i<n; ++i )
+        ids.push_back( tree.insert( boxes[i], i ) );
+    ASSERT_EQ( tree.size(), n );
+
+    std::mt19937 gen( 5 );
+    std::uniform_real_distribution<float> step( -1, 1 );
+    std::vector<bool> alive( n, true ), moved( n, true );
+    for( int tick=0; tick<10; ++tick )
+        {
+        // Fat pairs where either object was (re)inserted this tick.
+        std::vector< std::pair<size_t,size_t> > found, expected;
+        tree.moved_pairs( [&]( uint32_t a, uint32_t b )
+            {
+            size_t i = tree.data( a ), j = tree.data( b );
+            found.emplace_back( std::min( i, j ), std::max( i, j ) );
+            } );
+        for( size_t i=0; i<n; ++i )
+        for( size_t j=i+1; j<n; ++j )
+            if( alive[i] && alive[j] && ( moved[i] || moved[j] ) &&
+                overlaps( tree.fat_box( ids[i] ), tree.fat_box( ids[j] ) ) )
+                expected.emplace_back( i, j );
+        std::sort( found.begin(), found.end() );
+        ASSERT_EQ( found, expected );
+
+        // Every fat box holds its object.
+        for( size_t i=0; i<n; ++i )
+            ASSERT_TRUE( !alive[i] || contains( tree.fat_box( ids[i] ), boxes[i] ) );
+
+        std::fill( moved.begin(), moved.end(), false );
+        size_t reinserted = 0;
+        for( size_t i = tick; i < n; i += 7 )
+            {
+            if( !alive[i] )
+                continue;
+            fvec3 delta{ step( gen ), step( gen ), step( gen ) };
+            for( size_t d=0; d<3; ++d )
+                {
+                boxes[i](d,0) += delta[d];
+                boxes[i](d,1) += delta[d];
+                }
+            moved[i] = tree.move( ids[i], boxes[i], delta );
+            reinserted += moved[i];
+            }
+        ASSERT_GT( reinserted, 0u );
+        ASSERT_LT( reinserted, n/7 + 1 );
+        for( size_t i = tick*3; i < n; i += 97 )
+            if( alive[i] )
+                {
+                tree.remove( ids[i] );
+                alive[i] = false;
+                }
+        }
+
+    // Rotations keep the tree close to balanced.
+    ASSERT_LE( tree.height(), 2 * std::log2( double( tree.size() ) ) + 2 );
+
+    faabb3 q{ 40, 60, 40, 60, 40, 60 };
+    std::vector<size_t> found, expected;
+    tree.query_overlaps( q, [&]( uint32_t a ) { found.push_back( tree.data( a ) ); } );
+    for( size_t i=0; i<n; ++i )
+        if( alive[i] && overlaps( tree.fat_box( ids[i] ), q ) )
+            expected.push_back( i );
+    std::sort( found.begin(), found.end() );
+    ASSERT_EQ( found, expected );
+
+    // Removed ids are reused.
+    size_t before = tree.size();
+    auto id = tree.insert( q, n );
+    ASSERT_EQ( tree.size(), before + 1 );
+    ASSERT_EQ( tree.data( id ), n );
+    ASSERT_LT( id, 2*n );
+    }
+
+TEST( SweepPrune, IncrementalPairs )
+    {
+    typedef std::pair<uint32_t,uint32_t> id_pair;
+    const size_t n = 600;
+    aabb_list<float,3> boxes = random_boxes( n, 6, 6 );
+    sweep_prune<float,3> sap;
+    std::vector<uint32_t> ids;
+    std::vector<bool> alive( n, true );
+    for( auto& b : boxes )
+        ids.push_back( sap.insert( b ) );
+
+    std::set<id_pair> pairs;
+    std::mt19937 gen( 7 );
+    std::uniform_real_distribution<float> step( -.5f, .5f );
+    for( int frame=0; frame<12; ++frame )
+        {
+        sap.update();
+
+        std::set<id_pair> expected;
+        for( size_t i=0; i<n; ++i )
+        for( size_t j=i+1; j<n; ++j )
+            if( alive[i] && alive[j] && overlaps( boxes[i], boxes[j] ) )
+                expected.emplace( std::minmax( ids[i], ids[j] ) );
+
+        // The reported changes take the old pairs to the new ones.
+        for( auto& p : sap.removed() )
+            ASSERT_EQ( pairs.erase( p ), 1u );
+        for( auto& p : sap.added() )
+            ASSERT_TRUE( pairs.insert( p ).second );
+        ASSERT_EQ( pairs, expected );
+        ASSERT_EQ( sap.pair_count(), expected.size() );
+        ASSERT_TRUE( frame == 0 ||
+            sap.added().size() + sap.removed().size() < expected.size() );
+
+        for( size_t i=0; i<n; ++i )
+            if( alive[i] )
+                {
+                fvec3 delta{ step( gen ), step( gen ), step( gen ) };
+                for( size_t d=0; d<3; ++d )
+                    {
+                    boxes[i](d,0) += delta[d];
+                    boxes[i](d,1) += delta[d];
+                    }
+                sap.move( ids[i], boxes[i] );
+                }
+        // Touching boxes do not overlap.
+        if( frame == 3 && alive[1] )
+            {
+            boxes[1] = boxes[0];
+            boxes[1](0,0) = boxes[0](0,1);
+            boxes[1](0,1) = boxes[0](0,1) + 1;
+            sap.move( ids[1], boxes[1] );
+            }
+        for( size_t i = frame; i < n; i += 53 )
+            if( alive[i] )
+                {
+                sap.remove( ids[i] );
+                alive[i] = false;
+                }
+        for( size_t i = frame; i < n; i += 61 )
+            if( !alive[i] )
+                {
+                ids[i] = sap.insert( boxes[i] );
+                alive[i] = true;
+                }
+        }
+    size_t count = 0;
+    sap.for_each_pair( [&]( uint32_t a, uint32_t b )
+        {
+        ASSERT_LT( a, b );
+        ASSERT_TRUE( pairs.count( { a, b } ) );
+        ++count;
+        } );
+    ASSERT_EQ( count, pairs.size() );
+    }
+
+TEST( SweepPrune, RebuildWithRemovedAndFlatBoxes )
+    {
+    typedef std::pair<uint32_t,uint32_t> id_pair;
+    // Boxes of zero width on the swept axis close before they open.
+    sweep_prune<float,3> flat;
+    aabb_list<float,3> row{ faabb3{ 0, 10, 0, 1, 0, 1 }, faabb3{ 1, 3, 0, 1, 0, 1 },
+                            faabb3{ 2, 2, 0, 1, 0, 1 }, faabb3{ 2.5f, 4, 0, 1, 0, 1 } };
+    for( auto& b : row )
+        flat.insert( b );
+    flat.update();
+    ASSERT_EQ( flat.pair_count(), 5u );
+    ASSERT_FALSE( flat.overlapping( 2, 3 ) );
+
+    // Removals followed by enough inserts to sweep from scratch.
+    std::mt19937 gen( 3 );
+    aabb_list<float,3> boxes = random_boxes( 40, 40, 2 );
+    for( size_t i=0; i < boxes.size(); i += 3 )
+        boxes[i](0,1) = boxes[i](0,0);
+    sweep_prune<float,3> sap;
+    std::vector<uint32_t> ids;
+    std::vector<bool> alive;
+    std::set<id_pair> pairs;
+    auto check = [&]
+        {
+        sap.update();
+        for( auto& p : sap.removed() )
+            ASSERT_EQ( pairs.erase( p ), 1u );
+        for( auto& p : sap.added() )
+            ASSERT_TRUE( pairs.insert( p ).second );
+        std::set<id_pair> expected;
+        for( size_t i=0; i < ids.size(); ++i )
+            for( size_t j=i+1; j < ids.size(); ++j )
+                if( alive[i] && alive[j] && overlaps( boxes[i], boxes[j] ) )
+                    expected.emplace( std::minmax( ids[i], ids[j] ) );
+        ASSERT_EQ( pairs, expected );
+        ASSERT_EQ( sap.pair_count(), expected.size() );
+        };
+    for( size_t i=0; i < 10; ++i )
+        {
+        ids.push_back( sap.insert( boxes[i] ) );
+        alive.push_back( true );
+        }
+    check();
+    for( size_t round=0; round < 3; ++round )
+        {
+        size_t k = gen() % ids.size();
+        if( alive[k] )
+            {
+            sap.remove( ids[k] );
+            alive[k] = false;
+            }
+        for( size_t added=0; added < 11 && ids.size() < boxes.size(); ++added )
+            {
+            ids.push_back( sap.insert( boxes[ ids.size() ] ) );
+            alive.push_back( true );
+            }
+        check();
+        }
+    }
+
+static std::vector< std::vector<float> >
+sorted_elements( aabb_list<float,3>::const_iterator it,
+                 aabb_list<float,3>::const_iterator end )
+    {
+    std::vector< std::vector<float> > result;
+    for( ; it != end; ++it )
+        result.emplace_back( it->begin(), it->end() );
+    std::sort( result.begin(), result.end() );
+    return result;
+    }
+
+TEST( Aabb, CombineOverlapping )
+    {
+    // The merged first two overlap the third, which neither of them does.
+    aabb_list<float,2> cascade{
+        { 2, 3, 2, 3 },
+        { 0, 1, 0, 3 },
+        { 0, 3, 0, 1 },
+        { 5, 6, 5, 6 } };
+    auto end = combine_overlapping( cascade.begin(), cascade.end() );
+    ASSERT_EQ( end - cascade.begin(), 2 );
+    ASSERT_TRUE( ( cascade[0] == faabb2{ 0, 3, 0, 3 } ) );
+    ASSERT_TRUE( ( cascade[1] == faabb2{ 5, 6, 5, 6 } ) );
+
+    aabb_list<float,3> boxes = random_boxes( 3000, 4, 3 );
+    aabb_list<float,3> expected = boxes;
+    bool merged = true;
+    while( merged )
+        {
+        merged = false;
+        for( size_t i=0; i < expected.size(); ++i )
+            for( size_t j=i+1; j < expected.size(); ++j )
+                if( overlaps( expected[i], expected[j] ) )
+                    {
+                    expected[i] = combine( expected[i], expected[j] );
+                    expected.erase( expected.begin() + j );
+                    merged = true;
+                    }
+        }
+    ASSERT_LT( expected.size(), boxes.size() );
+
+    for( size_t threads : { 1, 4 } )
+        {
+        aabb_list<float,3> result = boxes;
+        auto last = combine_overlapping( result.begin(), result.end(), threads );
+        ASSERT_EQ( sorted_elements( result.begin(), last ),
+                   sorted_elements( expected.begin(), expected.end() ) );
+        }
+
+    // Large enough to sort and sweep in chunks.
+    boxes = random_boxes( 40000, 1, 4 );
+    aabb_list<float,3> serial = boxes;
+    auto serial_end = combine_overlapping( serial.begin(), serial.end() );
+    auto last = combine_overlapping( boxes.begin(), boxes.end(), 4 );
+    ASSERT_LT( serial_end - serial.begin(), 40000 );
+    ASSERT_TRUE( std::equal( boxes.begin(), last, serial.begin(), serial_end ) );
+    }
+
+template<class T, size_t W> static void
+check_aabb_packets()
+    {
+    std::mt19937 gen( 5 );
+    std::uniform_real_distribution<T> pos( 0, 10 ), side( 0, 4 );
+    auto random_box = [&]
+        {
+        aabb<T,3> b;
+        for( size_t d=0; d<3; ++d )
+            {
+            b(d,0) = pos( gen );
+            b(d,1) = b(d,0) + side( gen );
+            }
+        return b;
+        };
+    aabb_list<T,3> boxes( 5*W + 3 );
+    for( auto& b : boxes )
+        b = random_box();
+    // A box touching the first, which overlaps() does not count.
+    boxes[1] = boxes[0];
+    boxes[1](2,0) = boxes[0](2,1);
+    boxes[1](2,1) = boxes[0](2,1) + 1;
+
+    auto packets = make_aabb_packets<W>( boxes );
+    ASSERT_EQ( packets.size(), 6u );
+    ASSERT_EQ( packets.back().size(), 3u );
+    ASSERT_EQ( packets.back().used(), 7u );
+    ASSERT_TRUE( ( packets[0].get( 2 ) == boxes[2] ) );
+
+    for( int q=0; q<200; ++q )
+        {
+        aabb<T,3> a = q == 0 ? boxes[0] : random_box();
+        vec<T,3> x = q == 1 ? column( boxes[0], 1 ) : vec<T,3>{ pos( gen ), pos( gen ), pos( gen ) };
+        aabb<T,3> inner = a;
+        for( size_t d=0; d<3; ++d )
+            inner(d,1) = inner(d,0) + ( inner(d,1) - inner(d,0) ) / 8;
+        for( size_t p=0; p < packets.size(); ++p )
+            {
+            uint32_t over = 0, point = 0, box = 0;
+            for( size_t i=0; i<W && p*W+i < boxes.size(); ++i )
+                {
+                const aabb<T,3>& b = boxes[ p*W+i ];
+                over |= uint32_t( overlaps( b, a ) ) << i;
+                point |= uint32_t( contains( b, x ) ) << i;
+                box |= uint32_t( contains( b, inner ) ) << i;
+                }
+            ASSERT_EQ( overlaps( packets[p], a ), over );
+            ASSERT_EQ( contains( packets[p], x ), point );
+            ASSERT_EQ( contains( packets[p], inner ), box );
+            }
+        }
+
+    std::vector<size_t> bits;
+    for_each_bit( 0x80000005u, [&]( size_t i ){ bits.push_back( i ); } );
+    ASSERT_EQ( bits, ( std::vector<size_t>{ 0, 2, 31 } ) );
+    }
+
+TEST( AabbPacket, MatchesScalarTests )
+    {
+    check_aabb_packets<float,4>();
+    check_aabb_packets<float,8>();
+    check_aabb_packets<float,16>();
+    check_aabb_packets<double,4>();
+    check_aabb_packets<double,8>();
+    check_aabb_packets<double,16>();
+    }
+
+TEST( Aabb, Transform )
+    {
+    fmat44 M = translation( fvec3{1, -2, 3} ) * rotation( 0.7f, 0.f, 1.f, 1.f ) *
+               scaling( fvec3{2, -1, 0.5f} );
+    aabb_list<float,3> boxes = random_boxes( 3000, 5, 6 );
+    std::vector<faffine3> per_box( boxes.size() );
+    for( size_t i=0; i < boxes.size(); ++i )
+        per_box[i] = to_affine( rotation( 0.01f*i, 1.f, 0.f, 1.f ) * M );
+
+    aabb_list<float,3> out( boxes.size() ), out_affine( boxes.size() ),
+                       out_each( boxes.size() );
+    transform_aabbs( M, boxes.data(), out.data(), boxes.size(), 0 );
+    transform_aabbs( to_affine(M), boxes.data(), out_affine.data(), boxes.size() );
+    transform_aabbs( per_box.data(), boxes.data(), out_each.data(), boxes.size(), 3 );
+
+    auto around_corners = []( const faabb3& box, const fmat44& A )
+        {
+        std::vector<fvec3> points;
+        for( auto& c : corners( box ) )
+            points.push_back( submatrix<3,1>( A * weldv( c, scalar<float>{1} ) ) );
+        return calculate_aabb<float,3>( points.begin(), points.end() );
+        };
+    for( size_t i=0; i < boxes.size(); ++i )
+        {
+        faabb3 expected = around_corners( boxes[i], M );
+        faabb3 each = around_corners( boxes[i], to_matrix( per_box[i] ) );
+        faabb3 scalar = transform_aabb( boxes[i], M );
+        faabb3 from_affine = transform_aabb( boxes[i], to_affine(M) );
+        for( size_t k=0; k<6; ++k )
+            {
+            ASSERT_NEAR( scalar.data()[k], expected.data()[k], 1e-4f );
+            ASSERT_EQ( from_affine.data()[k], scalar.data()[k] );
+            ASSERT_NEAR( out[i].data()[k], expected.data()[k], 1e-4f );
+            ASSERT_NEAR( out_affine[i].data()[k], expected.data()[k], 1e-4f );
+            ASSERT_NEAR( out_each[i].data()[k], each.data()[k], 1e-4f );
+            }
+        }
+
+    // 2D, with a rotation by a quarter turn
+    daabb2 square{ 0, 2, 0, 1 };
+    daabb2 turned = transform_aabb( square, translation( dvec2{ 1, 1 } ) *
+                                            rotation( std::acos( 0. ) ) );
+    daabb2 expected{ 0, 1, 1, 3 };
+    for( size_t k=0; k<4; ++k )
+        ASSERT_NEAR( turned.data()[k], expected.data()[k], 1e-12 );
+
+    // In place
+    transform_aabbs( M, boxes.data(), boxes.data(), boxes.size(), 2 );
+    ASSERT_EQ( boxes, out );
+    }
+
+TEST( Frustum, Planes )
+    {
+    // Looking down -z from the origin, near 1 and far 10.
+    ffrustum f = make_frustum( perspective( -1.f, 1.f, -1.f, 1.f, 1.f, 10.f ) );
+    ASSERT_TRUE( contains( f, fvec3{ 0, 0, -5 } ) );
+    ASSERT_TRUE( contains( f, fvec3{ 0.9f, -0.9f, -1.01f } ) );
+    ASSERT_FALSE( contains( f, fvec3{ 0, 0, -0.5f } ) );
+    ASSERT_FALSE( contains( f, fvec3{ 0, 0, -11 } ) );
+    ASSERT_FALSE( contains( f, fvec3{ 2.1f, 0, -2 } ) );
+    ASSERT_NEAR( plane_distance( f.planes[ffrustum::near], fvec3{ 0, 0, -3 } ), 2, 1e-5f );
+
+    ffrustum g = make_frustum( perspective( 1.5f, 1.f, 1.f, 10.f ),
+                               clip_depth::zero_to_one );
+    ASSERT_NEAR( plane_distance( g.planes[ffrustum::near], fvec3{ 0, 0, -3 } ), 2, 1e-5f );
+    ASSERT_NEAR( plane_distance( g.planes[ffrustum::far], fvec3{ 0, 0, -3 } ), 7, 1e-5f );
+
+    // Moving the camera moves the frustum the other way.
+    ffrustum o = make_frustum( orthographic( -2.f, 2.f, -1.f, 1.f, 1.f, 3.f ) *
+                               translation( fvec3{ 0, 0, -10 } ) );
+    ASSERT_TRUE( contains( o, fvec3{ 1.5f, 0.5f, 8 } ) );
+    ASSERT_FALSE( contains( o, fvec3{ 1.5f, 0.5f, 5 } ) );
+    ASSERT_FALSE( contains( o, fvec3{ 2.5f, 0.5f, 8 } ) );
+
+    ASSERT_TRUE( classify( f, faabb3{ -.5f, .5f, -.5f, .5f, -3, -2 } ) == cull_result::inside );
+    ASSERT_TRUE( classify( f, faabb3{ -.5f, .5f, -.5f, .5f, -2, 0 } ) == cull_result::intersecting );
+    ASSERT_TRUE( classify( f, faabb3{ -.5f, .5f, -.5f, .5f, 0, 1 } ) == cull_result::outside );
+    ASSERT_TRUE( classify( f, fsphere{ fvec3{ 0, 0, -5 }, 1 } ) == cull_result::inside );
+    ASSERT_TRUE( classify( f, fsphere{ fvec3{ 0, 0, 0 }, 1.5f } ) == cull_result::intersecting );
+    ASSERT_TRUE( classify( f, fsphere{ fvec3{ 0, 0, 1 }, 0.5f } ) == cull_result::outside );
+    }
+
+TEST( Frustum, Cull )
+    {
+    // The boxes fill [0,100)^3, the camera at the center looks down -z.
+    fmat44 view = translation( fvec3{ -50, -50, -50 } );
+    aabb_list<float,3> boxes = random_boxes( 20003, 1, 7 );
+    std::vector<fsphere> spheres;
+    for( auto& b : boxes )
+        spheres.push_back( { center( b ), 0.5f } );
+
+    cull_cache box_cache, sphere_cache;
+    std::vector<uint32_t> visible, expected;
+    for( int frame=0; frame<3; ++frame )
+        {
+        float turn = 0.05f * frame;
+        ffrustum f = make_frustum( perspective( -1.f, 1.f, -1.f, 1.f, 1.f, 40.f ) *
+                                   rotation( turn, 0.f, 1.f, 0.f ) * view );
+
+        // The batch may only differ from classify at rounding distance.
+        auto check = [&]( auto inside, auto margin )
+            {
+            size_t k = 0;
+            for( uint32_t i=0; i < boxes.size(); ++i )
+                {
+                bool listed = k < visible.size() && visible[k] == i;
+                k += listed;
+                ASSERT_TRUE( listed == inside( i ) || margin( i ) < 1e-3f );
+                }
+            ASSERT_EQ( k, visible.size() );
+            };
+        auto plane_margin = [&]( float reach, fvec3 c )
+            {
+            float m = 1e9f;
+            for( auto& p : f.planes )
+                m = std::min( m, std::abs( plane_distance( p, c ) + reach ) );
+            return m;
+            };
+
+        size_t count = cull_aabbs( f, boxes.data(), boxes.size(), visible,
+                                   &box_cache, frame );
+        ASSERT_EQ( count, visible.size() );
+        ASSERT_GT( count, 0u );
+        ASSERT_LT( count, boxes.size() / 2 );
+        check( [&]( uint32_t i ){ return intersects( f, boxes[i] ); },
+               [&]( uint32_t i )
+                   {
+                   float m = 1e9f;
+                   for( auto& p : f.planes )
+                       {
+                       fvec3 e = dimensions( boxes[i] ) / 2.f;
+                       float r = std::abs( p[0] )*e[0] + std::abs( p[1] )*e[1] +
+                                 std::abs( p[2] )*e[2];
+                       m = std::min( m, std::abs( plane_distance( p, center( boxes[i] ) ) + r ) );
+                       }
+                   return m;
+                   } );
+        std::vector<uint32_t> uncached;
+        cull_aabbs( f, boxes.data(), boxes.size(), uncached );
+        ASSERT_EQ( uncached, visible );
+
+        cull_spheres( f, spheres.data(), spheres.size(), visible,
+                      &sphere_cache, 4 );
+        check( [&]( uint32_t i ){ return intersects( f, spheres[i] ); },
+               [&]( uint32_t i ){ return plane_margin( 0.5f, spheres[i].center ); } );
+        }
+    }
+
+template<class T, size_t W> static void
+check_ray_packets()
+    {
+    // Whole numbers put many origins in the planes of faces, and a third
+    // of the direction components are 0, so the NaN cases come up.
+    std::mt19937 gen( 11 );
+    std::uniform_int_distribution<int> pos( 0, 9 ), side( 0, 3 ), axis( 0, 2 );
+    std::uniform_real_distribution<T> dir( -1, 1 );
+    auto random_box = [&]
+        {
+        aabb<T,3> b;
+        for( size_t d=0; d<3; ++d )
+            {
+            b(d,0) = T( pos( gen ) );
+            b(d,1) = b(d,0) + T( side( gen ) );
+            }
+        return b;
+        };
+    auto random_ray = [&]
+        {
+        vec<T,3> o, v;
+        for( size_t d=0; d<3; ++d )
+            {
+            o[d] = T( pos( gen ) );
+            v[d] = axis( gen ) == 0 ? T(0) : dir( gen );
+            }
+        return make_ray( o, v );
+        };
+
+    aabb_list<T,3> boxes( 3*W + 1 );
+    for( auto& b : boxes )
+        b = random_box();
+    auto box_packets = make_aabb_packets<W>( boxes );
+    std::vector< ray<T,3> > rays( W );
+    T tn[W], tf[W], tnear, tfar;
+    for( int q=0; q<300; ++q )
+        {
+        for( auto& r : rays )
+            r = random_ray();
+        ray_packet<T,3,W> rp( rays.begin(), rays.end() - q % 3, T(0), T(8) );
+        ASSERT_EQ( rp.size(), W - q % 3 );
+        for( auto& b : boxes )
+            {
+            uint32_t mask = intersects( rp, b, tn, tf );
+            for( size_t i=0; i<W; ++i )
+                {
+                bool hit = i < rp.size() &&
+                    intersects( rays[i], b, T(0), T(8), tnear, tfar );
+                ASSERT_EQ( bool( mask >> i & 1 ), hit );
+                ASSERT_TRUE( !hit || ( tn[i] == tnear && tf[i] == tfar ) );
+                }
+            }
+        for( size_t p=0; p < box_packets.size(); ++p )
+            {
+            uint32_t mask = intersects( rays[0], box_packets[p], T(0), T(8), tn, tf );
+            for( size_t i=0; i<W; ++i )
+                {
+                bool hit = p*W+i < boxes.size() &&
+                    intersects( rays[0], boxes[p*W+i], T(0), T(8), tnear, tfar );
+                ASSERT_EQ( bool( mask >> i & 1 ), hit );
+                ASSERT_TRUE( !hit || ( tn[i] == tnear && tf[i] == tfar ) );
+                }
+            }
+        }
+    }
+
+TEST( Ray, Packets )
+    {
+    check_ray_packets<float,4>();
+    check_ray_packets<float,8>();
+    check_ray_packets<float,16>();
+    check_ray_packets<double,4>();
+    check_ray_packets<double,8>();
+
+    // Entry and exit of a ray starting inside
+    fray3 r = make_ray( fvec3{ 1, 1, 1 }, fvec3{ 1, 0, 0 } );
+    float tnear, tfar;
+    ASSERT_TRUE( intersects( r, faabb3{ 0, 3, 0, 2, 1, 2 }, 0.f, 10.f, tnear, tfar ) );
+    ASSERT_EQ( tnear, 0.f );
+    ASSERT_EQ( tfar, 2.f );
+    ASSERT_FALSE( intersects( r, faabb3{ 2, 3, 1.5f, 2, 0, 2 }, 0.f, 10.f, tnear, tfar ) );
+
+    // Packet traversal against the scalar closest hit, rays fanning out
+    // from one point like the pixels of a view.
+    aabb_list<float,3> boxes = random_boxes( 20000, 2, 5 );
+    bvh<float,3> tree( boxes );
+    std::vector<fray3> rays;
+    for( int y=0; y<40; ++y )
+    for( int x=0; x<41; ++x )
+        rays.push_back( make_ray( fvec3{ 50, 50, -5 },
+                                  fvec3{ x/40.f - .5f, y/40.f - .5f, 1 } ) );
+    std::vector<size_t> index( rays.size() ), index4( rays.size() );
+    std::vector<float> t( rays.size() ), t4( rays.size() );
+    tree.closest_hits( rays.data(), rays.size(), 80.f, index.data(), t.data() );
+    tree.closest_hits( rays.data(), rays.size(), 80.f, index4.data(), t4.data(), 4 );
+    ASSERT_EQ( index, index4 );
+    ASSERT_EQ( t, t4 );
+    size_t hits = 0;
+    for( size_t i=0; i < rays.size(); ++i )
+        {
+        size_t expected;
+        float te;
+        tree.closest_hit( rays[i], 80.f, expected, te );
+        ASSERT_EQ( t[i], te );
+        ASSERT_EQ( index[i] == tree.npos, expected == tree.npos );
+        if( expected == tree.npos )
+            continue;
+        ++hits;
+        ASSERT_TRUE( intersects( rays[i], boxes[ index[i] ], 0.f, 80.f, tnear ) );
+        ASSERT_EQ( tnear, te );
+        }
+    ASSERT_GT( hits, rays.size() / 4 );
+    ASSERT_LT( hits, rays.size() );
+    }
+
+template<class Key, size_t D> static Key
+morton_reference( const vec<uint32_t,D>& cell )
+    {
+    Key key = 0;
+    for( unsigned b=0; b < curve_bits<Key,D>::value; ++b )
+        for( size_t d=0; d<D; ++d )
+            key |= Key( cell[d] >> b & 1 ) << ( b*D + d );
+    return key;
+    }
+
+template<class Key, size_t D> static void
+check_curves( unsigned bits )
+    {
+    std::mt19937 gen( 5 );
+    for( int i=0; i<1000; ++i )
+        {
+        vec<uint32_t,D> cell;
+        for( size_t d=0; d<D; ++d )
+            cell[d] = uint32_t( gen() );
+        ASSERT_EQ( ( morton_code<Key,D>( cell ) ), ( morton_reference<Key,D>( cell ) ) );
+        }
+
+    // Every cell of a small grid once, each next to the one before.
+    size_t side = size_t(1) << bits, cells = 1;
+    for( size_t d=0; d<D; ++d )
+        cells *= side;
+    std::vector< std::pair< Key, vec<uint32_t,D> > > curve;
+    for( size_t i=0; i < cells; ++i )
+        {
+        vec<uint32_t,D> cell;
+        for( size_t d=0, rest=i; d<D; ++d, rest /= side )
+            cell[d] = uint32_t( rest % side );
+        curve.push_back( { hilbert_code<Key,D>( cell, bits ), cell } );
+        }
+    std::sort( curve.begin(), curve.end(),
+               []( auto& a, auto& b ) { return a.first < b.first; } );
+    for( size_t i=0; i < cells; ++i )
+        {
+        ASSERT_EQ( curve[i].first, Key(i) );
+        if( i == 0 )
+            continue;
+        uint32_t steps = 0;
+        for( size_t d=0; d<D; ++d )
+            steps += uint32_t( std::abs( int( curve[i].second[d] ) - int( curve[i-1].second[d] ) ) );
+        ASSERT_EQ( steps, 1u );
+        }
+    }
+
+TEST( Morton, Keys )
+    {
+    check_curves<uint32_t,2>( 4 );
+    check_curves<uint64_t,2>( 5 );
+    check_curves<uint32_t,3>( 3 );
+    check_curves<uint64_t,3>( 3 );
+
+    ASSERT_EQ( ( morton_code<uint32_t,3>( vec<uint32_t,3>{ 3, 0, 1 } ) ), 13u );
+    // Points are clamped to the bounds, the high side to the last cell.
+    faabb2 bounds{ 0, 1, 0, 2 };
+    ASSERT_EQ( morton_code<uint32_t>( fvec2{ 1, 2 }, bounds ), ~uint32_t(0) );
+    ASSERT_EQ( morton_code<uint32_t>( fvec2{ -1, 5 }, bounds ), 0xAAAAAAAAu );
+    ASSERT_EQ( morton_code<uint64_t>( faabb2{ 0, 1, 0, 2 }, bounds ),
+               morton_code<uint64_t>( fvec2{ .5f, 1 }, bounds ) );
+    ASSERT_EQ( ( hilbert_code<uint32_t>( dvec3{ 0, 0, 0 }, daabb3{ 0, 1, 0, 1, 0, 1 } ) ), 0u );
+    }
+
+TEST( Morton, RadixSort )
+    {
+    std::mt19937_64 gen( 9 );
+    for( size_t threads : { 1, 4 } )
+        {
+        // Only some bytes vary, and the last pass leaves the data in the
+        // buffer so it is copied back.
+        size_t n = 100000;
+        std::vector<uint64_t> keys( n );
+        std::vector<uint32_t> values( n );
+        std::vector< std::pair<uint64_t,uint32_t> > expected( n );
+        for( size_t i=0; i<n; ++i )
+            {
+            keys[i] = gen() & 0x00FF00000FFFull;
+            values[i] = uint32_t( i );
+            expected[i] = { keys[i], values[i] };
+            }
+        std::stable_sort( expected.begin(), expected.end(),
+                          []( auto& a, auto& b ) { return a.first < b.first; } );
+        radix_sort( keys.data(), values.data(), n, threads );
+        for( size_t i=0; i<n; ++i )
+            {
+            ASSERT_EQ( keys[i], expected[i].first );
+            ASSERT_EQ( values[i], expected[i].second );
+            }
+        }
+
+    std::vector<uint32_t> same( 10, 7 ), index( 10 );
+    radix_sort( same.data(), index.data(), same.size() );
+    ASSERT_EQ( same, std::vector<uint32_t>( 10, 7 ) );
+    }
+
+TEST( Morton, SpatialSort )
+    {
+    aabb_list<float,3> boxes = random_boxes( 50000, 1, 4 );
+    aabb_list<float,3> sorted = boxes;
+    std::vector<uint32_t> order = spatial_sort( sorted, curve::hilbert, 4 );
+    ASSERT_EQ( order, spatial_order( boxes.data(), boxes.size(), curve::hilbert ) );
+    std::vector<fvec3> centers;
+    for( auto& b : boxes )
+        centers.push_back( center( b ) );
+    faabb3 bounds = calculate_aabb<float,3>( centers.begin(), centers.end() );
+    std::vector<bool> seen( boxes.size() );
+    for( size_t i=0; i < boxes.size(); ++i )
+        {
+        ASSERT_TRUE( sorted[i] == boxes[ order[i] ] );
+        ASSERT_FALSE( seen[ order[i] ] );
+        seen[ order[i] ] = true;
+        ASSERT_TRUE( i == 0 || hilbert_code<uint32_t>( sorted[i-1], bounds ) <=
+                               hilbert_code<uint32_t>( sorted[i], bounds ) );
+        }
+
+    // Neighbours in the Morton order are mostly close.
+    std::vector<fvec3> points = centers;
+    spatial_sort<uint64_t>( points, curve::morton );
+    float total = 0;
+    for( size_t i=1; i < points.size(); ++i )
+        total += length( fvec3( points[i] - points[i-1] ) );
+    ASSERT_LT( total / points.size(), 10.f );
+    }
+
+template<size_t D> static void
+check_loose_tree()
+    {
+    typedef aabb<float,D> box;
+    std::mt19937 gen( 12 );
+    std::uniform_real_distribution<float> pos( -10, 110 ), unit( 0, 1 );
+    auto random_box = [&]
+        {
+        // Mostly small, some as large as the world, some outside it.
+        float size = unit( gen ) < 0.9f ? 2*unit( gen ) : 60*unit( gen );
+        box b;
+        for( size_t d=0; d<D; ++d )
+            {
+            b(d,0) = pos( gen );
+            b(d,1) = b(d,0) + size*unit( gen );
+            }
+        return b;
+        };
+    box world;
+    for( size_t d=0; d<D; ++d )
+        {
+        world(d,0) = 0;
+        world(d,1) = 100;
+        }
+
+    loose_tree<float,D> tree( world, 6, 4 );
+    std::vector<uint32_t> ids;
+    std::vector<box> boxes;
+    auto check = [&]
+        {
+        ASSERT_EQ( tree.size(), ids.size() );
+        for( int q=0; q<20; ++q )
+            {
+            box qb = random_box();
+            vec<float,D> p = center( random_box() );
+            std::vector<uint32_t> found, expected, found_p, expected_p;
+            tree.query_overlaps( qb, [&]( uint32_t a ) { found.push_back( a ); } );
+            tree.query_contains( p, [&]( uint32_t a ) { found_p.push_back( a ); } );
+            for( size_t i=0; i < ids.size(); ++i )
+                {
+                if( overlaps( boxes[i], qb ) )
+                    expected.push_back( ids[i] );
+                if( contains( boxes[i], p ) )
+                    expected_p.push_back( ids[i] );
+                }
+            std::sort( found.begin(), found.end() );
+            std::sort( expected.begin(), expected.end() );
+            std::sort( found_p.begin(), found_p.end() );
+            std::sort( expected_p.begin(), expected_p.end() );
+            ASSERT_EQ( found, expected );
+            ASSERT_EQ( found_p, expected_p );
+            }
+        };
+
+    for( int i=0; i<3000; ++i )
+        {
+        boxes.push_back( random_box() );
+        ids.push_back( tree.insert( boxes.back(), size_t(i) ) );
+        }
+    check();
+    size_t split_nodes = tree.node_count();
+    ASSERT_GT( split_nodes, 1u );
+    for( size_t i=0; i < ids.size(); ++i )
+        {
+        ASSERT_LE( tree.depth( ids[i] ), 6u );
+        ASSERT_EQ( tree.data( ids[i] ), i );
+        }
+
+    // Small steps, most of which stay in their node, and some jumps.
+    for( int round=0; round<5; ++round )
+        {
+        for( size_t i=0; i < ids.size(); ++i )
+            {
+            if( i % 7 == 0 )
+                boxes[i] = random_box();
+            else
+                for( size_t d=0; d<D; ++d )
+                    {
+                    float step = unit( gen ) - 0.5f;
+                    boxes[i](d,0) += step;
+                    boxes[i](d,1) += step;
+                    }
+            tree.move( ids[i], boxes[i] );
+            ASSERT_EQ( tree.box( ids[i] ), boxes[i] );
+            }
+        check();
+        }
+
+    // Removing merges the nodes back and frees the ids for reuse.
+    while( ids.size() > 10 )
+        {
+        size_t i = gen() % ids.size();
+        tree.remove( ids[i] );
+        ids.erase( ids.begin() + i );
+        boxes.erase( boxes.begin() + i );
+        }
+    check();
+    ASSERT_LT( tree.node_count(), split_nodes / 10 );
+    uint32_t again = tree.insert( world );
+    ASSERT_LT( again, 3000u );
+    tree.remove( again );
+    for( uint32_t a : ids )
+        tree.remove( a );
+    ids.clear();
+    boxes.clear();
+    ASSERT_EQ( tree.node_count(), 1u );
+    check();
+    }
+
+TEST( LooseTree, MatchesBruteForce )
+    {
+    check_loose_tree<2>();
+    check_loose_tree<3>();
+
+    // The cells of the children are the pieces split() makes.
+    faabb3 cube{ 0, 2, 0, 2, 0, 2 };
+    aabb_list<float,3> pieces = split( cube, center( cube ) );
+    ASSERT_EQ( pieces.size(), 8u );
+    ASSERT_EQ( ( combine<float,3>( pieces.begin(), pieces.end() ) ), cube );
+    for( auto& p : pieces )
+        ASSERT_EQ( volume( p ), 1.f );
+    ASSERT_TRUE( split( cube, fvec3{ 3, 1, 1 } ).empty() );
+    }
+
+template<class T, size_t D> static void
+check_spatial_hash( T cell, T lo, T hi, T max_side )
+    {
+    typedef aabb<T,D> box;
+    typedef spatial_hash<T,D> grid;
+    std::mt19937 gen( 7 );
+    auto random_box = [&]( T side )
+        {
+        box b;
+        for( size_t d=0; d<D; ++d )
+            {
+            b(d,0) = lo + T( ( hi - lo ) * std::generate_canonical<double,32>( gen ) );
+            b(d,1) = b(d,0) + T( side * std::generate_canonical<double,32>( gen ) );
+            }
+        return b;
+        };
+
+    aabb_list<T,D> boxes;
+    for( int i=0; i<2000; ++i )
+        boxes.push_back( random_box( max_side ) );
+    grid inserted( cell ), built( cell ), built_parallel( cell );
+    for( size_t i=0; i < boxes.size(); ++i )
+        ASSERT_EQ( inserted.insert( boxes[i], i ), i );
+    built.rebuild( boxes );
+    built_parallel.rebuild( boxes, 4 );
+    ASSERT_EQ( built.cell_count(), inserted.cell_count() );
+    ASSERT_EQ( built_parallel.cell_count(), inserted.cell_count() );
+
+    auto sorted = []( std::vector<uint32_t> v )
+        {
+        std::sort( v.begin(), v.end() );
+        return v;
+        };
+    // Checks g against brute force; each result must come once.
+    auto check = [&]( const grid& g, const std::vector<uint32_t>& ids )
+        {
+        ASSERT_EQ( g.size(), ids.size() );
+        for( int q=0; q<30; ++q )
+            {
+            box qb = random_box( q == 0 ? 2*( hi - lo ) : 4*max_side );
+            vec<T,D> p = center( random_box( 0 ) );
+            T radius = T( max_side / 2 );
+            std::vector<uint32_t> found, expected, found_p, expected_p, found_n, expected_n;
+            g.query_overlaps( qb, [&]( uint32_t a ) { found.push_back( a ); } );
+            g.query_contains( p, [&]( uint32_t a ) { found_p.push_back( a ); } );
+            g.query_near( p, radius, [&]( uint32_t a ) { found_n.push_back( a ); } );
+            for( uint32_t a : ids )
+                {
+                if( overlaps( g.box( a ), qb ) )
+                    expected.push_back( a );
+                if( contains( g.box( a ), p ) )
+                    expected_p.push_back( a );
+                if( distance_sq( g.box( a ), p ) <= radius*radius )
+                    expected_n.push_back( a );
+                }
+            ASSERT_EQ( sorted( found ), sorted( expected ) );
+            ASSERT_EQ( sorted( found_p ), sorted( expected_p ) );
+            ASSERT_EQ( sorted( found_n ), sorted( expected_n ) );
+            }
+
+        std::vector<std::pair<uint32_t,uint32_t>> pairs, expected;
+        g.query_pairs( [&]( uint32_t a, uint32_t b )
+            { pairs.emplace_back( std::min( a, b ), std::max( a, b ) ); } );
+        for( size_t i=0; i < ids.size(); ++i )
+            for( size_t j=i+1; j < ids.size(); ++j )
+                if( overlaps( g.box( ids[i] ), g.box( ids[j] ) ) )
+                    expected.emplace_back( std::min( ids[i], ids[j] ), std::max( ids[i], ids[j] ) );
+        std::sort( pairs.begin(), pairs.end() );
+        std::sort( expected.begin(), expected.end() );
+        ASSERT_EQ( pairs, expected );
+        };
+
+    std::vector<uint32_t> ids;
+    for( uint32_t i=0; i < boxes.size(); ++i )
+        ids.push_back( i );
+    check( inserted, ids );
+    check( built, ids );
+    check( built_parallel, ids );
+
+    // Moves within and across cells, then removals and reinsertion.
+    for( size_t i=0; i < boxes.size(); ++i )
+        {
+        if( i % 5 == 0 )
+            boxes[i] = random_box( max_side );
+        else
+            for( size_t d=0; d<D; ++d )
+                {
+                T step = T( cell * ( std::generate_canonical<double,32>( gen ) - .5 ) );
+                boxes[i](d,0) += step;
+                boxes[i](d,1) += step;
+                }
+        inserted.move( ids[i], boxes[i] );
+        built_parallel.move( ids[i], boxes[i] );
+        }
+    check( inserted, ids );
+    check( built_parallel, ids );
+    for( size_t i=0; i < ids.size(); )
+        {
+        built_parallel.remove( ids[i] );
+        ids.erase( ids.begin() + i );
+        i += 2;
+        }
+    check( built_parallel, ids );
+    uint32_t again = built_parallel.insert( boxes[1], 1 );
+    ASSERT_LT( again, boxes.size() );
+    built_parallel.remove( again );
+    for( uint32_t a : ids )
+        built_parallel.remove( a );
+    ASSERT_EQ( built_parallel.cell_count(), 0u );
+    ids.clear();
+    check( built_parallel, ids );
+    }
+
+TEST( SpatialHash, MatchesBruteForce )
+    {
+    check_spatial_hash<float,2>( 1.f, -20.f, 20.f, 2.f );
+    check_spatial_hash<float,3>( .5f, -5.f, 5.f, 1.f );
+    check_spatial_hash<int,3>( 4, -40, 40, 6 );
+
+    // Cells round towards minus infinity, for floats and integers.
+    spatial_hash<float,2> g( 2.f );
+    ASSERT_EQ( g.cell_of( fvec2{ -.5f, 3.9f } ), ( vec<int,2>{ -1, 1 } ) );
+    spatial_hash<int,2> gi( 4 );
+    ASSERT_EQ( gi.cell_of( vec<int,2>{ -1, -4 } ), ( vec<int,2>{ -1, -1 } ) );
+    ASSERT_EQ( gi.cell_of( vec<int,2>{ -5, 4 } ), ( vec<int,2>{ -2, 1 } ) );
+    uint32_t a = g.insert( faabb2{ -1, 1, -1, 1 } );
+    ASSERT_EQ( g.cell_count(), 4u );
+    ASSERT_EQ( g.objects_in( vec<int,2>{ -1, 0 } ), 1u );
+    ASSERT_FALSE( g.move( a, faabb2{ -1.5f, .5f, -1, 1 } ) );
+    ASSERT_TRUE( g.move( a, faabb2{ .5f, 1.5f, .5f, 1.5f } ) );
+    ASSERT_EQ( g.cell_count(), 1u );
+    ASSERT_EQ( g.objects_in( vec<int,2>{ -1, 0 } ), 0u );
+    }
+
+/* Tight is false for frames where neighbouring grid values can round to
+    the same coordinate. */
+template<class T, class Q> static void
+check_quantized( const aabb<T,3>& frame, bool tight = true )
+    {
+    typedef aabb_quantizer<T,3,Q> quantizer;
+    quantizer quant( frame );
+    std::mt19937 gen( 5 );
+    auto coordinate = [&]( size_t d )
+        {
+        // Some coordinates land exactly on grid values or the frame.
+        switch( gen() % 8 )
+            {
+            case 0: return frame(d,0);
+            case 1: return frame(d,1);
+            case 2: return quant.value( d, Q( gen() % ( size_t(quantizer::top) + 1 ) ) );
+            default:
+                return frame(d,0) + ( frame(d,1) - frame(d,0) ) *
+                       T( std::generate_canonical<double,32>( gen ) );
+            }
+        };
+    aabb_list<T,3> boxes( 3000 );
+    for( auto& b : boxes )
+        for( size_t d=0; d<3; ++d )
+            {
+            T x = coordinate( d ), y = coordinate( d );
+            b(d,0) = std::min( x, y );
+            b(d,1) = gen() % 4 == 0 ? b(d,0) : std::max( x, y );
+            }
+    // Boxes touching others.
+    for( size_t i=0; i+1 < boxes.size(); i += 10 )
+        {
+        T shift = boxes[i](0,1) - boxes[i+1](0,0);
+        boxes[i+1](0,0) += shift;
+        boxes[i+1](0,1) = std::min( boxes[i+1](0,1) + shift, frame(0,1) );
+        }
+
+    std::vector<aabb<Q,3>> q( boxes.size() ), q_parallel( boxes.size() );
+    aabb_list<T,3> decoded( boxes.size() );
+    quant.encode( boxes.data(), boxes.size(), q.data() );
+    quant.encode( boxes.data(), boxes.size(), q_parallel.data(), 4 );
+    quant.decode( q.data(), q.size(), decoded.data(), 4 );
+    ASSERT_TRUE( q == q_parallel );
+    for( size_t i=0; i < boxes.size(); ++i )
+        {
+        ASSERT_TRUE( contains( decoded[i], boxes[i] ) );
+        ASSERT_EQ( decoded[i], quant.decode( q[i] ) );
+        // Grid values can come back one step further out.
+        aabb<Q,3> again = quant.encode( decoded[i] );
+        for( size_t d=0; d<3 && tight; ++d )
+            {
+            ASSERT_LE( int( q[i](d,0) ) - int( again(d,0) ), 1 );
+            ASSERT_LE( int( again(d,1) ) - int( q[i](d,1) ), 1 );
+            }
+        ASSERT_TRUE( contains( quant.decode( again ), decoded[i] ) );
+        }
+
+    // Overlapping or touching boxes and contained points are never missed.
+    std::vector<uint32_t> hits( boxes.size() );
+    for( size_t i=0; i < 200; ++i )
+        {
+        const aabb<T,3>& a = boxes[i];
+        size_t n = may_overlap( q.data(), q.size(), q[i], hits.data() );
+        std::set<uint32_t> found( hits.begin(), hits.begin() + n );
+        for( size_t j=0; j < boxes.size(); ++j )
+            {
+            const aabb<T,3>& b = boxes[j];
+            bool touch = true;
+            for( size_t d=0; d<3; ++d )
+                touch &= a(d,0) <= b(d,1) && b(d,0) <= a(d,1);
+            ASSERT_EQ( found.count( uint32_t(j) ) == 1, may_overlap( q[i], q[j] ) );
+            ASSERT_TRUE( !touch || found.count( uint32_t(j) ) == 1 );
+            }
+        vec<T,3> p;
+        for( size_t d=0; d<3; ++d )
+            p[d] = coordinate( d );
+        for( size_t j=0; j < boxes.size(); ++j )
+            ASSERT_TRUE( !contains( boxes[j], p ) ||
+                         may_overlap( q[j], quant.encode( p ) ) );
+        }
+    }
+
+TEST( QuantizedAabb, Conservative )
+    {
+    check_quantized<float,uint8_t>( faabb3{ 0, 1, -2, 2, 0, 100 } );
+    check_quantized<float,uint16_t>( faabb3{ 0, 1, -2, 2, 0, 100 } );
+    // Far from the origin, where the grid steps are a few ulps.
+    check_quantized<float,uint16_t>( faabb3{ 1000, 1000.5f, -4096, -4095, 3, 3.001f }, false );
+    check_quantized<double,uint8_t>( daabb3{ -1e-3, 1e-3, 7, 9, 1e6, 1e6+1 } );
+    // A flat frame.
+    check_quantized<float,uint8_t>( faabb3{ 0, 1, 5, 5, 0, 1 }, false );
+
+    // Children quantized to 8 bits in the decoded box of their parent.
+    aabb_quantizer<float,3> world( faabb3{ -1000, 1000, -1000, 1000, -1000, 1000 } );
+    faabb3 parent{ 10.3f, 12.9f, -7.1f, -6.2f, 500, 600 };
+    faabb3 frame = world.decode( world.encode( parent ) );
+    aabb_quantizer<float,3,uint8_t> local( frame );
+    faabb3 child{ 10.3f, 10.4f, -7, -6.2f, 550, 551 };
+    faabb3 decoded = local.decode( local.encode( child ) );
+    ASSERT_TRUE( contains( decoded, child ) );
+    for( size_t d=0; d<3; ++d )
+        ASSERT_LE( decoded(d,1) - decoded(d,0),
+                   child(d,1) - child(d,0) + 2*( frame(d,1) - frame(d,0) ) / 255 * 1.0001f );
+    }
+
+TEST( OverlapPairs, MatchesBruteForce )
+    {
+    typedef std::pair<uint32_t,uint32_t> index_pair;
+    std::mt19937 gen( 9 );
+    // Coarse coordinates so that many boxes start and end together.
+    std::uniform_int_distribution<int> pos( 0, 40 ), side( 0, 6 );
+    auto random_boxes = [&]( size_t n )
+        {
+        aabb_list<float,3> boxes( n );
+        for( auto& b : boxes )
+            for( size_t d=0; d<3; ++d )
+                {
+                b(d,0) = float( pos( gen ) );
+                b(d,1) = b(d,0) + float( side( gen ) ) * ( d == 2 ? 4 : 1 );
+                }
+        return boxes;
+        };
+    aabb_list<float,3> a = random_boxes( 3000 ), b = random_boxes( 700 );
+    a[1] = a[0];
+
+    std::vector<index_pair> expected, expected_ab;
+    for( uint32_t i=0; i < a.size(); ++i )
+        {
+        for( uint32_t j=i+1; j < a.size(); ++j )
+            if( overlaps( a[i], a[j] ) )
+                expected.emplace_back( i, j );
+        for( uint32_t j=0; j < b.size(); ++j )
+            if( overlaps( a[i], b[j] ) )
+                expected_ab.emplace_back( i, j );
+        }
+    ASSERT_GT( expected.size(), 1000u );
+
+    std::vector<index_pair> serial = overlapping_pairs( a );
+    std::vector<index_pair> serial_ab = overlapping_pairs( a, b );
+    for( size_t threads : { 1, 3, 0 } )
+        {
+        std::vector<index_pair> pairs = overlapping_pairs( a, threads );
+        std::vector<index_pair> pairs_ab = overlapping_pairs( a, b, threads );
+        // The same order for any number of threads.
+        ASSERT_TRUE( pairs == serial );
+        ASSERT_TRUE( pairs_ab == serial_ab );
+        std::sort( pairs.begin(), pairs.end() );
+        std::sort( pairs_ab.begin(), pairs_ab.end() );
+        ASSERT_TRUE( pairs == expected );
+        ASSERT_TRUE( pairs_ab == expected_ab );
+        }
+
+    // Swapping the sets swaps the pairs.
+    std::vector<index_pair> pairs_ba = overlapping_pairs( b, a, 2 );
+    for( auto& p : pairs_ba )
+        std::swap( p.first, p.second );
+    std::sort( pairs_ba.begin(), pairs_ba.end() );
+    ASSERT_TRUE( pairs_ba == expected_ab );
+
+    ASSERT_TRUE( overlapping_pairs( aabb_list<float,3>() ).empty() );
+    ASSERT_TRUE( overlapping_pairs( a, aabb_list<float,3>() ).empty() );
+    ASSERT_TRUE( overlapping_pairs( aabb_list<float,2>{ faabb2{ 0, 1, 0, 1 } } ).empty() );
+    }
+
+TEST( Multiplication, Mat44Simd )
+    {
+    fmat44 A{
+        1,  2,  3,  4,
+        5,  6,  7,  8,
+        9,  10, 11, 12,
+        13, 14, 15, 16 };
+    fmat44 B = transpose(A);
+    fmat44 AB_correct{
+        30,  70,  110, 150,
+        70,  174, 278, 382,
+        110, 278, 446, 614,
+        150, 382, 614, 846 };
+    ASSERT_EQ( A*B, AB_correct );
+    ASSERT_EQ( B(0,3), 13 );
+
+    fvec4 v{ 1, 0, -1, 2 };
+    ASSERT_EQ( A*v, (fvec4{6, 14, 22, 30}) );
+    ASSERT_EQ( transpose(v)*A, (matrix<float,1,4>{18, 20, 22, 24}) );
+
+    dmat44 D = cast_matrix<double>(A);
+    dvec4 dv{ 1, 0, -1, 2 };
+    ASSERT_EQ( D*dv, (dvec4{6, 14, 22, 30}) );
+    ASSERT_EQ( D*transpose(D), cast_matrix<double>(AB_correct) );
+    }
+
+TEST( MatOp, Vec4Simd )
+    {
+    fvec4 a{ 1, 2, 3, 4 };
+    fvec4 b{ 4, 3, 2, 1 };
+    ASSERT_EQ( eval(a+b), uniform<fvec4>(5) );
+    ASSERT_EQ( eval(a-b), (fvec4{-3, -1, 1, 3}) );
+    ASSERT_EQ( eval(-a), (fvec4{-1, -2, -3, -4}) );
+    ASSERT_EQ( eval(2.0f*a), (fvec4{2, 4, 6, 8}) );
+    ASSERT_EQ( eval(a/2.0f), (fvec4{0.5f, 1, 1.5f, 2}) );
+    ASSERT_EQ( emultiply(a,b), (fvec4{4, 6, 6, 4}) );
+    ASSERT_FLOAT_EQ( dot(a,b), 20 );
+    ASSERT_FLOAT_EQ( length_sq(a), 30 );
+
+    dvec4 c{ 1, 2, 3, 4 };
+    dvec4 d{ 4, 3, 2, 1 };
+    ASSERT_EQ( eval(c+d), uniform<dvec4>(5) );
+    ASSERT_EQ( edivision(c,d), (dvec4{0.25, 2.0/3.0, 1.5, 4}) );
+    ASSERT_DOUBLE_EQ( dot(c,d), 20 );
+    ASSERT_EQ( reinterpret_cast<size_t>(a.data()) % 16, 0u );
+    }
 /*
     // Submatrix
     auto v0 = fvec4{1,2,3,4};
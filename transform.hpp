@@ -0,0 +1,253 @@
+#ifndef TUMBO_TRANSFORM_HPP
+#define TUMBO_TRANSFORM_HPP
+
+#include "matrix.hpp"
+#include "utility.hpp"
+#include "aabb.hpp"
+#include "affine.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+#include "types.hpp"
+
+/**
+    \file transform.hpp
+    \brief Transforms of whole buffers of 3D points, directions, normals and
+    boxes.
+
+    Each function reads n vectors from in and writes n vectors to out,
+    which may be the same buffer. The transform is split into four column
+    packets once; every vector then costs three broadcasts, three
+    multiplies and three additions, with no temporaries or allocation.
+    With threads other than 1 the buffer is split over default_thread_pool
+    (see parallel.hpp); 0 uses all hardware threads.
+
+    Boxes use Arvo's method from transform_aabb on the same column packets:
+    per input axis two multiplies and a min and max, instead of
+    transforming eight corners. transform_aabbs also takes one affine
+    transform per box.
+*/
+
+namespace tumbo
+    {
+
+    /* The columns of a 4x4 transform as 4-lane packets. */
+    template< class T >
+    struct transform_columns_
+        {
+        typedef simd::packet<T,4> P;
+        P c[4];
+
+        explicit
+        transform_columns_( const matrix<T,4,4>& A )
+            {
+            for( size_t j=0; j<4; ++j )
+                {
+                T col[4] = { A(0,j), A(1,j), A(2,j), A(3,j) };
+                c[j] = P::load( col );
+                }
+            }
+
+        /// Loads the rows and transposes them with the implied bottom row.
+        explicit
+        transform_columns_( const affine<T,3>& A )
+            {
+            const T unit[4] = { 0, 0, 0, 1 };
+            c[0] = P::load( A.data() );
+            c[1] = P::load( A.data() + 4 );
+            c[2] = P::load( A.data() + 8 );
+            c[3] = P::load( unit );
+            transpose( c[0], c[1], c[2], c[3] );
+            }
+
+        /// Lanes are x, y, z and w of A*(v,1), or A*(v,0) for directions.
+        template< bool Point > P
+        apply( const vec<T,3>& v ) const
+            {
+            const T* p = v.data();
+            P r = P::broadcast( p[0] ) * c[0] + P::broadcast( p[1] ) * c[1] +
+                  P::broadcast( p[2] ) * c[2];
+            if constexpr( Point )
+                return r + c[3];
+            return r;
+            }
+        };
+
+
+    enum class transform_kind_ { point, direction, projected };
+
+
+    template< transform_kind_ Kind, class T > void
+    transform_range_( const transform_columns_<T>& C,
+                      const vec<T,3>* in, vec<T,3>* out,
+                      size_t first, size_t last )
+        {
+        T r[4];
+        for( size_t i = first; i < last; ++i )
+            {
+            C.template apply< Kind != transform_kind_::direction >( in[i] )
+                .store( r );
+            T* o = out[i].begin();
+            if constexpr( Kind == transform_kind_::projected )
+                {
+                T w = T(1) / r[3];
+                o[0] = r[0]*w; o[1] = r[1]*w; o[2] = r[2]*w;
+                }
+            else
+                {
+                o[0] = r[0]; o[1] = r[1]; o[2] = r[2];
+                }
+            }
+        }
+
+
+    template< transform_kind_ Kind, class T > void
+    transform_buffer_( const matrix<T,4,4>& A,
+                       const vec<T,3>* in, vec<T,3>* out, size_t n,
+                       size_t threads )
+        {
+        transform_columns_<T> C( A );
+        parallel_for( 0, n, threads, [&]( size_t first, size_t last )
+            { transform_range_<Kind>( C, in, out, first, last ); },
+            1024 );
+        }
+
+
+    /// out[i] = A * (in[i],1) without the w component.
+    template< class T > void
+    transform_points( const matrix<T,4,4>& A, const vec<T,3>* in,
+                      vec<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        transform_buffer_<transform_kind_::point>( A, in, out, n, threads );
+        }
+
+
+    template< class T > void
+    transform_points( const affine<T,3>& A, const vec<T,3>* in,
+                      vec<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        transform_buffer_<transform_kind_::point>(
+            to_matrix(A), in, out, n, threads );
+        }
+
+
+    /// out[i] = A * (in[i],0), the translation is ignored.
+    template< class T > void
+    transform_directions( const matrix<T,4,4>& A, const vec<T,3>* in,
+                          vec<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        transform_buffer_<transform_kind_::direction>(
+            A, in, out, n, threads );
+        }
+
+
+    template< class T > void
+    transform_directions( const affine<T,3>& A, const vec<T,3>* in,
+                          vec<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        transform_buffer_<transform_kind_::direction>(
+            to_matrix(A), in, out, n, threads );
+        }
+
+
+    /// out[i] = A * (in[i],1) divided by its w, for projection matrices.
+    template< class T > void
+    transform_points_projected( const matrix<T,4,4>& A, const vec<T,3>* in,
+                                vec<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        transform_buffer_<transform_kind_::projected>(
+            A, in, out, n, threads );
+        }
+
+
+    /// Transforms normals by the inverse transpose of A's linear part.
+    /** Keeps normals perpendicular to transformed surfaces under
+        non-uniform scaling. The results are not renormalized. */
+    template< class T > void
+    transform_normals( const matrix<T,4,4>& A, const vec<T,3>* in,
+                       vec<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        matrix<T,3,3> N = transpose( inverse( submatrix<3,3>( A ) ) );
+        transform_buffer_<transform_kind_::direction>(
+            to_matrix( make_affine( N, vec<T,3>{} ) ), in, out, n, threads );
+        }
+
+
+    template< class T > void
+    transform_normals( const affine<T,3>& A, const vec<T,3>* in,
+                       vec<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        transform_normals( to_matrix(A), in, out, n, threads );
+        }
+
+
+
+    /* transform_aabb on the columns. Reads all of in before writing out. */
+    template< class T > void
+    transform_aabb_( const transform_columns_<T>& C, const aabb<T,3>& in,
+                     aabb<T,3>& out )
+        {
+        typedef simd::packet<T,4> P;
+        P lo = C.c[3], hi = C.c[3];
+        for( size_t j=0; j<3; ++j )
+            {
+            P a = C.c[j] * P::broadcast( in(j,0) );
+            P b = C.c[j] * P::broadcast( in(j,1) );
+            lo = lo + simd::min( a, b );
+            hi = hi + simd::max( a, b );
+            }
+        T l[4], h[4];
+        lo.store( l );
+        hi.store( h );
+        for( size_t d=0; d<3; ++d )
+            {
+            out(d,0) = l[d];
+            out(d,1) = h[d];
+            }
+        }
+
+
+    template< class T > void
+    transform_aabbs_( const transform_columns_<T>& C, const aabb<T,3>* in,
+                      aabb<T,3>* out, size_t n, size_t threads )
+        {
+        parallel_for( 0, n, threads, [&]( size_t first, size_t last )
+            {
+            for( size_t i = first; i < last; ++i )
+                transform_aabb_( C, in[i], out[i] );
+            }, 1024 );
+        }
+
+
+    /// out[i] = transform_aabb( in[i], A ) for an affine A.
+    /** Only the top three rows of A are used. */
+    template< class T > void
+    transform_aabbs( const matrix<T,4,4>& A, const aabb<T,3>* in,
+                     aabb<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        transform_aabbs_( transform_columns_<T>( A ), in, out, n, threads );
+        }
+
+
+    template< class T > void
+    transform_aabbs( const affine<T,3>& A, const aabb<T,3>* in,
+                     aabb<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        transform_aabbs_( transform_columns_<T>( A ), in, out, n, threads );
+        }
+
+
+    /// out[i] = transform_aabb( in[i], A[i] ), as for objects' world boxes.
+    template< class T > void
+    transform_aabbs( const affine<T,3>* A, const aabb<T,3>* in,
+                     aabb<T,3>* out, size_t n, size_t threads = 1 )
+        {
+        parallel_for( 0, n, threads, [&]( size_t first, size_t last )
+            {
+            for( size_t i = first; i < last; ++i )
+                transform_aabb_( transform_columns_<T>( A[i] ), in[i], out[i] );
+            }, 1024 );
+        }
+
+    } // namespace tumbo
+
+#endif // TUMBO_TRANSFORM_HPP
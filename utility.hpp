@@ -1,8 +1,10 @@
 #ifndef TUMBO_UTILITY_HPP
 #define TUMBO_UTILITY_HPP
 
+#include <cmath>
 #include <utility>
 #include "matrix.hpp"
+#include "expression.hpp"
 #include "assert.hpp"
 
 #undef minor
@@ -11,92 +13,140 @@ namespace tumbo
     {
     const double PI = 3.1415926535897932384626433832795028841971693993751058;
 
-    /// Returns a copy of the matrix transposed.
-    template< class T, size_t M, size_t N > matrix<T,N,M>
-    transpose( const matrix<T,M,N>& A )
+    /* Runs one of the simd.hpp pointer kernels into a new matrix. Kept out
+        of the constexpr functions below so the result is not zeroed first. */
+    template< class R, class Kernel > R
+    simd_kernel_( Kernel kernel )
         {
-        matrix<T,N,M> R;
+        R r;
+        kernel( r.begin() );
+        return r;
+        }
 
-        for( size_t i=0; i<M; ++i )
-        for( size_t j=0; j<N; ++j )
-            R(j,i) = A(i,j);
 
+    /* Fixed size kernels. Each builds its result with a fold over an
+        index_sequence of the result elements, reading operands through
+        their data pointer, so nothing is bounds checked or copied and the
+        compiler sees straight-line code. Sizes above unroll_limit_ fall
+        back to plain loops to keep instantiations small. */
+    constexpr size_t unroll_limit_ = 256;
+
+
+    template< class T, size_t M, size_t N, size_t... I >
+    constexpr matrix<T,N,M>
+    transpose_( const matrix<T,M,N>& A, std::index_sequence<I...> )
+        {
+        matrix<T,N,M> R{};
+        T* r = R.begin();
+        const T* a = A.data();
+        ( ( r[I] = a[ (I%M)*N + I/M ] ), ... );
         return R;
         }
 
 
-    /// Multiply matrix by scalar.
-    template< class S, class T, size_t M, size_t N>
-    typename std::enable_if< std::is_arithmetic<S>::value,
-        matrix< typename std::common_type<T,S>::type, M, N > >::type
-    operator* ( S s, const matrix<T,M,N>& A )
+    /// Element (i,j) of A*B.
+    template< size_t i, size_t j, size_t N, size_t P,
+              class T, class S, size_t... K >
+    constexpr typename std::common_type<T,S>::type
+    product_element_( const T* a, const S* b, std::index_sequence<K...> )
         {
-        matrix< typename std::common_type<T,S>::type, M, N > R;
-        for( size_t i=0; i < A.size(); ++i )
-            R[i] = s * A[i];
-        return R;
+        return ( ... + ( a[i*N+K] * b[K*P+j] ) );
         }
-        
-        
-    /// Scalar multiplication is associative.
-    template< class T, class S, size_t M, size_t N >
-    typename std::enable_if< std::is_arithmetic<S>::value,
-        matrix< typename std::common_type<T,S>::type, M, N > >::type
-    operator* ( const matrix<T,M,N>& A, S s )
+
+
+    template< class T, class S, size_t M, size_t N, size_t P, size_t... I >
+    constexpr matrix< typename std::common_type<T,S>::type, M, P >
+    multiply_( const matrix<T,M,N>& A, const matrix<S,N,P>& B,
+               std::index_sequence<I...> )
         {
-        return s * A;
+        typedef typename std::common_type<T,S>::type R_t;
+        matrix<R_t,M,P> R{};
+        R_t* r = R.begin();
+        ( ( r[I] = product_element_< I/P, I%P, N, P >(
+              A.data(), B.data(), std::make_index_sequence<N>() ) ), ... );
+        return R;
+        }
+
+
+    template< class T, class S, size_t M, size_t N, size_t P >
+    constexpr matrix< typename std::common_type<T,S>::type, M, P >
+    multiply_loop_( const matrix<T,M,N>& A, const matrix<S,N,P>& B )
+        {
+        typedef typename std::common_type<T,S>::type R_t;
+        matrix<R_t,M,P> R{};
+        R_t* r = R.begin();
+        const T* a = A.data();
+        const S* b = B.data();
+        for( size_t i=0; i<M; ++i )
+        for( size_t k=0; k<N; ++k )
+        for( size_t j=0; j<P; ++j )
+            r[i*P+j] += a[i*N+k] * b[k*P+j];
+        return R;
         }
 
 
-    /// Matrix division by scalar.
-    template< class T, class S, size_t M, size_t N >
-    matrix< typename std::common_type<S,T>::type, M, N >
-    operator/ (const matrix<T,M,N>& A, S s )
+    /// Returns a copy of the matrix transposed.
+    template< class T, size_t M, size_t N > constexpr matrix<T,N,M>
+    transpose( const matrix<T,M,N>& A )
         {
-        matrix< typename std::common_type<S,T>::type, M, N > R;
-        for( size_t i=0; i < A.size(); ++i )
-            R[i] = A[i] / s;
+        if constexpr( simd::accelerated<T,M,N>::value && M == 4 && N == 4 )
+            {
+            if( !TUMBO_IS_CONSTANT_EVALUATED() )
+                return simd_kernel_< matrix<T,4,4> >( [&]( T* r )
+                    { simd::transpose44( A.data(), r ); } );
+            }
+
+        if constexpr( M*N <= unroll_limit_ )
+            return transpose_( A, std::make_index_sequence<M*N>() );
+
+        matrix<T,N,M> R{};
+        T* r = R.begin();
+        const T* a = A.data();
+        for( size_t i=0; i<M; ++i )
+        for( size_t j=0; j<N; ++j )
+            r[j*M+i] = a[i*N+j];
         return R;
         }
 
+
     // Element-wise binary operation
-    template<class T, size_t M, size_t N, typename Op> matrix<T,M,N>
+    template<class T, size_t M, size_t N, typename Op> constexpr matrix<T,M,N>
     ewise(const matrix<T,M,N>& A, const matrix<T,M,N>& B, Op op)
         {
-        matrix<T,M,N> R;
+        matrix<T,M,N> R{};
         for( size_t i=0; i<M*N; ++i )
             R[i] = op(A[i],B[i]);
         return R;
         }
 
-    template<class T, size_t M, size_t N> matrix<T,M,N>
+    template<class T, size_t M, size_t N> constexpr matrix<T,M,N>
     emultiply( const matrix<T,M,N>& A, const matrix<T,M,N>& B )
         {
+        if constexpr( simd::packable<T,M*N>::value )
+            {
+            if( !TUMBO_IS_CONSTANT_EVALUATED() )
+                return simd_kernel_< matrix<T,M,N> >( [&]( T* r )
+                    { simd::emul( A.data(), B.data(), r, M*N ); } );
+            }
         return ewise(A,B, std::multiplies<T>());
         }
 
-    template<class T, size_t M, size_t N> matrix<T,M,N>
+    template<class T, size_t M, size_t N> constexpr matrix<T,M,N>
     edivision( const matrix<T,M,N>& A, const matrix<T,M,N>& B )
         {
+        if constexpr( simd::packable<T,M*N>::value )
+            {
+            if( !TUMBO_IS_CONSTANT_EVALUATED() )
+                return simd_kernel_< matrix<T,M,N> >( [&]( T* r )
+                    { simd::ediv( A.data(), B.data(), r, M*N ); } );
+            }
         return ewise(A,B, std::divides<T>());
         }
 
 
-    /// Element-wise negation of matrix.
-    template< class T, size_t M, size_t N> matrix<T,M,N>
-    operator- ( const matrix<T,M,N>& A )
-        {
-        matrix<T,M,N> R;
-
-        for( size_t i=0; i < A.size(); ++i )
-            R[i] = -A[i];
-        return R;
-        }
-
-
     /// Dot product between two equal length vector matrices.
     template< class T, class S, size_t AM, size_t AN, size_t BM, size_t BN >
-    typename std::common_type<T,S>::type
+    constexpr typename std::common_type<T,S>::type
     dot( const matrix<T,AM,AN>& A, const matrix<S,BM,BN>& B )
         {
         static_assert( (AM == 1 || AN == 1) && (BM == 1 || BN == 1),
@@ -104,6 +154,13 @@ namespace tumbo
         static_assert( AM*AN == BM*BN,
             "Vectors must be equal in length." );
 
+        if constexpr( std::is_same<T,S>::value &&
+                      simd::packable<T,4>::value && AM*AN == 4 )
+            {
+            if( !TUMBO_IS_CONSTANT_EVALUATED() )
+                return simd::dot4( A.data(), B.data() );
+            }
+
         typename std::common_type<T,S>::type sum = 0;
         for( size_t i=0; i < A.size(); ++i )
             sum += A[i]*B[i];
@@ -112,7 +169,7 @@ namespace tumbo
         }
 
     /// Special case of cross product for 2D vectors. Returns scalar.
-    template<class T> T
+    template<class T> constexpr T
     cross( const matrix<T,2,1>& A, const matrix<T,2,1>& B )
         {
         using namespace tumbo::components;
@@ -120,10 +177,10 @@ namespace tumbo
         }
 
     /// Returns the cross product vector of two vectors.
-    template<class T, size_t D> matrix<T,D,1>
+    template<class T, size_t D> constexpr matrix<T,D,1>
     cross( const matrix<T,D,1>& A, const matrix<T,D,1>& B )
         {
-        matrix<T,D,1> R;
+        matrix<T,D,1> R{};
         for( size_t d=0; d<D; ++d )
             R[d] = A[(d+1)%D] * B[(d+2)%D] - A[(d+D-1)%D] * B[(d+D-2)%D];
         return R;
@@ -137,12 +194,18 @@ namespace tumbo
         the standard length function.
     */
     template< class T, size_t M, size_t N >
-    T
+    constexpr T
     length_sq( const matrix<T,M,N>& A )
         {
         static_assert( M == 1 || N == 1,
            "Length is a vector property. matrix is not a vector." );
 
+        if constexpr( simd::packable<T,4>::value && M*N == 4 )
+            {
+            if( !TUMBO_IS_CONSTANT_EVALUATED() )
+                return simd::dot4( A.data(), A.data() );
+            }
+
         T square_sum = 0;
         for( size_t i=0; i<A.size(); ++i )
             square_sum += A[i]*A[i];
@@ -174,7 +237,7 @@ namespace tumbo
 
     // Reflect A over line L.
     template< class T, size_t M, size_t N >
-    matrix< T, M, N >
+    constexpr matrix< T, M, N >
     reflect( const matrix<T,M,N>& A, const matrix<T,M,N>& L )
         {
         static_assert( M == 1 || N == 1, "Only vectors can be reflected." );
@@ -186,7 +249,7 @@ namespace tumbo
     // This would be CCW on a right handed coordinate system and
     // CW on a left handed system
     template< class T, size_t M, size_t N >
-    matrix< T, M, N >
+    constexpr matrix< T, M, N >
     orthogonal( const matrix<T,M,N>& A )
         {
         static_assert( ( M == 1 && N == 2 ) || ( M == 2 && N == 1 ),
@@ -196,10 +259,10 @@ namespace tumbo
 
 
     /// Returns a copy of row i of matrix A as a vector matrix.
-    template< class T, size_t M, size_t N > matrix<T,1,N>
+    template< class T, size_t M, size_t N > constexpr matrix<T,1,N>
     row( const matrix<T,M,N>& A, size_t i )
         {
-        matrix<T,1,N> r;
+        matrix<T,1,N> r{};
         for( size_t j=0; j < N; ++j )
             r[j] = A(i,j);
         return r;
@@ -207,10 +270,10 @@ namespace tumbo
 
 
     /// Returns a copy of column j of matrix A as a vector matrix.
-    template< class T, size_t M, size_t N > matrix<T,M,1>
+    template< class T, size_t M, size_t N > constexpr matrix<T,M,1>
     column( const matrix<T,M,N>& A, size_t j )
         {
-        matrix<T,M,1> c;
+        matrix<T,M,1> c{};
         for( size_t i = 0; i < M; ++i )
             c[i] = A(i,j);
         return c;
@@ -223,17 +286,27 @@ namespace tumbo
         element of the submatrix.
         submatrix<H,W>( A, y, x )
     */
+    template< size_t RM, size_t RN, class T, size_t AM, size_t AN,
+              size_t... I >
+    constexpr matrix<T,RM,RN>
+    submatrix_( const matrix<T,AM,AN>& A, size_t oi, size_t oj,
+                std::index_sequence<I...> )
+        {
+        matrix<T,RM,RN> R{};
+        T* r = R.begin();
+        const T* a = A.data() + oi*AN + oj;
+        ( ( r[I] = a[ (I/RN)*AN + I%RN ] ), ... );
+        return R;
+        }
+
     template< size_t RM, size_t RN, class T, size_t AM, size_t AN >
-    matrix<T,RM,RN>
+    constexpr matrix<T,RM,RN>
     submatrix( const matrix<T,AM,AN>& A, size_t oi = 0, size_t oj = 0 )
         {
-        matrix<T,RM,RN> R;
-
-        for( size_t i=0; i<RM; ++i )
-        for( size_t j=0; j<RN; ++j )
-            R(i,j) = A(i+oi, j+oj);
-
-        return R;
+        static_assert( RM <= AM && RN <= AN,
+            "Submatrix must fit inside the matrix." );
+        TUMBO_ASSERT( oi + RM <= AM && oj + RN <= AN );
+        return submatrix_<RM,RN>( A, oi, oj, std::make_index_sequence<RM*RN>() );
         }
 
 
@@ -243,12 +316,13 @@ namespace tumbo
         the row, in which case it fills the row with the given elements and
         leaves the remaining row elements unchanged.
     */
-    template<class T, size_t M, size_t N, class container> matrix<T,M,N>&
+    template<class T, size_t M, size_t N, class container>
+    constexpr matrix<T,M,N>&
     assign_row( matrix<T,M,N>& A, size_t i, const container& vec)
         {
         auto it = std::begin(vec);
         auto end = std::end(vec);
-        TUMBO_ASSERT( N >= std::distance(it,end) );
+        TUMBO_ASSERT( N >= size_t( std::distance(it,end) ) );
         size_t j = 0;
         while( it != end )
             {
@@ -261,12 +335,13 @@ namespace tumbo
 
     // Mutates the matrix A at column j to contain the given data.
     /** Refer to assign_row for details. */
-    template<class T, size_t M, size_t N, class container> matrix<T,M,N>&
+    template<class T, size_t M, size_t N, class container>
+    constexpr matrix<T,M,N>&
     assign_column( matrix<T,M,N>& A, size_t j, const container& vec)
         {
         auto it = std::begin(vec);
         auto end = std::end(vec);
-        TUMBO_ASSERT( M >= std::distance(it,end) );
+        TUMBO_ASSERT( M >= size_t( std::distance(it,end) ) );
         size_t i = 0;
         while( it != end )
             {
@@ -277,56 +352,84 @@ namespace tumbo
         }
 
 
+    template< class T, size_t M, size_t N0, size_t N1, size_t... I >
+    constexpr matrix<T,M,N0+N1>
+    weld_( const matrix<T,M,N0>& A, const matrix<T,M,N1>& B,
+           std::index_sequence<I...> )
+        {
+        constexpr size_t W = N0+N1;
+        matrix<T,M,W> R{};
+        T* r = R.begin();
+        const T* a = A.data();
+        const T* b = B.data();
+        ( ( r[I] = I%W < N0 ? a[ (I/W)*N0 + I%W ]
+                            : b[ (I/W)*N1 + I%W - N0 ] ), ... );
+        return R;
+        }
+
     /// Combines two matrices of equal height into a larger matrix.
-    template< class T, size_t M, size_t N0, size_t N1 > matrix<T,M,N0+N1>
+    template< class T, size_t M, size_t N0, size_t N1 >
+    constexpr matrix<T,M,N0+N1>
     weld( const matrix<T,M,N0>& A, const matrix<T,M,N1>& B )
         {
-        matrix<T,M,N0+N1> result;
-        for( size_t i=0; i < M; ++i )
-            {
-            for( size_t j=0; j < N0; ++j )
-                result(i,j) = A(i,j);
-            for( size_t j=0; j < N1; ++j )
-                result(i,N0+j) = B(i,j);
-            }
-        return result;
+        return weld_( A, B, std::make_index_sequence<M*(N0+N1)>() );
         }
 
 
+    template< class T, size_t M0, size_t M1, size_t N, size_t... I >
+    constexpr matrix<T,M0+M1,N>
+    weldv_( const matrix<T,M0,N>& A, const matrix<T,M1,N>& B,
+            std::index_sequence<I...> )
+        {
+        matrix<T,M0+M1,N> R{};
+        T* r = R.begin();
+        const T* a = A.data();
+        const T* b = B.data();
+        ( ( r[I] = I < M0*N ? a[I] : b[ I - M0*N ] ), ... );
+        return R;
+        }
+
     /// Combines two matrices of equal width into a larger matrix.
-    template< class T, size_t M0, size_t M1, size_t N > matrix<T,M0+M1,N>
+    /** Both are stored row major, so this is A's elements followed by B's. */
+    template< class T, size_t M0, size_t M1, size_t N >
+    constexpr matrix<T,M0+M1,N>
     weldv( const matrix<T,M0,N>& A, const matrix<T,M1,N>& B )
         {
-        matrix<T,M0+M1,N> result;
-        for( size_t j=0; j < N; ++j )
-            {
-            for( size_t i=0; i < M0; ++i )
-                result(i,j) = A(i,j);
-            for( size_t i=0; i < M1; ++i )
-                result(M0+i,j) = B(i,j);
-            }
-        return result;
+        return weldv_( A, B, std::make_index_sequence<(M0+M1)*N>() );
         }
 
 
     /// Multiplication operator between two matrices.
     /** Matrix B must have the same height as A's width. */
     template< class T, class S, size_t M, size_t N, size_t P >
-    matrix< typename std::common_type<T,S>::type, M, P >
+    constexpr matrix< typename std::common_type<T,S>::type, M, P >
     operator * ( const matrix<T,M,N>& A, const matrix<S,N,P>& B )
         {
-        matrix< typename std::common_type<T,S>::type, M, P > R;
-
-        for( size_t i=0; i<M; ++i )
-        for( size_t j=0; j<P; ++j )
-            R(i,j) = dot( row(A,i), column(B,j) );
+        if constexpr( std::is_same<T,S>::value && simd::packable<T,4>::value &&
+                      N == 4 && ( M == 4 || M == 1 ) && ( P == 4 || P == 1 ) &&
+                      M*P != 1 )
+            {
+            if( !TUMBO_IS_CONSTANT_EVALUATED() )
+                return simd_kernel_< matrix<T,M,P> >( [&]( T* r )
+                    {
+                    if constexpr( M == 4 && P == 4 )
+                        simd::mul44( A.data(), B.data(), r );
+                    else if constexpr( M == 4 )
+                        simd::mul44v( A.data(), B.data(), r );
+                    else
+                        simd::mulv44( A.data(), B.data(), r );
+                    } );
+            }
 
-        return R;
+        if constexpr( M*N*P <= unroll_limit_ )
+            return multiply_( A, B, std::make_index_sequence<M*P>() );
+        else
+            return multiply_loop_( A, B );
         }
 
 
     /// Element-wise comparison between two matrices.
-    template< class T, size_t M, size_t N > bool
+    template< class T, size_t M, size_t N > constexpr bool
     operator == ( const matrix<T,M,N>& A, const matrix<T,M,N>& B )
         {
         for( size_t i = 0; i < M*N; ++i )
@@ -336,37 +439,11 @@ namespace tumbo
         }
 
 
-    /// Element-wise addition of matrices.
-    template< class T, class S, size_t M, size_t N >
-    matrix< typename std::common_type<T,S>::type, M, N >
-    operator + ( const matrix<T,M,N>& A, const matrix<S,M,N>& B )
-        {
-        matrix< typename std::common_type<T,S>::type, M, N > result;
-        for( size_t i=0; i < M*N; ++i )
-            result[i] = A[i] + B[i];
-
-        return result;
-        }
-
-
-    /// Element-wise subtraction of matrices.
-    template< class T, class S, size_t M, size_t N >
-    matrix< typename std::common_type<T,S>::type, M, N >
-    operator - ( const matrix<T,M,N>& A, const matrix<S,M,N>& B )
-        {
-        matrix< typename std::common_type<T,S>::type, M, N > result;
-        for( size_t i=0; i < M*N; ++i )
-            result[i] = A[i] - B[i];
-
-        return result;
-        }
-
-
     /// Generates a new matrix where a row and column is removed.
-    template< class T, size_t M, size_t N > matrix<T, M-1, N-1>
+    template< class T, size_t M, size_t N > constexpr matrix<T, M-1, N-1>
     cross_out( const matrix<T,M,N>& A, size_t r, size_t c )
         {
-        matrix<T, M-1, N-1> result;
+        matrix<T, M-1, N-1> result{};
         size_t rj = 0;
         size_t ri = 0;
 
@@ -388,21 +465,177 @@ namespace tumbo
         }
 
 
-    // The Determinant_ class does some template magic to avoid static
-    // infinite recursion
+    template< class T > constexpr T
+    abs_( T x )
+        {
+        return x < T(0) ? -x : x;
+        }
+
+
+    /// Partial pivoting LU decomposition, PA = LU.
+    /** lu holds U on and above the diagonal and the multipliers of L below
+        it; the unit diagonal of L is implicit. Row i of lu corresponds to
+        row perm[i] of A and sign is the determinant of the permutation.
+        singular is set when a column has no non-zero pivot. */
+    template< class T, size_t N >
+    struct lu_decomposition
+        {
+        matrix<T,N,N> lu;
+        size_t perm[N];
+        T sign;
+        bool singular;
+        };
+
+
+    template< class T, size_t N > constexpr lu_decomposition<T,N>
+    lu_decompose( const matrix<T,N,N>& A )
+        {
+        static_assert( std::is_floating_point<T>::value,
+            "LU decomposition needs a floating point type." );
+        lu_decomposition<T,N> D{ A, {}, T(1), false };
+        T* a = D.lu.begin();
+        for( size_t i=0; i<N; ++i )
+            D.perm[i] = i;
+
+        for( size_t k=0; k<N; ++k )
+            {
+            // Largest remaining element in column k becomes the pivot
+            size_t p = k;
+            for( size_t i=k+1; i<N; ++i )
+                if( abs_( a[i*N+k] ) > abs_( a[p*N+k] ) )
+                    p = i;
 
-    // Determinant for a NxN matrix:
-    // |A| == + a00 * |A00| - a01 * |A01| + a02 * |A02| ... +- a0n * |A0n|;
+            if( a[p*N+k] == T(0) )
+                {
+                D.singular = true;
+                continue;
+                }
+
+            if( p != k )
+                {
+                for( size_t j=0; j<N; ++j )
+                    {
+                    T t = a[k*N+j]; a[k*N+j] = a[p*N+j]; a[p*N+j] = t;
+                    }
+                size_t t = D.perm[k]; D.perm[k] = D.perm[p]; D.perm[p] = t;
+                D.sign = -D.sign;
+                }
+
+            for( size_t i=k+1; i<N; ++i )
+                {
+                T f = a[i*N+k] / a[k*N+k];
+                a[i*N+k] = f;
+                for( size_t j=k+1; j<N; ++j )
+                    a[i*N+j] -= f * a[k*N+j];
+                }
+            }
+        return D;
+        }
+
+
+    /// Solves Ax = b given the LU decomposition of A.
+    template< class T, size_t N > constexpr matrix<T,N,1>
+    lu_solve( const lu_decomposition<T,N>& D, const matrix<T,N,1>& b )
+        {
+        const T* a = D.lu.data();
+        matrix<T,N,1> x{};
+        // Forward substitution with L, b permuted to match the rows of LU
+        for( size_t i=0; i<N; ++i )
+            {
+            T sum = b[ D.perm[i] ];
+            for( size_t j=0; j<i; ++j )
+                sum -= a[i*N+j] * x[j];
+            x[i] = sum;
+            }
+        // Back substitution with U
+        for( size_t i=N; i-- > 0; )
+            {
+            T sum = x[i];
+            for( size_t j=i+1; j<N; ++j )
+                sum -= a[i*N+j] * x[j];
+            x[i] = sum / a[i*N+i];
+            }
+        return x;
+        }
+
+
+    /// Inverse of A given its LU decomposition.
+    /** Solves for all columns of the identity at once. */
+    template< class T, size_t N > constexpr matrix<T,N,N>
+    lu_inverse( const lu_decomposition<T,N>& D )
+        {
+        const T* a = D.lu.data();
+        matrix<T,N,N> X{};
+        for( size_t i=0; i<N; ++i )
+            X( i, D.perm[i] ) = T(1);
+
+        T* x = X.begin();
+        for( size_t i=0; i<N; ++i )
+        for( size_t k=0; k<i; ++k )
+            for( size_t j=0; j<N; ++j )
+                x[i*N+j] -= a[i*N+k] * x[k*N+j];
+
+        for( size_t i=N; i-- > 0; )
+            {
+            for( size_t k=i+1; k<N; ++k )
+                for( size_t j=0; j<N; ++j )
+                    x[i*N+j] -= a[i*N+k] * x[k*N+j];
+            T inv = T(1) / a[i*N+i];
+            for( size_t j=0; j<N; ++j )
+                x[i*N+j] *= inv;
+            }
+        return X;
+        }
+
+
+    template< class T, size_t N > constexpr T
+    lu_determinant( const lu_decomposition<T,N>& D )
+        {
+        T det = D.sign;
+        for( size_t i=0; i<N; ++i )
+            det *= D.lu(i,i);
+        return det;
+        }
+
+
+    // Determinant for a NxN matrix. Floating point types use the LU
+    // decomposition, integral types fraction free Bareiss elimination
+    // where every division is exact.
     template< class T, size_t M, size_t N >
     struct determinant_
         {
-        static T calc( const matrix<T,M,N>& A )
+        static constexpr T calc( const matrix<T,M,N>& A )
             {
-            T sum = 0;
-            for( size_t j=0; j<N; ++j )
-                sum += ( j%2==1 ? -1 : 1 ) * // Every other is negative
-                        A(0,j) * determinant(cross_out(A,0,j));
-            return sum;
+            if constexpr( std::is_floating_point<T>::value )
+                {
+                return lu_determinant( lu_decompose(A) );
+                }
+            else
+                {
+                matrix<T,M,N> B = A;
+                T* a = B.begin();
+                T sign = 1;
+                T prev = 1;
+                for( size_t k=0; k+1<N; ++k )
+                    {
+                    if( a[k*N+k] == 0 )
+                        {
+                        size_t p = k+1;
+                        while( p < N && a[p*N+k] == 0 ) ++p;
+                        if( p == N ) return 0;
+                        for( size_t j=0; j<N; ++j )
+                            {
+                            T t = a[k*N+j]; a[k*N+j] = a[p*N+j]; a[p*N+j] = t;
+                            }
+                        sign = -sign;
+                        }
+                    for( size_t i=k+1; i<N; ++i )
+                    for( size_t j=k+1; j<N; ++j )
+                        a[i*N+j] = ( a[i*N+j]*a[k*N+k] - a[i*N+k]*a[k*N+j] ) / prev;
+                    prev = a[k*N+k];
+                    }
+                return sign * a[N*N-1];
+                }
             }
         };
 
@@ -410,7 +643,7 @@ namespace tumbo
     template< class T >
     struct determinant_<T,1,1>
         {
-        static T calc( const matrix<T,1,1>& A )
+        static constexpr T calc( const matrix<T,1,1>& A )
             {
             return A[0];
             }
@@ -420,25 +653,62 @@ namespace tumbo
     template< class T >
     struct determinant_<T,2,2>
         {
-        static T calc( const matrix<T,2,2>& A )
+        static constexpr T calc( const matrix<T,2,2>& A )
             {
             return A[0] * A[3] - A[1] * A[2];
             }
         };
 
-    template< class T, size_t M, size_t N > T
+    // Determinant for a 3x3 matrix, expanded along the first row.
+    template< class T >
+    struct determinant_<T,3,3>
+        {
+        static constexpr T calc( const matrix<T,3,3>& A )
+            {
+            const T* a = A.data();
+            return a[0] * ( a[4]*a[8] - a[5]*a[7] )
+                 - a[1] * ( a[3]*a[8] - a[5]*a[6] )
+                 + a[2] * ( a[3]*a[7] - a[4]*a[6] );
+            }
+        };
+
+    // Determinant for a 4x4 matrix from the 2x2 determinants of the top
+    // and bottom row pairs (Laplace expansion over two rows).
+    template< class T >
+    struct determinant_<T,4,4>
+        {
+        static constexpr T calc( const matrix<T,4,4>& A )
+            {
+            const T* a = A.data();
+            T s0 = a[0]*a[5] - a[1]*a[4];
+            T s1 = a[0]*a[6] - a[2]*a[4];
+            T s2 = a[0]*a[7] - a[3]*a[4];
+            T s3 = a[1]*a[6] - a[2]*a[5];
+            T s4 = a[1]*a[7] - a[3]*a[5];
+            T s5 = a[2]*a[7] - a[3]*a[6];
+            T c5 = a[10]*a[15] - a[11]*a[14];
+            T c4 = a[9]*a[15] - a[11]*a[13];
+            T c3 = a[9]*a[14] - a[10]*a[13];
+            T c2 = a[8]*a[15] - a[11]*a[12];
+            T c1 = a[8]*a[14] - a[10]*a[12];
+            T c0 = a[8]*a[13] - a[9]*a[12];
+            return s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+            }
+        };
+
+    template< class T, size_t M, size_t N > constexpr T
     determinant( const matrix<T,M,N>& A )
         {
-        // Splits up the templates into recursion and base case
+        static_assert( M == N, "Determinant: matrix must be square." );
         return determinant_<T,M,N>::calc(A);
         }
 
 
     /// Returns the matrix minor.
-    template< class T, size_t M, size_t N > matrix<T,M,N>
+    template< class T, size_t M, size_t N > constexpr matrix<T,M,N>
     minor( const matrix<T,M,N>& A )
         {
-        matrix<T,M,N> result;
+        matrix<T,M,N> result{};
 
         for( size_t j=0; j<N; ++j )
         for( size_t i=0; i<M; ++i )
@@ -448,7 +718,7 @@ namespace tumbo
         }
 
 
-    template< class T, size_t M, size_t N > matrix<T,M,N>
+    template< class T, size_t M, size_t N > constexpr matrix<T,M,N>
     cofactor( const matrix<T,M,N>& A )
         {
         matrix<T,M,N> result = minor(A);
@@ -461,10 +731,10 @@ namespace tumbo
         }
 
 
-    template< class T, size_t M, size_t N > matrix<T,M,N>
+    template< class T, size_t M, size_t N > constexpr matrix<T,M,N>
     adjugate( const matrix<T,M,N>& A )
         {
-        if( M == 2 && N == 2 )
+        if constexpr( M == 2 && N == 2 )
             {
             matrix<T,M,N> adj{
                 A(1,1), -A(0,1),
@@ -477,15 +747,149 @@ namespace tumbo
         }
 
 
-    template< class T, size_t M, size_t N > matrix<T,M,N>
-    inverse( const matrix<T,M,N>& A )
+    // Inverse and determinant of a NxN floating point matrix from its LU
+    // decomposition. The closed forms for the small sizes follow.
+    template< class T, size_t N >
+    struct inverse_
+        {
+        static constexpr std::pair< matrix<T,N,N>, T >
+        calc( const matrix<T,N,N>& A )
+            {
+            lu_decomposition<T,N> D = lu_decompose(A);
+            return { lu_inverse(D), lu_determinant(D) };
+            }
+        };
+
+
+    template< class T >
+    struct inverse_<T,1>
+        {
+        static constexpr std::pair< matrix<T,1,1>, T >
+        calc( const matrix<T,1,1>& A )
+            {
+            return { matrix<T,1,1>{ T(1) / A[0] }, A[0] };
+            }
+        };
+
+
+    template< class T >
+    struct inverse_<T,2>
+        {
+        static constexpr std::pair< matrix<T,2,2>, T >
+        calc( const matrix<T,2,2>& A )
+            {
+            T det = determinant(A);
+            T inv = T(1) / det;
+            return { matrix<T,2,2>{
+                 A[3]*inv, -A[1]*inv,
+                -A[2]*inv,  A[0]*inv }, det };
+            }
+        };
+
+
+    // The rows of the adjugate are the cross products of the columns.
+    template< class T >
+    struct inverse_<T,3>
+        {
+        static constexpr std::pair< matrix<T,3,3>, T >
+        calc( const matrix<T,3,3>& A )
+            {
+            const T* a = A.data();
+            T c00 = a[4]*a[8] - a[5]*a[7];
+            T c01 = a[2]*a[7] - a[1]*a[8];
+            T c02 = a[1]*a[5] - a[2]*a[4];
+            T c10 = a[5]*a[6] - a[3]*a[8];
+            T c11 = a[0]*a[8] - a[2]*a[6];
+            T c12 = a[2]*a[3] - a[0]*a[5];
+            T c20 = a[3]*a[7] - a[4]*a[6];
+            T c21 = a[1]*a[6] - a[0]*a[7];
+            T c22 = a[0]*a[4] - a[1]*a[3];
+            T det = a[0]*c00 + a[1]*c10 + a[2]*c20;
+            T inv = T(1) / det;
+            return { matrix<T,3,3>{
+                c00*inv, c01*inv, c02*inv,
+                c10*inv, c11*inv, c12*inv,
+                c20*inv, c21*inv, c22*inv }, det };
+            }
+        };
+
+
+    // Uses the same 2x2 sub-determinants as determinant_<T,4,4>. Each
+    // element of the adjugate is three products of a matrix element and
+    // a sub-determinant, no branches, which vectorizes well.
+    template< class T >
+    struct inverse_<T,4>
+        {
+        static constexpr std::pair< matrix<T,4,4>, T >
+        calc( const matrix<T,4,4>& A )
+            {
+            const T* a = A.data();
+            T s0 = a[0]*a[5] - a[1]*a[4];
+            T s1 = a[0]*a[6] - a[2]*a[4];
+            T s2 = a[0]*a[7] - a[3]*a[4];
+            T s3 = a[1]*a[6] - a[2]*a[5];
+            T s4 = a[1]*a[7] - a[3]*a[5];
+            T s5 = a[2]*a[7] - a[3]*a[6];
+            T c5 = a[10]*a[15] - a[11]*a[14];
+            T c4 = a[9]*a[15] - a[11]*a[13];
+            T c3 = a[9]*a[14] - a[10]*a[13];
+            T c2 = a[8]*a[15] - a[11]*a[12];
+            T c1 = a[8]*a[14] - a[10]*a[12];
+            T c0 = a[8]*a[13] - a[9]*a[12];
+            T det = s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+            T inv = T(1) / det;
+            return { matrix<T,4,4>{
+                ( a[5]*c5 - a[6]*c4 + a[7]*c3 ) * inv,
+                (-a[1]*c5 + a[2]*c4 - a[3]*c3 ) * inv,
+                ( a[13]*s5 - a[14]*s4 + a[15]*s3 ) * inv,
+                (-a[9]*s5 + a[10]*s4 - a[11]*s3 ) * inv,
+
+                (-a[4]*c5 + a[6]*c2 - a[7]*c1 ) * inv,
+                ( a[0]*c5 - a[2]*c2 + a[3]*c1 ) * inv,
+                (-a[12]*s5 + a[14]*s2 - a[15]*s1 ) * inv,
+                ( a[8]*s5 - a[10]*s2 + a[11]*s1 ) * inv,
+
+                ( a[4]*c4 - a[5]*c2 + a[7]*c0 ) * inv,
+                (-a[0]*c4 + a[1]*c2 - a[3]*c0 ) * inv,
+                ( a[12]*s4 - a[13]*s2 + a[15]*s0 ) * inv,
+                (-a[8]*s4 + a[9]*s2 - a[11]*s0 ) * inv,
+
+                (-a[4]*c3 + a[5]*c1 - a[6]*c0 ) * inv,
+                ( a[0]*c3 - a[1]*c1 + a[2]*c0 ) * inv,
+                (-a[12]*s3 + a[13]*s1 - a[14]*s0 ) * inv,
+                ( a[8]*s3 - a[9]*s1 + a[10]*s0 ) * inv }, det };
+            }
+        };
+
+
+    /// Returns the inverse of A together with its determinant.
+    /** The inverse is only meaningful if the determinant is non-zero.
+        Integral matrices use the adjugate, as inverse always has. */
+    template< class T, size_t M, size_t N > constexpr
+    std::pair< matrix<T,M,N>, T >
+    inverse_and_determinant( const matrix<T,M,N>& A )
         {
         static_assert( M == N, "Inverse: matrix must be square." );
-        return (1 / determinant(A) ) * adjugate(A);
+        if constexpr( std::is_floating_point<T>::value )
+            {
+            return inverse_<T,N>::calc(A);
+            }
+        else
+            {
+            T det = determinant(A);
+            return { matrix<T,M,N>( (1 / det) * adjugate(A) ), det };
+            }
+        }
+
+
+    template< class T, size_t M, size_t N > constexpr matrix<T,M,N>
+    inverse( const matrix<T,M,N>& A )
+        {
+        return inverse_and_determinant(A).first;
         }
 
 
-    template< class T, size_t M, size_t N > bool
+    template< class T, size_t M, size_t N > constexpr bool
     is_singular( const matrix<T,M,N>& A )
         {
         return determinant(A) == 0;
@@ -493,10 +897,10 @@ namespace tumbo
 
 
     /// Maps a function over a matrix. Returns the resulting matrix
-    template<class T, size_t M, size_t N, class FuncT> matrix<T,M,N>
+    template<class T, size_t M, size_t N, class FuncT> constexpr matrix<T,M,N>
     mapf( const matrix<T,M,N>& A, FuncT fun )
         {
-        matrix<T,M,N> R;
+        matrix<T,M,N> R{};
         for( size_t i=0; i < A.size(); ++i )
             {
             R[i] = fun( A[i] );
@@ -504,6 +908,90 @@ namespace tumbo
         return R;
         }
 
+
+    /* The functions above for lazy expressions, evaluated to matrices
+        first as they read elements more than once. Deduction would not
+        see through an expression to the matrix<T,M,N> parameters. */
+
+    template< class E,
+              class = typename enable_lazy_< void, E >::type > constexpr auto
+    transpose( const E& e ) ->
+        decltype( transpose( eval(e) ) )
+        { return transpose( eval(e) ); }
+
+    template< class A, class B,
+              class = typename enable_lazy_< void, A, B >::type > constexpr auto
+    dot( const A& a, const B& b ) ->
+        decltype( dot( eval(a), eval(b) ) )
+        { return dot( eval(a), eval(b) ); }
+
+    template< class A, class B,
+              class = typename enable_lazy_< void, A, B >::type > constexpr auto
+    cross( const A& a, const B& b ) ->
+        decltype( cross( eval(a), eval(b) ) )
+        { return cross( eval(a), eval(b) ); }
+
+    template< class E,
+              class = typename enable_lazy_< void, E >::type > constexpr auto
+    length_sq( const E& e ) ->
+        decltype( length_sq( eval(e) ) )
+        { return length_sq( eval(e) ); }
+
+    template< class E,
+              class = typename enable_lazy_< void, E >::type > auto
+    length( const E& e ) ->
+        decltype( length( eval(e) ) )
+        { return length( eval(e) ); }
+
+    template< class E,
+              class = typename enable_lazy_< void, E >::type > auto
+    normalize( const E& e,
+               decltype( length( eval( std::declval<const E&>() ) ) )* len = nullptr ) ->
+        decltype( normalize( eval(e) ) )
+        { return normalize( eval(e), len ); }
+
+    template< class A, class B,
+              class = typename enable_lazy_< void, A, B >::type > constexpr auto
+    reflect( const A& a, const B& b ) ->
+        decltype( reflect( eval(a), eval(b) ) )
+        { return reflect( eval(a), eval(b) ); }
+
+    template< class A, class B,
+              class = typename enable_lazy_< void, A, B >::type > constexpr auto
+    weld( const A& a, const B& b ) ->
+        decltype( weld( eval(a), eval(b) ) )
+        { return weld( eval(a), eval(b) ); }
+
+    template< class A, class B,
+              class = typename enable_lazy_< void, A, B >::type > constexpr auto
+    weldv( const A& a, const B& b ) ->
+        decltype( weldv( eval(a), eval(b) ) )
+        { return weldv( eval(a), eval(b) ); }
+
+    template< class A, class B,
+              class = typename enable_lazy_< void, A, B >::type > constexpr auto
+    operator * ( const A& a, const B& b ) ->
+        decltype( eval(a) * eval(b) )
+        { return eval(a) * eval(b); }
+
+    template< class A, class B,
+              class = typename enable_lazy_< void, A, B >::type > constexpr auto
+    operator == ( const A& a, const B& b ) ->
+        decltype( eval(a) == eval(b) )
+        { return eval(a) == eval(b); }
+
+    template< class E,
+              class = typename enable_lazy_< void, E >::type > constexpr auto
+    determinant( const E& e ) ->
+        decltype( determinant( eval(e) ) )
+        { return determinant( eval(e) ); }
+
+    template< class E,
+              class = typename enable_lazy_< void, E >::type > constexpr auto
+    inverse( const E& e ) ->
+        decltype( inverse( eval(e) ) )
+        { return inverse( eval(e) ); }
+
     } // namespace tumbo
 
 